@@ -0,0 +1,330 @@
+/*
+ * Differential test of two backends.
+ *
+ * Runs the Butteraugli and output image stages, then whole encodes, on the
+ * same synthetic images with two backends and reports per stage the max and
+ * mean absolute and relative error and the first 8x8 block where they
+ * diverge beyond the tolerance. Exits with 1 if any stage does, so it can
+ * gate a kernel change: e.g. cpu against opencl, or cpu against cpu_opt,
+ * which gets tolerances that admit the float arithmetic of the latter.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "benchmark/test_image.h"
+#include "butteraugli/butteraugli.h"
+#include "clguetzli/clbutter_comparator.h"
+#include "clguetzli/clguetzli.h"
+#include "guetzli/diff_report.h"
+#include "guetzli/encoder.h"
+#include "guetzli/jpeg_data_decoder.h"
+#include "guetzli/jpeg_data_reader.h"
+#include "guetzli/output_image.h"
+#include "guetzli/quality.h"
+#ifdef __USE_OPENCL__
+#include "clguetzli/ocl.h"
+#endif
+
+namespace {
+
+using benchmark::BackendName;
+using benchmark::MakeTestImage;
+using benchmark::TestImage;
+
+typedef std::vector<std::vector<float> > Planes;
+
+// Runs a stage with the backend of |mode| and sets |out| to its result, as
+// planes of the image size. False if the stage has no variant for |mode|.
+// |arg| is the one of the Stage.
+typedef bool (*StageFunc)(int mode, const TestImage& img, double arg,
+                          Planes* out);
+
+struct Stage {
+  std::string name;
+  StageFunc run;
+  double arg;  // The blur sigma.
+};
+
+// The stages behind a dispatcher of clbutter_comparator.cpp, which picks the
+// variant of the current mode.
+bool RunOpsinDynamicsImage(int mode, const TestImage& img, double,
+                           Planes* out) {
+  ScopedMathMode scoped_mode(static_cast<MATH_MODE>(mode));
+  *out = img.linear;
+  ::butteraugli::OpsinDynamicsImage(img.width, img.height, *out);
+  return true;
+}
+
+bool RunMask(int mode, const TestImage& img, double, Planes* out) {
+  ScopedMathMode scoped_mode(static_cast<MATH_MODE>(mode));
+  Planes mask, mask_dc;
+  ::butteraugli::Mask(img.xyb0, img.xyb1, img.width, img.height, &mask,
+                      &mask_dc);
+  *out = mask;
+  out->insert(out->end(), mask_dc.begin(), mask_dc.end());
+  return true;
+}
+
+bool RunDiffmap(int mode, const TestImage& img, double, Planes* out) {
+  ScopedMathMode scoped_mode(static_cast<MATH_MODE>(mode));
+  ::butteraugli::clButteraugliComparator comparator(img.width, img.height, 3);
+  Planes xyb0 = img.xyb0, xyb1 = img.xyb1;
+  out->assign(1, std::vector<float>());
+  comparator.DiffmapOpsinDynamicsImage(xyb0, xyb1, (*out)[0]);
+  return true;
+}
+
+bool RunToLinearRGB(int mode, const TestImage& img, double, Planes* out) {
+  ScopedMathMode scoped_mode(static_cast<MATH_MODE>(mode));
+  guetzli::OutputImage image(img.width, img.height);
+  image.CopyFromJpegData(img.jpg);
+  out->assign(3, std::vector<float>(img.width * img.height));
+  image.ToLinearRGB(out);
+  return true;
+}
+
+#ifdef __USE_OPENCL__
+// Runs |kernel| on a device copy of |plane| and reads the result back.
+template <typename F>
+void RunOnDevice(const std::vector<float>& plane, F kernel,
+                 std::vector<float>* out) {
+  ocl_args_d_t& ocl = getOcl();
+  const size_t size = plane.size() * sizeof(float);
+  cl_mem mem = ocl.allocMem(size, plane.data());
+  kernel(mem);
+  out->resize(plane.size());
+  ocl.readBuffer(mem, size, out->data());
+  ocl.finish();
+  clReleaseMemObject(mem);
+}
+#endif
+
+// The in-place kernels, whose variants are called directly as in
+// guetzli_bench.
+bool RunBlur(int mode, const TestImage& img, double sigma, Planes* out) {
+  const int w = img.width, h = img.height;
+  out->assign(1, img.xyb0[1]);
+  if (mode == MODE_CPU) {
+    ScopedMathMode scoped_mode(MODE_CPU);
+    ::butteraugli::Blur(w, h, (*out)[0].data(), sigma, 0.0);
+    return true;
+  }
+  if (mode == MODE_CPU_OPT) {
+    ::butteraugli::BlurOpt(w, h, (*out)[0].data(), sigma, 0.0f);
+    return true;
+  }
+#ifdef __USE_OPENCL__
+  if (mode == MODE_OPENCL) {
+    RunOnDevice(img.xyb0[1],
+                [=](cl_mem mem) { clBlurEx(mem, w, h, sigma, 0.0); },
+                &(*out)[0]);
+    return true;
+  }
+#endif
+  return false;
+}
+
+bool RunMinSquareVal(int mode, const TestImage& img, double, Planes* out) {
+  const int w = img.width, h = img.height;
+  out->assign(1, img.xyb0[1]);
+  if (mode == MODE_CPU) {
+    ::butteraugli::_MinSquareVal(4, 0, w, h, (*out)[0].data());
+    return true;
+  }
+  if (mode == MODE_CPU_OPT) {
+    ::butteraugli::MinSquareValOpt(4, 0, w, h, (*out)[0].data());
+    return true;
+  }
+#ifdef __USE_OPENCL__
+  if (mode == MODE_OPENCL) {
+    RunOnDevice(img.xyb0[1],
+                [=](cl_mem mem) { clMinSquareValEx(mem, w, h, 4, 0); },
+                &(*out)[0]);
+    return true;
+  }
+#endif
+  return false;
+}
+
+std::vector<Stage> Stages() {
+  std::vector<Stage> stages = {
+      {"OpsinDynamicsImage", RunOpsinDynamicsImage, 0},
+      {"Mask", RunMask, 0},
+      {"DiffmapOpsinDynamicsImage", RunDiffmap, 0},
+      {"OutputImage::ToLinearRGB", RunToLinearRGB, 0},
+      {"MinSquareVal", RunMinSquareVal, 0},
+  };
+  // The sigmas of the Butteraugli blurs.
+  for (double sigma : {1.2, 1.5, 2.5, 3.0, 5.6}) {
+    char name[32];
+    snprintf(name, sizeof(name), "Blur/%g", sigma);
+    stages.push_back({name, RunBlur, sigma});
+  }
+  return stages;
+}
+
+// Planes one after the other, for DiffReport::Compare().
+std::vector<float> Flatten(const Planes& planes) {
+  std::vector<float> flat;
+  for (size_t c = 0; c < planes.size(); ++c) {
+    flat.insert(flat.end(), planes[c].begin(), planes[c].end());
+  }
+  return flat;
+}
+
+// The decoded pixels of |jpeg| as planes of bytes, empty if it is invalid.
+std::vector<uint8_t> DecodePlanes(const std::string& jpeg) {
+  guetzli::JPEGData jpg;
+  if (!guetzli::ReadJpeg(jpeg, guetzli::JPEG_READ_ALL, &jpg)) {
+    return std::vector<uint8_t>();
+  }
+  const std::vector<uint8_t> rgb = guetzli::DecodeJpegToRGB(jpg);
+  const size_t pixels = rgb.size() / 3;
+  std::vector<uint8_t> planes(rgb.size());
+  for (size_t i = 0; i < pixels; ++i) {
+    for (int c = 0; c < 3; ++c) planes[c * pixels + i] = rgb[3 * i + c];
+  }
+  return planes;
+}
+
+// cpu_opt computes in float where cpu computes in double. Against each
+// other OpsinDynamicsImage drifts by about 1e-2, and the encodes take
+// different search paths, so their outputs can't be equal.
+bool IsFloatPair(const std::vector<int>& modes) {
+  return (modes[0] == MODE_CPU && modes[1] == MODE_CPU_OPT) ||
+         (modes[0] == MODE_CPU_OPT && modes[1] == MODE_CPU);
+}
+
+const double kFloatPairOpsinAbs = 0.02;
+
+// Encodes |img| with both backends. With |exact| the outputs must be equal,
+// and their pixels are compared for the size of the divergence; otherwise
+// the divergence is only reported.
+void CompareEncode(const guetzli::Encoder& a, const guetzli::Encoder& b,
+                   const TestImage& img, const guetzli::Params& params,
+                   const std::string& suffix, bool exact,
+                   guetzli::DiffReport* report) {
+  std::string out_a, out_b;
+  const bool ok_a = a.Encode(params, img.srgb, img.width, img.height, &out_a);
+  const bool ok_b = b.Encode(params, img.srgb, img.width, img.height, &out_b);
+  if (exact) {
+    report->Equal(("Encode output" + suffix).c_str(),
+                  ok_a && ok_b && out_a == out_b);
+  } else {
+    guetzli::DiffTolerance any;
+    any.abs = 256.0;  // No 8-bit pixel exceeds this.
+    report->SetTolerance("Encode pixels" + suffix, any);
+    report->Equal(("Encode" + suffix).c_str(), ok_a && ok_b);
+  }
+  printf("Encode%s: %zu vs %zu bytes\n", suffix.c_str(), out_a.size(),
+         out_b.size());
+  const std::vector<uint8_t> pixels_a = DecodePlanes(out_a);
+  const std::vector<uint8_t> pixels_b = DecodePlanes(out_b);
+  if (pixels_a.size() != pixels_b.size() || pixels_a.empty()) {
+    report->Equal(("Encode pixels" + suffix).c_str(), false);
+    return;
+  }
+  report->Compare(("Encode pixels" + suffix).c_str(), pixels_a.data(),
+                  pixels_b.data(), pixels_a.size(), img.width, img.height);
+}
+
+void Usage() {
+  fprintf(stderr,
+      "Usage: guetzli_difftest [flags]\n"
+      "  --backends A,B    - The two backends, of cpu, cpu_opt, opencl and\n"
+      "                      cuda. Default is cpu,cpu_opt, whose OpsinDynamicsImage\n"
+      "                      gets an absolute tolerance of 0.02 and whose encodes\n"
+      "                      only have to succeed.\n"
+      "  --sizes WxH,...   - Image sizes. Default is 256x256.\n"
+      "  --filter S        - Only the stages whose name contains S.\n"
+      "  --abs A           - Absolute tolerance. Default is 0.001.\n"
+      "  --rel R           - Relative tolerance, a value differs when it\n"
+      "                      exceeds both. Default is 0.\n"
+      "  --quality Q       - Quality of the end-to-end encodes. Default 90.\n"
+      "  --no-encode       - Skip the end-to-end encodes.\n");
+  exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<std::pair<int, int> > sizes = {{256, 256}};
+  std::vector<int> modes = {MODE_CPU, MODE_CPU_OPT};
+  const char* filter = "";
+  guetzli::DiffTolerance tolerance;
+  bool custom_tolerance = false;
+  int quality = 90;
+  bool encode = true;
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "--backends") && has_value) {
+      if (!benchmark::ParseBackends(argv[++i], &modes)) Usage();
+      if (modes.size() != 2) Usage();
+    } else if (!strcmp(argv[i], "--sizes") && has_value) {
+      if (!benchmark::ParseSizes(argv[++i], &sizes)) Usage();
+    } else if (!strcmp(argv[i], "--filter") && has_value) {
+      filter = argv[++i];
+    } else if (!strcmp(argv[i], "--abs") && has_value) {
+      tolerance.abs = atof(argv[++i]);
+      custom_tolerance = true;
+    } else if (!strcmp(argv[i], "--rel") && has_value) {
+      tolerance.rel = atof(argv[++i]);
+      custom_tolerance = true;
+    } else if (!strcmp(argv[i], "--quality") && has_value) {
+      quality = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--no-encode")) {
+      encode = false;
+    } else {
+      Usage();
+    }
+  }
+
+  guetzli::DiffReport report;
+  report.SetTolerance(tolerance);
+  const bool float_pair = IsFloatPair(modes);
+  printf("%s against %s\n", BackendName(modes[0]), BackendName(modes[1]));
+  const std::vector<Stage> stages = Stages();
+  for (size_t s = 0; s < sizes.size(); ++s) {
+    TestImage img;
+    MakeTestImage(sizes[s].first, sizes[s].second, &img);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), " @%dx%d", img.width, img.height);
+    if (float_pair && !custom_tolerance) {
+      guetzli::DiffTolerance opsin = tolerance;
+      opsin.abs = kFloatPairOpsinAbs;
+      report.SetTolerance(std::string("OpsinDynamicsImage") + suffix, opsin);
+    }
+    for (size_t i = 0; i < stages.size(); ++i) {
+      if (!strstr(stages[i].name.c_str(), filter)) continue;
+      Planes a, b;
+      if (!stages[i].run(modes[0], img, stages[i].arg, &a) ||
+          !stages[i].run(modes[1], img, stages[i].arg, &b)) {
+        continue;
+      }
+      const std::vector<float> flat_a = Flatten(a), flat_b = Flatten(b);
+      const std::string name = stages[i].name + suffix;
+      if (flat_a.size() != flat_b.size()) {
+        report.Equal(name.c_str(), false);
+        continue;
+      }
+      report.Compare(name.c_str(), flat_a.data(), flat_b.data(),
+                     flat_a.size(), img.width, img.height);
+    }
+    if (encode && strstr("Encode", filter)) {
+      guetzli::Params params;
+      params.butteraugli_target = static_cast<float>(
+          guetzli::ButteraugliScoreForQuality(quality));
+      const guetzli::Encoder encoder_a(modes[0]), encoder_b(modes[1]);
+      CompareEncode(encoder_a, encoder_b, img, params, suffix, !float_pair,
+                    &report);
+    }
+  }
+  report.Print(stdout);
+  return report.Failed() ? 1 : 0;
+}
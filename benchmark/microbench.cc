@@ -0,0 +1,568 @@
+/*
+ * Microbenchmarks of the encoder and Butteraugli kernels.
+ *
+ * Every benchmark runs on a synthetic image of each requested size, once per
+ * backend it has a variant for: the reference CPU code, the CPU_OPT code and
+ * the OpenCL or CUDA kernels when built in. The median time is printed and,
+ * with --json, written with the other statistics for comparing runs.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "benchmark/test_image.h"
+#include "butteraugli/butteraugli.h"
+#include "clguetzli/clbutter_comparator.h"
+#include "clguetzli/clguetzli.h"
+#include "guetzli/butteraugli_comparator.h"
+#include "guetzli/cpu_dispatch.h"
+#include "guetzli/fdct.h"
+#include "guetzli/idct.h"
+#include "guetzli/jpeg_bit_writer.h"
+#include "guetzli/jpeg_data_writer.h"
+#include "guetzli/output_image.h"
+#include "guetzli/preprocess_downsample.h"
+#ifdef __USE_OPENCL__
+#include "clguetzli/ocl.h"
+#endif
+#ifdef __USE_CUDA__
+#include "clguetzli/ocu.h"
+#endif
+
+namespace {
+
+using benchmark::BackendName;
+using benchmark::HasBackend;
+using benchmark::MakeTestImage;
+using benchmark::TestImage;
+using guetzli::coeff_t;
+
+uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// One benchmark at one size and backend. reset() restores the inputs of an
+// in-place kernel and is not timed, run() is.
+struct Case {
+  std::function<void()> reset;
+  std::function<void()> run;
+  // The pixels one run() covers, for the throughput.
+  double pixels = 0;
+};
+
+// Sets up |c| for |mode|, false if the benchmark has no variant for it.
+// |arg| is the one of the Benchmark.
+typedef bool (*SetupFunc)(int mode, const TestImage& img, double arg,
+                          Case* c);
+
+struct Benchmark {
+  std::string name;
+  SetupFunc setup;
+  double arg;  // The blur sigma.
+};
+
+// 8x8 blocks of the first image plane, for the transforms.
+std::vector<coeff_t> PixelBlocks(const TestImage& img) {
+  const int bw = img.width / 8, bh = img.height / 8;
+  std::vector<coeff_t> blocks(bw * bh * 64);
+  for (int by = 0; by < bh; ++by) {
+    for (int bx = 0; bx < bw; ++bx) {
+      coeff_t* block = &blocks[(by * bw + bx) * 64];
+      for (int i = 0; i < 64; ++i) {
+        const int x = bx * 8 + i % 8, y = by * 8 + i / 8;
+        block[i] = img.srgb[3 * (y * img.width + x)] - 128;
+      }
+    }
+  }
+  return blocks;
+}
+
+bool SetupDCT(int mode, const TestImage& img, double, Case* c) {
+  if (mode != MODE_CPU) return false;
+  std::shared_ptr<std::vector<coeff_t> > input(
+      new std::vector<coeff_t>(PixelBlocks(img)));
+  std::shared_ptr<std::vector<coeff_t> > blocks(
+      new std::vector<coeff_t>(input->size()));
+  c->reset = [=]() { *blocks = *input; };
+  c->run = [=]() {
+    for (size_t i = 0; i < blocks->size(); i += 64) {
+      guetzli::ComputeBlockDCT(&(*blocks)[i]);
+    }
+  };
+  c->pixels = input->size();
+  return true;
+}
+
+bool SetupIDCT(int mode, const TestImage& img, double, Case* c) {
+  if (mode != MODE_CPU) return false;
+  std::shared_ptr<std::vector<coeff_t> > coeffs(
+      new std::vector<coeff_t>(PixelBlocks(img)));
+  for (size_t i = 0; i < coeffs->size(); i += 64) {
+    guetzli::ComputeBlockDCT(&(*coeffs)[i]);
+  }
+  std::shared_ptr<std::vector<uint8_t> > pixels(
+      new std::vector<uint8_t>(coeffs->size()));
+  c->run = [=]() {
+    for (size_t i = 0; i < coeffs->size(); i += 64) {
+      guetzli::ComputeBlockIDCT(&(*coeffs)[i], &(*pixels)[i]);
+    }
+  };
+  c->pixels = coeffs->size();
+  return true;
+}
+
+bool SetupEncodeDCTBlockSequential(int mode, const TestImage& img, double,
+                                   Case* c) {
+  if (mode != MODE_CPU) return false;
+  const guetzli::JPEGData* jpg = &img.jpg;
+  std::shared_ptr<std::vector<guetzli::HuffmanCodeTable> > dc(
+      new std::vector<guetzli::HuffmanCodeTable>);
+  std::shared_ptr<std::vector<guetzli::HuffmanCodeTable> > ac(
+      new std::vector<guetzli::HuffmanCodeTable>);
+  guetzli::BuildSequentialHuffmanCodes(*jpg, dc.get(), ac.get());
+  c->run = [=]() {
+    guetzli::BitWriter bw(1 << 17);
+    for (size_t i = 0; i < jpg->components.size(); ++i) {
+      const guetzli::JPEGComponent& comp = jpg->components[i];
+      coeff_t last_dc_coeff = 0;
+      for (size_t b = 0; b < comp.coeffs.size(); b += 64) {
+        guetzli::EncodeDCTBlockSequential(&comp.coeffs[b], (*dc)[i], (*ac)[i],
+                                          &last_dc_coeff, &bw);
+        if (bw.pos > (1 << 16)) bw.pos = 0;
+      }
+    }
+  };
+  c->pixels = img.width * img.height;
+  return true;
+}
+
+bool SetupBuildACHistograms(int mode, const TestImage& img, double,
+                            Case* c) {
+  if (mode != MODE_CPU) return false;
+  const guetzli::JPEGData* jpg = &img.jpg;
+  std::shared_ptr<std::vector<guetzli::JpegHistogram> > histo(
+      new std::vector<guetzli::JpegHistogram>(jpg->components.size()));
+  c->reset = [=]() {
+    for (size_t i = 0; i < histo->size(); ++i) (*histo)[i].Clear();
+  };
+  c->run = [=]() { guetzli::BuildACHistograms(*jpg, histo->data()); };
+  c->pixels = img.width * img.height;
+  return true;
+}
+
+bool SetupClusterHistograms(int mode, const TestImage& img, double,
+                            Case* c) {
+  if (mode != MODE_CPU) return false;
+  const size_t ncomps = img.jpg.components.size();
+  std::shared_ptr<std::vector<guetzli::JpegHistogram> > input(
+      new std::vector<guetzli::JpegHistogram>(ncomps));
+  guetzli::BuildACHistograms(img.jpg, input->data());
+  std::shared_ptr<std::vector<guetzli::JpegHistogram> > histo(
+      new std::vector<guetzli::JpegHistogram>(ncomps));
+  std::shared_ptr<std::vector<uint8_t> > depths(
+      new std::vector<uint8_t>(ncomps * guetzli::JpegHistogram::kSize));
+  c->reset = [=]() { *histo = *input; };
+  c->run = [=]() {
+    size_t num = histo->size();
+    int indexes[guetzli::kMaxComponents];
+    guetzli::ClusterHistograms(histo->data(), &num, indexes, depths->data());
+  };
+  c->pixels = img.width * img.height;
+  return true;
+}
+
+// The 8x8 blocks of both XYB images in the layout of ButteraugliBlockDiff.
+template <typename T>
+std::vector<T> XybBlocks(const TestImage& img,
+                         const std::vector<std::vector<float> >& xyb) {
+  const int bw = img.width / 8, bh = img.height / 8;
+  std::vector<T> blocks(bw * bh * 192);
+  for (int by = 0; by < bh; ++by) {
+    for (int bx = 0; bx < bw; ++bx) {
+      T* block = &blocks[(by * bw + bx) * 192];
+      for (int c = 0; c < 3; ++c) {
+        for (int i = 0; i < 64; ++i) {
+          const int x = bx * 8 + i % 8, y = by * 8 + i / 8;
+          block[c * 64 + i] = xyb[c][y * img.width + x];
+        }
+      }
+    }
+  }
+  return blocks;
+}
+
+bool SetupButteraugliBlockDiff(int mode, const TestImage& img, double,
+                               Case* c) {
+  if (mode == MODE_CPU) {
+    std::shared_ptr<std::vector<double> > b0(
+        new std::vector<double>(XybBlocks<double>(img, img.xyb0)));
+    std::shared_ptr<std::vector<double> > b1(
+        new std::vector<double>(XybBlocks<double>(img, img.xyb1)));
+    c->run = [=]() {
+      double dc[3], ac[3], edge_dc[3];
+      for (size_t i = 0; i < b0->size(); i += 192) {
+        ::butteraugli::ButteraugliBlockDiff(&(*b0)[i], &(*b1)[i], dc, ac,
+                                            edge_dc);
+      }
+    };
+    c->pixels = b0->size() / 3;
+    return true;
+  }
+  if (mode == MODE_CPU_OPT) {
+    std::shared_ptr<std::vector<float> > b0(
+        new std::vector<float>(XybBlocks<float>(img, img.xyb0)));
+    std::shared_ptr<std::vector<float> > b1(
+        new std::vector<float>(XybBlocks<float>(img, img.xyb1)));
+    c->run = [=]() {
+      float dc[3], ac[3], edge_dc[3];
+      for (size_t i = 0; i < b0->size(); i += 192) {
+        ::butteraugli::ButteraugliBlockDiffOpt(&(*b0)[i], &(*b1)[i], dc, ac,
+                                               edge_dc);
+      }
+    };
+    c->pixels = b0->size() / 3;
+    return true;
+  }
+  return false;
+}
+
+// CompareBlock of up to kCompareBlocks blocks, each after its SwitchBlock as
+// in the coefficient zeroing.
+bool SetupCompareBlock(int mode, const TestImage& img, double, Case* c) {
+  static const int kCompareBlocks = 256;
+  if (mode != MODE_CPU && mode != MODE_CPU_OPT) return false;
+  if (img.width < 32 || img.height < 32) return false;
+  ScopedMathMode scoped_mode(static_cast<MATH_MODE>(mode));
+  struct State {
+    guetzli::ProcessStats stats;
+    std::unique_ptr<guetzli::ButteraugliComparator> comparator;
+    std::unique_ptr<guetzli::OutputImage> out;
+  };
+  std::shared_ptr<State> state(new State);
+#if defined(__USE_OPENCL__) || defined(__USE_CUDA__)
+  state->comparator.reset(new guetzli::ButteraugliComparatorEx(
+      img.width, img.height, &img.srgb, 1.0f, &state->stats));
+#else
+  state->comparator.reset(new guetzli::ButteraugliComparator(
+      img.width, img.height, &img.srgb, 1.0f, &state->stats));
+#endif
+  state->out.reset(new guetzli::OutputImage(img.width, img.height));
+  state->out->CopyFromJpegData(img.jpg);
+  state->comparator->Compare(*state->out);
+  state->comparator->StartBlockComparisons();
+  const int bw = img.width / 8;
+  const int blocks = std::min(kCompareBlocks, bw * (img.height / 8));
+  c->run = [=]() {
+    ScopedMathMode scoped_mode(static_cast<MATH_MODE>(mode));
+    coeff_t block[3 * guetzli::kDCTBlockSize];
+    for (int b = 0; b < blocks; ++b) {
+      const int bx = b % bw, by = b / bw;
+      for (int i = 0; i < 3; ++i) {
+        state->out->component(i).GetCoeffBlock(
+            bx, by, &block[i * guetzli::kDCTBlockSize]);
+      }
+      state->comparator->SwitchBlock(bx, by, 1, 1);
+      state->comparator->CompareBlock(*state->out, 0, 0, block, 7);
+    }
+  };
+  c->pixels = blocks * 64;
+  return true;
+}
+
+// The kernels the butteraugli dispatchers run for each backend.
+bool SetupOpsinDynamicsImage(int mode, const TestImage& img, double, Case* c) {
+  if (!HasBackend(mode)) return false;
+  std::shared_ptr<std::vector<std::vector<float> > > rgb(
+      new std::vector<std::vector<float> >);
+  const std::vector<std::vector<float> >* linear = &img.linear;
+  const int w = img.width, h = img.height;
+  c->reset = [=]() { *rgb = *linear; };
+  c->run = [=]() {
+    ScopedMathMode scoped_mode(static_cast<MATH_MODE>(mode));
+    ::butteraugli::OpsinDynamicsImage(w, h, *rgb);
+  };
+  c->pixels = w * h;
+  return true;
+}
+
+bool SetupMask(int mode, const TestImage& img, double, Case* c) {
+  if (!HasBackend(mode)) return false;
+  std::shared_ptr<std::vector<std::vector<float> > > mask(
+      new std::vector<std::vector<float> >);
+  std::shared_ptr<std::vector<std::vector<float> > > mask_dc(
+      new std::vector<std::vector<float> >);
+  const TestImage* in = &img;
+  c->run = [=]() {
+    ScopedMathMode scoped_mode(static_cast<MATH_MODE>(mode));
+    ::butteraugli::Mask(in->xyb0, in->xyb1, in->width, in->height, mask.get(),
+                        mask_dc.get());
+  };
+  c->pixels = img.width * img.height;
+  return true;
+}
+
+#ifdef __USE_OPENCL__
+// A device copy of a plane, made anew by reset().
+struct DeviceChannel {
+  cl_mem mem = nullptr;
+  ~DeviceChannel() {
+    if (mem) clReleaseMemObject(mem);
+  }
+  void Upload(const std::vector<float>& plane) {
+    if (mem) clReleaseMemObject(mem);
+    ocl_args_d_t& ocl = getOcl();
+    mem = ocl.allocMem(plane.size() * sizeof(float), plane.data());
+    ocl.finish();
+  }
+};
+#endif
+
+bool SetupBlur(int mode, const TestImage& img, double sigma, Case* c) {
+  const std::vector<float>* input = &img.xyb0[1];
+  const int w = img.width, h = img.height;
+  c->pixels = w * h;
+  if (mode == MODE_CPU || mode == MODE_CPU_OPT) {
+    std::shared_ptr<std::vector<float> > plane(new std::vector<float>);
+    c->reset = [=]() { *plane = *input; };
+    if (mode == MODE_CPU) {
+      c->run = [=]() {
+        ScopedMathMode scoped_mode(MODE_CPU);
+        ::butteraugli::Blur(w, h, plane->data(), sigma, 0.0);
+      };
+    } else {
+      c->run = [=]() {
+        ::butteraugli::BlurOpt(w, h, plane->data(), sigma, 0.0f);
+      };
+    }
+    return true;
+  }
+#ifdef __USE_OPENCL__
+  if (mode == MODE_OPENCL) {
+    std::shared_ptr<DeviceChannel> plane(new DeviceChannel);
+    c->reset = [=]() { plane->Upload(*input); };
+    c->run = [=]() {
+      clBlurEx(plane->mem, w, h, sigma, 0.0);
+      getOcl().finish();
+    };
+    return true;
+  }
+#endif
+  return false;
+}
+
+bool SetupMinSquareVal(int mode, const TestImage& img, double, Case* c) {
+  const std::vector<float>* input = &img.xyb0[1];
+  const int w = img.width, h = img.height;
+  c->pixels = w * h;
+  if (mode == MODE_CPU || mode == MODE_CPU_OPT) {
+    std::shared_ptr<std::vector<float> > plane(new std::vector<float>);
+    c->reset = [=]() { *plane = *input; };
+    if (mode == MODE_CPU) {
+      c->run = [=]() {
+        ::butteraugli::_MinSquareVal(4, 0, w, h, plane->data());
+      };
+    } else {
+      c->run = [=]() {
+        ::butteraugli::MinSquareValOpt(4, 0, w, h, plane->data());
+      };
+    }
+    return true;
+  }
+#ifdef __USE_OPENCL__
+  if (mode == MODE_OPENCL) {
+    std::shared_ptr<DeviceChannel> plane(new DeviceChannel);
+    c->reset = [=]() { plane->Upload(*input); };
+    c->run = [=]() {
+      clMinSquareValEx(plane->mem, w, h, 4, 0);
+      getOcl().finish();
+    };
+    return true;
+  }
+#endif
+  return false;
+}
+
+bool SetupRGBToYUV420(int mode, const TestImage& img, double, Case* c) {
+  if (mode != MODE_CPU) return false;
+  const TestImage* in = &img;
+  c->run = [=]() { guetzli::RGBToYUV420(in->srgb, in->width, in->height); };
+  c->pixels = img.width * img.height;
+  return true;
+}
+
+std::vector<Benchmark> Benchmarks() {
+  std::vector<Benchmark> benchmarks = {
+      {"ComputeBlockDCT", SetupDCT, 0},
+      {"ComputeBlockIDCT", SetupIDCT, 0},
+      {"EncodeDCTBlockSequential", SetupEncodeDCTBlockSequential, 0},
+      {"BuildACHistograms", SetupBuildACHistograms, 0},
+      {"ClusterHistograms", SetupClusterHistograms, 0},
+      {"ButteraugliBlockDiff", SetupButteraugliBlockDiff, 0},
+      {"CompareBlock", SetupCompareBlock, 0},
+      {"OpsinDynamicsImage", SetupOpsinDynamicsImage, 0},
+  };
+  // Every sigma butteraugli blurs with.
+  static const double kSigmas[] = {0.4, 0.586, 1.1, 1.5, 4.53358927369,
+                                   8.8510880283, 9.65781083553, 14,
+                                   14.2644604355};
+  for (double sigma : kSigmas) {
+    char name[64];
+    snprintf(name, sizeof(name), "Blur/%g", sigma);
+    benchmarks.push_back({name, SetupBlur, sigma});
+  }
+  benchmarks.push_back({"MinSquareVal", SetupMinSquareVal, 0});
+  benchmarks.push_back({"Mask", SetupMask, 0});
+  benchmarks.push_back({"RGBToYUV420", SetupRGBToYUV420, 0});
+  return benchmarks;
+}
+
+struct Result {
+  std::string name;
+  int mode;
+  int width;
+  int height;
+  size_t iterations;
+  double min_ns;
+  double median_ns;
+  double mean_ns;
+  double mpix_per_s;  // At the median.
+};
+
+// Runs |c| until |min_time_s| has been timed, at least kMinIterations times.
+Result Run(Case* c, double min_time_s) {
+  static const size_t kMinIterations = 3;
+  if (c->reset) c->reset();
+  c->run();  // Warm up the caches, the tuner and the allocators.
+  std::vector<double> times;
+  double total = 0;
+  while (times.size() < kMinIterations || total < min_time_s * 1e9) {
+    if (c->reset) c->reset();
+    const uint64_t start = NowNs();
+    c->run();
+    times.push_back(static_cast<double>(NowNs() - start));
+    total += times.back();
+  }
+  std::sort(times.begin(), times.end());
+  Result r;
+  r.iterations = times.size();
+  r.min_ns = times.front();
+  r.median_ns = times[times.size() / 2];
+  r.mean_ns = total / times.size();
+  r.mpix_per_s = r.median_ns > 0 ? c->pixels / r.median_ns * 1e3 : 0;
+  return r;
+}
+
+bool WriteJson(const char* filename, double min_time_s,
+               const std::vector<Result>& results) {
+  FILE* f = strcmp(filename, "-") ? fopen(filename, "w") : stdout;
+  if (!f) return false;
+  fprintf(f, "{\"min_time_s\":%g,\"isa\":\"%s\",\"benchmarks\":[",
+          min_time_s, guetzli::CpuIsaName(guetzli::ActiveCpuIsa()));
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    fprintf(f,
+            "%s\n{\"name\":\"%s\",\"backend\":\"%s\",\"width\":%d,"
+            "\"height\":%d,\"iterations\":%zu,\"min_ns\":%.0f,"
+            "\"median_ns\":%.0f,\"mean_ns\":%.0f,\"mpix_per_s\":%.3f}",
+            i ? "," : "", r.name.c_str(), BackendName(r.mode), r.width,
+            r.height, r.iterations, r.min_ns, r.median_ns, r.mean_ns,
+            r.mpix_per_s);
+  }
+  fprintf(f, "\n]}\n");
+  return f == stdout ? fflush(f) == 0 : fclose(f) == 0;
+}
+
+void Usage() {
+  fprintf(stderr,
+      "Usage: guetzli_bench [flags]\n"
+      "  --sizes WxH,...   - Image sizes. Default is 256x256,1024x1024.\n"
+      "  --backends B,...  - Of cpu, cpu_opt, opencl and cuda. Default is all\n"
+      "                      that are built in and have a device.\n"
+      "  --filter S        - Only the benchmarks whose name contains S.\n"
+      "  --min-time T      - Seconds to time each benchmark. Default is 0.5.\n"
+      "  --isa NAME        - Cap the CPU kernels at NAME of baseline, sse4.2,\n"
+      "                      avx2 and avx512. Default is the best of the CPU.\n"
+      "  --json F          - Write the results to F, \"-\" for stdout.\n");
+  exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<std::pair<int, int> > sizes = {{256, 256}, {1024, 1024}};
+  std::vector<int> modes = {MODE_CPU, MODE_CPU_OPT};
+#ifdef __USE_OPENCL__
+  if (supportsOpenCl()) modes.push_back(MODE_OPENCL);
+#endif
+#ifdef __USE_CUDA__
+  if (supportsCuda()) modes.push_back(MODE_CUDA);
+#endif
+  const char* filter = "";
+  const char* json = nullptr;
+  double min_time_s = 0.5;
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "--sizes") && has_value) {
+      if (!benchmark::ParseSizes(argv[++i], &sizes)) Usage();
+    } else if (!strcmp(argv[i], "--backends") && has_value) {
+      if (!benchmark::ParseBackends(argv[++i], &modes)) Usage();
+    } else if (!strcmp(argv[i], "--filter") && has_value) {
+      filter = argv[++i];
+    } else if (!strcmp(argv[i], "--min-time") && has_value) {
+      min_time_s = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--isa") && has_value) {
+      guetzli::CpuIsa isa;
+      if (!guetzli::ParseCpuIsa(argv[++i], &isa)) Usage();
+      guetzli::SetMaxCpuIsa(isa);
+    } else if (!strcmp(argv[i], "--json") && has_value) {
+      json = argv[++i];
+    } else {
+      Usage();
+    }
+  }
+
+  // Results go to stdout unless the JSON does.
+  FILE* out = json && !strcmp(json, "-") ? stderr : stdout;
+  fprintf(out, "CPU kernels: %s\n",
+          guetzli::CpuIsaName(guetzli::ActiveCpuIsa()));
+  std::vector<Result> results;
+  const std::vector<Benchmark> benchmarks = Benchmarks();
+  for (size_t s = 0; s < sizes.size(); ++s) {
+    TestImage img;
+    MakeTestImage(sizes[s].first, sizes[s].second, &img);
+    for (size_t b = 0; b < benchmarks.size(); ++b) {
+      if (!strstr(benchmarks[b].name.c_str(), filter)) continue;
+      for (size_t m = 0; m < modes.size(); ++m) {
+        Case c;
+        if (!benchmarks[b].setup(modes[m], img, benchmarks[b].arg, &c)) {
+          continue;
+        }
+        Result r = Run(&c, min_time_s);
+        r.name = benchmarks[b].name;
+        r.mode = modes[m];
+        r.width = img.width;
+        r.height = img.height;
+        fprintf(out, "%-26s %-8s %5dx%-5d %12.3f us %10.2f MPix/s %6zu runs\n",
+                r.name.c_str(), BackendName(r.mode), r.width, r.height,
+                r.median_ns / 1e3, r.mpix_per_s, r.iterations);
+        fflush(out);
+        results.push_back(r);
+      }
+    }
+  }
+  if (json && !WriteJson(json, min_time_s, results)) {
+    perror("Can't write the JSON results");
+    return 1;
+  }
+  return 0;
+}
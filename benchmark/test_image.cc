@@ -0,0 +1,114 @@
+/*
+ * The synthetic image and backend selection the benchmark tools share.
+ */
+
+#include "benchmark/test_image.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+
+#include "butteraugli/butteraugli.h"
+#include "clguetzli/clguetzli.h"
+#include "guetzli/gamma_correct.h"
+#include "guetzli/jpeg_data_encoder.h"
+#include "guetzli/output_image.h"
+
+namespace benchmark {
+
+void MakeTestImage(int width, int height, TestImage* img) {
+  img->width = width;
+  img->height = height;
+  img->srgb.resize(3 * width * height);
+  uint32_t seed = 12345;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        seed = seed * 1103515245 + 12345;
+        const int noise = static_cast<int>((seed >> 16) & 31) - 16;
+        int v = (x * (c + 1) * 255 / width + y * (3 - c) * 255 / height) / 3;
+        if (((x / 37) + (y / 29)) % 5 == 0) v = 255 - v;
+        v = std::min(255, std::max(0, v + noise));
+        img->srgb[3 * (y * width + x) + c] = static_cast<uint8_t>(v);
+      }
+    }
+  }
+  const double* lut = guetzli::Srgb8ToLinearTable();
+  img->linear.assign(3, std::vector<float>(width * height));
+  for (int i = 0; i < width * height; ++i) {
+    for (int c = 0; c < 3; ++c) {
+      img->linear[c][i] = static_cast<float>(lut[img->srgb[3 * i + c]]);
+    }
+  }
+
+  std::vector<int> quant(3 * guetzli::kDCTBlockSize, 4);
+  guetzli::EncodeRGBToJpeg(img->srgb, width, height, quant.data(), &img->jpg);
+  guetzli::OutputImage out(width, height);
+  out.CopyFromJpegData(img->jpg);
+
+  ScopedMathMode scoped_mode(MODE_CPU);
+  img->xyb0 = img->linear;
+  ::butteraugli::OpsinDynamicsImage(width, height, img->xyb0);
+  img->xyb1.assign(3, std::vector<float>(width * height));
+  out.ToLinearRGB(&img->xyb1);
+  ::butteraugli::OpsinDynamicsImage(width, height, img->xyb1);
+}
+
+const char* BackendName(int mode) {
+  switch (mode) {
+    case MODE_CPU: return "cpu";
+    case MODE_CPU_OPT: return "cpu_opt";
+    case MODE_OPENCL: return "opencl";
+    case MODE_CUDA: return "cuda";
+  }
+  return "unknown";
+}
+
+bool HasBackend(int mode) {
+  if (mode == MODE_CPU || mode == MODE_CPU_OPT) return true;
+#ifdef __USE_OPENCL__
+  if (mode == MODE_OPENCL) return true;
+#endif
+#ifdef __USE_CUDA__
+  if (mode == MODE_CUDA) return true;
+#endif
+  return false;
+}
+
+bool ParseSizes(const char* s, std::vector<std::pair<int, int> >* sizes) {
+  sizes->clear();
+  while (*s) {
+    int w, h, n;
+    if (sscanf(s, "%dx%d%n", &w, &h, &n) != 2 || w < 8 || h < 8) return false;
+    sizes->push_back(std::make_pair(w, h));
+    s += n;
+    if (*s == ',') ++s;
+  }
+  return !sizes->empty();
+}
+
+bool ParseBackends(const char* s, std::vector<int>* modes) {
+  modes->clear();
+  std::string list(s);
+  size_t pos = 0;
+  while (pos <= list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) end = list.size();
+    const std::string name = list.substr(pos, end - pos);
+    int mode = -1;
+    for (int m : {MODE_CPU, MODE_CPU_OPT, MODE_OPENCL, MODE_CUDA}) {
+      if (name == BackendName(m)) mode = m;
+    }
+    if (mode < 0) return false;
+    if (!HasBackend(mode)) {
+      fprintf(stderr, "%s is not built in, skipping it\n", name.c_str());
+    } else {
+      modes->push_back(mode);
+    }
+    pos = end + 1;
+  }
+  return true;
+}
+
+}  // namespace benchmark
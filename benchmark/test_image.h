@@ -0,0 +1,44 @@
+/*
+ * The synthetic image and backend selection the benchmark tools share.
+ */
+
+#ifndef BENCHMARK_TEST_IMAGE_H_
+#define BENCHMARK_TEST_IMAGE_H_
+
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include "guetzli/jpeg_data.h"
+
+namespace benchmark {
+
+// The inputs of the kernels at one image size.
+struct TestImage {
+  int width;
+  int height;
+  std::vector<uint8_t> srgb;                // Interleaved.
+  std::vector<std::vector<float> > linear;  // Planes of linear RGB, 0..255.
+  std::vector<std::vector<float> > xyb0;    // Opsin dynamics of linear.
+  std::vector<std::vector<float> > xyb1;    // Same, of the encoded image.
+  guetzli::JPEGData jpg;                    // srgb, quantized by 4.
+};
+
+// Smooth gradients with noise and a few edges: neither flat nor random, so
+// that the entropy coder and the masking see typical data. Deterministic.
+void MakeTestImage(int width, int height, TestImage* img);
+
+// "cpu", "cpu_opt", "opencl" or "cuda".
+const char* BackendName(int mode);
+// Whether the backend of |mode| is built in.
+bool HasBackend(int mode);
+
+// "WxH,..." and "name,...", false on a malformed list. Backends that are not
+// built in are skipped with a warning.
+bool ParseSizes(const char* s, std::vector<std::pair<int, int> >* sizes);
+bool ParseBackends(const char* s, std::vector<int>* modes);
+
+}  // namespace benchmark
+
+#endif  // BENCHMARK_TEST_IMAGE_H_
@@ -8,6 +8,7 @@
 #include "clbutter_comparator.h"
 #include "clguetzli.h"
 #include "clguetzli_test.h"
+#include "guetzli/cpu_dispatch.h"
 
 #include <algorithm>
 #include <array>
@@ -30,28 +31,8 @@ void ConvolutionOpt(size_t xsize, size_t ysize,
 	float border_ratio,
 	float* __restrict__ result) {
 	PROFILER_FUNC;
-	float weight_no_border = 0;
-	for (size_t j = 0; j <= 2 * offset; ++j) {
-		weight_no_border += multipliers[j];
-	}
-	for (size_t x = 0, ox = 0; x < xsize; x += xstep, ox++) {
-		int minx = x < offset ? 0 : x - offset;
-		int maxx = std::min(xsize, x + len - offset) - 1;
-		float weight = 0.0;
-		for (int j = minx; j <= maxx; ++j) {
-			weight += multipliers[j - x + offset];
-		}
-		// Interpolate linearly between the no-border scaling and border scaling.
-		weight = (1.0 - border_ratio) * weight + border_ratio * weight_no_border;
-		float scale = 1.0 / weight;
-		for (size_t y = 0; y < ysize; ++y) {
-			float sum = 0.0;
-			for (int j = minx; j <= maxx; ++j) {
-				sum += inp[y * xsize + j] * multipliers[j - x + offset];
-			}
-			result[ox * ysize + y] = static_cast<float>(sum * scale);
-		}
-	}
+	guetzli::GetCpuKernels().convolution(xsize, ysize, xstep, len, offset,
+		multipliers, inp, border_ratio, result);
 }
 
 void BlurOpt(size_t xsize, size_t ysize, float* channel, float sigma,
@@ -228,16 +209,6 @@ inline float InterpolateClampNegativeOpt(const float *array,
 	return res;
 }
 
-void RgbToXybOpt(float r, float g, float b,
-	float *valx, float *valy, float *valz) {
-	static const float a0 = 1.01611726948;
-	static const float a1 = 0.982482243696;
-	static const float a2 = 1.43571362627;
-	static const float a3 = 0.896039849412;
-	*valx = a0 * r - a1 * g;
-	*valy = a2 * r + a3 * g;
-	*valz = b;
-}
 
 static inline void XybToValsOpt(float x, float y, float z,
 	float *valx, float *valy, float *valz) {
@@ -298,251 +269,12 @@ void XybDiffLowFreqSquaredAccumulateOpt(float r0, float g0, float b0,
 	res[2] += factor * valz * valz;
 }
 
-struct ComplexOpt {
-public:
-	float real;
-	float imag;
-};
-
-inline float abssq(const ComplexOpt& c) {
-	return c.real * c.real + c.imag * c.imag;
-}
-
-static void TransposeBlock(ComplexOpt data[kBlockSize]) {
-	for (int i = 0; i < kBlockEdge; i++) {
-		for (int j = 0; j < i; j++) {
-			std::swap(data[kBlockEdge * i + j], data[kBlockEdge * j + i]);
-		}
-	}
-}
-
-//  D. J. Bernstein's Fast Fourier Transform algorithm on 4 elements.
-inline void FFT4Opt(ComplexOpt* a) {
-	float t1, t2, t3, t4, t5, t6, t7, t8;
-	t5 = a[2].real;
-	t1 = a[0].real - t5;
-	t7 = a[3].real;
-	t5 += a[0].real;
-	t3 = a[1].real - t7;
-	t7 += a[1].real;
-	t8 = t5 + t7;
-	a[0].real = t8;
-	t5 -= t7;
-	a[1].real = t5;
-	t6 = a[2].imag;
-	t2 = a[0].imag - t6;
-	t6 += a[0].imag;
-	t5 = a[3].imag;
-	a[2].imag = t2 + t3;
-	t2 -= t3;
-	a[3].imag = t2;
-	t4 = a[1].imag - t5;
-	a[3].real = t1 + t4;
-	t1 -= t4;
-	a[2].real = t1;
-	t5 += a[1].imag;
-	a[0].imag = t6 + t5;
-	t6 -= t5;
-	a[1].imag = t6;
-}
-
-static const float kSqrtHalf = 0.70710678118654752440084436210484903;
-
-//  D. J. Bernstein's Fast Fourier Transform algorithm on 8 elements.
-void FFT8OptOpt(ComplexOpt* a) {
-	float t1, t2, t3, t4, t5, t6, t7, t8;
-
-	t7 = a[4].imag;
-	t4 = a[0].imag - t7;
-	t7 += a[0].imag;
-	a[0].imag = t7;
-
-	t8 = a[6].real;
-	t5 = a[2].real - t8;
-	t8 += a[2].real;
-	a[2].real = t8;
-
-	t7 = a[6].imag;
-	a[6].imag = t4 - t5;
-	t4 += t5;
-	a[4].imag = t4;
-
-	t6 = a[2].imag - t7;
-	t7 += a[2].imag;
-	a[2].imag = t7;
-
-	t8 = a[4].real;
-	t3 = a[0].real - t8;
-	t8 += a[0].real;
-	a[0].real = t8;
-
-	a[4].real = t3 - t6;
-	t3 += t6;
-	a[6].real = t3;
-
-	t7 = a[5].real;
-	t3 = a[1].real - t7;
-	t7 += a[1].real;
-	a[1].real = t7;
-
-	t8 = a[7].imag;
-	t6 = a[3].imag - t8;
-	t8 += a[3].imag;
-	a[3].imag = t8;
-	t1 = t3 - t6;
-	t3 += t6;
-
-	t7 = a[5].imag;
-	t4 = a[1].imag - t7;
-	t7 += a[1].imag;
-	a[1].imag = t7;
-
-	t8 = a[7].real;
-	t5 = a[3].real - t8;
-	t8 += a[3].real;
-	a[3].real = t8;
-
-	t2 = t4 - t5;
-	t4 += t5;
-
-	t6 = t1 - t4;
-	t8 = kSqrtHalf;
-	t6 *= t8;
-	a[5].real = a[4].real - t6;
-	t1 += t4;
-	t1 *= t8;
-	a[5].imag = a[4].imag - t1;
-	t6 += a[4].real;
-	a[4].real = t6;
-	t1 += a[4].imag;
-	a[4].imag = t1;
-
-	t5 = t2 - t3;
-	t5 *= t8;
-	a[7].imag = a[6].imag - t5;
-	t2 += t3;
-	t2 *= t8;
-	a[7].real = a[6].real - t2;
-	t2 += a[6].real;
-	a[6].real = t2;
-	t5 += a[6].imag;
-	a[6].imag = t5;
-
-	FFT4Opt(a);
-
-	// Reorder to the correct output order.
-	// TODO: Modify the above computation so that this is not needed.
-	ComplexOpt tmp = a[2];
-	a[2] = a[3];
-	a[3] = a[5];
-	a[5] = a[7];
-	a[7] = a[4];
-	a[4] = a[1];
-	a[1] = a[6];
-	a[6] = tmp;
-}
-
-// Same as FFT8, but all inputs are real.
-// TODO: Since this does not need to be in-place, maybe there is a
-// faster FFT than this one, which is derived from DJB's in-place complex FFT.
-void RealFFT8Opt(const float* in, ComplexOpt* out) {
-	float t1, t2, t3, t5, t6, t7, t8;
-	t8 = in[6];
-	t5 = in[2] - t8;
-	t8 += in[2];
-	out[2].real = t8;
-	out[6].imag = -t5;
-	out[4].imag = t5;
-	t8 = in[4];
-	t3 = in[0] - t8;
-	t8 += in[0];
-	out[0].real = t8;
-	out[4].real = t3;
-	out[6].real = t3;
-	t7 = in[5];
-	t3 = in[1] - t7;
-	t7 += in[1];
-	out[1].real = t7;
-	t8 = in[7];
-	t5 = in[3] - t8;
-	t8 += in[3];
-	out[3].real = t8;
-	t2 = -t5;
-	t6 = t3 - t5;
-	t8 = kSqrtHalf;
-	t6 *= t8;
-	out[5].real = out[4].real - t6;
-	t1 = t3 + t5;
-	t1 *= t8;
-	out[5].imag = out[4].imag - t1;
-	t6 += out[4].real;
-	out[4].real = t6;
-	t1 += out[4].imag;
-	out[4].imag = t1;
-	t5 = t2 - t3;
-	t5 *= t8;
-	out[7].imag = out[6].imag - t5;
-	t2 += t3;
-	t2 *= t8;
-	out[7].real = out[6].real - t2;
-	t2 += out[6].real;
-	out[6].real = t2;
-	t5 += out[6].imag;
-	out[6].imag = t5;
-	t5 = out[2].real;
-	t1 = out[0].real - t5;
-	t7 = out[3].real;
-	t5 += out[0].real;
-	t3 = out[1].real - t7;
-	t7 += out[1].real;
-	t8 = t5 + t7;
-	out[0].real = t8;
-	t5 -= t7;
-	out[1].real = t5;
-	out[2].imag = t3;
-	out[3].imag = -t3;
-	out[3].real = t1;
-	out[2].real = t1;
-	out[0].imag = 0;
-	out[1].imag = 0;
-
-	// Reorder to the correct output order.
-	// TODO: Modify the above computation so that this is not needed.
-	ComplexOpt tmp = out[2];
-	out[2] = out[3];
-	out[3] = out[5];
-	out[5] = out[7];
-	out[7] = out[4];
-	out[4] = out[1];
-	out[1] = out[6];
-	out[6] = tmp;
-}
-
+// The FFT is in guetzli/cpu_kernels.inc.
 // Fills in block[kBlockEdgeHalf..(kBlockHalf+kBlockEdgeHalf)], and leaves the
 // rest unmodified.
 void ButteraugliFFTSquaredOpt(float block[kBlockSize]) {
-	float global_mul = 0.000064;
-	ComplexOpt block_c[kBlockSize];
-	assert(kBlockEdge == 8);
-	for (int y = 0; y < kBlockEdge; ++y) {
-		RealFFT8Opt(block + y * kBlockEdge, block_c + y * kBlockEdge);
-	}
-	TransposeBlock(block_c);
-	float r0[kBlockEdge];
-	float r1[kBlockEdge];
-	for (int x = 0; x < kBlockEdge; ++x) {
-		r0[x] = block_c[x].real;
-		r1[x] = block_c[kBlockHalf + x].real;
-	}
-	RealFFT8Opt(r0, block_c);
-	RealFFT8Opt(r1, block_c + kBlockHalf);
-	for (int y = 1; y < kBlockEdgeHalf; ++y) {
-		FFT8OptOpt(block_c + y * kBlockEdge);
-	}
-	for (int i = kBlockEdgeHalf; i < kBlockHalf + kBlockEdgeHalf + 1; ++i) {
-		block[i] = abssq(block_c[i]);
-		block[i] *= global_mul;
-	}
+	static_assert(kBlockEdge == 8, "The FFT kernel is 8x8.");
+	guetzli::GetCpuKernels().fft_squared(block);
 }
 
 // Computes 8x8 FFT of each channel of xyb0 and xyb1 and adds the total squared
@@ -800,84 +532,8 @@ float SimpleGammaOpt(float v) {
 	return retval;
 }
 
-// Polynomial evaluation via Clenshaw's scheme (similar to Horner's).
-// Template enables compile-time unrolling of the recursion, but must reside
-// outside of a class due to the specialization.
-template <int INDEX>
-static inline void ClenshawRecursionOpt(const float x, const float *coefficients,
-	float *b1, float *b2) {
-	const float x_b1 = x * (*b1);
-	const float t = (x_b1 + x_b1) - (*b2) + coefficients[INDEX];
-	*b2 = *b1;
-	*b1 = t;
-
-	ClenshawRecursionOpt<INDEX - 1>(x, coefficients, b1, b2);
-}
-
-// Base case
-template <>
-inline void ClenshawRecursionOpt<0>(const float x, const float *coefficients,
-	float *b1, float *b2) {
-	const float x_b1 = x * (*b1);
-	// The final iteration differs - no 2 * x_b1 here.
-	*b1 = x_b1 - (*b2) + coefficients[0];
-}
-
-// Rational polynomial := dividing two polynomial evaluations. These are easier
-// to find than minimax polynomials.
-struct RationalPolynomialOpt {
-	template <int N>
-	static float EvaluatePolynomial(const float x,
-		const float(&coefficients)[N]) {
-		float b1 = 0.0;
-		float b2 = 0.0;
-		ClenshawRecursionOpt<N - 1>(x, coefficients, &b1, &b2);
-		return b1;
-	}
-
-	// Evaluates the polynomial at x (in [min_value, max_value]).
-	inline float operator()(const float x) const {
-		// First normalize to [0, 1].
-		const float x01 = (x - min_value) / (max_value - min_value);
-		// And then to [-1, 1] domain of Chebyshev polynomials.
-		const float xc = 2.0 * x01 - 1.0;
-
-		const float yp = EvaluatePolynomial(xc, p);
-		const float yq = EvaluatePolynomial(xc, q);
-		if (yq == 0.0) return 0.0;
-		return static_cast<float>(yp / yq);
-	}
-
-	// Domain of the polynomials; they are undefined elsewhere.
-	float min_value;
-	float max_value;
-
-	// Coefficients of T_n (Chebyshev polynomials of the first kind).
-	// Degree 5/5 is a compromise between accuracy (0.1%) and numerical stability.
-	float p[5 + 1];
-	float q[5 + 1];
-};
-
-static inline float GammaPolynomialOpt(float value) {
-	// Generated by gamma_polynomial.m from equispaced x/gamma(x) samples.
-	static const RationalPolynomialOpt r = {
-		0.770000000000000, 274.579999999999984,
-		{
-			881.979476556478289, 1496.058452015812463, 908.662212739659481,
-			373.566100223287378, 85.840860336314364, 6.683258861509244,
-		},
-		{
-			12.262350348616792, 20.557285797683576, 12.161463238367844,
-			4.711532733641639, 0.899112889751053, 0.035662329617191,
-		} };
-	return static_cast<float>(r(value));
-}
-
-static inline float GammaOpt(float v) {
-	// return SimpleGamma(v);
-	return GammaPolynomialOpt(static_cast<float>(v));
-}
-
+// GammaOpt() and the rest of the per pixel part of OpsinDynamicsImageOpt()
+// are in guetzli/cpu_kernels.inc.
 void OpsinDynamicsImageOpt(size_t xsize, size_t ysize,
 	std::vector<std::vector<float> > &rgb) {
 	PROFILER_FUNC;
@@ -886,29 +542,11 @@ void OpsinDynamicsImageOpt(size_t xsize, size_t ysize,
 	for (int i = 0; i < 3; ++i) {
 		BlurOpt(xsize, ysize, blurred[i].data(), kSigma, 0.0);
 	}
-	for (size_t i = 0; i < rgb[0].size(); ++i) {
-		float sensitivity[3];
-		{
-			// Calculate sensitivity[3] based on the smoothed image gamma derivative.
-			float pre_rgb[3] = { blurred[0][i], blurred[1][i], blurred[2][i] };
-			float pre_mixed[3];
-			OpsinAbsorbanceOpt(pre_rgb, pre_mixed);
-			sensitivity[0] = GammaOpt(pre_mixed[0]) / pre_mixed[0];
-			sensitivity[1] = GammaOpt(pre_mixed[1]) / pre_mixed[1];
-			sensitivity[2] = GammaOpt(pre_mixed[2]) / pre_mixed[2];
-		}
-		float cur_rgb[3] = { rgb[0][i],  rgb[1][i],  rgb[2][i] };
-		float cur_mixed[3];
-		OpsinAbsorbanceOpt(cur_rgb, cur_mixed);
-		cur_mixed[0] *= sensitivity[0];
-		cur_mixed[1] *= sensitivity[1];
-		cur_mixed[2] *= sensitivity[2];
-		float x, y, z;
-		RgbToXybOpt(cur_mixed[0], cur_mixed[1], cur_mixed[2], &x, &y, &z);
-		rgb[0][i] = static_cast<float>(x);
-		rgb[1][i] = static_cast<float>(y);
-		rgb[2][i] = static_cast<float>(z);
-	}
+	const float* const blurred_planes[3] = {
+		blurred[0].data(), blurred[1].data(), blurred[2].data() };
+	float* const rgb_planes[3] = { rgb[0].data(), rgb[1].data(), rgb[2].data() };
+	guetzli::GetCpuKernels().opsin_dynamics(blurred_planes, rgb_planes,
+		rgb[0].size());
 }
 
 void ScaleImageOpt(float scale, std::vector<float> *result) {
@@ -1278,12 +916,12 @@ namespace butteraugli
         std::vector<std::vector<float>> &xyb1,
         std::vector<float> &result)
     {
-		if (MODE_CPU_OPT == g_mathMode)
+		if (MODE_CPU_OPT == CurrentMathMode())
 		{
 			DiffmapOpsinDynamicsImageOpt(xyb0, xyb1, result);
 		}
 #ifdef __USE_OPENCL__
-        else if (MODE_OPENCL == g_mathMode && xsize_ > 100 && ysize_ > 100)
+        else if (MODE_OPENCL == CurrentMathMode() && xsize_ > 100 && ysize_ > 100)
         {
             result.resize(xsize_ * ysize_);
             clDiffmapOpsinDynamicsImage(result.data(), xyb0[0].data(), xyb0[1].data(), xyb0[2].data(),
@@ -1291,7 +929,7 @@ namespace butteraugli
         }
 #endif
 #ifdef __USE_CUDA__
-        else if (MODE_CUDA == g_mathMode && xsize_ > 100 && ysize_ > 100)
+        else if (MODE_CUDA == CurrentMathMode() && xsize_ > 100 && ysize_ > 100)
         {
             result.resize(xsize_ * ysize_);
             cuDiffmapOpsinDynamicsImage(result.data(), xyb0[0].data(), xyb0[1].data(), xyb0[2].data(),
@@ -1312,7 +950,7 @@ namespace butteraugli
     {
         ButteraugliComparator::BlockDiffMap(xyb0, xyb1, block_diff_dc, block_diff_ac);
 #ifdef __USE_OPENCL__
-        if (MODE_CHECKCL == g_mathMode && xsize_ > 8 && ysize_ > 8)
+        if (MODE_CHECKCL == CurrentMathMode() && xsize_ > 8 && ysize_ > 8)
         {
             tclBlockDiffMap(xyb0[0].data(), xyb0[1].data(), xyb0[2].data(),
                 xyb1[0].data(), xyb1[1].data(), xyb1[2].data(),
@@ -1328,7 +966,7 @@ namespace butteraugli
     {
         ButteraugliComparator::EdgeDetectorMap(xyb0, xyb1, edge_detector_map);
 #ifdef __USE_OPENCL__
-        if (MODE_CHECKCL == g_mathMode && xsize_ > 8 && ysize_ > 8)
+        if (MODE_CHECKCL == CurrentMathMode() && xsize_ > 8 && ysize_ > 8)
         {
             tclEdgeDetectorMap(xyb0[0].data(), xyb0[1].data(), xyb0[2].data(),
                 xyb1[0].data(), xyb1[1].data(), xyb1[2].data(),
@@ -1343,7 +981,7 @@ namespace butteraugli
         std::vector<float>* block_diff_ac)
     {
 #ifdef __USE_OPENCL__
-        if (MODE_CHECKCL == g_mathMode && xsize_ > 8 && ysize_ > 8)
+        if (MODE_CHECKCL == CurrentMathMode() && xsize_ > 8 && ysize_ > 8)
         {
             std::vector<float> orign_ac = *block_diff_ac;
             ButteraugliComparator::EdgeDetectorLowFreq(xyb0, xyb1, block_diff_ac);
@@ -1367,7 +1005,7 @@ namespace butteraugli
         std::vector<float>* result)
     {
 #ifdef __USE_OPENCL__
-        if (MODE_CHECKCL == g_mathMode && xsize_ > 8 && ysize_ > 8)
+        if (MODE_CHECKCL == CurrentMathMode() && xsize_ > 8 && ysize_ > 8)
         {
             std::vector<float> temp = *result;
 			temp.resize(res_xsize_ * res_ysize_);
@@ -1567,7 +1205,7 @@ namespace butteraugli
     void MinSquareVal(size_t square_size, size_t offset, size_t xsize, size_t ysize, float *values) 
     {
 #ifdef __USE_OPENCL__
-        if (MODE_CHECKCL == g_mathMode && xsize > 8 && ysize > 8)
+        if (MODE_CHECKCL == CurrentMathMode() && xsize > 8 && ysize > 8)
         {
             std::vector<float> img;
             img.resize(xsize * ysize);
@@ -1585,7 +1223,7 @@ namespace butteraugli
     void Average5x5(int xsize, int ysize, std::vector<float>* diffs)
     {
 #ifdef __USE_OPENCL__
-        if (MODE_CHECKCL == g_mathMode && xsize > 8 && ysize > 8)
+        if (MODE_CHECKCL == CurrentMathMode() && xsize > 8 && ysize > 8)
         {
             std::vector<float> diffs_org = *diffs;
             _Average5x5(xsize, ysize, diffs);
@@ -1603,7 +1241,7 @@ namespace butteraugli
         _DiffPrecompute(xyb0, xyb1, xsize, ysize, mask);
 
 #ifdef __USE_OPENCL__
-        if (MODE_CHECKCL == g_mathMode && xsize > 8 && ysize > 8)
+        if (MODE_CHECKCL == CurrentMathMode() && xsize > 8 && ysize > 8)
         {
             tclDiffPrecompute(xyb0, xyb1, xsize, ysize, mask);
         }
@@ -1616,12 +1254,12 @@ namespace butteraugli
         std::vector<std::vector<float> > *mask,
         std::vector<std::vector<float> > *mask_dc)
     {
-		if (MODE_CPU_OPT == g_mathMode)
+		if (MODE_CPU_OPT == CurrentMathMode())
 		{
 			MaskOpt(xyb0, xyb1, xsize, ysize, mask, mask_dc);
 		}
 #ifdef __USE_OPENCL__
-        else if (MODE_OPENCL == g_mathMode && xsize > 100 && ysize > 100)
+        else if (MODE_OPENCL == CurrentMathMode() && xsize > 100 && ysize > 100)
         {
             mask->resize(3);
             mask_dc->resize(3);
@@ -1637,7 +1275,7 @@ namespace butteraugli
                 xyb1[0].data(), xyb1[1].data(), xyb1[2].data()
                 );
         }
-		else if (MODE_CHECKCL == g_mathMode && xsize > 8 && ysize > 8)
+		else if (MODE_CHECKCL == CurrentMathMode() && xsize > 8 && ysize > 8)
 		{
 			_Mask(xyb0, xyb1, xsize, ysize, mask, mask_dc);
 			tclMask(xyb0[0].data(), xyb0[1].data(), xyb0[2].data(),
@@ -1648,7 +1286,7 @@ namespace butteraugli
 		}
 #endif
 #ifdef __USE_CUDA__
-        else if (MODE_CUDA == g_mathMode && xsize > 100 && ysize > 100)
+        else if (MODE_CUDA == CurrentMathMode() && xsize > 100 && ysize > 100)
         {
             mask->resize(3);
             mask_dc->resize(3);
@@ -1676,7 +1314,7 @@ namespace butteraugli
         std::vector<float>* diffmap)
     {
 #ifdef __USE_OPENCL__
-        if (MODE_CHECKCL == g_mathMode && xsize > 8 && ysize > 8)
+        if (MODE_CHECKCL == CurrentMathMode() && xsize > 8 && ysize > 8)
         {
             std::vector<float> diffmap_org = *diffmap;
             _CalculateDiffmap(xsize, ysize, step, diffmap);
@@ -1697,7 +1335,7 @@ namespace butteraugli
         std::vector<std::vector<float> > &xyb1)
     {
 #ifdef __USE_OPENCL__
-        if (MODE_CHECKCL == g_mathMode && xsize > 8 && ysize > 8)
+        if (MODE_CHECKCL == CurrentMathMode() && xsize > 8 && ysize > 8)
         {
 			_MaskHighIntensityChange(xsize, ysize, c0, c1, xyb0, xyb1);
             tclMaskHighIntensityChange(c0[0].data(), c0[1].data(), c0[2].data(),
@@ -1708,7 +1346,7 @@ namespace butteraugli
         }
 		else
 #endif
-		if (MODE_CPU_OPT == g_mathMode)
+		if (MODE_CPU_OPT == CurrentMathMode())
 		{
 			MaskHighIntensityChangeOpt(xsize, ysize, c0, c1, xyb0, xyb1);
 		}
@@ -1721,7 +1359,7 @@ namespace butteraugli
     void ScaleImage(double scale, std::vector<float> *result)
     {
 #ifdef __USE_OPENCL__
-        if (MODE_CHECKCL == g_mathMode && result->size() > 64)
+        if (MODE_CHECKCL == CurrentMathMode() && result->size() > 64)
         {
             std::vector<float> result_org = *result;
             _ScaleImage(scale, result);
@@ -1744,7 +1382,7 @@ namespace butteraugli
     {
 #ifdef __USE_OPENCL__
 		_Convolution(xsize, ysize, xstep, len, offset, multipliers, inp, border_ratio, result);
-        if (MODE_CHECKCL == g_mathMode && xsize > 8 && ysize > 8)
+        if (MODE_CHECKCL == CurrentMathMode() && xsize > 8 && ysize > 8)
         {
             tclConvolution(xsize, ysize, xstep, len, offset, multipliers, inp, border_ratio, result);
         }
@@ -1755,7 +1393,7 @@ namespace butteraugli
         double border_ratio)
     {
 #ifdef __USE_OPENCL__
-        if (MODE_CHECKCL == g_mathMode && xsize > 8 && ysize > 8)
+        if (MODE_CHECKCL == CurrentMathMode() && xsize > 8 && ysize > 8)
         {
             std::vector<float> orignChannel;
             orignChannel.resize(xsize * ysize);
@@ -1773,12 +1411,12 @@ namespace butteraugli
     void OpsinDynamicsImage(size_t xsize, size_t ysize,
         std::vector<std::vector<float> > &rgb)
     {
-		if (MODE_CPU_OPT == g_mathMode)
+		if (MODE_CPU_OPT == CurrentMathMode())
 		{
 			OpsinDynamicsImageOpt(xsize, ysize, rgb);
 		}
 #ifdef __USE_OPENCL__
-        else if (MODE_OPENCL == g_mathMode && xsize > 100 && ysize > 100)
+        else if (MODE_OPENCL == CurrentMathMode() && xsize > 100 && ysize > 100)
         {
             float * r = rgb[0].data();
             float * g = rgb[1].data();
@@ -1786,7 +1424,7 @@ namespace butteraugli
 
             clOpsinDynamicsImage(r, g, b, xsize, ysize);
         }
-		else if (MODE_CHECKCL == g_mathMode && xsize > 8 && ysize > 8)
+		else if (MODE_CHECKCL == CurrentMathMode() && xsize > 8 && ysize > 8)
 		{
 			std::vector< std::vector<float>> orig_rgb = rgb;
 			_OpsinDynamicsImage(xsize, ysize, rgb);
@@ -1796,7 +1434,7 @@ namespace butteraugli
 	}
 #endif
 #ifdef __USE_CUDA__
-        else if (MODE_CUDA == g_mathMode && xsize > 100 && ysize > 100)
+        else if (MODE_CUDA == CurrentMathMode() && xsize > 100 && ysize > 100)
         {
             float * r = rgb[0].data();
             float * g = rgb[1].data();
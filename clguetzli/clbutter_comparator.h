@@ -97,6 +97,16 @@ namespace butteraugli {
     void _Blur(size_t xsize, size_t ysize, float* channel, double sigma,
         double border_ratio);
 
+    // The MODE_CPU_OPT versions, which the dispatchers below pick from CurrentMathMode().
+    void BlurOpt(size_t xsize, size_t ysize, float* channel, float sigma,
+        float border_ratio);
+    void MinSquareValOpt(size_t square_size, size_t offset, size_t xsize, size_t ysize, float *values);
+    void ButteraugliBlockDiffOpt(float xyb0[3 * 64],
+        float xyb1[3 * 64],
+        float diff_xyb_dc[3],
+        float diff_xyb_ac[3],
+        float diff_xyb_edge_dc[3]);
+
     void MinSquareVal(size_t square_size, size_t offset, size_t xsize, size_t ysize, float *values);
     void Average5x5(int xsize, int ysize, std::vector<float>* diffs);
     void DiffPrecompute(const std::vector<std::vector<float> > &xyb0, const std::vector<std::vector<float> > &xyb1, size_t xsize, size_t ysize, std::vector<std::vector<float> > *mask);
@@ -179,6 +179,10 @@ typedef struct __channel_info_t
 	__global const ushort* pixel;
 }channel_info;
 
+// Work items per block of clComputeBlockZeroingOrderGroupEx: the three lookahead
+// candidates, padded to a power of two for the reduction.
+#define kBlockZeroingGroupSize 4
+
 #endif /*__CLGUETZLI_CL_H__*/
 
 #endif // __USE_OPENCL__
@@ -269,6 +273,7 @@ __device__ void CoeffToIDCT(__private const coeff_t block[8 * 8], uchar out[8 *
 __device__ coeff_t Quantize(coeff_t raw_coeff, int quant);
 __device__ bool QuantizeBlock(coeff_t block[kDCTBlockSize], __global const int q[kDCTBlockSize]);
 __device__ void ColorTransformYCbCrToRGB(__global uchar pixel[3]);
+__device__ void YUVToLinearRGB(__private uchar pixel[3], float rgb[3]);
 
 __kernel void clConvolutionEx(
 	__global float* result,
@@ -1052,6 +1057,168 @@ __kernel void clComputeBlockZeroingOrderEx(
     }
 }
 
+#ifdef __OPENCL_VERSION__
+// Same result as clComputeBlockZeroingOrderEx, with a work group of kBlockZeroingGroupSize
+// work items per block instead of one work item. The block is loaded once into __local
+// memory, every work item then rates one of the lookahead candidates of a step, and the
+// best candidate is picked by a reduction in __local memory. Each work item keeps its own
+// private copy of the zeroing state, so all of them apply the same step without another
+// round trip through local memory.
+__kernel __attribute__((reqd_work_group_size(kBlockZeroingGroupSize, 1, 1)))
+void clComputeBlockZeroingOrderGroupEx(
+    __global const coeff_t *orig_batch_0,       // Coeffs of Original image.
+    __global const coeff_t *orig_batch_1,       // Coeffs of Original image.
+    __global const coeff_t *orig_batch_2,       // Coeffs of Original image.
+    __global const float   *orig_image_batch,   // pregamma of Original image..
+    __global const float   *mask_scale,         // mask_scale of Original image..
+    const int              block_xsize,
+    const int              block_ysize,
+    const int              image_width,
+    const int              image_height,
+
+    __global const coeff_t *mayout_batch_0,     // Coeffs of output image.
+    __global const coeff_t *mayout_batch_1,     // Coeffs of output image.
+    __global const coeff_t *mayout_batch_2,     // Coeffs of output image.
+    __global const ushort  *mayout_pixel_0,
+    __global const ushort  *mayout_pixel_1,
+    __global const ushort  *mayout_pixel_2,
+
+    const channel_info     mayout_channel_0,
+    const channel_info     mayout_channel_1,
+    const channel_info     mayout_channel_2,
+    const int factor,                                 // Current factor in computing.
+    const int comp_mask,                              // Current channel in computing.
+    const float BlockErrorLimit,
+    __global CoeffData *output_order_list/*out*/)
+{
+    const int lane    = get_local_id(0);
+    const int block_x = get_group_id(0);
+    const int block_y = get_global_id(1);
+
+    // The whole work group shares the block, so this exits all of it or none of it.
+    if (block_x >= block_xsize || block_y >= block_ysize) return;
+
+    __local coeff_t shared_block[kComputeBlockSize];
+    __local coeff_t shared_orig[kComputeBlockSize];
+    __local float   lane_err[kBlockZeroingGroupSize];
+    __local int     lane_idx[kBlockZeroingGroupSize];
+
+    __global const coeff_t *orig_coeff[3] = { orig_batch_0, orig_batch_1, orig_batch_2 };
+
+    channel_info mayout_channel[3] = { mayout_channel_0, mayout_channel_1, mayout_channel_2 };
+    mayout_channel[0].coeff = mayout_batch_0;
+    mayout_channel[1].coeff = mayout_batch_1;
+    mayout_channel[2].coeff = mayout_batch_2;
+    mayout_channel[0].pixel = mayout_pixel_0;
+    mayout_channel[1].pixel = mayout_pixel_1;
+    mayout_channel[2].pixel = mayout_pixel_2;
+
+    int block_idx = 0;
+
+    for (int c = 0; c < 3; c++) {
+        const bool used = (comp_mask & (1 << c)) != 0;
+        if (used) {
+            block_idx = block_y * mayout_channel[c].block_width + block_x;
+        }
+        for (int k = lane; k < kBlockSize; k += kBlockZeroingGroupSize) {
+            shared_block[c * kBlockSize + k] = used ? mayout_channel[c].coeff[block_idx * kBlockSize + k] : 0;
+            shared_orig[c * kBlockSize + k]  = used ? orig_coeff[c][block_idx * kBlockSize + k] : 0;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    coeff_t mayout_block[kComputeBlockSize];
+    coeff_t orig_block[kComputeBlockSize];
+    for (int i = 0; i < kComputeBlockSize; i++) {
+        mayout_block[i] = shared_block[i];
+        orig_block[i] = shared_orig[i];
+    }
+
+    DCTScoreData input_order_data[kComputeBlockSize];
+    CoeffData    output_order_data[kComputeBlockSize];
+
+    IntFloatPairList input_order = { 0, input_order_data };
+    IntFloatPairList output_order = { 0, output_order_data };
+
+    MakeInputOrderEx(mayout_block, orig_block, &input_order);
+
+    while (input_order.size > 0)
+    {
+        float err = 1e17f;
+        if (lane < min(3, input_order.size))
+        {
+            const int idx = input_order.pData[lane].idx;
+            coeff_t old_coeff = mayout_block[idx];
+            mayout_block[idx] = 0;
+
+            err = CompareBlockFactor(mayout_channel,
+                                     mayout_block,
+                                     block_x,
+                                     block_y,
+                                     orig_image_batch,
+                                     mask_scale,
+                                     image_width,
+                                     image_height,
+                                     factor);
+            mayout_block[idx] = old_coeff;
+        }
+        lane_err[lane] = err;
+        lane_idx[lane] = lane;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // Ties go to the lower candidate, as in the serial loop.
+        for (int s = kBlockZeroingGroupSize / 2; s > 0; s >>= 1)
+        {
+            if (lane < s &&
+                (lane_err[lane + s] < lane_err[lane] ||
+                 (lane_err[lane + s] == lane_err[lane] && lane_idx[lane + s] < lane_idx[lane])))
+            {
+                lane_err[lane] = lane_err[lane + s];
+                lane_idx[lane] = lane_idx[lane + s];
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        const float best_err = lane_err[0];
+        const int best_i = lane_idx[0];
+        // Everyone has the result before the next step overwrites it.
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if (best_err >= BlockErrorLimit)
+        {   // The input_order is an ascent vector, break when best_err exceed the error limit.
+            break;
+        }
+        int idx = input_order.pData[best_i].idx;
+        mayout_block[idx] = 0;
+        list_erase(&input_order, best_i);
+
+        list_push_back(&output_order, idx, best_err);
+    }
+
+    if (lane != 0) return;
+
+    float min_err = 1e10;
+    for (int i = output_order.size - 1; i >= 0; --i) {
+        min_err = min(min_err, output_order.pData[i].err);
+        output_order.pData[i].err = min_err;
+    }
+
+    __global CoeffData *output_block = output_order_list + block_idx * kComputeBlockSize;
+
+    int out_count = 0;
+    for (int i = 0; i < kComputeBlockSize && i < output_order.size; i++)
+    {
+        // err exceeding the limit is no need to continue.
+        if (output_order.pData[i].err <= BlockErrorLimit)
+        {
+            output_block[out_count].idx = output_order.pData[i].idx;
+            output_block[out_count].err = output_order.pData[i].err;
+            out_count++;
+        }
+    }
+}
+#endif
+
 __kernel void clCopyFromJpegComponentEx(
     __global coeff_t *output_batch,     // Coeffs of output image.
     __global uchar  *output_idct,
@@ -1257,6 +1424,45 @@ __kernel void clColorTransformYCbCrToRGB(
 	ColorTransformYCbCrToRGB(&rgb[block_x*3]);
 }
 
+// Fused clComponentsToPixels + clComponentsToPixelsEx1/Ex2 + clColorTransformYCbCrToRGB + sRGB linearisation.
+// Writes planar linear RGB, pixels past the image edge replicate the last row/column like ToPixels().
+__kernel void clComponentsToLinearRGBEx(
+	__global float *r,
+	__global float *g,
+	__global float *b,
+	__global const ushort *pixels_y,
+	__global const ushort *pixels_cb,
+	__global const ushort *pixels_cr,
+	const int width,
+	const int height,
+	const int xmin,
+	const int ymin,
+	const int xsize,
+	const int ysize)
+{
+	const int ox = get_global_id(0);
+	const int oy = get_global_id(1);
+
+	if (ox >= xsize || oy >= ysize) return;
+
+	const int x = min(xmin + ox, width - 1);
+	const int y = min(ymin + oy, height - 1);
+	const int px = y * width + x;
+
+	uchar pixel[3];
+	pixel[0] = (uchar)((pixels_y[px] + 8 - (x & 1)) >> 4);
+	pixel[1] = (uchar)((pixels_cb[px] + 8 - (x & 1)) >> 4);
+	pixel[2] = (uchar)((pixels_cr[px] + 8 - (x & 1)) >> 4);
+
+	float rgb[3];
+	YUVToLinearRGB(pixel, rgb);
+
+	const int idx = oy * xsize + ox;
+	r[idx] = rgb[0];
+	g[idx] = rgb[1];
+	b[idx] = rgb[2];
+}
+
 __device__ void Butteraugli8x8CornerEdgeDetectorDiff(
     int pos_x,
     int pos_y,
@@ -3161,6 +3367,15 @@ __device__ void YUVToImage(__private uchar yuv[3 * 8 * 8], float* r, float* g, f
 #undef lut
 }
 
+__device__ void YUVToLinearRGB(__private uchar pixel[3], float rgb[3])
+{
+    YUVToRGB(pixel, 1);
+
+    rgb[0] = kSrgb8ToLinearTable[pixel[0]];
+    rgb[1] = kSrgb8ToLinearTable[pixel[1]];
+    rgb[2] = kSrgb8ToLinearTable[pixel[2]];
+}
+
 __device__ void BlockToImage(__private const coeff_t block[8*8*3], float r[8*8], float g[8*8], float b[8*8], int inside_x, int inside_y)
 {
 	uchar idct[3][8 * 8];
@@ -14,8 +14,9 @@
 
 using namespace std;
 
-int g_idvec[10] = { 0 };
-int g_sizevec[10] = { 0 };
+// Thread local, so host threads can run kernels side by side (see ComputeBlockZeroingOrderRowsCpu).
+thread_local int g_idvec[10] = { 0 };
+thread_local int g_sizevec[10] = { 0 };
 
 int get_global_id(int dim) {
     return g_idvec[dim];
@@ -45,8 +46,9 @@ namespace guetzli
         const float target_distance, ProcessStats* stats)
         : ButteraugliComparator(width, height, rgb, target_distance, stats)
     {
-        if (MODE_CPU != g_mathMode)
+        if (MODE_CPU != CurrentMathMode())
         {
+            rgb_orig_opsin_memory.Set(3 * sizeof(float) * width * height);
             rgb_orig_opsin.resize(3);
             rgb_orig_opsin[0].resize(width * height);
             rgb_orig_opsin[1].resize(width * height);
@@ -70,8 +72,9 @@ namespace guetzli
 
     void ButteraugliComparatorEx::Compare(const OutputImage& img)
     {
-		if (MODE_CPU_OPT == g_mathMode)
+		if (MODE_CPU_OPT == CurrentMathMode())
 		{
+			MemoryReservation planes(6 * sizeof(float) * width_ * height_);
 			std::vector<std::vector<float> > rgb0 = rgb_orig_opsin;
 
 			std::vector<std::vector<float> > rgb(3, std::vector<float>(width_ * height_));
@@ -82,11 +85,8 @@ namespace guetzli
 			distance_ = ::butteraugli::ButteraugliScoreFromDiffmap(distmap_);
 		}
 #ifdef __USE_OPENCL__
-        else if (MODE_OPENCL == g_mathMode)
+        else if (MODE_OPENCL == CurrentMathMode())
         {
-            std::vector<std::vector<float> > rgb1(3, std::vector<float>(width_ * height_));
-            img.ToLinearRGB(&rgb1);
-
             const int xsize = width_;
             const int ysize = height_;
             std::vector<float>().swap(distmap_);
@@ -95,17 +95,18 @@ namespace guetzli
             size_t channel_size = xsize * ysize * sizeof(float);
             ocl_args_d_t &ocl = getOcl();
             ocl_channels xyb0 = ocl.allocMemChannels(channel_size, rgb_orig_opsin[0].data(), rgb_orig_opsin[1].data(), rgb_orig_opsin[2].data());
-            ocl_channels xyb1 = ocl.allocMemChannels(channel_size, rgb1[0].data(), rgb1[1].data(), rgb1[2].data());
+            ocl_channels xyb1 = ocl.allocMemChannels(channel_size);
+
+            // linear RGB is produced on the device and consumed by the opsin stage in place.
+            clComponentsToLinearRGBEx(xyb1, 0, 0, xsize, ysize, img);
 
             cl_mem mem_result = ocl.allocMem(channel_size);
 
             clOpsinDynamicsImageEx(xyb1, xsize, ysize);
             clDiffmapOpsinDynamicsImageEx(mem_result, xyb0, xyb1, xsize, ysize, comparator_.step());
 
-            cl_int err = clEnqueueReadBuffer(ocl.commandQueue, mem_result, false, 0, channel_size, distmap_.data(), 0, NULL, NULL);
-            LOG_CL_RESULT(err);
-            err = clFinish(ocl.commandQueue);
-            LOG_CL_RESULT(err);
+            ocl.readBuffer(mem_result, channel_size, distmap_.data());
+            ocl.finish();
 
             clReleaseMemObject(mem_result);
             ocl.releaseMemChannels(xyb0);
@@ -115,7 +116,7 @@ namespace guetzli
         }
 #endif
 #ifdef __USE_CUDA__
-        else if (MODE_CUDA == g_mathMode)
+        else if (MODE_CUDA == CurrentMathMode())
         {
             std::vector<std::vector<float> > rgb1(3, std::vector<float>(width_ * height_));
             img.ToLinearRGB(&rgb1);
@@ -153,13 +154,14 @@ namespace guetzli
 
     void ButteraugliComparatorEx::StartBlockComparisons()
     {
-        if (MODE_CPU == g_mathMode)
+        if (MODE_CPU == CurrentMathMode())
         {
             ButteraugliComparator::StartBlockComparisons();
             return;
         }
 
         std::vector<std::vector<float> > dummy(3);
+        mask_xyz_memory_.Set(3 * sizeof(float) * width_ * height_);
         ::butteraugli::Mask(rgb_orig_opsin, rgb_orig_opsin, width_, height_, &mask_xyz_, &dummy);
 
         const int width = width_;
@@ -223,4 +225,45 @@ namespace guetzli
     }
 }
 
+void ComputeBlockZeroingOrderRowsCpu(
+    guetzli::CoeffData *output_order_batch,
+    const channel_info orig_channel[3],
+    const float *orig_image_batch,
+    const float *mask_scale,
+    const int image_width,
+    const int image_height,
+    const channel_info mayout_channel[3],
+    const int factor,
+    const int comp_mask,
+    const float BlockErrorLimit,
+    const int row_begin,
+    const int row_end)
+{
+    const int blockf_width = (image_width + 8 * factor - 1) / (8 * factor);
+    const int blockf_height = (image_height + 8 * factor - 1) / (8 * factor);
+
+    set_global_size(0, blockf_width);
+    set_global_size(1, blockf_height);
+
+    for (int block_y = row_begin; block_y < row_end; block_y++)
+    {
+        set_global_id(1, block_y);
+        for (int block_x = 0; block_x < blockf_width; block_x++)
+        {
+            set_global_id(0, block_x);
+            clComputeBlockZeroingOrderEx(orig_channel[0].coeff, orig_channel[1].coeff, orig_channel[2].coeff,
+                orig_image_batch, mask_scale,
+                blockf_width, blockf_height,
+                image_width, image_height,
+                mayout_channel[0].coeff, mayout_channel[1].coeff, mayout_channel[2].coeff,
+                mayout_channel[0].pixel, mayout_channel[1].pixel, mayout_channel[2].pixel,
+                mayout_channel[0], mayout_channel[1], mayout_channel[2],
+                factor,
+                comp_mask,
+                BlockErrorLimit,
+                (CoeffData*)output_order_batch);
+        }
+    }
+}
+
 #endif
\ No newline at end of file
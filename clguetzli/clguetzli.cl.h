@@ -164,6 +164,10 @@ typedef CUdeviceptr cu_mem;
         __global const ushort  *pixel;
     }channel_info;
 
+    // Work items per block of clComputeBlockZeroingOrderGroupEx: the three lookahead
+    // candidates, padded to a power of two for the reduction.
+    #define kBlockZeroingGroupSize 4
+
 #endif /*__CLGUETZLI_CL_H__*/
 
 #endif // __USE_OPENCL__
\ No newline at end of file
@@ -9,13 +9,41 @@
 #include "clguetzli.h"
 #include <math.h>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include "cl.hpp"
+#include "guetzli/memory_account.h"
+#include "guetzli/profiler.h"
 
 extern MATH_MODE g_mathMode = MODE_CPU;
 
+static thread_local int t_mathMode = -1;
+
+MATH_MODE CurrentMathMode()
+{
+    return t_mathMode < 0 ? g_mathMode : static_cast<MATH_MODE>(t_mathMode);
+}
+
+ScopedMathMode::ScopedMathMode(MATH_MODE mode)
+    : previous_(t_mathMode)
+{
+    t_mathMode = mode;
+}
+
+ScopedMathMode::~ScopedMathMode()
+{
+    t_mathMode = previous_;
+}
+
 #ifdef __USE_OPENCL__
 
+bool g_useGroupBlockZeroing = false;
+int  g_hybridCpuThreads = 0;
+
 #ifdef __USE_DOUBLE_AS_FLOAT__
 #define double float
 #endif
@@ -29,10 +57,10 @@ void clOpsinDynamicsImage(float *r, float *g, float *b, const size_t xsize, cons
 
     clOpsinDynamicsImageEx(rgb, xsize, ysize);
 
-    clEnqueueReadBuffer(ocl.commandQueue, rgb.r, false, 0, channel_size, r, 0, NULL, NULL);
-    clEnqueueReadBuffer(ocl.commandQueue, rgb.g, false, 0, channel_size, g, 0, NULL, NULL);
-    clEnqueueReadBuffer(ocl.commandQueue, rgb.b, false, 0, channel_size, b, 0, NULL, NULL);
-    clFinish(ocl.commandQueue);
+    ocl.readBuffer(rgb.r, channel_size, r);
+    ocl.readBuffer(rgb.g, channel_size, g);
+    ocl.readBuffer(rgb.b, channel_size, b);
+    ocl.finish();
 
     ocl.releaseMemChannels(rgb);
 }
@@ -54,8 +82,8 @@ void clDiffmapOpsinDynamicsImage(
 
     clDiffmapOpsinDynamicsImageEx(mem_result, xyb0, xyb1, xsize, ysize, step);
 
-    clEnqueueReadBuffer(ocl.commandQueue, mem_result, false, 0, channel_size, result, 0, NULL, NULL);
-    cl_int err = clFinish(ocl.commandQueue);
+    ocl.readBuffer(mem_result, channel_size, result);
+    ocl.finish();
 
     ocl.releaseMemChannels(xyb1);
     ocl.releaseMemChannels(xyb0);
@@ -63,6 +91,91 @@ void clDiffmapOpsinDynamicsImage(
     clReleaseMemObject(mem_result);
 }
 
+namespace
+{
+    // Hands out the block rows of clComputeBlockZeroingOrder to the OpenCL device and the
+    // CPU threads. The first chunk of a worker is a single row that measures its throughput.
+    // After that a worker gets its throughput share of half the rows left, capped to
+    // kMaxChunkSeconds of work so the estimate stays fresh, so all of them run out of rows
+    // at about the same time.
+    class BlockRowScheduler
+    {
+    public:
+        BlockRowScheduler(int rows, int workers) : next_(0), rows_(rows), rate_(workers, 0.0) {}
+
+        bool take(int worker, int *begin, int *end)
+        {
+            static const double kMaxChunkSeconds = 0.25;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            const int remaining = rows_ - next_;
+            if (remaining <= 0) return false;
+
+            int count = 1;
+            if (rate_[worker] > 0)
+            {
+                double total = 0;
+                int measured = 0;
+                for (size_t i = 0; i < rate_.size(); i++)
+                {
+                    if (rate_[i] > 0)
+                    {
+                        total += rate_[i];
+                        measured++;
+                    }
+                }
+                // Workers still measuring count with the average rate.
+                total *= (double)rate_.size() / measured;
+
+                double share = 0.5 * remaining * rate_[worker] / total;
+                count = (int)std::min<double>(share, rate_[worker] * kMaxChunkSeconds);
+                count = std::max(count, 1);
+            }
+
+            *begin = next_;
+            *end = std::min(rows_, next_ + count);
+            next_ = *end;
+            return true;
+        }
+
+        void report(int worker, int rows, double seconds)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            rate_[worker] = rows / std::max<double>(seconds, 1e-6);
+        }
+
+    private:
+        std::mutex          mutex_;
+        int                 next_;
+        const int           rows_;
+        std::vector<double> rate_;      // rows per second, 0 until measured
+    };
+
+    double secondsSince(const std::chrono::steady_clock::time_point &start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+// Enqueues the zeroing order kernel, whose arguments are set, for the block rows [row_begin, row_end).
+static void clEnqueueBlockZeroingRows(cl_kernel kernel, bool group, int blockf_width, int row_begin, int row_end)
+{
+    ocl_args_d_t &ocl = getOcl();
+
+    size_t globalWorkOffset[2] = { 0, (size_t)row_begin };
+    if (group)
+    {
+        size_t globalWorkSize[2] = { (size_t)blockf_width * kBlockZeroingGroupSize, (size_t)(row_end - row_begin) };
+        size_t localWorkSize[2] = { kBlockZeroingGroupSize, 1 };
+        ocl.enqueueKernel(kernel, 2, globalWorkSize, localWorkSize, globalWorkOffset);
+    }
+    else
+    {
+        size_t globalWorkSize[2] = { (size_t)blockf_width, (size_t)(row_end - row_begin) };
+        ocl.enqueueKernel(kernel, 2, globalWorkSize, NULL, globalWorkOffset);
+    }
+}
+
 void clComputeBlockZeroingOrder(
     guetzli::CoeffData *output_order_batch,
     const channel_info orig_channel[3],
@@ -103,27 +216,111 @@ void clComputeBlockZeroingOrder(
     int output_order_batch_size = sizeof(CoeffData) * 3 * kDCTBlockSize * blockf_width * blockf_height;
     cl_mem mem_output_order_batch = ocl.allocMem(output_order_batch_size, output_order_batch);
 
-    cl_kernel kernel = ocl.kernel[KERNEL_COMPUTEBLOCKZEROINGORDER];
-    clSetKernelArgEx(kernel, &mem_orig_coeff[0], &mem_orig_coeff[1], &mem_orig_coeff[2],
-                        &mem_orig_image, &mem_mask_scale, 
-						&blockf_width, &blockf_height,
-                        &image_width, &image_height,
-                        &mem_mayout_coeff[0], &mem_mayout_coeff[1], &mem_mayout_coeff[2],
-                        &mem_mayout_pixel[0], &mem_mayout_pixel[1], &mem_mayout_pixel[2],
-                        &mayout_channel[0], &mayout_channel[1], &mayout_channel[2],
-                        &factor, 
-						&comp_mask, 
-						&BlockErrorLimit, 
-						&mem_output_order_batch);
-
-    size_t globalWorkSize[2] = { blockf_width, blockf_height };
-    cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-    err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
-
-    clEnqueueReadBuffer(ocl.commandQueue, mem_output_order_batch, false, 0, output_order_batch_size, output_order_batch, 0, NULL, NULL);
-    clFinish(ocl.commandQueue);
+    // The selected kernel writes the result, --checkcl also runs the other one for comparison.
+    const bool check = MODE_CHECKCL == CurrentMathMode();
+    cl_mem mem_check_batch = check ? ocl.allocMem(output_order_batch_size, output_order_batch) : NULL;
+    std::vector<CoeffData> check_batch(check ? 3 * kDCTBlockSize * blockf_width * blockf_height : 0);
+    // --checkcl compares the kernels over the whole grid, so it doesn't split the rows.
+    const bool hybrid = g_hybridCpuThreads > 0 && !check;
+
+    for (int i = 0; i < (check ? 2 : 1); i++)
+    {
+        const bool group = (i == 0) == g_useGroupBlockZeroing;
+        cl_mem mem_output = i == 0 ? mem_output_order_batch : mem_check_batch;
+
+        cl_kernel kernel = ocl.kernel[group ? KERNEL_COMPUTEBLOCKZEROINGORDER_GROUP : KERNEL_COMPUTEBLOCKZEROINGORDER];
+        clSetKernelArgEx(kernel, &mem_orig_coeff[0], &mem_orig_coeff[1], &mem_orig_coeff[2],
+                            &mem_orig_image, &mem_mask_scale, 
+                            &blockf_width, &blockf_height,
+                            &image_width, &image_height,
+                            &mem_mayout_coeff[0], &mem_mayout_coeff[1], &mem_mayout_coeff[2],
+                            &mem_mayout_pixel[0], &mem_mayout_pixel[1], &mem_mayout_pixel[2],
+                            &mayout_channel[0], &mayout_channel[1], &mayout_channel[2],
+                            &factor, 
+                            &comp_mask, 
+                            &BlockErrorLimit, 
+                            &mem_output);
+
+        if (i == 0 && hybrid)
+        {
+            // The device, driven from this thread, and g_hybridCpuThreads host threads take
+            // block rows from the scheduler. Both write straight into output_order_batch.
+            const int row_size = 3 * kDCTBlockSize * blockf_width;
+            BlockRowScheduler scheduler(blockf_height, 1 + g_hybridCpuThreads);
+
+            // The host threads charge the encode's memory account, and its limit error is
+            // rethrown here once they are joined.
+            guetzli::Profiler* profiler = guetzli::Profiler::Current();
+            guetzli::MemoryAccount* account = guetzli::MemoryAccount::Current();
+            std::vector<std::exception_ptr> errors(g_hybridCpuThreads + 1);
+            std::vector<std::thread> workers;
+            for (int t = 1; t <= g_hybridCpuThreads; t++)
+            {
+                workers.push_back(std::thread([&, t]() {
+                    guetzli::ScopedProfiler scoped_profiler(profiler);
+                    guetzli::ScopedMemoryAccount scoped_account(account);
+                    try
+                    {
+                        int row_begin, row_end;
+                        while (scheduler.take(t, &row_begin, &row_end))
+                        {
+                            guetzli::ScopedProfileZone zone("ComputeBlockZeroingOrder cpu rows");
+                            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                            ComputeBlockZeroingOrderRowsCpu(output_order_batch, orig_channel, orig_image_batch, mask_scale,
+                                image_width, image_height, mayout_channel, factor, comp_mask, BlockErrorLimit,
+                                row_begin, row_end);
+                            scheduler.report(t, row_end - row_begin, secondsSince(start));
+                        }
+                    }
+                    catch (...)
+                    {
+                        errors[t] = std::current_exception();
+                    }
+                }));
+            }
+
+            int row_begin, row_end;
+            while (scheduler.take(0, &row_begin, &row_end))
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                clEnqueueBlockZeroingRows(kernel, group, blockf_width, row_begin, row_end);
+                ocl.readBuffer(mem_output, sizeof(CoeffData) * row_size * (row_end - row_begin),
+                    output_order_batch + row_begin * row_size, sizeof(CoeffData) * row_size * row_begin);
+                ocl.finish();
+                scheduler.report(0, row_end - row_begin, secondsSince(start));
+            }
+
+            for (size_t t = 0; t < workers.size(); t++)
+            {
+                workers[t].join();
+            }
+            for (size_t t = 0; t < errors.size(); t++)
+            {
+                if (errors[t]) std::rethrow_exception(errors[t]);
+            }
+        }
+        else
+        {
+            clEnqueueBlockZeroingRows(kernel, group, blockf_width, 0, blockf_height);
+        }
+    }
+
+    if (!hybrid)
+    {
+        ocl.readBuffer(mem_output_order_batch, output_order_batch_size, output_order_batch);
+    }
+    if (check)
+    {
+        ocl.readBuffer(mem_check_batch, output_order_batch_size, check_batch.data());
+    }
+    ocl.finish();
+
+    if (check)
+    {
+        CompareBlockZeroingOrder("clComputeBlockZeroingOrder kernels", output_order_batch,
+            check_batch.data(), blockf_width * blockf_height, blockf_width);
+        clReleaseMemObject(mem_check_batch);
+    }
 
     for (int c = 0; c < 3; c++)
     {
@@ -155,13 +352,13 @@ void clMask(
 
     clMaskEx(mask, mask_dc, rgb, rgb2, xsize, ysize);
 
-    clEnqueueReadBuffer(ocl.commandQueue, mask.r, false, 0, channel_size, mask_r, 0, NULL, NULL);
-    clEnqueueReadBuffer(ocl.commandQueue, mask.g, false, 0, channel_size, mask_g, 0, NULL, NULL);
-    clEnqueueReadBuffer(ocl.commandQueue, mask.b, false, 0, channel_size, mask_b, 0, NULL, NULL);
-    clEnqueueReadBuffer(ocl.commandQueue, mask_dc.r, false, 0, channel_size, maskdc_r, 0, NULL, NULL);
-    clEnqueueReadBuffer(ocl.commandQueue, mask_dc.g, false, 0, channel_size, maskdc_g, 0, NULL, NULL);
-    clEnqueueReadBuffer(ocl.commandQueue, mask_dc.b, false, 0, channel_size, maskdc_b, 0, NULL, NULL);
-    clFinish(ocl.commandQueue);
+    ocl.readBuffer(mask.r, channel_size, mask_r);
+    ocl.readBuffer(mask.g, channel_size, mask_g);
+    ocl.readBuffer(mask.b, channel_size, mask_b);
+    ocl.readBuffer(mask_dc.r, channel_size, maskdc_r);
+    ocl.readBuffer(mask_dc.g, channel_size, maskdc_g);
+    ocl.readBuffer(mask_dc.b, channel_size, maskdc_b);
+    ocl.finish();
 
     ocl.releaseMemChannels(rgb);
     ocl.releaseMemChannels(rgb2);
@@ -223,10 +420,7 @@ void clConvolutionEx(
     clSetKernelArgEx(kernel, &result, &inp, &xsize, &multipliers, &len, &xstep, &offset, &border_ratio);
 
 	size_t globalWorkSize[2] = { oxsize, ysize };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 }
 
 void clConvolutionXEx(
@@ -242,10 +436,7 @@ void clConvolutionXEx(
 
 	size_t x_count = (xsize + xstep - 1) / xstep;
 	size_t globalWorkSize[2] = { x_count, ysize };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 }
 
 void clConvolutionYEx(
@@ -262,10 +453,7 @@ void clConvolutionYEx(
 	size_t x_count = (xsize + xstep - 1) / xstep;
 	size_t y_count = (ysize + xstep - 1) / xstep;
 	size_t globalWorkSize[2] = { x_count, y_count };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 }
 
 void clSquareSampleEx(
@@ -279,10 +467,7 @@ void clSquareSampleEx(
     clSetKernelArgEx(kernel, &result, &xsize, &ysize, &image, &xstep, &ystep);
 
 	size_t globalWorkSize[2] = { xsize, ysize };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 }
 
 void clBlurEx(cl_mem image/*out, opt*/, const size_t xsize, const size_t ysize,
@@ -342,10 +527,7 @@ void clOpsinDynamicsImageEx(ocl_channels &rgb, const size_t xsize, const size_t
     clSetKernelArgEx(kernel,  &rgb.r, &rgb.g, &rgb.b, &size, &rgb_blurred.r, &rgb_blurred.g, &rgb_blurred.b);
 
 	size_t globalWorkSize[1] = { xsize * ysize };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 1, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 1, globalWorkSize);
 
 	ocl.releaseMemChannels(rgb_blurred);
 }
@@ -362,13 +544,12 @@ void clMaskHighIntensityChangeEx(
 	ocl_channels c0 = ocl.allocMemChannels(channel_size);
 	ocl_channels c1 = ocl.allocMemChannels(channel_size);
 
-	clEnqueueCopyBuffer(ocl.commandQueue, xyb0.r, c0.r, 0, 0, channel_size, 0, NULL, NULL);
-	clEnqueueCopyBuffer(ocl.commandQueue, xyb0.g, c0.g, 0, 0, channel_size, 0, NULL, NULL);
-	clEnqueueCopyBuffer(ocl.commandQueue, xyb0.b, c0.b, 0, 0, channel_size, 0, NULL, NULL);
-	clEnqueueCopyBuffer(ocl.commandQueue, xyb1.r, c1.r, 0, 0, channel_size, 0, NULL, NULL);
-	clEnqueueCopyBuffer(ocl.commandQueue, xyb1.g, c1.g, 0, 0, channel_size, 0, NULL, NULL);
-	clEnqueueCopyBuffer(ocl.commandQueue, xyb1.b, c1.b, 0, 0, channel_size, 0, NULL, NULL);
-	clFinish(ocl.commandQueue);
+	ocl.copyBuffer(xyb0.r, c0.r, channel_size);
+	ocl.copyBuffer(xyb0.g, c0.g, channel_size);
+	ocl.copyBuffer(xyb0.b, c0.b, channel_size);
+	ocl.copyBuffer(xyb1.r, c1.r, channel_size);
+	ocl.copyBuffer(xyb1.g, c1.g, channel_size);
+	ocl.copyBuffer(xyb1.b, c1.b, channel_size);
 
 	cl_kernel kernel = ocl.kernel[KERNEL_MASKHIGHINTENSITYCHANGE];
     clSetKernelArgEx(kernel, 
@@ -379,10 +560,7 @@ void clMaskHighIntensityChangeEx(
         &c1.r, &c1.g, &c1.b);
 
 	size_t globalWorkSize[2] = { xsize, ysize };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 
 	ocl.releaseMemChannels(c0);
 	ocl.releaseMemChannels(c1);
@@ -419,10 +597,7 @@ void clEdgeDetectorMapEx(
         &xsize, &ysize, &step);
 
 	size_t globalWorkSize[2] = { res_xsize, res_ysize};
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 
 	ocl.releaseMemChannels(rgb_blured);
 	ocl.releaseMemChannels(rgb2_blured);
@@ -449,10 +624,7 @@ void clBlockDiffMapEx(
 
 
 	size_t globalWorkSize[2] = { res_xsize, res_ysize };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 }
 
 void clEdgeDetectorLowFreqEx(
@@ -484,10 +656,7 @@ void clEdgeDetectorLowFreqEx(
         &xsize, &ysize, &step);
 
 	size_t globalWorkSize[2] = { res_xsize, res_ysize };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 
 	ocl.releaseMemChannels(rgb_blured);
 	ocl.releaseMemChannels(rgb2_blured);
@@ -507,10 +676,7 @@ void clDiffPrecomputeEx(
 							&xyb1.x, &xyb1.y, &xyb1.b);
 
 	size_t globalWorkSize[2] = { xsize, ysize };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 }
 
 void clScaleImageEx(cl_mem img/*in, out*/, size_t size, double w)
@@ -522,10 +688,7 @@ void clScaleImageEx(cl_mem img/*in, out*/, size_t size, double w)
 	clSetKernelArgEx(kernel, &img, &size, &fw);
 
 	size_t globalWorkSize[1] = { size };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 1, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 1, globalWorkSize);
 }
 
 void clAverage5x5Ex(cl_mem img/*in,out*/, const size_t xsize, const size_t ysize)
@@ -540,16 +703,13 @@ void clAverage5x5Ex(cl_mem img/*in,out*/, const size_t xsize, const size_t ysize
     size_t len = xsize * ysize * sizeof(float);
     cl_mem img_org = ocl.allocMem(len);
 
-    clEnqueueCopyBuffer(ocl.commandQueue, img, img_org, 0, 0, len, 0, NULL, NULL);
+    ocl.copyBuffer(img, img_org, len);
 
     cl_kernel kernel = ocl.kernel[KERNEL_AVERAGE5X5];
     clSetKernelArgEx(kernel, &img, &xsize, &ysize, &img_org);
 
     size_t globalWorkSize[2] = { xsize, ysize };
-    cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-    err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+    ocl.enqueueKernel(kernel, 2, globalWorkSize);
 
     clReleaseMemObject(img_org);
 }
@@ -567,24 +727,24 @@ void clMinSquareValEx(
     clSetKernelArgEx(kernel, &result, &xsize, &ysize, &img, &square_size, &offset);
 
 	size_t globalWorkSize[2] = { xsize, ysize };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clEnqueueCopyBuffer(ocl.commandQueue, result, img, 0, 0, sizeof(cl_float) * xsize * ysize, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
+	ocl.copyBuffer(result, img, sizeof(cl_float) * xsize * ysize);
     clReleaseMemObject(result);
 }
 
-static void MakeMask(double extmul, double extoff,
+typedef std::array<double, 512> MaskLut;
+
+static MaskLut MakeMask(double extmul, double extoff,
 	double mul, double offset,
-	double scaler, double *result)
+	double scaler)
 {
+	MaskLut result;
 	for (size_t i = 0; i < 512; ++i) {
 		const double c = mul / ((0.01 * scaler * i) + offset);
 		result[i] = 1.0 + extmul * (c + extoff);
 		result[i] *= result[i];
 	}
+	return result;
 }
 
 static const double kInternalGoodQualityThreshold = 14.921561160295326;
@@ -594,87 +754,18 @@ void clDoMask(ocl_channels mask/*in, out*/, ocl_channels mask_dc/*in, out*/, siz
 {
 	ocl_args_d_t &ocl = getOcl();
 
-	double extmul = 0.975741017749;
-	double extoff = -4.25328244168;
-	double offset = 0.454909521427;
-	double scaler = 0.0738288224836;
-	double mul = 20.8029176447;
-	static double lut_x[512];
-    static bool lutx_init = false;
-    if (!lutx_init)
-    {
-        lutx_init = true;
-        MakeMask(extmul, extoff, mul, offset, scaler, lut_x);
-    }
-
-	extmul = 0.373995618954;
-	extoff = 1.5307267433;
-	offset = 0.911952641929;
-	scaler = 1.1731667845;
-	mul = 16.2447033988;
-	static double lut_y[512];
-    static bool luty_init = false;
-    if (!luty_init)
-    {
-        luty_init = true;
-        MakeMask(extmul, extoff, mul, offset, scaler, lut_y);
-    }
-
-	extmul = 0.61582234137;
-	extoff = -4.25376118646;
-	offset = 1.05105070921;
-	scaler = 0.47434643535;
-	mul = 31.1444967089;
-	static double lut_b[512];
-    static bool lutb_init = false;
-    if (!lutb_init)
-    {
-        lutb_init = true;
-        MakeMask(extmul, extoff, mul, offset, scaler, lut_b);
-    }
-
-	extmul = 1.79116943438;
-	extoff = -3.86797479189;
-	offset = 0.670960225853;
-	scaler = 0.486575865525;
-	mul = 20.4563479139;
-	static double lut_dcx[512];
-    static bool lutdcx_init = false;
-    if (!lutdcx_init)
-    {
-        lutdcx_init = true;
-        MakeMask(extmul, extoff, mul, offset, scaler, lut_dcx);
-    }
-
-	extmul = 0.212223514236;
-	extoff = -3.65647120524;
-	offset = 1.73396799447;
-	scaler = 0.170392660501;
-	mul = 21.6566724788;
-	static double lut_dcy[512];
-    static bool lutdcy_init = false;
-    if (!lutdcy_init)
-    {
-        lutdcy_init = true;
-        MakeMask(extmul, extoff, mul, offset, scaler, lut_dcy);
-    }
-
-	extmul = 0.349376011816;
-	extoff = -0.894711072781;
-	offset = 0.901647926679;
-	scaler = 0.380086095024;
-	mul = 18.0373825149;
-	static double lut_dcb[512];
-    static bool lutdcb_init = false;
-    if (!lutdcb_init)
-    {
-        lutdcb_init = true;
-        MakeMask(extmul, extoff, mul, offset, scaler, lut_dcb);
-    }
+	// Initialized once, also when several devices run clDoMask at once.
+	// MakeMask(extmul, extoff, mul, offset, scaler)
+	static const MaskLut lut_x = MakeMask(0.975741017749, -4.25328244168, 20.8029176447, 0.454909521427, 0.0738288224836);
+	static const MaskLut lut_y = MakeMask(0.373995618954, 1.5307267433, 16.2447033988, 0.911952641929, 1.1731667845);
+	static const MaskLut lut_b = MakeMask(0.61582234137, -4.25376118646, 31.1444967089, 1.05105070921, 0.47434643535);
+	static const MaskLut lut_dcx = MakeMask(1.79116943438, -3.86797479189, 20.4563479139, 0.670960225853, 0.486575865525);
+	static const MaskLut lut_dcy = MakeMask(0.212223514236, -3.65647120524, 21.6566724788, 1.73396799447, 0.170392660501);
+	static const MaskLut lut_dcb = MakeMask(0.349376011816, -0.894711072781, 18.0373825149, 0.901647926679, 0.380086095024);
 
 	size_t channel_size = 512 * sizeof(double);
-	ocl_channels xyb = ocl.allocMemChannels(channel_size, lut_x, lut_y, lut_b);
-    ocl_channels xyb_dc = ocl.allocMemChannels(channel_size, lut_dcx, lut_dcy, lut_dcb);
+	ocl_channels xyb = ocl.allocMemChannels(channel_size, lut_x.data(), lut_y.data(), lut_b.data());
+    ocl_channels xyb_dc = ocl.allocMemChannels(channel_size, lut_dcx.data(), lut_dcy.data(), lut_dcb.data());
 
 	cl_kernel kernel = ocl.kernel[KERNEL_DOMASK];
     clSetKernelArgEx(kernel, &mask.r, &mask.g, &mask.b,
@@ -684,10 +775,7 @@ void clDoMask(ocl_channels mask/*in, out*/, ocl_channels mask_dc/*in, out*/, siz
         &xyb_dc.x, &xyb_dc.y, &xyb_dc.b);
 
 	size_t globalWorkSize[2] = { xsize, ysize };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 
 	ocl.releaseMemChannels(xyb);
 	ocl.releaseMemChannels(xyb_dc);
@@ -749,10 +837,7 @@ void clCombineChannelsEx(
         &step);
 
 	size_t globalWorkSize[2] = { work_xsize, work_ysize };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 }
 
 void clUpsampleSquareRootEx(cl_mem diffmap, const size_t xsize, const size_t ysize, const int step)
@@ -768,12 +853,8 @@ void clUpsampleSquareRootEx(cl_mem diffmap, const size_t xsize, const size_t ysi
 	const size_t res_ysize = (ysize + step - 1) / step;
 
 	size_t globalWorkSize[2] = { res_xsize, res_ysize };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clEnqueueCopyBuffer(ocl.commandQueue, diffmap_out, diffmap, 0, 0, xsize * ysize * sizeof(float), 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
+	ocl.copyBuffer(diffmap_out, diffmap, xsize * ysize * sizeof(float));
 
     clReleaseMemObject(diffmap_out);
 }
@@ -792,10 +873,7 @@ void clRemoveBorderEx(cl_mem out, const cl_mem in, const size_t xsize, const siz
     clSetKernelArgEx(kernel, &out, &out_xsize, &out_ysize, &in, &cls, &cls2);
 
 	size_t globalWorkSize[2] = { out_xsize, out_ysize};
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 }
 
 void clAddBorderEx(cl_mem out, size_t xsize, size_t ysize, int step, cl_mem in)
@@ -808,10 +886,7 @@ void clAddBorderEx(cl_mem out, size_t xsize, size_t ysize, int step, cl_mem in)
     clSetKernelArgEx(kernel, &out, &xsize, &ysize, &cls, &cls2, &in);
 
 	size_t globalWorkSize[2] = { xsize, ysize};
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-    LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-    LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 }
 
 void clCalculateDiffmapEx(cl_mem diffmap/*in,out*/, const size_t xsize, const size_t ysize, const int step)
@@ -873,14 +948,11 @@ void clCopyFromJpegComponent(
 		&output_width, &output_height);
 
 	size_t globalWorkSize[2] = { output_block_width, output_block_height };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-	LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-	LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 
-	err = clEnqueueReadBuffer(ocl.commandQueue, dst_coeff, false, 0, dst_coeff_size, output_batch, 0, NULL, NULL);
-	err = clEnqueueReadBuffer(ocl.commandQueue, dst_idct, false, 0, dst_idct_size, output_idct, 0, NULL, NULL);
-	err = clFinish(ocl.commandQueue);
+	ocl.readBuffer(dst_coeff, dst_coeff_size, output_batch);
+	ocl.readBuffer(dst_idct, dst_idct_size, output_idct);
+	ocl.finish();
 
 	clReleaseMemObject(src_coeff);
 	clReleaseMemObject(dst_coeff);
@@ -917,15 +989,12 @@ void clApplyGlobalQuantization(
 		&dst_bool, &src_q, &block_width, &block_height);
 
 	size_t globalWorkSize[2] = { block_width, block_height };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-	LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-	LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 
-	err = clEnqueueReadBuffer(ocl.commandQueue, dst_coeff, false, 0, dst_coeff_size, output_batch, 0, NULL, NULL);
-	err = clEnqueueReadBuffer(ocl.commandQueue, dst_idct, false, 0, dst_idct_size, output_idct, 0, NULL, NULL);
-	err = clEnqueueReadBuffer(ocl.commandQueue, dst_bool, false, 0, dst_bool_size, output_bool, 0, NULL, NULL);
-	err = clFinish(ocl.commandQueue);
+	ocl.readBuffer(dst_coeff, dst_coeff_size, output_batch);
+	ocl.readBuffer(dst_idct, dst_idct_size, output_idct);
+	ocl.readBuffer(dst_bool, dst_bool_size, output_bool);
+	ocl.finish();
 
 	clReleaseMemObject(dst_bool);
 	clReleaseMemObject(dst_coeff);
@@ -976,10 +1045,7 @@ void clComponentsToPixels(
 				&cl_pixels, &width, &height);
 
 			size_t globalWorkSize[2] = { xend0 - xmin, yend0 - ymin };
-			cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-			LOG_CL_RESULT(err);
-			err = clFinish(ocl.commandQueue);
-			LOG_CL_RESULT(err);
+			ocl.enqueueKernel(kernel, 2, globalWorkSize);
 		}
 
 		clReleaseMemObject(cl_pixels);
@@ -991,10 +1057,7 @@ void clComponentsToPixels(
 				&width, &height);
 
 			size_t globalWorkSize[2] = { xend1 - xend0, yend0 - ymin };
-			cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-			LOG_CL_RESULT(err);
-			err = clFinish(ocl.commandQueue);
-			LOG_CL_RESULT(err);
+			ocl.enqueueKernel(kernel, 2, globalWorkSize);
 		}
 
 		if (yend1 - yend0 > 0) {
@@ -1004,10 +1067,7 @@ void clComponentsToPixels(
 				&width, &height);
 
 			size_t globalWorkSize[2] = { xsize, yend1 - yend0 };
-			cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-			LOG_CL_RESULT(err);
-			err = clFinish(ocl.commandQueue);
-			LOG_CL_RESULT(err);
+			ocl.enqueueKernel(kernel, 2, globalWorkSize);
 		}
 
 		clReleaseMemObject(cl_out_offset);
@@ -1017,15 +1077,71 @@ void clComponentsToPixels(
 	clSetKernelArgEx(kernel, &cl_out);
 
 	size_t globalWorkSize[2] = { xsize * ysize, 1 };
-	cl_int err = clEnqueueNDRangeKernel(ocl.commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-	LOG_CL_RESULT(err);
-	err = clFinish(ocl.commandQueue);
-	LOG_CL_RESULT(err);
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
 	
-	clEnqueueReadBuffer(ocl.commandQueue, cl_out, CL_TRUE, 0, out_size, rgb, 0, NULL, NULL);
+	ocl.readBuffer(cl_out, out_size, rgb);
+	ocl.finish();
+
 	clReleaseMemObject(cl_out);
 }
 
+void clComponentsToLinearRGB(
+	float *r, float *g, float *b,/*out*/
+	const int xmin,
+	const int ymin,
+	const int xsize,
+	const int ysize,
+	const guetzli::OutputImage &img /*in*/)
+{
+	ocl_args_d_t &ocl = getOcl();
+
+	size_t channel_size = xsize * ysize * sizeof(float);
+	ocl_channels rgb = ocl.allocMemChannels(channel_size);
+
+	clComponentsToLinearRGBEx(rgb, xmin, ymin, xsize, ysize, img);
+
+	ocl.readBuffer(rgb.r, channel_size, r);
+	ocl.readBuffer(rgb.g, channel_size, g);
+	ocl.readBuffer(rgb.b, channel_size, b);
+	ocl.finish();
+
+	ocl.releaseMemChannels(rgb);
+}
+
+void clComponentsToLinearRGBEx(
+	ocl_channels &rgb/*out*/,
+	const int xmin,
+	const int ymin,
+	const int xsize,
+	const int ysize,
+	const guetzli::OutputImage &img /*in*/)
+{
+	ocl_args_d_t &ocl = getOcl();
+
+	const int width = img.width();
+	const int height = img.height();
+
+	cl_mem cl_pixels[3];
+	for (int c = 0; c < 3; c++)
+	{
+		cl_pixels[c] = ocl.allocMem(img.component(c).pixels_size() * sizeof(ushort), img.component(c).pixels());
+	}
+
+	cl_kernel kernel = ocl.kernel[KERNEL_COMPONENTSTOLINEARRGB];
+	clSetKernelArgEx(kernel, &rgb.r, &rgb.g, &rgb.b,
+		&cl_pixels[0], &cl_pixels[1], &cl_pixels[2],
+		&width, &height,
+		&xmin, &ymin, &xsize, &ysize);
+
+	size_t globalWorkSize[2] = { xsize, ysize };
+	ocl.enqueueKernel(kernel, 2, globalWorkSize);
+
+	for (int c = 0; c < 3; c++)
+	{
+		clReleaseMemObject(cl_pixels[c]);
+	}
+}
+
 #ifdef __USE_DOUBLE_AS_FLOAT__
 #undef double
 #endif
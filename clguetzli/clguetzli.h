@@ -25,10 +25,33 @@ enum MATH_MODE
     MODE_AUTO,
 };
 
+// The process wide backend.
 extern MATH_MODE g_mathMode;
 
+// The backend of the calling thread: the one set by a ScopedMathMode, else g_mathMode.
+MATH_MODE CurrentMathMode();
+
+// Sets the backend of the calling thread for the scope, see guetzli::Encoder.
+class ScopedMathMode
+{
+public:
+    explicit ScopedMathMode(MATH_MODE mode);
+    ~ScopedMathMode();
+
+private:
+    int previous_;
+};
+
 #ifdef __USE_OPENCL__
 
+// Run clComputeBlockZeroingOrder with a work group per block (clComputeBlockZeroingOrderGroupEx)
+// instead of a work item per block. --checkcl runs both kernels and compares them.
+extern bool g_useGroupBlockZeroing;
+
+// CPU worker threads that share the clComputeBlockZeroingOrder block rows with the
+// OpenCL device, 0 leaves all rows to the device.
+extern int g_hybridCpuThreads;
+
 #ifdef __USE_DOUBLE_AS_FLOAT__
 #define double float
 #endif
@@ -56,6 +79,22 @@ void clComputeBlockZeroingOrder(
     const int comp_mask,
     const float BlockErrorLimit);
 
+// clComputeBlockZeroingOrderEx run on the host for the block rows [row_begin, row_end).
+// Safe to call from several threads on disjoint rows.
+void ComputeBlockZeroingOrderRowsCpu(
+    guetzli::CoeffData *output_order_batch,
+    const channel_info orig_channel[3],
+    const float *orig_image_batch,
+    const float *mask_scale,
+    const int image_width,
+    const int image_height,
+    const channel_info mayout_channel[3],
+    const int factor,
+    const int comp_mask,
+    const float BlockErrorLimit,
+    const int row_begin,
+    const int row_end);
+
 void clMask(
     float* mask_r,   float* mask_g,   float* mask_b,
     float* maskdc_r, float* maskdc_g, float* maskdc_b, 
@@ -187,6 +226,22 @@ void clComponentsToPixels(
 	const int ysize,
 	const std::vector<guetzli::OutputImageComponent> &components /*in*/);
 
+void clComponentsToLinearRGB(
+	float *r, float *g, float *b,/*out*/
+	const int xmin,
+	const int ymin,
+	const int xsize,
+	const int ysize,
+	const guetzli::OutputImage &img /*in*/);
+
+void clComponentsToLinearRGBEx(
+	ocl_channels &rgb/*out*/,
+	const int xmin,
+	const int ymin,
+	const int xsize,
+	const int ysize,
+	const guetzli::OutputImage &img /*in*/);
+
 #endif
 
 #if defined(__USE_OPENCL__) || defined(__USE_CUDA__)
@@ -212,9 +267,10 @@ namespace guetzli {
 
         double CompareBlock(const OutputImage& img, int off_x, int off_y, const coeff_t* candidate_block, const int comp_mask) const override;
     public:
-        std::vector<float> imgOpsinDynamicsBlockList;   // [RR..RRGG..GGBB..BB]:blockCount
-        std::vector<float> imgMaskXyzScaleBlockList;    // [RGBRGB..RGBRGB]:blockCount
+        tracked_vector<float> imgOpsinDynamicsBlockList;   // [RR..RRGG..GGBB..BB]:blockCount
+        tracked_vector<float> imgMaskXyzScaleBlockList;    // [RGBRGB..RGBRGB]:blockCount
         std::vector<std::vector<float>> rgb_orig_opsin;
+        MemoryReservation rgb_orig_opsin_memory;
     };
 }
 
@@ -12,28 +12,13 @@
 #include <assert.h>
 #include <vector>
 #include "clguetzli_test.h"
+#include "guetzli/diff_report.h"
 #include "clguetzli.h"
 #include "ocl.h"
 #include "ocu.h"
 
-#define FLOAT_COMPARE(a, b, c)  floatCompare((a), (b), (c), __FUNCTION__, __LINE__ )
-
-int floatCompare(const float* a, const float* b, size_t size, const char* szFunc, int line)
-{
-	int count = 0;
-	for (int i = 0; i < size; i++)
-	{
-		if (fabs(a[i] - b[i]) > 0.001)
-		{
-			count++;
-		}
-	}
-	if (count > 0)
-	{
-		LogError("CHK %s(%d) %d:%d\r\n", szFunc, line, count, size);
-	}
-	return count;
-}
+// Each tcl* helper is a stage of the report, the CPU result comes first.
+#define FLOAT_COMPARE(a, b, c)  guetzli::DiffReport::Global()->Compare(__FUNCTION__, (a), (b), (c))
 
 void tclMaskHighIntensityChange(const float* r, const float* g, const float* b,
 	const float* r2, const float* g2, const float* b2,
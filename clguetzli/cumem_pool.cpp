@@ -5,6 +5,8 @@
  */
 
 #include "cumem_pool.h"
+#include "guetzli/memory_account.h"
+#include "guetzli/profiler.h"
 
 #ifdef __USE_CUDA__
 
@@ -44,10 +46,12 @@ cu_mem cu_mem_pool_t::allocMem(size_t s, const void *init)
         block_candidate->used = s;
 
         mem = block_candidate->mem;
+        guetzli::ProfileInstant("pool reuse", "memory", s);
     }
     else {
         cu_mem new_mem;
         cuMemAlloc(&new_mem, s);
+        guetzli::TrackDeviceAllocation(s);
         cu_mem_block_t mem_block;
         mem_block.size = s;
         mem_block.used = s;
@@ -57,6 +61,7 @@ cu_mem cu_mem_pool_t::allocMem(size_t s, const void *init)
         mem_pool.sort(compare_size);
 
         mem = new_mem;
+        guetzli::ProfileInstant("pool alloc", "memory", s);
     }
     if (init)
     {
@@ -84,6 +89,7 @@ void cu_mem_pool_t::releaseMem(cu_mem mem)
     if (block_candidate != NULL) {
         block_candidate->status = MBS_IDLE;
         block_candidate->used = 0;
+        guetzli::ProfileInstant("pool release", "memory", block_candidate->size);
     }
     else {
         cuMemFree(mem);
@@ -101,6 +107,7 @@ void cu_mem_pool_t::drain()
         if (iter->status == MBS_IDLE) {
             total_mem += iter->size;
             cuMemFree(iter->mem);
+            guetzli::TrackDeviceRelease(iter->size);
             iter = mem_pool.erase(iter);
 		}
 		else {
@@ -108,6 +115,7 @@ void cu_mem_pool_t::drain()
 		}
     }
 
+    guetzli::ProfileInstant("pool drain", "memory", total_mem);
     LogError("mem_pool has %u blocks, and total pool memory is:%f kb, total memory request:%f kb, total alloc count:%d.\r\n", total_block, (float)(total_mem) / 1024, (float)(total_mem_request) / 1024, alloc_count);
 }
 
@@ -6,22 +6,49 @@
 */
 
 #include "ocl.h"
+#include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <vector>
 #include "clguetzli/clguetzli_cl_src.h"
+#include "guetzli/memory_account.h"
+#include "guetzli/profiler.h"
 
 
 #ifdef __USE_OPENCL__
 
+bool g_useOutOfOrderQueue = false;
+
+static thread_local ocl_args_d_t* t_ocl = NULL;
+
 ocl_args_d_t& getOcl(void)
 {
+    if (t_ocl) return *t_ocl;
+
     static bool bInit = false;
     static ocl_args_d_t ocl;
 
     if (bInit == true) return ocl;
 
     bInit = true;
-    cl_int err = SetupOpenCL(&ocl, CL_DEVICE_TYPE_GPU);
+    initOcl(ocl);
+    return ocl;
+}
+
+ScopedOcl::ScopedOcl(ocl_args_d_t* ocl)
+    : previous_(t_ocl)
+{
+    t_ocl = ocl;
+}
+
+ScopedOcl::~ScopedOcl()
+{
+    t_ocl = previous_;
+}
+
+void initOcl(ocl_args_d_t& ocl, const ocl_device_t* device)
+{
+    cl_int err = device ? SetupOpenCLDevice(&ocl, *device) : SetupOpenCL(&ocl, CL_DEVICE_TYPE_GPU);
     LOG_CL_RESULT(err);
 
 	const char* source = (char*)clguetzli_cl_src;
@@ -70,8 +97,19 @@ ocl_args_d_t& getOcl(void)
 	ocl.kernel[KERNEL_COMPONENTSTOPIXELS_EX1] = clCreateKernel(ocl.program, "clComponentsToPixelsEx1", &err);
 	ocl.kernel[KERNEL_COMPONENTSTOPIXELS_EX2] = clCreateKernel(ocl.program, "clComponentsToPixelsEx2", &err);
 	ocl.kernel[KERNEL_COLORTRANSFORMYCBCRTORGB] = clCreateKernel(ocl.program, "clColorTransformYCbCrToRGB", &err);
+	ocl.kernel[KERNEL_COMPONENTSTOLINEARRGB] = clCreateKernel(ocl.program, "clComponentsToLinearRGBEx", &err);
+	ocl.kernel[KERNEL_COMPUTEBLOCKZEROINGORDER_GROUP] = clCreateKernel(ocl.program, "clComputeBlockZeroingOrderGroupEx", &err);
 
-    return ocl;
+    for (int i = 0; i < KERNEL_COUNT; i++)
+    {
+        char name[128] = {0};
+        if (ocl.kernel[i] && CL_SUCCESS == clGetKernelInfo(ocl.kernel[i], CL_KERNEL_FUNCTION_NAME, sizeof(name) - 1, name, NULL))
+        {
+            ocl.kernelNames[i] = name;
+        }
+    }
+
+    ocl.tuner.init(ocl.device, ocl.kernel, KERNEL_COUNT);
 }
 
 ocl_args_d_t::ocl_args_d_t() :
@@ -81,7 +119,9 @@ ocl_args_d_t::ocl_args_d_t() :
 	program(NULL),
 	platformVersion(OPENCL_VERSION_1_2),
 	deviceVersion(OPENCL_VERSION_1_2),
-	compilerVersion(OPENCL_VERSION_1_2)
+	compilerVersion(OPENCL_VERSION_1_2),
+	outOfOrder(false),
+	lastEvent(NULL)
 {
 	for (int i = 0; i < KERNEL_COUNT; i++)
 	{
@@ -92,6 +132,14 @@ ocl_args_d_t::ocl_args_d_t() :
 ocl_args_d_t::~ocl_args_d_t()
 {
 	cl_int err = CL_SUCCESS;
+	if (lastEvent)
+	{
+		clReleaseEvent(lastEvent);
+	}
+	for (size_t i = 0; i < traced.size(); i++)
+	{
+		clReleaseEvent(traced[i].ev);
+	}
 	for (int i = 0; i < KERNEL_COUNT; i++)
 	{
 		err = clReleaseKernel(kernel[i]);
@@ -135,30 +183,46 @@ ocl_args_d_t::~ocl_args_d_t()
 	}
 }
 
+static void CL_CALLBACK trackMemRelease(cl_mem, void *size)
+{
+	guetzli::TrackDeviceRelease(reinterpret_cast<size_t>(size));
+}
+
 cl_mem ocl_args_d_t::allocMem(size_t s, const void *init)
 {
 	cl_int err = 0;
-	cl_mem mem = clCreateBuffer(this->context, CL_MEM_READ_WRITE, s, nullptr, &err);
-    LOG_CL_RESULT(err);
-    if (!mem) return NULL;
-    
-    // init memory
-    if (init)
-    {
-        err = clEnqueueWriteBuffer(this->commandQueue, mem, CL_FALSE, 0, s, init, 0, NULL, NULL);
-        LOG_CL_RESULT(err);
-        err = clFinish(this->commandQueue);
-        LOG_CL_RESULT(err);
-    }
-    else
-    {
-        cl_char cc = 0;
-        err = clEnqueueFillBuffer(this->commandQueue, mem, &cc, sizeof(cc), 0, s / sizeof(cc), 0, NULL, NULL);
-        LOG_CL_RESULT(err);
-        err = clFinish(this->commandQueue);
-        LOG_CL_RESULT(err);
-    }
+	cl_mem mem = NULL;
+
+	// init memory
+	// CL_MEM_COPY_HOST_PTR copies init before clCreateBuffer returns, so the caller may free it
+	// right away and no write has to be waited for. Zero fill is just queued ahead of the consumers.
+	if (init)
+	{
+		const uint64_t t0 = guetzli::ProfileEventsEnabled() ? guetzli::ProfileNowNs() : 0;
+		mem = clCreateBuffer(this->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, s, const_cast<void*>(init), &err);
+		LOG_CL_RESULT(err);
+		if (t0) guetzli::ProfileSpan("writeBuffer", "transfer", t0, guetzli::ProfileNowNs(), s);
+	}
+	else
+	{
+		mem = clCreateBuffer(this->context, CL_MEM_READ_WRITE, s, nullptr, &err);
+		LOG_CL_RESULT(err);
+		if (!mem) return NULL;
 
+		cl_char cc = 0;
+		cl_event ev = NULL;
+		const uint64_t t0 = guetzli::ProfileNowNs();
+		err = clEnqueueFillBuffer(this->commandQueue, mem, &cc, sizeof(cc), 0, s / sizeof(cc), waitCount(), waitList(), eventOut(&ev));
+		LOG_CL_RESULT(err);
+		chainCommand(ev, "fillBuffer", "transfer", s, t0);
+	}
+
+	if (mem)
+	{
+		// The buffers are released all over the host code, count them back when the runtime frees them.
+		guetzli::TrackDeviceAllocation(s);
+		clSetMemObjectDestructorCallback(mem, trackMemRelease, reinterpret_cast<void*>(s));
+	}
 	return mem;
 }
 
@@ -184,6 +248,138 @@ void ocl_args_d_t::releaseMemChannels(ocl_channels &rgb)
     }
 }
 
+void ocl_args_d_t::chainEvent(cl_event ev)
+{
+	if (!ev) return;
+
+	if (lastEvent)
+	{
+		clReleaseEvent(lastEvent);
+	}
+	lastEvent = ev;
+}
+
+cl_event* ocl_args_d_t::eventOut(cl_event *ev) const
+{
+	return (outOfOrder || guetzli::ProfileEventsEnabled()) ? ev : NULL;
+}
+
+void ocl_args_d_t::chainCommand(cl_event ev, const char *name, const char *category, size_t bytes, uint64_t enqueued_ns)
+{
+	if (!ev) return;
+
+	if (guetzli::ProfileEventsEnabled())
+	{
+		ocl_traced_t cmd = { ev, name, category, bytes, enqueued_ns };
+		clRetainEvent(ev);
+		traced.push_back(cmd);
+	}
+	if (outOfOrder)
+	{
+		chainEvent(ev);
+	}
+	else
+	{
+		clReleaseEvent(ev);
+	}
+}
+
+void ocl_args_d_t::collectTraced()
+{
+	for (size_t i = 0; i < traced.size(); i++)
+	{
+		const ocl_traced_t &cmd = traced[i];
+		cl_ulong queued = 0, start = 0, end = 0;
+		if (CL_SUCCESS == clGetEventProfilingInfo(cmd.ev, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL) &&
+			CL_SUCCESS == clGetEventProfilingInfo(cmd.ev, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) &&
+			CL_SUCCESS == clGetEventProfilingInfo(cmd.ev, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) &&
+			start >= queued && end >= start)
+		{
+			// The device clock has its own origin, the command was queued when the host enqueued it.
+			guetzli::ProfileDeviceSpan(cmd.name, cmd.category, cmd.enqueued_ns + (start - queued), cmd.enqueued_ns + (end - queued), cmd.bytes);
+		}
+		clReleaseEvent(cmd.ev);
+	}
+	traced.clear();
+}
+
+const char* ocl_args_d_t::kernelName(cl_kernel k) const
+{
+	for (int i = 0; i < KERNEL_COUNT; i++)
+	{
+		if (kernel[i] == k) return kernelNames[i].c_str();
+	}
+	return "kernel";
+}
+
+cl_int ocl_args_d_t::enqueueKernel(cl_kernel kernel, cl_uint work_dim, const size_t *globalWorkSize, const size_t *localWorkSize, const size_t *globalWorkOffset)
+{
+	ocl_tune_launch_t launch;
+	size_t tunedSize[3];
+	bool tuned = false;
+	if (!localWorkSize && tuner.localSize(kernel, work_dim, globalWorkSize, tunedSize, &launch))
+	{
+		localWorkSize = tunedSize;
+		tuned = true;
+	}
+	const bool timed = launch.timed;
+
+	cl_event ev = NULL;
+	const uint64_t t0 = guetzli::ProfileNowNs();
+	cl_int err = clEnqueueNDRangeKernel(commandQueue, kernel, work_dim, globalWorkOffset, globalWorkSize, localWorkSize, waitCount(), waitList(), timed ? &ev : eventOut(&ev));
+	if (CL_SUCCESS != err && tuned)
+	{
+		// The device doesn't take this local size for the kernel, fall back to the driver's choice.
+		tuner.reject(launch);
+		ev = NULL;
+		err = clEnqueueNDRangeKernel(commandQueue, kernel, work_dim, globalWorkOffset, globalWorkSize, NULL, waitCount(), waitList(), eventOut(&ev));
+	}
+	else if (CL_SUCCESS == err && timed)
+	{
+		// The tuner keeps its own reference until collect().
+		launch.ev = ev;
+		clRetainEvent(ev);
+		tuner.addSample(launch);
+	}
+	LOG_CL_RESULT(err);
+	chainCommand(ev, kernelName(kernel), "kernel", 0, t0);
+	return err;
+}
+
+cl_int ocl_args_d_t::copyBuffer(cl_mem src, cl_mem dst, size_t s)
+{
+	cl_event ev = NULL;
+	const uint64_t t0 = guetzli::ProfileNowNs();
+	cl_int err = clEnqueueCopyBuffer(commandQueue, src, dst, 0, 0, s, waitCount(), waitList(), eventOut(&ev));
+	LOG_CL_RESULT(err);
+	chainCommand(ev, "copyBuffer", "transfer", s, t0);
+	return err;
+}
+
+cl_int ocl_args_d_t::readBuffer(cl_mem mem, size_t s, void *dst, size_t offset)
+{
+	cl_event ev = NULL;
+	const uint64_t t0 = guetzli::ProfileNowNs();
+	cl_int err = clEnqueueReadBuffer(commandQueue, mem, CL_FALSE, offset, s, dst, waitCount(), waitList(), eventOut(&ev));
+	LOG_CL_RESULT(err);
+	chainCommand(ev, "readBuffer", "transfer", s, t0);
+	return err;
+}
+
+cl_int ocl_args_d_t::finish()
+{
+	cl_int err = clFinish(commandQueue);
+	LOG_CL_RESULT(err);
+	tuner.collect();
+	collectTraced();
+	if (lastEvent)
+	{
+		clReleaseEvent(lastEvent);
+		lastEvent = NULL;
+	}
+	return err;
+}
+
 const char* TranslateOpenCLError(cl_int errorCode)
 {
 	switch (errorCode)
@@ -539,6 +735,8 @@ int GetPlatformAndDeviceVersion(cl_platform_id platformId, ocl_args_d_t *ocl)
 }
 
 
+static int CreateCommandQueue(ocl_args_d_t *ocl);
+
 /*
 * This function picks/creates necessary OpenCL objects which are needed.
 * The objects are:
@@ -595,24 +793,47 @@ int SetupOpenCL(ocl_args_d_t *ocl, cl_device_type deviceType)
 	// Read the OpenCL platform's version and the device OpenCL and OpenCL C versions
 	GetPlatformAndDeviceVersion(platformId, ocl);
 
+	return CreateCommandQueue(ocl);
+}
+
+/*
+* Creates the command queue of ocl->device in ocl->context, see SetupOpenCL().
+*/
+static int CreateCommandQueue(ocl_args_d_t *ocl)
+{
+	cl_int err = CL_SUCCESS;
+
 	// Create command queue.
 	// OpenCL kernels are enqueued for execution to a particular device through special objects called command queues.
-	// Command queue guarantees some ordering between calls and other OpenCL commands.
-	// Here you create a simple in-order OpenCL command queue that doesn't allow execution of two kernels in parallel on a target device.
+	// By default this is an in-order queue, which already serialises the stage chains.
+	// With g_useOutOfOrderQueue the device may overlap commands; ordering then comes from the event chain kept in ocl_args_d_t.
+	cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
+	if (g_useOutOfOrderQueue)
+	{
+		cl_command_queue_properties supported = 0;
+		clGetDeviceInfo(ocl->device, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, NULL);
+		if (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+		{
+			properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+			ocl->outOfOrder = true;
+		}
+		else
+		{
+			LogError("Out-of-order queue is not supported by the device, using in-order queue.\n");
+		}
+	}
 #ifdef CL_VERSION_2_0
 	if (OPENCL_VERSION_2_0 == ocl->deviceVersion)
 	{
-		const cl_command_queue_properties properties[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
-		ocl->commandQueue = clCreateCommandQueueWithProperties(ocl->context, ocl->device, properties, &err);
+		const cl_queue_properties queueProperties[] = { CL_QUEUE_PROPERTIES, properties, 0 };
+		ocl->commandQueue = clCreateCommandQueueWithProperties(ocl->context, ocl->device, queueProperties, &err);
 	}
 	else {
 		// default behavior: OpenCL 1.2
-		cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
 		ocl->commandQueue = clCreateCommandQueue(ocl->context, ocl->device, properties, &err);
 	}
 #else
 	// default behavior: OpenCL 1.2
-	cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
 	ocl->commandQueue = clCreateCommandQueue(ocl->context, ocl->device, properties, &err);
 #endif
 	if (CL_SUCCESS != err)
@@ -624,4 +845,131 @@ int SetupOpenCL(ocl_args_d_t *ocl, cl_device_type deviceType)
 	return CL_SUCCESS;
 }
 
-#endif
\ No newline at end of file
+int SetupOpenCLDevice(ocl_args_d_t *ocl, const ocl_device_t& device)
+{
+	cl_int err = CL_SUCCESS;
+
+	cl_context_properties contextProperties[] = { CL_CONTEXT_PLATFORM, (cl_context_properties)device.platform, 0 };
+	ocl->context = clCreateContext(contextProperties, 1, &device.device, NULL, NULL, &err);
+	if ((CL_SUCCESS != err) || (NULL == ocl->context))
+	{
+		LogError("Couldn't create a context on %s, clCreateContext() returned '%s'.\n", device.name.c_str(), TranslateOpenCLError(err));
+		return err;
+	}
+	ocl->device = device.device;
+
+	GetPlatformAndDeviceVersion(device.platform, ocl);
+
+	return CreateCommandQueue(ocl);
+}
+
+static std::string PlatformString(cl_platform_id platform, cl_platform_info info)
+{
+	size_t len = 0;
+	if (CL_SUCCESS != clGetPlatformInfo(platform, info, 0, NULL, &len) || len == 0)
+	{
+		return std::string();
+	}
+	std::vector<char> value(len);
+	clGetPlatformInfo(platform, info, len, &value[0], NULL);
+	return std::string(&value[0]);
+}
+
+static std::string DeviceString(cl_device_id device, cl_device_info info)
+{
+	size_t len = 0;
+	if (CL_SUCCESS != clGetDeviceInfo(device, info, 0, NULL, &len) || len == 0)
+	{
+		return std::string();
+	}
+	std::vector<char> value(len);
+	clGetDeviceInfo(device, info, len, &value[0], NULL);
+	return std::string(&value[0]);
+}
+
+static std::vector<ocl_device_t> EnumerateOclDevices()
+{
+	std::vector<ocl_device_t> devices;
+
+	cl_uint numPlatforms = 0;
+	if (CL_SUCCESS != clGetPlatformIDs(0, NULL, &numPlatforms) || 0 == numPlatforms)
+	{
+		return devices;
+	}
+	std::vector<cl_platform_id> platforms(numPlatforms);
+	if (CL_SUCCESS != clGetPlatformIDs(numPlatforms, &platforms[0], NULL))
+	{
+		return devices;
+	}
+
+	for (cl_uint i = 0; i < numPlatforms; i++)
+	{
+		// A platform without any device returns CL_DEVICE_NOT_FOUND.
+		cl_uint numDevices = 0;
+		if (CL_SUCCESS != clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices) || 0 == numDevices)
+		{
+			continue;
+		}
+		std::vector<cl_device_id> ids(numDevices);
+		if (CL_SUCCESS != clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, numDevices, &ids[0], NULL))
+		{
+			continue;
+		}
+		const std::string platformName = PlatformString(platforms[i], CL_PLATFORM_NAME);
+		for (cl_uint d = 0; d < numDevices; d++)
+		{
+			ocl_device_t device;
+			device.platform = platforms[i];
+			device.device = ids[d];
+			device.type = 0;
+			clGetDeviceInfo(ids[d], CL_DEVICE_TYPE, sizeof(device.type), &device.type, NULL);
+			device.name = platformName + " | " + DeviceString(ids[d], CL_DEVICE_NAME);
+			devices.push_back(device);
+		}
+	}
+	return devices;
+}
+
+const std::vector<ocl_device_t>& listOclDevices()
+{
+	static const std::vector<ocl_device_t> devices = EnumerateOclDevices();
+	return devices;
+}
+
+bool parseOclDevices(const char* spec, std::vector<int>* devices)
+{
+	const std::vector<ocl_device_t>& all = listOclDevices();
+	devices->clear();
+
+	cl_device_type type = 0;
+	if (!strcmp(spec, "all")) type = CL_DEVICE_TYPE_ALL;
+	else if (!strcmp(spec, "gpu")) type = CL_DEVICE_TYPE_GPU;
+	else if (!strcmp(spec, "cpu")) type = CL_DEVICE_TYPE_CPU;
+	if (type)
+	{
+		for (size_t i = 0; i < all.size(); i++)
+		{
+			if (all[i].type & type) devices->push_back((int)i);
+		}
+		return !devices->empty();
+	}
+
+	const char* p = spec;
+	while (*p)
+	{
+		char* end = NULL;
+		const long index = strtol(p, &end, 10);
+		if (end == p || index < 0 || index >= (long)all.size() || (*end && *end != ','))
+		{
+			return false;
+		}
+		if (std::find(devices->begin(), devices->end(), (int)index) == devices->end())
+		{
+			devices->push_back((int)index);
+		}
+		p = *end ? end + 1 : end;
+	}
+	return !devices->empty();
+}
+
+#endif
@@ -32,6 +32,8 @@ enum KernelName {
 	KERNEL_COMPONENTSTOPIXELS_EX1,
 	KERNEL_COMPONENTSTOPIXELS_EX2,
 	KERNEL_COLORTRANSFORMYCBCRTORGB,
+	KERNEL_COMPONENTSTOLINEARRGB,
+	KERNEL_COMPUTEBLOCKZEROINGORDER_GROUP,
 	KERNEL_COUNT,
 };
 
@@ -40,7 +42,11 @@ enum KernelName {
 
 #ifdef __USE_OPENCL__
 
+#include <stdint.h>
+#include <string>
+#include <vector>
 #include "CL/cl.h"
+#include "ocl_tuner.h"
 
 // Macros for OpenCL versions
 #define OPENCL_VERSION_1_2  1.2f
@@ -50,14 +56,64 @@ enum KernelName {
 
 struct ocl_args_d_t;
 
+// Create the command queue with CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE when the device supports it.
+// Must be set before the first getOcl() call.
+extern bool g_useOutOfOrderQueue;
+
 const char* TranslateOpenCLError(cl_int errorCode);
 
 int SetupOpenCL(ocl_args_d_t *ocl, cl_device_type deviceType);
 
 bool supportsOpenCl();
 
+// An OpenCL device of any platform.
+struct ocl_device_t
+{
+	cl_platform_id platform;
+	cl_device_id   device;
+	cl_device_type type;
+	std::string    name;     // "<platform> | <device>"
+};
+
+// Every device of every platform, in platform order. --devices selects by the index in this list.
+const std::vector<ocl_device_t>& listOclDevices();
+
+// Parses a --devices selector: "all", "gpu", "cpu" or comma separated indices of listOclDevices().
+// False if it is malformed or selects no device.
+bool parseOclDevices(const char* spec, std::vector<int>* devices);
+
+// Like SetupOpenCL(), with a context of |device| only.
+int SetupOpenCLDevice(ocl_args_d_t *ocl, const ocl_device_t& device);
+
+// The context of the calling thread: the one set by a ScopedOcl, else the process wide one,
+// created on first use.
 ocl_args_d_t& getOcl(void);
 
+// Creates the queue, program and kernels of a fresh context, on |device| or, if NULL, on the
+// first GPU (else CPU) device as getOcl() does.
+void initOcl(ocl_args_d_t& ocl, const ocl_device_t* device = NULL);
+
+// Makes getOcl() return |ocl| on the calling thread for the scope, see guetzli::Encoder.
+class ScopedOcl
+{
+public:
+	explicit ScopedOcl(ocl_args_d_t* ocl);
+	~ScopedOcl();
+
+private:
+	ocl_args_d_t* previous_;
+};
+
+// A command whose device times go to the trace once the queue is finished.
+struct ocl_traced_t
+{
+	cl_event    ev;
+	const char* name;
+	const char* category;    // "kernel" or "transfer".
+	size_t      bytes;
+	uint64_t    enqueued_ns; // Host time, relates the device clock to it.
+};
+
 struct ocl_args_d_t
 {
 	ocl_args_d_t();
@@ -67,6 +123,17 @@ struct ocl_args_d_t
 	ocl_channels allocMemChannels(size_t s, const void *c0 = NULL, const void *c1 = NULL, const void *c2 = NULL);
     void releaseMemChannels(ocl_channels &rgb);
 
+	// Commands are enqueued without host synchronisation. Each command waits on the previous one,
+	// so a stage chain keeps its order on an out-of-order queue too. finish() is the only host sync
+	// point and must be called before the host touches the destination of a readBuffer().
+	cl_int enqueueKernel(cl_kernel kernel, cl_uint work_dim, const size_t *globalWorkSize, const size_t *localWorkSize = NULL, const size_t *globalWorkOffset = NULL);
+	cl_int copyBuffer(cl_mem src, cl_mem dst, size_t s);
+	cl_int readBuffer(cl_mem mem, size_t s, void *dst, size_t offset = 0);
+	cl_int finish();
+
+	// The function name of a kernel of this context.
+	const char* kernelName(cl_kernel k) const;
+
 	// Regular OpenCL objects:
 	cl_context       context;           // hold the context handler
 	cl_device_id     device;            // hold the selected device handler
@@ -76,6 +143,23 @@ struct ocl_args_d_t
 	float            platformVersion;   // hold the OpenCL platform version (default 1.2)
 	float            deviceVersion;     // hold the OpenCL device version (default. 1.2)
 	float            compilerVersion;   // hold the device OpenCL C version (default. 1.2)
+	bool             outOfOrder;        // commandQueue was created out-of-order
+	cl_event         lastEvent;         // last command of the chain, only tracked when outOfOrder
+	ocl_tuner_t      tuner;             // local work sizes for launches that don't set one
+	std::string      kernelNames[KERNEL_COUNT];
+	std::vector<ocl_traced_t> traced;   // commands enqueued while the calling thread was profiled
+
+private:
+	cl_uint waitCount() const { return lastEvent ? 1 : 0; }
+	const cl_event* waitList() const { return lastEvent ? &lastEvent : NULL; }
+	void chainEvent(cl_event ev);
+	// The event out-parameter for a command: events are needed to chain them on an
+	// out-of-order queue and to trace them.
+	cl_event* eventOut(cl_event* ev) const;
+	// Takes the event of a command just enqueued, see eventOut().
+	void chainCommand(cl_event ev, const char* name, const char* category, size_t bytes, uint64_t enqueued_ns);
+	// Emits the device spans of the traced commands, once they completed.
+	void collectTraced();
 };
 
 #endif
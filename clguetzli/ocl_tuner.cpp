@@ -0,0 +1,434 @@
+/*
+* OpenCL work-group size tuner
+*
+* Author: strongtu@tencent.com
+*/
+#include "ocl_tuner.h"
+
+#ifdef __USE_OPENCL__
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <atomic>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include "utils.h"
+
+// Candidate local sizes, { 0, 0 } is the driver's choice (NULL local size).
+static const size_t kCandidates1D[][2] = { { 0, 0 }, { 32, 1 }, { 64, 1 }, { 128, 1 }, { 256, 1 } };
+static const size_t kCandidates2D[][2] = { { 0, 0 }, { 8, 8 }, { 16, 8 }, { 16, 16 }, { 32, 4 }, { 32, 8 }, { 64, 4 } };
+
+// Every candidate is timed this many times, the fastest run counts.
+static const int kSamplesPerCandidate = 3;
+
+static int SizeClass(cl_uint work_dim, const size_t *globalWorkSize)
+{
+    size_t total = 1;
+    for (cl_uint i = 0; i < work_dim; i++)
+    {
+        total *= globalWorkSize[i];
+    }
+    int log2 = 0;
+    while ((total >>= 1) != 0) log2++;
+
+    return work_dim * 64 + log2;
+}
+
+static std::string DeviceString(cl_device_id device, cl_device_info info)
+{
+    size_t len = 0;
+    if (CL_SUCCESS != clGetDeviceInfo(device, info, 0, NULL, &len) || len == 0)
+    {
+        return std::string();
+    }
+    std::vector<char> value(len + 1);
+    clGetDeviceInfo(device, info, len, &value[0], NULL);
+    value[len] = 0;
+    return std::string(&value[0]);
+}
+
+ocl_tuner_t::ocl_tuner_t()
+    : enabled(true)
+    , device_(NULL)
+    , dirty_(false)
+{
+}
+
+ocl_tuner_t::~ocl_tuner_t()
+{
+    for (size_t i = 0; i < samples_.size(); i++)
+    {
+        clReleaseEvent(samples_[i].ev);
+    }
+}
+
+void ocl_tuner_t::init(cl_device_id device, const cl_kernel *kernels, int count)
+{
+    device_ = device;
+    kernels_.assign(kernels, kernels + count);
+    names_.resize(count);
+    maxWorkGroup_.resize(count);
+
+    for (int k = 0; k < count; k++)
+    {
+        maxWorkGroup_[k] = 0;
+        if (!kernels[k]) continue;
+
+        size_t len = 0;
+        clGetKernelInfo(kernels[k], CL_KERNEL_FUNCTION_NAME, 0, NULL, &len);
+        std::vector<char> name(len + 1);
+        clGetKernelInfo(kernels[k], CL_KERNEL_FUNCTION_NAME, len, &name[0], NULL);
+        name[len] = 0;
+        names_[k] = &name[0];
+
+        clGetKernelWorkGroupInfo(kernels[k], device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroup_[k], NULL);
+    }
+
+    identity_ = DeviceString(device, CL_DEVICE_NAME) + " | " + DeviceString(device, CL_DRIVER_VERSION);
+
+    load();
+}
+
+int ocl_tuner_t::kernelIndex(cl_kernel kernel) const
+{
+    for (size_t k = 0; k < kernels_.size(); k++)
+    {
+        if (kernels_[k] == kernel) return (int)k;
+    }
+    return -1;
+}
+
+int ocl_tuner_t::candidateCount(int size_class) const
+{
+    return size_class / 64 == 1 ? sizeof(kCandidates1D) / sizeof(kCandidates1D[0])
+                                : sizeof(kCandidates2D) / sizeof(kCandidates2D[0]);
+}
+
+const size_t* ocl_tuner_t::candidate(int size_class, int c) const
+{
+    return size_class / 64 == 1 ? kCandidates1D[c] : kCandidates2D[c];
+}
+
+bool ocl_tuner_t::isValid(int k, int size_class, int c, const size_t *globalWorkSize) const
+{
+    if (c == 0) return true;
+
+    const size_t *local = candidate(size_class, c);
+    const int work_dim = size_class / 64;
+    if (work_dim > 2) return false;
+
+    // OpenCL 1.2 requires the global size to be a multiple of the local size, and the
+    // kernels use get_global_size() for the image size so it can't be padded either.
+    size_t items = 1;
+    for (int i = 0; i < work_dim; i++)
+    {
+        if (globalWorkSize && globalWorkSize[i] % local[i] != 0) return false;
+        items *= local[i];
+    }
+    return maxWorkGroup_[k] == 0 || items <= maxWorkGroup_[k];
+}
+
+ocl_tune_entry_t& ocl_tuner_t::entry(int k, int size_class)
+{
+    ocl_tune_entry_t &e = entries_[tune_key(k, size_class)];
+    if (e.time.empty())
+    {
+        const int count = candidateCount(size_class);
+        e.time.assign(count, DBL_MAX);
+        e.runs.assign(count, 0);
+    }
+    return e;
+}
+
+bool ocl_tuner_t::localSize(cl_kernel kernel, cl_uint work_dim, const size_t *globalWorkSize, size_t local[3], ocl_tune_launch_t *launch)
+{
+    launch->candidate = -1;
+    launch->timed = false;
+    if (!enabled || work_dim > 2) return false;
+
+    const int k = kernelIndex(kernel);
+    if (k < 0) return false;
+
+    const int size_class = SizeClass(work_dim, globalWorkSize);
+    ocl_tune_entry_t &e = entry(k, size_class);
+    const int count = candidateCount(size_class);
+
+    int c = e.best;
+    if (c < 0)
+    {
+        c = 0;
+        while (e.next < count * kSamplesPerCandidate)
+        {
+            int next = e.next++ % count;
+            if (e.runs[next] >= 0 && isValid(k, size_class, next, globalWorkSize))
+            {
+                c = next;
+                launch->timed = true;
+                break;
+            }
+        }
+    }
+
+    launch->kernel = k;
+    launch->size_class = size_class;
+    launch->candidate = c;
+
+    // The winner of the size class may not divide this exact global size.
+    if (c == 0 || !isValid(k, size_class, c, globalWorkSize)) return false;
+
+    const size_t *size = candidate(size_class, c);
+    local[0] = size[0];
+    local[1] = size[1];
+    local[2] = 1;
+    return true;
+}
+
+void ocl_tuner_t::addSample(const ocl_tune_launch_t &launch)
+{
+    entry(launch.kernel, launch.size_class).pending++;
+    samples_.push_back(launch);
+}
+
+void ocl_tuner_t::reject(const ocl_tune_launch_t &launch)
+{
+    if (launch.candidate <= 0) return;
+
+    ocl_tune_entry_t &e = entry(launch.kernel, launch.size_class);
+    e.runs[launch.candidate] = -1;
+    if (e.best == launch.candidate)
+    {
+        e.best = 0;
+        dirty_ = true;
+    }
+}
+
+void ocl_tuner_t::collect()
+{
+    for (size_t i = 0; i < samples_.size(); i++)
+    {
+        ocl_tune_launch_t &s = samples_[i];
+        ocl_tune_entry_t &e = entry(s.kernel, s.size_class);
+
+        cl_ulong start = 0, end = 0;
+        cl_int err = clGetEventProfilingInfo(s.ev, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+        if (CL_SUCCESS == err)
+        {
+            err = clGetEventProfilingInfo(s.ev, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+        }
+        if (CL_SUCCESS == err && e.runs[s.candidate] >= 0)
+        {
+            double us = (end - start) / 1000.0;
+            if (us < e.time[s.candidate]) e.time[s.candidate] = us;
+            e.runs[s.candidate]++;
+        }
+        clReleaseEvent(s.ev);
+        e.pending--;
+
+        decide(e);
+    }
+    samples_.clear();
+}
+
+void ocl_tuner_t::decide(ocl_tune_entry_t &e)
+{
+    const int count = (int)e.time.size();
+    if (e.best >= 0 || e.pending > 0 || e.next < count * kSamplesPerCandidate) return;
+
+    e.best = 0;
+    for (int c = 1; c < count; c++)
+    {
+        if (e.runs[c] > 0 && (e.runs[e.best] <= 0 || e.time[c] < e.time[e.best]))
+        {
+            e.best = c;
+        }
+    }
+    dirty_ = true;
+}
+
+int ocl_tuner_t::untuned() const
+{
+    int count = 0;
+    for (std::map<tune_key, ocl_tune_entry_t>::const_iterator iter = entries_.begin(); iter != entries_.end(); iter++)
+    {
+        if (iter->second.best < 0) count++;
+    }
+    return count;
+}
+
+std::string ocl_tuner_t::fileName() const
+{
+    const char *name = getenv("GUETZLI_CL_TUNE_FILE");
+    if (name && *name) return name;
+
+    const char *home = getenv("HOME");
+    if (!home) home = getenv("USERPROFILE");
+    if (home && *home) return std::string(home) + "/.guetzli_cltune";
+
+    return "guetzli_cltune.txt";
+}
+
+// File format, one section per device:
+//   device <name> | <driver version>
+//   <kernel function name> <size class> <local x> <local y>
+bool ocl_tuner_t::load()
+{
+    FILE *f = fopen(fileName().c_str(), "r");
+    if (!f) return false;
+
+    bool match = false;
+    char line[1024];
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (strncmp(line, "device ", 7) == 0)
+        {
+            match = identity_ == line + 7;
+            continue;
+        }
+        if (!match) continue;
+
+        char name[256];
+        int size_class = 0;
+        unsigned long lx = 0, ly = 0;
+        if (sscanf(line, "%255s %d %lu %lu", name, &size_class, &lx, &ly) != 4) continue;
+
+        for (size_t k = 0; k < names_.size(); k++)
+        {
+            if (names_[k] != name) continue;
+
+            ocl_tune_entry_t &e = entry((int)k, size_class);
+            for (int c = 0; c < candidateCount(size_class); c++)
+            {
+                const size_t *local = candidate(size_class, c);
+                if (local[0] == lx && local[1] == ly && isValid((int)k, size_class, c, NULL))
+                {
+                    e.best = c;
+                }
+            }
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+bool ocl_tuner_t::save()
+{
+    if (!dirty_) return true;
+
+    // Keep the sections of other devices.
+    std::string others;
+    const std::string name = fileName();
+    FILE *f = fopen(name.c_str(), "r");
+    if (f)
+    {
+        bool match = false;
+        char line[1024];
+        while (fgets(line, sizeof(line), f))
+        {
+            if (strncmp(line, "device ", 7) == 0)
+            {
+                std::string id(line + 7);
+                id.erase(id.find_last_not_of("\r\n") + 1);
+                match = identity_ == id;
+            }
+            if (!match) others += line;
+        }
+        fclose(f);
+    }
+
+    // Written to a temporary file and renamed into place, so another process
+    // reading or saving the file at once never sees it half written.
+    static std::atomic<unsigned> counter(0);
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".tmp.%d.%u", (int)getpid(), counter++);
+    const std::string tmp = name + suffix;
+    f = fopen(tmp.c_str(), "w");
+    if (!f)
+    {
+        LogError("Can't write OpenCL tuning file %s.\r\n", tmp.c_str());
+        return false;
+    }
+
+    fputs(others.c_str(), f);
+    fprintf(f, "device %s\n", identity_.c_str());
+    for (std::map<tune_key, ocl_tune_entry_t>::const_iterator iter = entries_.begin(); iter != entries_.end(); iter++)
+    {
+        const ocl_tune_entry_t &e = iter->second;
+        if (e.best < 0) continue;
+
+        const size_t *local = candidate(iter->first.second, e.best);
+        fprintf(f, "%s %d %lu %lu\n", names_[iter->first.first].c_str(), iter->first.second,
+            (unsigned long)local[0], (unsigned long)local[1]);
+    }
+    const bool written = !ferror(f);
+    if (fclose(f) != 0 || !written)
+    {
+        LogError("Can't write OpenCL tuning file %s.\r\n", tmp.c_str());
+        remove(tmp.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    const bool renamed = MoveFileExA(tmp.c_str(), name.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    const bool renamed = rename(tmp.c_str(), name.c_str()) == 0;
+#endif
+    if (!renamed)
+    {
+        LogError("Can't replace OpenCL tuning file %s.\r\n", name.c_str());
+        remove(tmp.c_str());
+        return false;
+    }
+
+    dirty_ = false;
+    return true;
+}
+
+void ocl_tuner_t::report(FILE *f) const
+{
+    fprintf(f, "OpenCL work-group sizes for %s\n", identity_.c_str());
+    fprintf(f, "  %-32s %-10s %-8s %s\n", "kernel", "size", "best", "time per candidate (us)");
+
+    for (std::map<tune_key, ocl_tune_entry_t>::const_iterator iter = entries_.begin(); iter != entries_.end(); iter++)
+    {
+        const int size_class = iter->first.second;
+        const ocl_tune_entry_t &e = iter->second;
+
+        char size[32];
+        snprintf(size, sizeof(size), "%dD 2^%d", size_class / 64, size_class % 64);
+
+        char best[32] = "-";
+        if (e.best == 0)
+        {
+            snprintf(best, sizeof(best), "driver");
+        }
+        else if (e.best > 0)
+        {
+            const size_t *local = candidate(size_class, e.best);
+            snprintf(best, sizeof(best), "%lux%lu", (unsigned long)local[0], (unsigned long)local[1]);
+        }
+
+        fprintf(f, "  %-32s %-10s %-8s", names_[iter->first.first].c_str(), size, best);
+        for (size_t c = 0; c < e.time.size(); c++)
+        {
+            if (e.runs[c] <= 0) continue;
+
+            const size_t *local = candidate(size_class, (int)c);
+            if (c == 0)
+                fprintf(f, " driver:%.1f", e.time[c]);
+            else
+                fprintf(f, " %lux%lu:%.1f", (unsigned long)local[0], (unsigned long)local[1], e.time[c]);
+        }
+        fprintf(f, "\n");
+    }
+}
+
+#endif
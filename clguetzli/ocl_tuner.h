@@ -0,0 +1,89 @@
+/*
+* OpenCL work-group size tuner
+*
+* Every kernel launch that leaves the local work size to the driver is routed
+* through ocl_tuner_t. The first launches of a kernel in a given global size
+* class try the candidate local sizes in turn and are timed with the profiling
+* events of the command queue, later launches use the fastest one. Results are
+* persisted per device, so the sweep only happens once per device.
+*/
+#pragma once
+
+#ifdef __USE_OPENCL__
+
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "CL/cl.h"
+
+struct ocl_tune_entry_t
+{
+    ocl_tune_entry_t() : best(-1), next(0), pending(0) {}
+
+    int best;                   // winning candidate, -1 while still tuning
+    int next;                   // next launch slot of the sweep
+    int pending;                // timed launches not collected yet
+    std::vector<double> time;   // fastest time per candidate in us
+    std::vector<int>    runs;   // timed launches per candidate, -1 if invalid for the device
+};
+
+struct ocl_tune_launch_t
+{
+    ocl_tune_launch_t() : kernel(-1), size_class(0), candidate(-1), timed(false), ev(NULL) {}
+
+    int      kernel;
+    int      size_class;
+    int      candidate;         // the local size picked by the tuner, -1 for none
+    bool     timed;             // the launch is part of the sweep and must be timed
+    cl_event ev;
+};
+
+struct ocl_tuner_t
+{
+    ocl_tuner_t();
+    ~ocl_tuner_t();
+
+    void init(cl_device_id device, const cl_kernel *kernels, int count);
+
+    // Sets |local| to the local work size for the launch and returns true, false lets the
+    // driver choose.
+    bool localSize(cl_kernel kernel, cl_uint work_dim, const size_t *globalWorkSize, size_t local[3], ocl_tune_launch_t *launch);
+    void addSample(const ocl_tune_launch_t &launch);
+    // The device refused the candidate, never try it again. A decided size falls back to the
+    // driver's choice.
+    void reject(const ocl_tune_launch_t &launch);
+    // Reads back the timings of finished launches, call after clFinish.
+    void collect();
+
+    int  untuned() const;
+    bool load();
+    // Writes the decided sizes, if any changed. Call it once the queue is idle, the
+    // destructor doesn't.
+    bool save();
+    void report(FILE *f) const;
+
+    bool enabled;
+
+private:
+    typedef std::pair<int, int> tune_key;
+
+    int  kernelIndex(cl_kernel kernel) const;
+    int  candidateCount(int size_class) const;
+    const size_t* candidate(int size_class, int c) const;
+    bool isValid(int k, int size_class, int c, const size_t *globalWorkSize) const;
+    ocl_tune_entry_t& entry(int k, int size_class);
+    void decide(ocl_tune_entry_t &e);
+    std::string fileName() const;
+
+    cl_device_id                        device_;
+    std::vector<cl_kernel>              kernels_;
+    std::vector<std::string>            names_;
+    std::vector<size_t>                 maxWorkGroup_;
+    std::string                         identity_;
+    std::map<tune_key, ocl_tune_entry_t> entries_;
+    std::vector<ocl_tune_launch_t>      samples_;
+    bool                                dirty_;
+};
+
+#endif
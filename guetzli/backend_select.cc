@@ -0,0 +1,360 @@
+/*
+ * Benchmark-driven choice of the backend for --auto.
+ */
+
+#include "guetzli/backend_select.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "clguetzli/clguetzli.h"
+#include "guetzli/cpu_dispatch.h"
+#include "guetzli/encoder.h"
+#ifdef __USE_OPENCL__
+#include "clguetzli/ocl.h"
+#endif
+#ifdef __USE_CUDA__
+#include "clguetzli/ocu.h"
+#endif
+
+namespace guetzli {
+
+namespace {
+
+// The edge of the calibration image of each size class. Smaller than the
+// images of the class so that a calibration takes seconds, but large enough
+// that the fixed costs of the GPU backends weigh as they do there.
+const int kCalibrationEdge[kSizeClassCount] = {64, 160, 320};
+
+const char* ModeName(int mode) {
+  switch (mode) {
+    case MODE_CPU: return "cpu";
+    case MODE_CPU_OPT: return "cpu_opt";
+    case MODE_OPENCL: return "opencl";
+    case MODE_CUDA: return "cuda";
+  }
+  return "unknown";
+}
+
+bool ParseMode(const char* name, int* mode) {
+  for (int m : {MODE_CPU, MODE_CPU_OPT, MODE_OPENCL, MODE_CUDA}) {
+    if (!strcmp(name, ModeName(m))) {
+      *mode = m;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether the backend of |mode| can run here. The MSVC builds load the
+// OpenCL and CUDA DLLs lazily, a missing one raises an SEH exception on the
+// first call; that needs a function without C++ objects to unwind.
+bool ProbeBackend(int mode) {
+#ifdef _MSC_VER
+  __try {
+#endif
+#ifdef __USE_OPENCL__
+    if (mode == MODE_OPENCL) return supportsOpenCl();
+#endif
+#ifdef __USE_CUDA__
+    if (mode == MODE_CUDA) return supportsCuda();
+#endif
+    return mode == MODE_CPU || mode == MODE_CPU_OPT;
+#ifdef _MSC_VER
+  } __except (1 /* EXCEPTION_EXECUTE_HANDLER */) {
+    return false;
+  }
+#endif
+}
+
+// ProbeBackend(), once per backend: probing CUDA creates a context.
+bool BackendAvailable(int mode) {
+  static const bool available[] = {
+    ProbeBackend(MODE_CPU), ProbeBackend(MODE_CPU_OPT),
+    ProbeBackend(MODE_OPENCL), ProbeBackend(MODE_CUDA),
+  };
+  return mode >= 0 && mode <= MODE_CUDA && available[mode];
+}
+
+// Smooth gradients with noise and a few edges, so that the search runs as
+// on a photo. Deterministic.
+std::vector<uint8_t> CalibrationImage(int edge) {
+  std::vector<uint8_t> rgb(3 * edge * edge);
+  uint32_t seed = 12345;
+  for (int y = 0; y < edge; ++y) {
+    for (int x = 0; x < edge; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        seed = seed * 1103515245 + 12345;
+        const int noise = static_cast<int>((seed >> 16) & 31) - 16;
+        int v = (x * (c + 1) + y * (3 - c)) * 255 / (3 * edge);
+        if (((x / 37) + (y / 29)) % 5 == 0) v = 255 - v;
+        v += noise;
+        rgb[3 * (y * edge + x) + c] = v < 0 ? 0 : (v > 255 ? 255 : v);
+      }
+    }
+  }
+  return rgb;
+}
+
+// Images per second of |workers| concurrent encodes of |rgb| with |encoder|,
+// 0 if one fails.
+double MeasureThroughput(const Encoder& encoder, const std::vector<uint8_t>& rgb,
+                         int edge, int workers) {
+  const Params params;
+  std::string out;
+  // Warms up the lookup tables, the kernels and the OpenCL tuner.
+  if (!encoder.Encode(params, rgb, edge, edge, &out)) return 0;
+
+  std::vector<char> ok(workers, 0);
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 1; i < workers; ++i) {
+    threads.emplace_back([&, i] {
+      std::string result;
+      ok[i] = encoder.Encode(params, rgb, edge, edge, &result);
+    });
+  }
+  ok[0] = encoder.Encode(params, rgb, edge, edge, &out);
+  for (size_t i = 0; i < threads.size(); ++i) threads[i].join();
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  for (int i = 0; i < workers; ++i) {
+    if (!ok[i]) return 0;
+  }
+  return seconds > 0 ? workers / seconds : 0;
+}
+
+std::string HostName() {
+#ifdef _WIN32
+  const char* name = getenv("COMPUTERNAME");
+  return name ? name : "localhost";
+#else
+  char name[256];
+  if (gethostname(name, sizeof(name)) != 0) return "localhost";
+  name[sizeof(name) - 1] = 0;
+  return name;
+#endif
+}
+
+// File format, one section per host:
+//   host <HostIdentity()>
+//   <size class> <workers> <backend> <backend workers> <images per second>
+bool LoadChoices(const std::string& identity, int workers,
+                 BackendChoice* choices, bool* found) {
+  FILE* f = fopen(BackendSelectFile().c_str(), "r");
+  if (!f) return false;
+  bool match = false;
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (!strncmp(line, "host ", 5)) {
+      match = identity == line + 5;
+      continue;
+    }
+    if (!match) continue;
+    char size_class[32], backend[32];
+    int line_workers, backend_workers;
+    double images_per_s;
+    if (sscanf(line, "%31s %d %31s %d %lf", size_class, &line_workers, backend,
+               &backend_workers, &images_per_s) != 5 ||
+        line_workers != workers) {
+      continue;
+    }
+    int c = 0;
+    while (c < kSizeClassCount &&
+           strcmp(size_class, SizeClassName(static_cast<SizeClass>(c)))) {
+      ++c;
+    }
+    BackendChoice choice;
+    // A backend that stopped working is calibrated again.
+    if (c == kSizeClassCount || !ParseMode(backend, &choice.mode) ||
+        !BackendAvailable(choice.mode)) {
+      continue;
+    }
+    choice.workers = backend_workers < 1 ? 1 : backend_workers;
+    choice.images_per_s = images_per_s;
+    choices[c] = choice;
+    found[c] = true;
+  }
+  fclose(f);
+  return true;
+}
+
+// Replaces the lines of this host and worker count, keeps the others.
+bool SaveChoices(const std::string& identity, int workers,
+                 const BackendChoice* choices) {
+  const std::string name = BackendSelectFile();
+  std::string others, ours;
+  FILE* f = fopen(name.c_str(), "r");
+  if (f) {
+    bool match = false;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+      std::string text(line);
+      text.erase(text.find_last_not_of("\r\n") + 1);
+      if (!strncmp(line, "host ", 5)) {
+        match = identity == text.substr(5);
+        if (!match) others += text + "\n";
+        continue;
+      }
+      char size_class[32];
+      int line_workers;
+      if (match && sscanf(line, "%31s %d", size_class, &line_workers) == 2 &&
+          line_workers == workers) {
+        continue;
+      }
+      (match ? ours : others) += text + "\n";
+    }
+    fclose(f);
+  }
+
+  f = fopen(name.c_str(), "w");
+  if (!f) return false;
+  fputs(others.c_str(), f);
+  fprintf(f, "host %s\n", identity.c_str());
+  fputs(ours.c_str(), f);
+  for (int c = 0; c < kSizeClassCount; ++c) {
+    fprintf(f, "%s %d %s %d %.3f\n", SizeClassName(static_cast<SizeClass>(c)),
+            workers, ModeName(choices[c].mode), choices[c].workers,
+            choices[c].images_per_s);
+  }
+  return fclose(f) == 0;
+}
+
+}  // namespace
+
+SizeClass SizeClassOf(int width, int height) {
+  const double pixels = static_cast<double>(width) * height;
+  if (pixels <= 256 * 1024) return kSizeClassSmall;
+  if (pixels <= 2 * 1024 * 1024) return kSizeClassMedium;
+  return kSizeClassLarge;
+}
+
+const char* SizeClassName(SizeClass size_class) {
+  static const char* const kNames[kSizeClassCount] = {"small", "medium",
+                                                      "large"};
+  return size_class >= 0 && size_class < kSizeClassCount ? kNames[size_class]
+                                                         : "unknown";
+}
+
+BackendChoice CalibrateBackends(SizeClass size_class,
+                                const BackendSelectOptions& options) {
+  const int edge = kCalibrationEdge[size_class];
+  const std::vector<uint8_t> rgb = CalibrationImage(edge);
+  const int workers = options.workers < 1 ? 1 : options.workers;
+
+  // The single threaded CPU backend is the fallback, the others must beat it.
+  std::vector<BackendChoice> candidates(1);
+  candidates[0].mode = MODE_CPU_OPT;
+  if (workers > 1) {
+    candidates.push_back(BackendChoice());
+    candidates.back().mode = MODE_CPU_OPT;
+    candidates.back().workers = workers;
+  }
+  for (int mode : {MODE_OPENCL, MODE_CUDA}) {
+    if (!BackendAvailable(mode)) continue;
+    candidates.push_back(BackendChoice());
+    candidates.back().mode = mode;
+  }
+  // Nothing to choose from, e.g. a single encode without a GPU.
+  if (candidates.size() == 1) {
+    if (options.log) {
+      fprintf(options.log, "  %-6s %-8s only backend\n",
+              SizeClassName(size_class), ModeName(candidates[0].mode));
+    }
+    return candidates[0];
+  }
+  const int opencl_queues =
+      std::max<int>(1, options.opencl_devices.size()) *
+      std::max(1, options.opencl_queues);
+
+  BackendChoice best = candidates[0];
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    BackendChoice& candidate = candidates[i];
+    if (candidate.mode == MODE_OPENCL) {
+      candidate.workers = std::min(workers, opencl_queues);
+    }
+    {
+      const Encoder encoder(candidate.mode, options.opencl_devices,
+                            options.opencl_queues);
+      candidate.images_per_s =
+          MeasureThroughput(encoder, rgb, edge, candidate.workers);
+    }
+    if (options.log) {
+      fprintf(options.log, "  %-6s %dx%d %-8s x%-3d %8.3f images/s\n",
+              SizeClassName(size_class), edge, edge, ModeName(candidate.mode),
+              candidate.workers, candidate.images_per_s);
+    }
+    if (candidate.images_per_s > best.images_per_s) best = candidate;
+  }
+  return best;
+}
+
+bool SelectBackends(const BackendSelectOptions& options,
+                    BackendChoice* choices) {
+  std::string identity = HostIdentity();
+  if (BackendAvailable(MODE_OPENCL) &&
+      (!options.opencl_devices.empty() || options.opencl_queues > 1)) {
+    identity += " devices";
+    for (size_t i = 0; i < options.opencl_devices.size(); ++i) {
+      identity += (i ? "," : " ") + std::to_string(options.opencl_devices[i]);
+    }
+    identity += " x" + std::to_string(std::max(1, options.opencl_queues));
+  }
+  const int workers = options.workers < 1 ? 1 : options.workers;
+  bool found[kSizeClassCount] = {false};
+  if (!options.recalibrate) {
+    LoadChoices(identity, workers, choices, found);
+  }
+  bool calibrated = false;
+  for (int c = 0; c < kSizeClassCount; ++c) {
+    if (found[c]) continue;
+    if (!calibrated && options.log) {
+      fprintf(options.log, "Calibrating the backends of %s:\n",
+              identity.c_str());
+    }
+    choices[c] = CalibrateBackends(static_cast<SizeClass>(c), options);
+    calibrated = true;
+  }
+  return !calibrated || SaveChoices(identity, workers, choices);
+}
+
+std::string BackendSelectFile() {
+  const char* name = getenv("GUETZLI_BACKEND_FILE");
+  if (name && *name) return name;
+
+  const char* home = getenv("HOME");
+  if (!home) home = getenv("USERPROFILE");
+  if (home && *home) return std::string(home) + "/.guetzli_backend";
+
+  return "guetzli_backend.txt";
+}
+
+std::string HostIdentity() {
+  std::string identity = HostName();
+  char buf[64];
+  snprintf(buf, sizeof(buf), " | %u cpus %s",
+           std::thread::hardware_concurrency(),
+           CpuIsaName(DetectedCpuIsa()));
+  identity += buf;
+  for (int mode : {MODE_OPENCL, MODE_CUDA}) {
+    if (BackendAvailable(mode)) {
+      identity += " ";
+      identity += ModeName(mode);
+    }
+  }
+  return identity;
+}
+
+}  // namespace guetzli
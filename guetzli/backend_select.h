@@ -0,0 +1,80 @@
+/*
+ * Benchmark-driven choice of the backend for --auto.
+ *
+ * Which backend encodes fastest depends on the host (a GPU and its driver,
+ * the number of cores) and on the image size: the fixed cost of the OpenCL
+ * and CUDA setup and transfers only pays off on larger images. For each
+ * image size class, SelectBackends() encodes a built-in synthetic image with
+ * every backend available here and picks the one with the highest
+ * throughput. The choices are kept per host in a small file, so the
+ * calibration runs once per host and worker count.
+ */
+
+#ifndef GUETZLI_BACKEND_SELECT_H_
+#define GUETZLI_BACKEND_SELECT_H_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace guetzli {
+
+// Images up to 0.25 MPix, up to 2 MPix, and larger.
+enum SizeClass {
+  kSizeClassSmall,
+  kSizeClassMedium,
+  kSizeClassLarge,
+  kSizeClassCount
+};
+
+SizeClass SizeClassOf(int width, int height);
+// "small", "medium" or "large".
+const char* SizeClassName(SizeClass size_class);
+
+// A backend and how many encodes it runs at once. The caller runs at most
+// the largest |workers| of its choices.
+struct BackendChoice {
+  int mode = -1;  // A MATH_MODE.
+  int workers = 1;
+  double images_per_s = 0;  // Of the calibration image, 0 if not measured.
+};
+
+struct BackendSelectOptions {
+  // Encodes the caller runs at once, e.g. --jobs in batch mode. The CPU
+  // backend is also measured with this many concurrent encodes; the GPU
+  // backends serialize them on their device.
+  int workers = 1;
+  // Calibrates again even if the file has the choices of this host.
+  bool recalibrate = false;
+  // The calibration results, nullptr for none.
+  FILE* log = nullptr;
+  // The OpenCL devices and queues per device of the encoder, see
+  // guetzli::Encoder. The OpenCL backend is measured with as many concurrent
+  // encodes as it has queues, up to |workers|.
+  std::vector<int> opencl_devices;
+  int opencl_queues = 1;
+};
+
+// Fills choices[kSizeClassCount]. Reads them from BackendSelectFile() and
+// calibrates the size classes that are missing there, then saves them. The
+// choices are kept per HostIdentity() and OpenCL device selection.
+// False if the file could not be written, the choices are valid anyway.
+bool SelectBackends(const BackendSelectOptions& options,
+                    BackendChoice* choices);
+
+// Measures every backend available here on the calibration image of
+// |size_class| and returns the fastest. A single candidate is returned
+// without measuring it.
+BackendChoice CalibrateBackends(SizeClass size_class,
+                                const BackendSelectOptions& options);
+
+// $GUETZLI_BACKEND_FILE, else ~/.guetzli_backend.
+std::string BackendSelectFile();
+
+// The host name, CPU and the GPU backends that are usable: a file shared by
+// a fleet keeps one section per identity.
+std::string HostIdentity();
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_BACKEND_SELECT_H_
@@ -0,0 +1,370 @@
+/*
+ * Batch mode of the command line tool.
+ */
+
+#include "guetzli/batch.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "guetzli/input_file.h"
+#include "guetzli/memory_scheduler.h"
+
+namespace guetzli {
+
+namespace {
+
+// The I/O stage of batch mode. Its threads open and read the inputs of the
+// next |read_ahead| jobs before the workers get to them and write finished
+// outputs behind them, so the latency of open/read/write on slow storage
+// overlaps with encoding. Writes go before reads, as they free memory.
+class BatchIo {
+ public:
+  // |done| is called on an I/O thread once a job's output is written.
+  BatchIo(std::vector<BatchJob>* jobs, int read_ahead,
+          const std::function<void(BatchJob*)>& done)
+      : jobs_(jobs), read_ahead_(read_ahead), done_(done),
+        inputs_(jobs->size()), ready_(jobs->size(), false) {
+    const int num_threads = std::max(1, std::min(read_ahead, kMaxIoThreads));
+    for (int i = 0; i < num_threads; ++i) {
+      threads_.push_back(std::thread([this]() { Run(); }));
+    }
+  }
+
+  // Finishes the queued writes.
+  ~BatchIo() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+      work_cv_.notify_all();
+    }
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      threads_[i].join();
+    }
+  }
+
+  // Waits for the input of job |index|. Returns nullptr if it couldn't be
+  // read, with the reason in the job's error.
+  std::unique_ptr<InputFile> TakeInput(size_t index) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++taken_;
+    work_cv_.notify_all();
+    ready_cv_.wait(lock, [&]() { return ready_[index] != 0; });
+    return std::move(inputs_[index]);
+  }
+
+  // Queues |out_data|, which is taken over, for the output of job |index|.
+  void Write(size_t index, std::string* out_data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writes_.push_back(std::make_pair(index, std::string()));
+    writes_.back().second.swap(*out_data);
+    work_cv_.notify_one();
+  }
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      if (!writes_.empty()) {
+        std::pair<size_t, std::string> write;
+        write.first = writes_.front().first;
+        write.second.swap(writes_.front().second);
+        writes_.pop_front();
+        lock.unlock();
+        BatchJob* job = &(*jobs_)[write.first];
+        if (WriteFile(job->output.c_str(), write.second, &job->error)) {
+          job->output_size = write.second.size();
+          job->ok = true;
+        }
+        done_(job);
+        lock.lock();
+      } else if (next_read_ < jobs_->size() &&
+                 next_read_ < taken_ + read_ahead_) {
+        const size_t index = next_read_++;
+        lock.unlock();
+        BatchJob* job = &(*jobs_)[index];
+        std::unique_ptr<InputFile> input(new InputFile);
+        if (input->Open(job->input.c_str(), &job->error)) {
+          input->Populate();
+        } else {
+          input.reset();
+        }
+        lock.lock();
+        inputs_[index] = std::move(input);
+        ready_[index] = 1;
+        ready_cv_.notify_all();
+      } else if (stopped_) {
+        return;
+      } else {
+        work_cv_.wait(lock);
+      }
+    }
+  }
+
+  std::vector<BatchJob>* jobs_;
+  const size_t read_ahead_;
+  const std::function<void(BatchJob*)> done_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable ready_cv_;
+  std::vector<std::unique_ptr<InputFile> > inputs_;
+  std::vector<char> ready_;
+  std::deque<std::pair<size_t, std::string> > writes_;
+  size_t next_read_ = 0;
+  size_t taken_ = 0;
+  bool stopped_ = false;
+  std::vector<std::thread> threads_;
+};
+
+// Encodes job |index|. Failures, including running out of memory, only fail
+// this job. With |io| the input comes from its read-ahead and the output is
+// written behind. Returns whether the job is finished here, i.e. it failed
+// or was written synchronously. Otherwise the job belongs to the I/O thread
+// once the output is handed to it, and its time excludes the write.
+bool RunBatchJob(const ImagePipeline& process, const EncodeOptions& options,
+                 std::vector<BatchJob>* jobs, size_t index,
+                 MemoryScheduler* scheduler, BatchIo* io) {
+  BatchJob* job = &(*jobs)[index];
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  try {
+    std::unique_ptr<InputFile> input;
+    if (io) {
+      input = io->TakeInput(index);
+    } else {
+      input.reset(new InputFile);
+      if (!input->Open(job->input.c_str(), &job->error)) input.reset();
+    }
+    std::string out_data;
+    if (job->input == job->output) {
+      job->error = "output would overwrite the input";
+    } else if (input) {
+      job->input_size = input->view().size;
+      ProcessResult result = process(input->view(), options, &out_data,
+                                     job->input.c_str(), scheduler);
+      input.reset();
+      if (result == NotSupported) {
+        job->error = "unknown file format";
+      } else if (result == ProcessFailed) {
+        job->error = "processing failed";
+      } else if (io) {
+        job->seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        io->Write(index, &out_data);
+        return false;
+      } else if (WriteFile(job->output.c_str(), out_data, &job->error)) {
+        job->output_size = out_data.size();
+        job->ok = true;
+      }
+    }
+  } catch (const std::bad_alloc&) {
+    job->error = "insufficient memory";
+  } catch (const std::exception& e) {
+    job->error = e.what();
+  }
+  job->seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  return true;
+}
+
+void WriteBatchSummary(FILE* f, const EncoderSet& encoders,
+                       const std::vector<BatchJob>& jobs, int num_workers,
+                       double seconds) {
+  size_t ok = 0, input_size = 0, output_size = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    if (!jobs[i].ok) continue;
+    ++ok;
+    input_size += jobs[i].input_size;
+    output_size += jobs[i].output_size;
+  }
+  fprintf(f, "Batch: %zu images, %zu encoded, %zu failed, %d workers, %.2f s"
+          " (%.2f images/s)\n", jobs.size(), ok, jobs.size() - ok, num_workers,
+          seconds, seconds > 0 ? jobs.size() / seconds : 0.0);
+  fprintf(f, "Input %zu bytes, output %zu bytes (%.1f%%)\n", input_size,
+          output_size, input_size ? 100.0 * output_size / input_size : 0.0);
+  encoders.WriteDeviceUsage(f, seconds);
+  if (ok != jobs.size()) {
+    fprintf(f, "Failed:\n");
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      if (!jobs[i].ok) {
+        fprintf(f, "  %s: %s\n", jobs[i].input.c_str(), jobs[i].error.c_str());
+      }
+    }
+  }
+}
+
+}  // namespace
+
+std::string BatchOutputName(const std::string& input,
+                            const std::string& out_dir) {
+  size_t slash = input.find_last_of("/\\");
+  size_t dot = input.find_last_of('.');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    dot = input.size();
+  }
+  if (out_dir.empty()) {
+    return input.substr(0, dot) + ".guetzli.jpg";
+  }
+  size_t begin = slash == std::string::npos ? 0 : slash + 1;
+  return out_dir + "/" + input.substr(begin, dot - begin) + ".jpg";
+}
+
+bool ReadBatchManifest(const char* filename, std::vector<BatchJob>* jobs) {
+  std::string data, error;
+  if (!ReadFile(filename, &data, &error)) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return false;
+  }
+  std::istringstream lines(data);
+  std::string line;
+  while (std::getline(lines, line)) {
+    line.erase(line.find_last_not_of("\r\n") + 1);
+    if (line.find_first_not_of(" \t") == std::string::npos || line[0] == '#') {
+      continue;
+    }
+
+    BatchJob job;
+    const size_t sep = line.find('\t');
+    job.input = line.substr(0, sep);
+    const size_t output = sep == std::string::npos
+                              ? std::string::npos
+                              : line.find_first_not_of('\t', sep);
+    job.output = output == std::string::npos ? BatchOutputName(job.input, "")
+                                             : line.substr(output);
+    jobs->push_back(job);
+  }
+  return true;
+}
+
+bool ReadBatchDirectory(const std::string& in_dir, const std::string& out_dir,
+                        std::vector<BatchJob>* jobs) {
+  std::vector<std::string> names;
+#ifdef _WIN32
+  WIN32_FIND_DATAA entry;
+  HANDLE find = FindFirstFileA((in_dir + "\\*").c_str(), &entry);
+  if (find == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "Can't read input directory %s\n", in_dir.c_str());
+    return false;
+  }
+  do {
+    if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+      names.push_back(entry.cFileName);
+    }
+  } while (FindNextFileA(find, &entry));
+  FindClose(find);
+#else
+  DIR* dir = opendir(in_dir.c_str());
+  if (!dir) {
+    perror("Can't read input directory");
+    return false;
+  }
+  while (struct dirent* entry = readdir(dir)) {
+    struct stat st;
+    std::string path = in_dir + "/" + entry->d_name;
+    if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+      names.push_back(entry->d_name);
+    }
+  }
+  closedir(dir);
+#endif
+  std::sort(names.begin(), names.end());
+  for (size_t i = 0; i < names.size(); ++i) {
+    BatchJob job;
+    job.input = in_dir + "/" + names[i];
+    job.output = BatchOutputName(names[i], out_dir);
+    jobs->push_back(job);
+  }
+  return true;
+}
+
+int RunBatch(const BatchOptions& options, const EncoderSet& encoders,
+             const ImagePipeline& process, std::vector<BatchJob>* jobs) {
+  int num_workers = encoders.LimitWorkers(options.workers, stderr);
+  num_workers = std::max(1, std::min<int>(num_workers, jobs->size()));
+
+  MemoryScheduler scheduler(num_workers > 1 ? options.memory_budget : 0,
+                            options.bytes_per_pixel,
+                            options.verbose ? stderr : nullptr);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::atomic<size_t> next(0);
+  std::mutex log_mutex;
+  size_t done = 0;
+
+  auto report = [&](BatchJob* job) {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    ++done;
+    if (!job->ok) {
+      fprintf(stderr, "[%zu/%zu] %s: %s\n", done, jobs->size(),
+              job->input.c_str(), job->error.c_str());
+    } else if (options.verbose) {
+      fprintf(stderr, "[%zu/%zu] %s -> %s: %zu bytes, %.2f s\n", done,
+              jobs->size(), job->input.c_str(), job->output.c_str(),
+              job->output_size, job->seconds);
+    }
+  };
+
+  {
+    std::unique_ptr<BatchIo> io;
+    if (options.prefetch > 0) {
+      io.reset(new BatchIo(jobs, options.prefetch, report));
+    }
+
+    auto worker = [&]() {
+      for (size_t i = next++; i < jobs->size(); i = next++) {
+        if (RunBatchJob(process, options.encode_options, jobs, i, &scheduler,
+                        io.get())) {
+          report(&(*jobs)[i]);
+        }
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_workers; ++i) {
+      threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); ++i) {
+      threads[i].join();
+    }
+    // Destroying io finishes the writes.
+  }
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  FILE* f = options.summary_file ? fopen(options.summary_file, "w") : stderr;
+  if (!f) {
+    perror("Can't open summary file for writing");
+    f = stderr;
+  }
+  WriteBatchSummary(f, encoders, *jobs, num_workers, seconds);
+  if (f != stderr) fclose(f);
+
+  for (size_t i = 0; i < jobs->size(); ++i) {
+    if (!(*jobs)[i].ok) return 1;
+  }
+  return 0;
+}
+
+}  // namespace guetzli
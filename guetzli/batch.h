@@ -0,0 +1,75 @@
+/*
+ * Batch mode: encodes many images in one process, so the OpenCL/CUDA
+ * context, the compiled kernels and the lookup tables are set up once.
+ *
+ * The jobs come from a manifest or an input directory and run on a pool of
+ * workers, admitted by a MemoryScheduler. An I/O stage reads the inputs of
+ * the next jobs ahead of the workers and writes the outputs behind them, so
+ * the latency of slow storage overlaps with encoding. A failure, including
+ * running out of memory, only fails its job; a summary follows the last one.
+ */
+
+#ifndef GUETZLI_BATCH_H_
+#define GUETZLI_BATCH_H_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "guetzli/encoder_set.h"
+#include "guetzli/image_pipeline.h"
+
+namespace guetzli {
+
+constexpr int kDefaultPrefetch = 4;
+constexpr int kMaxIoThreads = 8;
+
+struct BatchJob {
+  std::string input;
+  std::string output;
+  bool ok = false;
+  std::string error;
+  size_t input_size = 0;
+  size_t output_size = 0;
+  double seconds = 0.0;
+};
+
+// The output of |input|: input.guetzli.jpg next to it without |out_dir|,
+// else its base name with a .jpg extension in |out_dir|.
+std::string BatchOutputName(const std::string& input,
+                            const std::string& out_dir);
+
+// One job per line: "input<TAB>output", or just "input", which writes
+// input.guetzli.jpg next to it, as does an empty output. Only a tab
+// separates the paths, so they may contain spaces. Blank lines and lines
+// starting with '#' are skipped.
+bool ReadBatchManifest(const char* filename, std::vector<BatchJob>* jobs);
+
+// A job per regular file in |in_dir|, sorted by name, see BatchOutputName().
+bool ReadBatchDirectory(const std::string& in_dir, const std::string& out_dir,
+                        std::vector<BatchJob>* jobs);
+
+struct BatchOptions {
+  // Encodes at once, limited further by the encoders.
+  int workers = 1;
+  // Inputs read ahead, 0 to read and write on the workers.
+  int prefetch = kDefaultPrefetch;
+  // Memory of the concurrent encodes, 0 for no limit, and the starting point
+  // of their estimates, see MemoryScheduler.
+  size_t memory_budget = 0;
+  double bytes_per_pixel = 0;
+  EncodeOptions encode_options;
+  // The summary goes to stderr without one.
+  const char* summary_file = nullptr;
+  // Reports every job and the admissions, not only the failures.
+  bool verbose = false;
+};
+
+// Runs |jobs| through |process| with |encoders|. Returns the process exit
+// code.
+int RunBatch(const BatchOptions& options, const EncoderSet& encoders,
+             const ImagePipeline& process, std::vector<BatchJob>* jobs);
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_BATCH_H_
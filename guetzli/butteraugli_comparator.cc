@@ -58,6 +58,7 @@ ButteraugliComparator::ButteraugliComparator(const int width, const int height,
       stats_(stats) {}
 
 void ButteraugliComparator::Compare(const OutputImage& img) {
+  MemoryReservation planes(6 * sizeof(float) * width_ * height_);
   std::vector<std::vector<float> > rgb0 =
       ComputeOpsinDynamicsImage(width_, height_, rgb_orig_);
   std::vector<std::vector<float> > rgb(3, std::vector<float>(width_ * height_));
@@ -70,6 +71,8 @@ void ButteraugliComparator::Compare(const OutputImage& img) {
 }
 
 void ButteraugliComparator::StartBlockComparisons() {
+  MemoryReservation planes(3 * sizeof(float) * width_ * height_);
+  mask_xyz_memory_.Set(3 * sizeof(float) * width_ * height_);
   std::vector<std::vector<float> > dummy(3);
   std::vector<std::vector<float> > rgb0 =
       ComputeOpsinDynamicsImage(width_, height_, rgb_orig_);
@@ -80,6 +83,7 @@ void ButteraugliComparator::StartBlockComparisons() {
 
 void ButteraugliComparator::FinishBlockComparisons() {
   mask_xyz_.clear();
+  mask_xyz_memory_.Set(0);
 }
 
 void ButteraugliComparator::SwitchBlock(int block_x, int block_y,
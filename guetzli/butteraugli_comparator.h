@@ -23,6 +23,7 @@
 #include "clguetzli/clbutter_comparator.h"
 #include "guetzli/comparator.h"
 #include "guetzli/jpeg_data.h"
+#include "guetzli/memory_account.h"
 #include "guetzli/output_image.h"
 #include "guetzli/stats.h"
 
@@ -73,6 +74,7 @@ class ButteraugliComparator : public Comparator {
   int factor_x_;
   int factor_y_;
   std::vector<std::vector<float>> mask_xyz_;
+  MemoryReservation mask_xyz_memory_;
   std::vector<std::vector<std::vector<float>>> per_block_pregamma_;
   ::butteraugli::clButteraugliComparator comparator_;
   float distance_;
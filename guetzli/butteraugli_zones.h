@@ -0,0 +1,23 @@
+/*
+ * Butteraugli's PROFILER_FUNC and PROFILER_ZONE as detail zones of the
+ * guetzli profiler, see profiler.h.
+ *
+ * Butteraugli leaves the macros to the build when PROFILER_ENABLED is set,
+ * so this header is force-included rather than included by it:
+ *
+ *   make CPPFLAGS="-DPROFILER_ENABLED=1 -include guetzli/butteraugli_zones.h"
+ */
+
+#ifndef GUETZLI_BUTTERAUGLI_ZONES_H_
+#define GUETZLI_BUTTERAUGLI_ZONES_H_
+
+#include "guetzli/profiler.h"
+
+#define PROFILER_FUNC                                 \
+  ::guetzli::ScopedProfileZone profiler_zone_func(    \
+      __func__, ::guetzli::kProfileDetail)
+#define PROFILER_ZONE(name)                           \
+  ::guetzli::ScopedProfileZone profiler_zone(         \
+      name, ::guetzli::kProfileDetail)
+
+#endif  // GUETZLI_BUTTERAUGLI_ZONES_H_
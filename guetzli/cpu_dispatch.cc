@@ -0,0 +1,166 @@
+/*
+ * Runtime selection of the SIMD instruction set of the CPU kernels.
+ */
+
+#include "guetzli/cpu_dispatch.h"
+
+#include <string.h>
+
+#include <atomic>
+
+#if GUETZLI_CPU_X86
+#ifdef _MSC_VER
+#include <immintrin.h>
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace guetzli {
+
+// The tables of cpu_kernels_*.cc.
+extern const CpuKernels kCpuKernelsBaseline;
+#if GUETZLI_CPU_X86
+extern const CpuKernels kCpuKernelsSse42;
+extern const CpuKernels kCpuKernelsAvx2;
+extern const CpuKernels kCpuKernelsAvx512;
+#endif
+
+namespace {
+
+const char* const kCpuIsaNames[kCpuIsaCount] = {
+  "baseline", "sse4.2", "avx2", "avx512",
+};
+
+#if GUETZLI_CPU_X86
+
+void CpuId(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+#ifdef _MSC_VER
+  int out[4];
+  __cpuidex(out, static_cast<int>(leaf), static_cast<int>(subleaf));
+  for (int i = 0; i < 4; ++i) regs[i] = static_cast<uint32_t>(out[i]);
+#else
+  __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// The register state the OS saves on context switches, XCR0.
+uint64_t XGetBv() {
+#ifdef _MSC_VER
+  return _xgetbv(0);
+#else
+  uint32_t eax, edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+bool HasBits(uint32_t reg, uint32_t bits) { return (reg & bits) == bits; }
+
+CpuIsa Detect() {
+  uint32_t regs[4];
+  CpuId(0, 0, regs);
+  const uint32_t max_leaf = regs[0];
+  CpuId(0x80000000, 0, regs);
+  const uint32_t max_ext_leaf = regs[0];
+  if (max_leaf < 1) return kCpuIsaBaseline;
+
+  CpuId(1, 0, regs);
+  const uint32_t ecx1 = regs[2];
+  // SSE4.2 and POPCNT.
+  if (!HasBits(ecx1, (1u << 20) | (1u << 23))) return kCpuIsaBaseline;
+
+  // AVX needs the OS to save the YMM registers: OSXSAVE, then XCR0 bits 1-2.
+  if (!HasBits(ecx1, (1u << 27) | (1u << 28)) || max_leaf < 7 ||
+      !HasBits(static_cast<uint32_t>(XGetBv()), 0x6)) {
+    return kCpuIsaSse42;
+  }
+  CpuId(7, 0, regs);
+  const uint32_t ebx7 = regs[1];
+  uint32_t ecx_ext = 0;
+  if (max_ext_leaf >= 0x80000001) {
+    CpuId(0x80000001, 0, regs);
+    ecx_ext = regs[2];
+  }
+  // FMA; AVX2, BMI1 and BMI2; LZCNT.
+  if (!HasBits(ecx1, 1u << 12) ||
+      !HasBits(ebx7, (1u << 3) | (1u << 5) | (1u << 8)) ||
+      !HasBits(ecx_ext, 1u << 5)) {
+    return kCpuIsaSse42;
+  }
+
+  // AVX-512 F, DQ, CD, BW and VL, and the OS saving the opmask and ZMM
+  // registers: XCR0 bits 5-7.
+  if (!HasBits(ebx7, (1u << 16) | (1u << 17) | (1u << 28) | (1u << 30) |
+                         (1u << 31)) ||
+      !HasBits(static_cast<uint32_t>(XGetBv()), 0xe6)) {
+    return kCpuIsaAvx2;
+  }
+  return kCpuIsaAvx512;
+}
+
+#else
+
+CpuIsa Detect() { return kCpuIsaBaseline; }
+
+#endif
+
+const CpuKernels* KernelsFor(CpuIsa isa) {
+  switch (isa) {
+#if GUETZLI_CPU_X86
+    case kCpuIsaAvx512: return &kCpuKernelsAvx512;
+    case kCpuIsaAvx2: return &kCpuKernelsAvx2;
+    case kCpuIsaSse42: return &kCpuKernelsSse42;
+#endif
+    default: return &kCpuKernelsBaseline;
+  }
+}
+
+std::atomic<int> max_isa(kCpuIsaCount - 1);
+// The table of ActiveCpuIsa(), null until the first kernel call after a
+// change of max_isa.
+std::atomic<const CpuKernels*> active_kernels(nullptr);
+
+}  // namespace
+
+const char* CpuIsaName(CpuIsa isa) {
+  return isa >= 0 && isa < kCpuIsaCount ? kCpuIsaNames[isa] : "unknown";
+}
+
+bool ParseCpuIsa(const char* name, CpuIsa* isa) {
+  for (int i = 0; i < kCpuIsaCount; ++i) {
+    if (!strcmp(name, kCpuIsaNames[i])) {
+      *isa = static_cast<CpuIsa>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+CpuIsa DetectedCpuIsa() {
+  static const CpuIsa detected = Detect();
+  return detected;
+}
+
+CpuIsa ActiveCpuIsa() {
+  const CpuIsa detected = DetectedCpuIsa();
+  const int cap = max_isa.load(std::memory_order_relaxed);
+  return detected < cap ? detected : static_cast<CpuIsa>(cap);
+}
+
+void SetMaxCpuIsa(CpuIsa isa) {
+  max_isa.store(isa, std::memory_order_relaxed);
+  active_kernels.store(nullptr, std::memory_order_release);
+}
+
+const CpuKernels& GetCpuKernels() {
+  const CpuKernels* kernels = active_kernels.load(std::memory_order_acquire);
+  if (!kernels) {
+    kernels = KernelsFor(ActiveCpuIsa());
+    active_kernels.store(kernels, std::memory_order_release);
+  }
+  return *kernels;
+}
+
+}  // namespace guetzli
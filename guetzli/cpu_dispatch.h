@@ -0,0 +1,82 @@
+/*
+ * Runtime selection of the SIMD instruction set of the CPU kernels.
+ *
+ * The hot loops of the encoder and of the CPU_OPT Butteraugli are compiled
+ * once per instruction set, each in its own translation unit built with that
+ * set enabled (cpu_kernels_*.cc, all including cpu_kernels.inc), so that one
+ * binary runs on every x86-64 host and still uses AVX2 or AVX-512 where
+ * present. The best set the CPU and the OS support is detected with cpuid
+ * once, the first time a kernel is called.
+ *
+ * All variants compute the same results bit for bit: they are the same code,
+ * and the per-ISA units are built without floating point contraction.
+ */
+
+#ifndef GUETZLI_CPU_DISPATCH_H_
+#define GUETZLI_CPU_DISPATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "guetzli/jpeg_data.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+    defined(_M_IX86)
+#define GUETZLI_CPU_X86 1
+#else
+#define GUETZLI_CPU_X86 0
+#endif
+
+namespace guetzli {
+
+// In increasing order, each level includes the ones before it.
+enum CpuIsa {
+  kCpuIsaBaseline,  // SSE2 on x86-64, whatever the compiler targets else.
+  kCpuIsaSse42,     // SSE4.2 and POPCNT.
+  kCpuIsaAvx2,      // AVX2, FMA, BMI1, BMI2 and LZCNT.
+  kCpuIsaAvx512,    // AVX-512 F, BW, CD, DQ and VL.
+  kCpuIsaCount
+};
+
+// "baseline", "sse4.2", "avx2" or "avx512".
+const char* CpuIsaName(CpuIsa isa);
+// Sets *isa to the level called |name|, false if there is none.
+bool ParseCpuIsa(const char* name, CpuIsa* isa);
+
+// The best level of this host.
+CpuIsa DetectedCpuIsa();
+// The level the kernels use: the detected one, unless capped below.
+CpuIsa ActiveCpuIsa();
+// Caps the level, e.g. to reproduce the results or the speed of an older
+// host. Takes effect for the kernel calls that follow.
+void SetMaxCpuIsa(CpuIsa isa);
+
+struct CpuKernels {
+  // See ComputeBlockDCT() and ComputeBlockIDCT().
+  void (*compute_block_dct)(coeff_t* coeffs);
+  void (*compute_block_idct)(const coeff_t* block, uint8_t* out);
+  // The 8x8 interleaved RGB pixels of |rgb| to the Y, Cb and Cr blocks at
+  // out[0], out[64] and out[128], centered on 0.
+  void (*rgb_to_ycbcr_block)(const uint8_t* rgb, coeff_t* out);
+  // In place, |num_pixels| interleaved pixels.
+  void (*ycbcr_to_rgb)(uint8_t* pixels, size_t num_pixels);
+  // Adds the run length symbols of the AC coefficients of |block| to the
+  // JpegHistogram |counts|.
+  void (*update_ac_histogram)(const coeff_t* block, uint32_t* counts);
+  // The Butteraugli kernels of CPU_OPT: ConvolutionOpt(),
+  // ButteraugliFFTSquaredOpt() and the per pixel part of
+  // OpsinDynamicsImageOpt(), from the blurred planes to XYB in place.
+  void (*convolution)(size_t xsize, size_t ysize, size_t xstep, size_t len,
+                      size_t offset, const float* multipliers,
+                      const float* inp, float border_ratio, float* result);
+  void (*fft_squared)(float block[64]);
+  void (*opsin_dynamics)(const float* const blurred[3], float* const rgb[3],
+                         size_t size);
+};
+
+// The kernels of ActiveCpuIsa().
+const CpuKernels& GetCpuKernels();
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_CPU_DISPATCH_H_
@@ -0,0 +1,12 @@
+/*
+ * The CPU kernels for AVX2 and FMA. The build compiles this file with that set
+ * enabled; cpu_dispatch.cc only calls them on hosts that have it.
+ */
+
+#include "guetzli/cpu_dispatch.h"
+
+#if GUETZLI_CPU_X86
+#define GUETZLI_CPU_ISA avx2
+#define GUETZLI_CPU_KERNELS kCpuKernelsAvx2
+#include "guetzli/cpu_kernels.inc"
+#endif
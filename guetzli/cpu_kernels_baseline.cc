@@ -0,0 +1,7 @@
+/*
+ * The CPU kernels for the instruction set the compiler targets by default.
+ */
+
+#define GUETZLI_CPU_ISA baseline
+#define GUETZLI_CPU_KERNELS kCpuKernelsBaseline
+#include "guetzli/cpu_kernels.inc"
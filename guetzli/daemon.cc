@@ -0,0 +1,396 @@
+/*
+ * Daemon mode of the command line tool.
+ */
+
+#include "guetzli/daemon.h"
+
+#ifndef _WIN32
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "guetzli/memory_scheduler.h"
+#include "guetzli/quality.h"
+
+namespace guetzli {
+
+namespace {
+
+const char kDaemonRequestMagic[4] = { 'G', 'Z', 'Q', '3' };
+const char kDaemonResponseMagic[4] = { 'G', 'Z', 'R', '1' };
+constexpr uint32_t kDaemonMaxInputSize = 1u << 30;
+
+volatile sig_atomic_t g_daemonStop = 0;
+
+void DaemonSignalHandler(int) {
+  g_daemonStop = 1;
+}
+
+bool ReadFully(int fd, void* buf, size_t size) {
+  char* p = static_cast<char*>(buf);
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool WriteFully(int fd, const void* buf, size_t size) {
+  const char* p = static_cast<const char*>(buf);
+  while (size > 0) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Writes a frame: the magic, |fields| and |payload|, whose size is appended
+// to the fields.
+bool WriteFrame(int fd, const char magic[4], const int32_t* fields,
+                int num_fields, const InputView& payload) {
+  std::string header(magic, 4);
+  for (int i = 0; i <= num_fields; ++i) {
+    uint32_t v = htonl(i < num_fields ? static_cast<uint32_t>(fields[i])
+                                      : static_cast<uint32_t>(payload.size));
+    header.append(reinterpret_cast<const char*>(&v), sizeof(v));
+  }
+  return WriteFully(fd, header.data(), header.size()) &&
+         WriteFully(fd, payload.data, payload.size);
+}
+
+// Reads a frame written by WriteFrame. Returns false on end of stream, a
+// wrong magic or a payload over kDaemonMaxInputSize.
+bool ReadFrame(int fd, const char magic[4], int32_t* fields, int num_fields,
+               std::string* payload) {
+  char header[4 + 4 * 4];
+  const size_t header_size = 4 + 4 * (num_fields + 1);
+  if (!ReadFully(fd, header, header_size) || memcmp(header, magic, 4) != 0) {
+    return false;
+  }
+  for (int i = 0; i < num_fields; ++i) {
+    uint32_t v;
+    memcpy(&v, header + 4 + 4 * i, sizeof(v));
+    fields[i] = static_cast<int32_t>(ntohl(v));
+  }
+  uint32_t size;
+  memcpy(&size, header + 4 + 4 * num_fields, sizeof(size));
+  size = ntohl(size);
+  if (size > kDaemonMaxInputSize) return false;
+  payload->resize(size);
+  return size == 0 || ReadFully(fd, &(*payload)[0], size);
+}
+
+struct DaemonJob {
+  EncodeOptions options;
+  std::string in_data;
+  int32_t status = kDaemonOk;
+  std::string out_data;  // The JPEG, or the error message.
+  bool done = false;
+};
+
+// Bounded queue of encode jobs between the connection threads and the
+// workers.
+class DaemonQueue {
+ public:
+  explicit DaemonQueue(size_t capacity) : capacity_(capacity) {}
+
+  // Returns false if the queue is full or shutting down.
+  bool Push(DaemonJob* job) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopped_ || jobs_.size() >= capacity_) return false;
+    jobs_.push_back(job);
+    work_cv_.notify_one();
+    return true;
+  }
+
+  // Blocks for the next job. Returns nullptr once stopped and drained.
+  DaemonJob* Pop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    work_cv_.wait(lock, [this] { return stopped_ || !jobs_.empty(); });
+    if (jobs_.empty()) return nullptr;
+    DaemonJob* job = jobs_.front();
+    jobs_.pop_front();
+    return job;
+  }
+
+  void Finish(DaemonJob* job) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    job->done = true;
+    done_cv_.notify_all();
+  }
+
+  void Wait(DaemonJob* job) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [job] { return job->done; });
+  }
+
+  // Queued jobs still run, new ones are refused.
+  void Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    work_cv_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::deque<DaemonJob*> jobs_;
+  const size_t capacity_;
+  bool stopped_ = false;
+};
+
+void RunDaemonJob(const ImagePipeline& process, DaemonJob* job,
+                  MemoryScheduler* scheduler) {
+  try {
+    ProcessResult result = process(ViewOf(job->in_data), job->options,
+                                   &job->out_data, nullptr, scheduler);
+    if (result == NotSupported) {
+      job->status = kDaemonUnknownFormat;
+      job->out_data = "unknown file format";
+    } else if (result == ProcessFailed) {
+      job->status = kDaemonProcessFailed;
+      job->out_data = "processing failed";
+    }
+  } catch (const std::bad_alloc&) {
+    job->status = kDaemonOutOfMemory;
+    job->out_data = "insufficient memory";
+  } catch (const std::exception& e) {
+    job->status = kDaemonProcessFailed;
+    job->out_data = e.what();
+  }
+  std::string().swap(job->in_data);
+}
+
+class Daemon {
+ public:
+  Daemon(const DaemonOptions& options, int num_workers,
+         const EncoderSet& encoders, const ImagePipeline& process)
+      : options_(options), num_workers_(num_workers), encoders_(encoders),
+        process_(process), queue_(std::max(1, options.queue_size)),
+        scheduler_(num_workers > 1 ? options.memory_budget : 0,
+                   options.bytes_per_pixel,
+                   options.verbose ? stderr : nullptr) {}
+
+  // Serves |socket_path| until SIGINT or SIGTERM. Returns the process exit
+  // code.
+  int Run(const char* socket_path) {
+    int listen_fd = Listen(socket_path);
+    if (listen_fd < 0) return 1;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = DaemonSignalHandler;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < num_workers_; ++i) {
+      workers.push_back(std::thread(&Daemon::Worker, this));
+    }
+    fprintf(stderr, "Listening on %s with %d workers.\n", socket_path,
+            num_workers_);
+
+    while (!g_daemonStop) {
+      struct pollfd pfd = { listen_fd, POLLIN, 0 };
+      if (poll(&pfd, 1, 200) <= 0) continue;
+      int fd = accept(listen_fd, nullptr, nullptr);
+      if (fd < 0) continue;
+      std::lock_guard<std::mutex> lock(connections_mutex_);
+      connections_.insert(fd);
+      std::thread(&Daemon::Serve, this, fd).detach();
+    }
+
+    fprintf(stderr, "Shutting down.\n");
+    close(listen_fd);
+    unlink(socket_path);
+    {
+      // Let the requests in flight finish, but read no new ones.
+      std::unique_lock<std::mutex> lock(connections_mutex_);
+      for (std::set<int>::const_iterator it = connections_.begin();
+           it != connections_.end(); ++it) {
+        shutdown(*it, SHUT_RD);
+      }
+      connections_cv_.wait(lock, [this] { return connections_.empty(); });
+    }
+    queue_.Stop();
+    for (size_t i = 0; i < workers.size(); ++i) {
+      workers[i].join();
+    }
+    encoders_.WriteDeviceUsage(stderr, std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count());
+    return 0;
+  }
+
+ private:
+  static int Listen(const char* socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+      return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror("Can't create socket");
+      return -1;
+    }
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0) {
+      fprintf(stderr, "Another daemon is listening on %s\n", socket_path);
+      close(fd);
+      return -1;
+    }
+    unlink(socket_path);  // A stale socket of a daemon that died.
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+      perror("Can't listen on socket");
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  void Worker() {
+    while (DaemonJob* job = queue_.Pop()) {
+      RunDaemonJob(process_, job, &scheduler_);
+      queue_.Finish(job);
+    }
+  }
+
+  void Serve(int fd) {
+    int32_t fields[3];
+    DaemonJob job;
+    while (ReadFrame(fd, kDaemonRequestMagic, fields, 3, &job.in_data)) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      const size_t input_size = job.in_data.size();
+      job.options = options_.encode_options;
+      if (fields[0] != 0) job.options.quality = fields[0];
+      if (fields[1] != 0) job.options.memlimit_mb = fields[1];
+      // The daemon's own mode is its choice too, e.g. MODE_AUTO.
+      if (fields[2] != encoders_.mode()) job.options.backend = fields[2];
+      job.status = kDaemonOk;
+      job.out_data.clear();
+      job.done = false;
+      if (fields[0] != 0 && !ValidQuality(fields[0])) {
+        job.status = kDaemonBadRequest;
+        job.out_data = "quality out of range";
+      } else if (fields[1] < -1) {
+        job.status = kDaemonBadRequest;
+        job.out_data = "memory limit out of range";
+      } else if (job.options.backend != kBackendAny &&
+                 !encoders_.Find(job.options.backend)) {
+        job.status = kDaemonBadRequest;
+        job.out_data = "backend not available";
+      } else if (queue_.Push(&job)) {
+        queue_.Wait(&job);
+      } else {
+        job.status = kDaemonQueueFull;
+        job.out_data = "queue full";
+      }
+
+      if (job.status != kDaemonOk) {
+        fprintf(stderr, "Request of %zu bytes failed: %s\n", input_size,
+                job.out_data.c_str());
+      } else if (options_.verbose) {
+        fprintf(stderr, "Request of %zu bytes: %zu bytes, %.2f s\n", input_size,
+                job.out_data.size(), std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count());
+      }
+      const int32_t response[2] = {
+          job.status, job.options.backend != kBackendAny ? job.options.backend
+                                                         : encoders_.mode() };
+      if (!WriteFrame(fd, kDaemonResponseMagic, response, 2, ViewOf(job.out_data))) break;
+    }
+    close(fd);
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    connections_.erase(fd);
+    connections_cv_.notify_all();
+  }
+
+  const DaemonOptions options_;
+  const int num_workers_;
+  const EncoderSet& encoders_;
+  const ImagePipeline process_;
+  DaemonQueue queue_;
+  MemoryScheduler scheduler_;
+  std::mutex connections_mutex_;
+  std::condition_variable connections_cv_;
+  std::set<int> connections_;
+};
+
+}  // namespace
+
+int RunDaemon(const char* socket_path, const DaemonOptions& options,
+              const EncoderSet& encoders, const ImagePipeline& process) {
+  const int num_workers = encoders.LimitWorkers(options.workers, stderr);
+  Daemon daemon(options, num_workers, encoders, process);
+  return daemon.Run(socket_path);
+}
+
+int RunClient(const char* socket_path, const InputView& in_data,
+              const EncodeOptions& options, std::string* out_data) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 ||
+      connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+    perror("Can't connect to the daemon");
+    if (fd >= 0) close(fd);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  const int32_t request[3] = { options.quality, options.memlimit_mb,
+                               options.backend };
+  int32_t response[2];
+  if (!WriteFrame(fd, kDaemonRequestMagic, request, 3, in_data) ||
+      !ReadFrame(fd, kDaemonResponseMagic, response, 2, out_data)) {
+    fprintf(stderr, "Connection to the daemon failed\n");
+    close(fd);
+    return 1;
+  }
+  close(fd);
+  if (response[0] == kDaemonUnknownFormat) return 2;
+  if (response[0] != kDaemonOk) {
+    fprintf(stderr, "Daemon: %s\n", out_data->c_str());
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace guetzli
+
+#endif  // _WIN32
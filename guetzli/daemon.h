@@ -0,0 +1,81 @@
+/*
+ * Daemon mode: a long-running encoder listening on a UNIX domain socket, so
+ * the OpenCL/CUDA context, the compiled kernels, the device memory pools and
+ * the lookup tables stay warm across images. Not available on Windows.
+ *
+ * A connection carries any number of requests, each answered in order. All
+ * integers are 32-bit big-endian.
+ *   request:  "GZQ3" quality memlimit_mb backend size <size bytes of image>
+ *   response: "GZR1" status backend size <size bytes of JPEG or error text>
+ * quality 0 and memlimit_mb 0 use the daemon's settings, memlimit_mb -1
+ * disables the limit. Other qualities must be in [kLowestQuality,
+ * kHighestQuality], else the request fails with kDaemonBadRequest.
+ *
+ * backend is a MATH_MODE or kBackendAny. The daemon encodes with the
+ * encoders it was started with, see EncoderSet: kBackendAny or the daemon's
+ * own mode leave the choice to it, e.g. by image size with --auto, another
+ * backend must be one of its encoders, else the request fails with
+ * kDaemonBadRequest. The response names the requested backend, else the
+ * daemon's mode.
+ *
+ * The connection threads queue the requests for a pool of workers, admitted
+ * by a MemoryScheduler; a full queue fails the request with
+ * kDaemonQueueFull. SIGINT and SIGTERM let the requests in flight finish.
+ */
+
+#ifndef GUETZLI_DAEMON_H_
+#define GUETZLI_DAEMON_H_
+
+#ifndef _WIN32
+
+#include <stddef.h>
+#include <string>
+
+#include "guetzli/encoder_set.h"
+#include "guetzli/image_pipeline.h"
+#include "guetzli/input_file.h"
+
+namespace guetzli {
+
+constexpr int kDefaultDaemonQueue = 64;
+
+enum DaemonStatus {
+  kDaemonOk = 0,
+  kDaemonUnknownFormat = 1,
+  kDaemonProcessFailed = 2,
+  kDaemonBadRequest = 3,
+  kDaemonQueueFull = 4,
+  kDaemonOutOfMemory = 5,
+};
+
+struct DaemonOptions {
+  // Encodes at once, limited further by the encoders.
+  int workers = 1;
+  // Requests waiting for a worker.
+  int queue_size = kDefaultDaemonQueue;
+  // Memory of the concurrent encodes, 0 for no limit, and the starting point
+  // of their estimates, see MemoryScheduler.
+  size_t memory_budget = 0;
+  double bytes_per_pixel = 0;
+  // The settings of requests with quality or memlimit_mb 0.
+  EncodeOptions encode_options;
+  // Reports every request and the admissions, not only the failures.
+  bool verbose = false;
+};
+
+// Serves |socket_path| with |process| and |encoders| until SIGINT or
+// SIGTERM. Returns the process exit code.
+int RunDaemon(const char* socket_path, const DaemonOptions& options,
+              const EncoderSet& encoders, const ImagePipeline& process);
+
+// Sends one image to the daemon on |socket_path|, to be encoded with
+// |options|. Returns the process exit code: 0, 1 on failure, 2 for an unknown
+// input format.
+int RunClient(const char* socket_path, const InputView& in_data,
+              const EncodeOptions& options, std::string* out_data);
+
+}  // namespace guetzli
+
+#endif  // _WIN32
+
+#endif  // GUETZLI_DAEMON_H_
@@ -16,15 +16,57 @@
 
 #include "guetzli/debug_print.h"
 
+#include <stdarg.h>
+#include <stdio.h>
+#include <vector>
+
 namespace guetzli {
 
-void PrintDebug(ProcessStats* stats, std::string s) {
+void PrintDebug(ProcessStats* stats, const std::string& s) {
   if (stats->debug_output) {
     stats->debug_output->append(s);
   }
   if (stats->debug_output_file) {
-    fprintf(stats->debug_output_file, "%s", s.c_str());
+    fwrite(s.data(), 1, s.size(), stats->debug_output_file);
+  }
+  if (stats->log_sink) {
+    stats->log_sink->Write(s.data(), s.size());
+  }
+}
+
+void PrintDebugF(ProcessStats* stats, const char* format, ...) {
+  char buffer[1024];
+  va_list args;
+  va_start(args, format);
+  int size = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (size < 0) return;
+  if (static_cast<size_t>(size) < sizeof(buffer)) {
+    PrintDebug(stats, std::string(buffer, size));
+    return;
+  }
+  // Longer than the stack buffer, format again into one that fits.
+  std::vector<char> long_buffer(size + 1);
+  va_start(args, format);
+  vsnprintf(long_buffer.data(), long_buffer.size(), format, args);
+  va_end(args);
+  PrintDebug(stats, std::string(long_buffer.data(), size));
+}
+
+void PrintDebugQuant(ProcessStats* stats, const int q[3][64]) {
+  std::string s;
+  char value[16];
+  for (int y = 0; y < 8; ++y) {
+    for (int c = 0; c < 3; ++c) {
+      for (int x = 0; x < 8; ++x) {
+        snprintf(value, sizeof(value), " %2d", q[c][8 * y + x]);
+        s += value;
+      }
+      s += "   ";
+    }
+    s += "\n";
   }
+  PrintDebug(stats, s);
 }
 
 }  // namespace guetzli
@@ -17,33 +17,52 @@
 #ifndef GUETZLI_DEBUG_PRINT_H_
 #define GUETZLI_DEBUG_PRINT_H_
 
+#include <string>
+
 #include "guetzli/stats.h"
 
+#if defined(__GNUC__) || defined(__clang__)
+#define GUETZLI_PRINTF_FORMAT(fmt, args) \
+  __attribute__((format(printf, fmt, args)))
+#else
+#define GUETZLI_PRINTF_FORMAT(fmt, args)
+#endif
+
 namespace guetzli {
 
-void PrintDebug(ProcessStats* stats, std::string s);
+// Whether the debug log of |stats| goes anywhere. The GUETZLI_LOG macros
+// check this before they evaluate or format their arguments, so encodes
+// without a log pay for a few loads.
+inline bool DebugLogEnabled(const ProcessStats* stats) {
+  return stats != nullptr && (stats->debug_output != nullptr ||
+                              stats->debug_output_file != nullptr ||
+                              stats->log_sink != nullptr);
+}
+
+// Writes |s| to the debug outputs of |stats|.
+void PrintDebug(ProcessStats* stats, const std::string& s);
+
+// Formats and writes, the arguments are checked against |format| at compile
+// time where the compiler supports it.
+void PrintDebugF(ProcessStats* stats, const char* format, ...)
+    GUETZLI_PRINTF_FORMAT(2, 3);
+
+// Writes the 3 quantization matrices side by side, one row per line.
+void PrintDebugQuant(ProcessStats* stats, const int q[3][64]);
 
 }  // namespace guetzli
 
-#define GUETZLI_LOG(stats, ...)                                    \
-  do {                                                             \
-    char debug_string[1024];                                       \
-    int res = snprintf(debug_string, sizeof(debug_string),         \
-                       __VA_ARGS__);                               \
-    assert(res > 0 && "expected successful printing");             \
-    (void)res;                                                     \
-    debug_string[sizeof(debug_string) - 1] = '\0';                 \
-    ::guetzli::PrintDebug(                      \
-         stats, std::string(debug_string));        \
+#define GUETZLI_LOG(stats, ...)                      \
+  do {                                               \
+    if (::guetzli::DebugLogEnabled(stats)) {         \
+      ::guetzli::PrintDebugF(stats, __VA_ARGS__);    \
+    }                                                \
+  } while (0)
+#define GUETZLI_LOG_QUANT(stats, q)                  \
+  do {                                               \
+    if (::guetzli::DebugLogEnabled(stats)) {         \
+      ::guetzli::PrintDebugQuant(stats, q);          \
+    }                                                \
   } while (0)
-#define GUETZLI_LOG_QUANT(stats, q)                    \
-  for (int y = 0; y < 8; ++y) {                        \
-    for (int c = 0; c < 3; ++c) {                      \
-      for (int x = 0; x < 8; ++x)                      \
-        GUETZLI_LOG(stats, " %2d", (q)[c][8 * y + x]); \
-      GUETZLI_LOG(stats, "   ");                       \
-    }                                                  \
-    GUETZLI_LOG(stats, "\n");                          \
-  }
 
 #endif  // GUETZLI_DEBUG_PRINT_H_
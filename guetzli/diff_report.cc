@@ -0,0 +1,227 @@
+/*
+ * Differences between the results of two backends.
+ */
+
+#include "guetzli/diff_report.h"
+
+#include <math.h>
+#include <algorithm>
+
+namespace guetzli {
+
+namespace {
+
+// Fills the position of value |i| in the first mismatch of |diff|.
+void Locate(const DiffReport::Layout& layout, size_t i, StageDiff* diff) {
+  if (layout.width_in_blocks) {
+    const size_t block = i / layout.block_values;
+    diff->first_block_x = static_cast<int>(block % layout.width_in_blocks);
+    diff->first_block_y = static_cast<int>(block / layout.width_in_blocks);
+  } else if (layout.xsize && layout.ysize) {
+    const size_t plane = layout.xsize * layout.ysize;
+    const size_t pixel = i % plane;
+    diff->first_channel = static_cast<int>(i / plane);
+    diff->first_block_x = static_cast<int>(pixel % layout.xsize / 8);
+    diff->first_block_y = static_cast<int>(pixel / layout.xsize / 8);
+  }
+}
+
+}  // namespace
+
+DiffReport* DiffReport::Global() {
+  static DiffReport* report = new DiffReport;
+  return report;
+}
+
+void DiffReport::SetTolerance(const DiffTolerance& tolerance) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  tolerance_ = tolerance;
+}
+
+void DiffReport::SetTolerance(const std::string& stage,
+                              const DiffTolerance& tolerance) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stage_tolerances_[stage] = tolerance;
+}
+
+DiffTolerance DiffReport::ToleranceFor(const std::string& stage) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<std::string, DiffTolerance>::const_iterator it =
+      stage_tolerances_.find(stage);
+  return it != stage_tolerances_.end() ? it->second : tolerance_;
+}
+
+template <typename T>
+size_t DiffReport::CompareValues(const char* stage, const T* a, const T* b,
+                                 size_t n, const Layout& layout) {
+  const DiffTolerance tolerance = ToleranceFor(stage);
+  StageDiff diff;
+  diff.calls = 1;
+  diff.values = n;
+  for (size_t i = 0; i < n; ++i) {
+    const double va = static_cast<double>(a[i]);
+    const double vb = static_cast<double>(b[i]);
+    const double abs_err = fabs(va - vb);
+    const double scale = std::max(fabs(va), fabs(vb));
+    const double rel_err = scale > 0 ? abs_err / scale : 0.0;
+    // NaN on one side only is always a mismatch.
+    const bool nan = (va != va) != (vb != vb);
+    diff.max_abs = std::max(diff.max_abs, abs_err);
+    diff.sum_abs += abs_err;
+    diff.max_rel = std::max(diff.max_rel, rel_err);
+    diff.sum_rel += rel_err;
+    if (nan || (abs_err > tolerance.abs && rel_err > tolerance.rel)) {
+      if (!diff.diverged) {
+        diff.diverged = true;
+        diff.first_index = i;
+        diff.first_a = va;
+        diff.first_b = vb;
+        Locate(layout, i, &diff);
+      }
+      ++diff.mismatches;
+    }
+  }
+  Merge(stage, diff);
+  return diff.mismatches;
+}
+
+void DiffReport::Merge(const char* stage, const StageDiff& diff) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  StageDiff& total = stages_[stage];
+  if (diff.diverged && !total.diverged) {
+    total.diverged = true;
+    total.first_call = total.calls + 1;
+    total.first_index = diff.first_index;
+    total.first_channel = diff.first_channel;
+    total.first_block_x = diff.first_block_x;
+    total.first_block_y = diff.first_block_y;
+    total.first_a = diff.first_a;
+    total.first_b = diff.first_b;
+  }
+  total.calls += diff.calls;
+  total.values += diff.values;
+  total.mismatches += diff.mismatches;
+  total.max_abs = std::max(total.max_abs, diff.max_abs);
+  total.sum_abs += diff.sum_abs;
+  total.max_rel = std::max(total.max_rel, diff.max_rel);
+  total.sum_rel += diff.sum_rel;
+}
+
+size_t DiffReport::Compare(const char* stage, const float* a, const float* b,
+                           size_t n, size_t xsize, size_t ysize) {
+  Layout layout;
+  layout.xsize = xsize;
+  layout.ysize = ysize;
+  return CompareValues(stage, a, b, n, layout);
+}
+
+size_t DiffReport::Compare(const char* stage, const double* a,
+                           const double* b, size_t n, size_t xsize,
+                           size_t ysize) {
+  Layout layout;
+  layout.xsize = xsize;
+  layout.ysize = ysize;
+  return CompareValues(stage, a, b, n, layout);
+}
+
+size_t DiffReport::Compare(const char* stage, const uint8_t* a,
+                           const uint8_t* b, size_t n, size_t xsize,
+                           size_t ysize) {
+  Layout layout;
+  layout.xsize = xsize;
+  layout.ysize = ysize;
+  return CompareValues(stage, a, b, n, layout);
+}
+
+size_t DiffReport::Compare(const char* stage, const uint16_t* a,
+                           const uint16_t* b, size_t n, size_t xsize,
+                           size_t ysize) {
+  Layout layout;
+  layout.xsize = xsize;
+  layout.ysize = ysize;
+  return CompareValues(stage, a, b, n, layout);
+}
+
+size_t DiffReport::CompareBlocks(const char* stage, const int16_t* a,
+                                 const int16_t* b, size_t n,
+                                 size_t width_in_blocks, size_t block_values) {
+  Layout layout;
+  layout.width_in_blocks = width_in_blocks;
+  layout.block_values = block_values;
+  return CompareValues(stage, a, b, n, layout);
+}
+
+size_t DiffReport::CompareBlocks(const char* stage, const int* a,
+                                 const int* b, size_t n,
+                                 size_t width_in_blocks, size_t block_values) {
+  Layout layout;
+  layout.width_in_blocks = width_in_blocks;
+  layout.block_values = block_values;
+  return CompareValues(stage, a, b, n, layout);
+}
+
+size_t DiffReport::CompareBlocks(const char* stage, const float* a,
+                                 const float* b, size_t n,
+                                 size_t width_in_blocks, size_t block_values) {
+  Layout layout;
+  layout.width_in_blocks = width_in_blocks;
+  layout.block_values = block_values;
+  return CompareValues(stage, a, b, n, layout);
+}
+
+void DiffReport::Equal(const char* stage, bool equal) {
+  StageDiff diff;
+  diff.calls = 1;
+  diff.values = 1;
+  if (!equal) {
+    diff.mismatches = 1;
+    diff.diverged = true;
+  }
+  Merge(stage, diff);
+}
+
+std::map<std::string, StageDiff> DiffReport::stages() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stages_;
+}
+
+bool DiffReport::Failed() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (std::map<std::string, StageDiff>::const_iterator it = stages_.begin();
+       it != stages_.end(); ++it) {
+    if (it->second.mismatches) return true;
+  }
+  return false;
+}
+
+void DiffReport::Print(FILE* f) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  fprintf(f, "%-36s %6s %10s %10s %10s %10s %10s %10s\n", "stage", "calls",
+          "values", "mismatch", "max abs", "mean abs", "max rel",
+          "mean rel");
+  for (std::map<std::string, StageDiff>::const_iterator it = stages_.begin();
+       it != stages_.end(); ++it) {
+    const StageDiff& d = it->second;
+    const double values = d.values ? static_cast<double>(d.values) : 1.0;
+    fprintf(f, "%-36s %6llu %10llu %10llu %10.3g %10.3g %10.3g %10.3g\n",
+            it->first.c_str(), static_cast<unsigned long long>(d.calls),
+            static_cast<unsigned long long>(d.values),
+            static_cast<unsigned long long>(d.mismatches), d.max_abs,
+            d.sum_abs / values, d.max_rel, d.sum_rel / values);
+    if (!d.diverged || d.values == d.calls) continue;
+    fprintf(f, "    first mismatch in call %llu at value %zu",
+            static_cast<unsigned long long>(d.first_call), d.first_index);
+    if (d.first_channel >= 0) fprintf(f, ", channel %d", d.first_channel);
+    if (d.first_block_x >= 0) {
+      fprintf(f, ", block (%d, %d)", d.first_block_x, d.first_block_y);
+    }
+    fprintf(f, ": %.9g vs %.9g\n", d.first_a, d.first_b);
+  }
+}
+
+void DiffReport::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stages_.clear();
+}
+
+}  // namespace guetzli
@@ -0,0 +1,118 @@
+/*
+ * Differences between the results of two backends.
+ *
+ * The check modes (--checkcl, --checkcuda) and guetzli_difftest run a stage
+ * on two backends with the same inputs and hand both results to a
+ * DiffReport. It aggregates per stage the max and mean absolute and relative
+ * error, counts the values outside the stage's tolerance and keeps where the
+ * first of them is, as the 8x8 block of the image it falls in when the
+ * layout is known. End-to-end results are recorded as equal or not.
+ */
+
+#ifndef GUETZLI_DIFF_REPORT_H_
+#define GUETZLI_DIFF_REPORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace guetzli {
+
+// A value differs when |a - b| is above abs and above rel * max(|a|, |b|).
+struct DiffTolerance {
+  double abs = 1e-3;
+  double rel = 0.0;
+};
+
+struct StageDiff {
+  uint64_t calls = 0;
+  uint64_t values = 0;
+  uint64_t mismatches = 0;  // Outside the tolerance, or unequal results.
+  double max_abs = 0.0;
+  double sum_abs = 0.0;
+  double max_rel = 0.0;
+  double sum_rel = 0.0;
+  // The first mismatch: the call (from 1), the value index and the values.
+  // channel and block are -1 where the layout is not known.
+  bool diverged = false;
+  uint64_t first_call = 0;
+  size_t first_index = 0;
+  int first_channel = -1;
+  int first_block_x = -1;
+  int first_block_y = -1;
+  double first_a = 0.0;
+  double first_b = 0.0;
+};
+
+class DiffReport {
+ public:
+  // The report the check modes of the library write to.
+  static DiffReport* Global();
+
+  // The tolerance of the stages without one of their own.
+  void SetTolerance(const DiffTolerance& tolerance);
+  void SetTolerance(const std::string& stage, const DiffTolerance& tolerance);
+
+  // Compares the n values of a and b. With xsize and ysize the values are
+  // image planes of that size one after the other, else just a sequence.
+  // Returns the number of mismatches.
+  size_t Compare(const char* stage, const float* a, const float* b, size_t n,
+                 size_t xsize = 0, size_t ysize = 0);
+  size_t Compare(const char* stage, const double* a, const double* b,
+                 size_t n, size_t xsize = 0, size_t ysize = 0);
+  size_t Compare(const char* stage, const uint8_t* a, const uint8_t* b,
+                 size_t n, size_t xsize = 0, size_t ysize = 0);
+  size_t Compare(const char* stage, const uint16_t* a, const uint16_t* b,
+                 size_t n, size_t xsize = 0, size_t ysize = 0);
+  // Values of 8x8 blocks one block after the other, block_values per block
+  // and blocks in rows of width_in_blocks, as the coefficients of a JPEG
+  // component.
+  size_t CompareBlocks(const char* stage, const int16_t* a, const int16_t* b,
+                       size_t n, size_t width_in_blocks,
+                       size_t block_values = 64);
+  size_t CompareBlocks(const char* stage, const int* a, const int* b,
+                       size_t n, size_t width_in_blocks,
+                       size_t block_values = 64);
+  size_t CompareBlocks(const char* stage, const float* a, const float* b,
+                       size_t n, size_t width_in_blocks,
+                       size_t block_values = 64);
+
+  // Records a result that must be identical, e.g. the encoded JPEG.
+  void Equal(const char* stage, bool equal);
+
+  std::map<std::string, StageDiff> stages() const;
+  // Whether any stage has mismatches.
+  bool Failed() const;
+  // One line per stage, followed by its first mismatch if any.
+  void Print(FILE* f) const;
+  void Clear();
+
+  // Where a value lies, see Compare() and CompareBlocks().
+  struct Layout {
+    size_t xsize = 0;
+    size_t ysize = 0;
+    size_t width_in_blocks = 0;
+    size_t block_values = 0;
+  };
+
+ private:
+  DiffTolerance ToleranceFor(const std::string& stage) const;
+  // Adds the statistics of one call to the stage.
+  void Merge(const char* stage, const StageDiff& diff);
+
+  template <typename T>
+  size_t CompareValues(const char* stage, const T* a, const T* b, size_t n,
+                       const Layout& layout);
+
+  mutable std::mutex mutex_;
+  DiffTolerance tolerance_;
+  std::map<std::string, DiffTolerance> stage_tolerances_;
+  std::map<std::string, StageDiff> stages_;
+};
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_DIFF_REPORT_H_
@@ -0,0 +1,189 @@
+/*
+ * A reusable encoder for embedding Guetzli in a server.
+ */
+
+#include "guetzli/encoder.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "clguetzli/clguetzli.h"
+#include "guetzli/gamma_correct.h"
+
+namespace guetzli {
+
+namespace {
+
+#ifdef __USE_CUDA__
+// There is a single CUDA context per process, see getOcu().
+std::mutex g_cuda_mutex;
+#endif
+
+bool IsOpenClMode(int mode) {
+  return mode == MODE_OPENCL || mode == MODE_CHECKCL;
+}
+
+}  // namespace
+
+struct Encoder::Queue {
+  ocl_args_d_t* ocl = nullptr;  // Owned.
+  int device = 0;  // Index in DeviceUsage().
+  std::string device_name;
+  bool busy = false;
+  uint64_t encodes = 0;
+  uint64_t busy_ns = 0;
+};
+
+Encoder::Encoder(int mode) : Encoder(mode, std::vector<int>(), 1) {}
+
+Encoder::Encoder(int mode, const std::vector<int>& devices,
+                 int queues_per_device)
+    : mode_(mode) {
+  // The lookup tables are built on first use, do it before any Encode().
+  Srgb8ToLinearTable();
+  if (!IsOpenClMode(mode)) return;
+
+  // The default device when none is given. --checkcl compares every stage
+  // with the CPU, a single queue on the default device.
+  const bool check = mode == MODE_CHECKCL;
+  const std::vector<int> selected = check ? std::vector<int>() : devices;
+  const size_t num_devices = selected.empty() ? 1 : selected.size();
+  const int per_device = check ? 1 : std::max(1, queues_per_device);
+  // Queue q of device d at q * num_devices + d, so that AcquireQueue() fills
+  // the devices in turn.
+  for (int q = 0; q < per_device; ++q) {
+    for (size_t d = 0; d < num_devices; ++d) {
+      std::unique_ptr<Queue> queue(new Queue);
+      queue->device = static_cast<int>(d);
+      queue->device_name = "default";
+#ifdef __USE_OPENCL__
+      queue->ocl = new ocl_args_d_t;
+      initOcl(*queue->ocl,
+              selected.empty() ? nullptr : &listOclDevices()[selected[d]]);
+      for (const ocl_device_t& known : listOclDevices()) {
+        if (known.device == queue->ocl->device) {
+          queue->device_name = known.name;
+        }
+      }
+#endif
+      queues_.push_back(std::move(queue));
+    }
+  }
+}
+
+Encoder::~Encoder() {
+#ifdef __USE_OPENCL__
+  for (size_t i = 0; i < queues_.size(); ++i) delete queues_[i]->ocl;
+#endif
+}
+
+std::vector<EncoderDeviceUsage> Encoder::DeviceUsage() const {
+  std::vector<EncoderDeviceUsage> usage;
+  std::lock_guard<std::mutex> lock(queues_mutex_);
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    const Queue& queue = *queues_[i];
+    if (queue.device >= static_cast<int>(usage.size())) {
+      usage.resize(queue.device + 1);
+    }
+    EncoderDeviceUsage& device = usage[queue.device];
+    device.name = queue.device_name;
+    ++device.queues;
+    device.encodes += queue.encodes;
+    device.busy_s += queue.busy_ns / 1e9;
+  }
+  return usage;
+}
+
+bool Encoder::SaveTuning() const {
+  bool ok = true;
+#ifdef __USE_OPENCL__
+  std::lock_guard<std::mutex> lock(queues_mutex_);
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    // Collects the timings of the last launches.
+    queues_[i]->ocl->finish();
+    if (!queues_[i]->ocl->tuner.save()) ok = false;
+  }
+#endif
+  return ok;
+}
+
+Encoder::Queue* Encoder::AcquireQueue() const {
+  std::unique_lock<std::mutex> lock(queues_mutex_);
+  for (;;) {
+    for (size_t i = 0; i < queues_.size(); ++i) {
+      if (!queues_[i]->busy) {
+        queues_[i]->busy = true;
+        return queues_[i].get();
+      }
+    }
+    queue_released_.wait(lock);
+  }
+}
+
+void Encoder::ReleaseQueue(Queue* queue, uint64_t busy_ns) const {
+  {
+    std::lock_guard<std::mutex> lock(queues_mutex_);
+    queue->busy = false;
+    ++queue->encodes;
+    queue->busy_ns += busy_ns;
+  }
+  queue_released_.notify_one();
+}
+
+template <typename F>
+bool Encoder::Run(ProcessStats* stats, F process) const {
+  ProcessStats local_stats;
+  if (!stats) stats = &local_stats;
+
+#ifdef __USE_CUDA__
+  std::unique_lock<std::mutex> cuda_lock;
+  if (mode_ == MODE_CUDA || mode_ == MODE_CHECKCUDA) {
+    cuda_lock = std::unique_lock<std::mutex>(g_cuda_mutex);
+  }
+#endif
+
+  // Returns the queue also if |process| throws.
+  struct Lease {
+    const Encoder* encoder;
+    Queue* queue;
+    std::chrono::steady_clock::time_point start;
+    ~Lease() {
+      if (!queue) return;
+      encoder->ReleaseQueue(
+          queue, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start).count());
+    }
+  } lease = {this, queues_.empty() ? nullptr : AcquireQueue(),
+             std::chrono::steady_clock::now()};
+  if (lease.queue) stats->device = lease.queue->device_name;
+
+  ScopedMathMode scoped_mode(static_cast<MATH_MODE>(mode_));
+#ifdef __USE_OPENCL__
+  ScopedOcl scoped_ocl(lease.queue ? lease.queue->ocl : nullptr);
+#endif
+  return process(stats);
+}
+
+bool Encoder::Encode(const Params& params, const std::vector<uint8_t>& rgb,
+                     int w, int h, std::string* out,
+                     ProcessStats* stats) const {
+  return Run(stats, [&](ProcessStats* s) {
+    return Process(params, s, rgb, w, h, out);
+  });
+}
+
+bool Encoder::Encode(const Params& params, const std::string& jpeg,
+                     std::string* out, ProcessStats* stats) const {
+  return Encode(params, reinterpret_cast<const uint8_t*>(jpeg.data()),
+                jpeg.size(), out, stats);
+}
+
+bool Encoder::Encode(const Params& params, const uint8_t* jpeg,
+                     size_t jpeg_size, std::string* out,
+                     ProcessStats* stats) const {
+  return Run(stats, [&](ProcessStats* s) {
+    return Process(params, s, jpeg, jpeg_size, out);
+  });
+}
+
+}  // namespace guetzli
@@ -0,0 +1,98 @@
+/*
+ * A reusable encoder for embedding Guetzli in a server.
+ *
+ * The free Process() functions use the backend chosen by g_mathMode and the
+ * process wide OpenCL context. An Encoder instead owns its backend: the
+ * OpenCL context, queue and compiled kernels live as long as the Encoder, and
+ * the backend is selected per calling thread while it encodes, so Encoders
+ * of different backends can be used side by side.
+ *
+ * Encode() may be called from any number of threads. The CPU backends run
+ * the calls concurrently. The OpenCL backends run one call per command queue
+ * of the Encoder, on one or several devices, and the CUDA backends serialize
+ * all calls on the process wide CUDA context.
+ */
+
+#ifndef GUETZLI_ENCODER_H_
+#define GUETZLI_ENCODER_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "guetzli/processor.h"
+#include "guetzli/stats.h"
+
+struct ocl_args_d_t;
+
+namespace guetzli {
+
+// An OpenCL device of an Encoder and how much it was used.
+struct EncoderDeviceUsage {
+  std::string name;  // See ocl_device_t.
+  int queues = 0;
+  uint64_t encodes = 0;
+  double busy_s = 0;  // Summed over the queues of the device.
+};
+
+class Encoder {
+ public:
+  // |mode| is one of the MATH_MODE backends of clguetzli/clguetzli.h, except
+  // MODE_AUTO, which the caller resolves. The GPU backends are set up here.
+  explicit Encoder(int mode);
+  // MODE_OPENCL on |devices|, indices of listOclDevices(), with
+  // |queues_per_device| command queues on each, every one with its own
+  // context and kernels. The calls run on the first free queue, taking the
+  // devices in turn. No |devices| is the default device of Encoder(mode).
+  Encoder(int mode, const std::vector<int>& devices, int queues_per_device);
+  ~Encoder();
+
+  int mode() const { return mode_; }
+
+  // The OpenCL command queues, 0 for the other backends.
+  int queues() const { return static_cast<int>(queues_.size()); }
+
+  // Per OpenCL device, in the order they were given.
+  std::vector<EncoderDeviceUsage> DeviceUsage() const;
+
+  // Stores the OpenCL work-group sizes the queues picked, see ocl_tuner_t.
+  // Call it while no Encode() runs. False if the tuning file can't be
+  // written.
+  bool SaveTuning() const;
+
+  // Same as the Process() overloads, with this Encoder's backend. |stats| may
+  // be nullptr.
+  bool Encode(const Params& params, const std::vector<uint8_t>& rgb, int w,
+              int h, std::string* out, ProcessStats* stats = nullptr) const;
+  bool Encode(const Params& params, const std::string& jpeg, std::string* out,
+              ProcessStats* stats = nullptr) const;
+  bool Encode(const Params& params, const uint8_t* jpeg, size_t jpeg_size,
+              std::string* out, ProcessStats* stats = nullptr) const;
+
+ private:
+  Encoder(const Encoder&);
+  Encoder& operator=(const Encoder&);
+
+  struct Queue;
+
+  template <typename F>
+  bool Run(ProcessStats* stats, F process) const;
+
+  // Waits for a queue without a call running on it.
+  Queue* AcquireQueue() const;
+  void ReleaseQueue(Queue* queue, uint64_t busy_ns) const;
+
+  const int mode_;
+  // OpenCL backends only. A queue runs one call at a time, its event chain is
+  // not thread-safe.
+  std::vector<std::unique_ptr<Queue> > queues_;
+  mutable std::mutex queues_mutex_;
+  mutable std::condition_variable queue_released_;
+};
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_ENCODER_H_
@@ -0,0 +1,112 @@
+/*
+ * The encoders of the command line tool.
+ */
+
+#include "guetzli/encoder_set.h"
+
+#include <algorithm>
+
+#include "clguetzli/clguetzli.h"
+
+namespace guetzli {
+
+bool EncoderSet::Init(int mode, const BackendSelectOptions& select) {
+  mode_ = mode;
+  bool saved = true;
+  if (mode != MODE_AUTO) {
+    choices_[kSizeClassSmall].mode = mode;
+  } else {
+    saved = SelectBackends(select, choices_);
+  }
+  for (int c = 0; c < kSizeClassCount; ++c) {
+    const int backend = choices_[mode == MODE_AUTO ? c : 0].mode;
+    if (encoders_.find(backend) == encoders_.end()) {
+      encoders_[backend].reset(
+          new Encoder(backend, select.opencl_devices, select.opencl_queues));
+    }
+  }
+  default_ = encoders_.at(choices_[kSizeClassSmall].mode).get();
+  return saved;
+}
+
+const Encoder* EncoderSet::For(int xsize, int ysize) const {
+  if (mode_ != MODE_AUTO) {
+    return default_;
+  }
+  return encoders_.at(choices_[SizeClassOf(xsize, ysize)].mode).get();
+}
+
+const Encoder* EncoderSet::Find(int mode) const {
+  std::map<int, std::unique_ptr<Encoder> >::const_iterator it =
+      encoders_.find(mode);
+  return it == encoders_.end() ? nullptr : it->second.get();
+}
+
+std::string EncoderSet::Describe() const {
+  if (mode_ != MODE_AUTO) {
+    return std::to_string(default_->mode());
+  }
+  std::string desc = "auto";
+  for (int c = 0; c < kSizeClassCount; ++c) {
+    desc += (c ? "," : ":") + std::to_string(choices_[c].mode);
+  }
+  return desc;
+}
+
+int EncoderSet::LimitWorkers(int num_workers, FILE* log) const {
+  if (mode_ == MODE_AUTO) {
+    int max_workers = 1;
+    for (int c = 0; c < kSizeClassCount; ++c) {
+      max_workers = std::max(max_workers, choices_[c].workers);
+    }
+    if (num_workers > max_workers) {
+      fprintf(log, "Using %d worker(s), as calibrated for --auto.\n",
+              max_workers);
+      return max_workers;
+    }
+    return num_workers;
+  }
+  if (mode_ == MODE_CPU || mode_ == MODE_CPU_OPT) {
+    return num_workers;
+  }
+  const int max_workers = std::max(1, default_->queues());
+  if (num_workers > max_workers) {
+    fprintf(log, "Using %d worker(s) with the GPU backends, one per %s.\n",
+            max_workers, mode_ == MODE_OPENCL ? "OpenCL queue" : "device");
+    return max_workers;
+  }
+  return num_workers;
+}
+
+std::vector<const Encoder*> EncoderSet::All() const {
+  std::vector<const Encoder*> encoders;
+  for (std::map<int, std::unique_ptr<Encoder> >::const_iterator it =
+           encoders_.begin(); it != encoders_.end(); ++it) {
+    encoders.push_back(it->second.get());
+  }
+  return encoders;
+}
+
+void EncoderSet::WriteDeviceUsage(FILE* f, double seconds) const {
+  const std::vector<const Encoder*> encoders = All();
+  for (size_t i = 0; i < encoders.size(); ++i) {
+    const std::vector<EncoderDeviceUsage> usage = encoders[i]->DeviceUsage();
+    for (size_t d = 0; d < usage.size(); ++d) {
+      fprintf(f, "OpenCL device %s: %d queue(s), %llu images, busy %.2f s"
+              " (%.1f%%)\n", usage[d].name.c_str(), usage[d].queues,
+              static_cast<unsigned long long>(usage[d].encodes),
+              usage[d].busy_s,
+              seconds > 0 ? 100.0 * usage[d].busy_s / (seconds * usage[d].queues)
+                          : 0.0);
+    }
+  }
+}
+
+void EncoderSet::SaveTuning() const {
+  const std::vector<const Encoder*> encoders = All();
+  for (size_t i = 0; i < encoders.size(); ++i) {
+    encoders[i]->SaveTuning();
+  }
+}
+
+}  // namespace guetzli
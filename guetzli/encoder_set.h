@@ -0,0 +1,81 @@
+/*
+ * The encoders of the command line tool, shared by the single image, batch
+ * and daemon paths.
+ *
+ * For a backend given on the command line that is one Encoder. With --auto
+ * it is the backend SelectBackends() chose for each image size class and one
+ * Encoder per backend in use, each image is encoded by the one of its size.
+ * The set is filled before any worker starts and only read after.
+ */
+
+#ifndef GUETZLI_ENCODER_SET_H_
+#define GUETZLI_ENCODER_SET_H_
+
+#include <stdio.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "guetzli/backend_select.h"
+#include "guetzli/encoder.h"
+
+namespace guetzli {
+
+class EncoderSet {
+ public:
+  // Creates the encoders of |mode|, a MATH_MODE, on the OpenCL devices and
+  // queues of |select|. For MODE_AUTO selects the backends first, with
+  // |select|. False if the choices could not be saved, the set is usable
+  // anyway.
+  bool Init(int mode, const BackendSelectOptions& select);
+
+  // The MATH_MODE given to Init(), MODE_AUTO included.
+  int mode() const { return mode_; }
+
+  // With MODE_AUTO the backend of |size_class|.
+  const BackendChoice& choice(SizeClass size_class) const {
+    return choices_[size_class];
+  }
+
+  // The encoder of an image of the given size.
+  const Encoder* For(int xsize, int ysize) const;
+
+  // The encoder of backend |mode|, a MATH_MODE, nullptr if the set has none.
+  const Encoder* Find(int mode) const;
+
+  // The encoder of an image whose size is not known yet, with MODE_AUTO the
+  // one of the small images.
+  const Encoder* Default() const { return default_; }
+
+  // The backend of every size class, e.g. for a cache key of an input that
+  // is not decoded yet: the mode number, or "auto:" and the mode of each
+  // size class.
+  std::string Describe() const;
+
+  // The encodes that can run at once, at most |num_workers|: one per OpenCL
+  // command queue, one for CUDA and the check modes. With MODE_AUTO the most
+  // any size class was calibrated with, the GPU encoders queue the images of
+  // their size classes. A reduction is reported on |log|.
+  int LimitWorkers(int num_workers, FILE* log) const;
+
+  // The encoder, or with MODE_AUTO the encoder of each backend in use.
+  std::vector<const Encoder*> All() const;
+
+  // The OpenCL devices of the encoders: their queues, encodes and how busy
+  // the queues were over |seconds|.
+  void WriteDeviceUsage(FILE* f, double seconds) const;
+
+  // See Encoder::SaveTuning(). Call it while no encode runs.
+  void SaveTuning() const;
+
+ private:
+  int mode_ = -1;
+  BackendChoice choices_[kSizeClassCount];
+  std::map<int, std::unique_ptr<Encoder> > encoders_;
+  const Encoder* default_ = nullptr;
+};
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_ENCODER_SET_H_
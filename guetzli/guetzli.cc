@@ -15,20 +15,36 @@
  */
 
 #include <algorithm>
+#include <cctype>
 #include <cstdio>
 #include <cstdlib>
 #include <exception>
+#include <map>
 #include <memory>
 #include <string>
-#include <sstream>
+#include <thread>
+#include <vector>
 #include <string.h>
 #include "png.h"
 #include "tiffio.h"
+#include "guetzli/backend_select.h"
+#include "guetzli/batch.h"
+#include "guetzli/cpu_dispatch.h"
+#include "guetzli/daemon.h"
+#include "guetzli/diff_report.h"
+#include "guetzli/encoder.h"
+#include "guetzli/encoder_set.h"
+#include "guetzli/image_pipeline.h"
+#include "guetzli/input_file.h"
 #include "guetzli/jpeg_data.h"
 #include "guetzli/jpeg_data_reader.h"
+#include "guetzli/memory_scheduler.h"
 #include "guetzli/processor.h"
+#include "guetzli/profiler.h"
 #include "guetzli/quality.h"
+#include "guetzli/result_cache.h"
 #include "guetzli/stats.h"
+#include "guetzli/stats_output.h"
 #include "clguetzli/clguetzli.h"
 #ifdef __USE_GPERFTOOLS__
 #include <google/profiler.h>
@@ -36,32 +52,74 @@
 
 namespace {
 
+    using guetzli::EncodeOptions;
+    using guetzli::InputFile;
+    using guetzli::InputView;
+    using guetzli::kBackendAny;
+    using guetzli::MemoryScheduler;
+    using guetzli::NotSupported;
+    using guetzli::ProcessFailed;
+    using guetzli::ProcessResult;
+    using guetzli::Sucess;
+    using guetzli::ViewOf;
+    using guetzli::WriteFile;
+
     constexpr char* version = "v2.1.5";
 
     constexpr int kDefaultJPEGQuality = 95;
 
     // An upper estimate of memory usage of Guetzli. The bound is
-    // max(kLowerMemusaeMB * 1<<20, pixel_count * kBytesPerPixel)
+    // max(kLowerMemusaeMB * 1<<20, pixel_count * kBytesPerPixel). Images over
+    // --memlimit by this bound fail up front, the tracked allocations are
+    // checked against it while encoding. It is also the starting point of the
+    // batch and daemon admission control.
     constexpr int kBytesPerPixel = 110;
     constexpr int kLowestMemusageMB = 100; // in MB
 
     constexpr int kDefaultMemlimitMB = 6000; // in MB
 
     int verbose = 0;
+    // A guetzli::ProfileLevel, set by --profile.
+    int profile = guetzli::kProfileOff;
     int quality = kDefaultJPEGQuality;
     int memlimit_mb = kDefaultMemlimitMB;
     bool blendOnBlack = true;
+    // Dimensions of raw RGB input, 0 unless --raw is given.
+    int raw_xsize = 0;
+    int raw_ysize = 0;
+
+    // Created once the backend is known.
+    const guetzli::EncoderSet* encoders = nullptr;
+
+    // The encoder of an image of the given size: the backend |options| asks
+    // for, else the one |encoders| picks.
+    const guetzli::Encoder* EncoderFor(const EncodeOptions& options,
+                                       int xsize, int ysize) {
+        return options.backend != kBackendAny
+            ? encoders->Find(options.backend)
+            : encoders->For(xsize, ysize);
+    }
+
+    // --devices and --queues: the OpenCL devices, indices of listOclDevices(),
+    // none for the default one, and the command queues on each.
+    std::vector<int> opencl_devices;
+    int opencl_queues = 1;
 
-    enum ProcessResult {
-        NotSupported,
-        ProcessFailed,
-        Sucess,
+    // An input image decoded by one of the processors: RGB pixels, or a JPEG
+    // that is recompressed from its coefficients.
+    struct DecodedImage
+    {
+        int xsize = 0;
+        int ysize = 0;
+        std::vector<uint8_t> rgb;
+        bool is_jpeg = false;
     };
 
     class IImageProcessor
     {
     public:
-        virtual ProcessResult Process(const std::string& in_data, std::string* out_data) const = 0;
+        // Returns NotSupported if |in_data| isn't in this processor's format.
+        virtual ProcessResult Decode(const InputView& in_data, DecodedImage* image) const = 0;
     };
 
     inline uint8_t BlendOnBlack(const uint8_t val, const uint8_t alpha) {
@@ -74,11 +132,69 @@ namespace {
     inline uint8_t Blend(const uint8_t val, const uint8_t alpha) {
         return blendOnBlack ? BlendOnBlack(val, alpha) : BlendOnWhite(val, alpha);
     }
+    // For a |val| already multiplied by |alpha|.
+    inline uint8_t BlendPremultiplied(const uint8_t val, const uint8_t alpha) {
+        return blendOnBlack ? val : static_cast<uint8_t>(std::min(255, val + 255 - alpha));
+    }
+
+    // Converts a row of 1 (gray), 2 (gray + alpha), 3 (RGB) or 4 (RGBA)
+    // components to RGB.
+    inline void ConvertRowToRGB(const uint8_t* row_in, int components, int xsize, uint8_t* row_out)
+    {
+        switch (components) {
+        case 1:
+            // GRAYSCALE
+            for (int x = 0; x < xsize; ++x) {
+                const uint8_t gray = row_in[x];
+                row_out[3 * x + 0] = gray;
+                row_out[3 * x + 1] = gray;
+                row_out[3 * x + 2] = gray;
+            }
+            break;
+        case 2:
+            // GRAYSCALE + ALPHA
+            for (int x = 0; x < xsize; ++x) {
+                const uint8_t gray = Blend(row_in[2 * x], row_in[2 * x + 1]);
+                row_out[3 * x + 0] = gray;
+                row_out[3 * x + 1] = gray;
+                row_out[3 * x + 2] = gray;
+            }
+            break;
+        case 3:
+            // RGB
+            memcpy(row_out, row_in, 3 * xsize);
+            break;
+        case 4:
+            // RGBA
+            for (int x = 0; x < xsize; ++x) {
+                const uint8_t alpha = row_in[4 * x + 3];
+                row_out[3 * x + 0] = Blend(row_in[4 * x + 0], alpha);
+                row_out[3 * x + 1] = Blend(row_in[4 * x + 1], alpha);
+                row_out[3 * x + 2] = Blend(row_in[4 * x + 2], alpha);
+            }
+            break;
+        }
+    }
 
     class PngProcessor : public IImageProcessor
     {
     private:
-        static bool ReadPNG(const std::string& data, int* xsize, int* ysize,
+        struct png_io
+        {
+            const uint8_t* data;
+            size_t size;
+            size_t pos;
+        };
+
+        static void png_Read(png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead)
+        {
+            png_io* input = static_cast<png_io*>(png_get_io_ptr(png_ptr));
+            if (byteCountToRead > input->size - input->pos) png_error(png_ptr, "unexpected end of data");
+            memcpy(outBytes, input->data + input->pos, byteCountToRead);
+            input->pos += byteCountToRead;
+        }
+
+        static bool ReadPNG(const InputView& data, int* xsize, int* ysize,
             std::vector<uint8_t>* rgb) {
             png_structp png_ptr =
                 png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
@@ -92,134 +208,74 @@ namespace {
                 return false;
             }
 
+            // Declared before setjmp, so a libpng error doesn't skip its destructor.
+            std::vector<uint8_t> rows;
+
             if (setjmp(png_jmpbuf(png_ptr)) != 0) {
                 // Ok we are here because of the setjmp.
                 png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
                 return false;
             }
 
-            std::istringstream memstream(data, std::ios::in | std::ios::binary);
-            png_set_read_fn(png_ptr, static_cast<void*>(&memstream), [](png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead) {
-                std::istringstream& memstream = *static_cast<std::istringstream*>(png_get_io_ptr(png_ptr));
+            png_io input = { data.data, data.size, 0 };
+            png_set_read_fn(png_ptr, &input, png_Read);
 
-                memstream.read(reinterpret_cast<char*>(outBytes), byteCountToRead);
+            png_read_info(png_ptr, info_ptr);
 
-                if (memstream.eof()) png_error(png_ptr, "unexpected end of data");
-                if (memstream.fail()) png_error(png_ptr, "read from memory error");
-                });
-
-            // The png_transforms flags are as follows:
+            // Transforms as follows:
             // packing == convert 1,2,4 bit images,
-            // strip == 16 -> 8 bits / channel,
-            // shift == use sBIT dynamics, and
-            // expand == palettes -> rgb, grayscale -> 8 bit images, tRNS -> alpha.
-            const unsigned int png_transforms =
-                PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND | PNG_TRANSFORM_STRIP_16;
-
-            png_read_png(png_ptr, info_ptr, png_transforms, nullptr);
-
-            png_bytep* row_pointers = png_get_rows(png_ptr, info_ptr);
+            // expand == palettes -> rgb, grayscale -> 8 bit images, tRNS -> alpha,
+            // strip == 16 -> 8 bits / channel.
+            png_set_packing(png_ptr);
+            png_set_expand(png_ptr);
+            png_set_strip_16(png_ptr);
+            const int passes = png_set_interlace_handling(png_ptr);
+            png_read_update_info(png_ptr, info_ptr);
 
             *xsize = png_get_image_width(png_ptr, info_ptr);
             *ysize = png_get_image_height(png_ptr, info_ptr);
-            rgb->resize(3 * (*xsize) * (*ysize));
-
             const int components = png_get_channels(png_ptr, info_ptr);
-            switch (components) {
-            case 1: {
-                // GRAYSCALE
-                for (int y = 0; y < *ysize; ++y) {
-                    const uint8_t* row_in = row_pointers[y];
-                    uint8_t* row_out = &(*rgb)[3 * y * (*xsize)];
-                    for (int x = 0; x < *xsize; ++x) {
-                        const uint8_t gray = row_in[x];
-                        row_out[3 * x + 0] = gray;
-                        row_out[3 * x + 1] = gray;
-                        row_out[3 * x + 2] = gray;
-                    }
-                }
-                break;
-            }
-            case 2: {
-                // GRAYSCALE + ALPHA
-                for (int y = 0; y < *ysize; ++y) {
-                    const uint8_t* row_in = row_pointers[y];
-                    uint8_t* row_out = &(*rgb)[3 * y * (*xsize)];
-                    for (int x = 0; x < *xsize; ++x) {
-                        const uint8_t gray = Blend(row_in[2 * x], row_in[2 * x + 1]);
-                        row_out[3 * x + 0] = gray;
-                        row_out[3 * x + 1] = gray;
-                        row_out[3 * x + 2] = gray;
-                    }
-                }
-                break;
-            }
-            case 3: {
-                // RGB
-                for (int y = 0; y < *ysize; ++y) {
-                    const uint8_t* row_in = row_pointers[y];
-                    uint8_t* row_out = &(*rgb)[3 * y * (*xsize)];
-                    memcpy(row_out, row_in, 3 * (*xsize));
-                }
-                break;
+            if (components < 1 || components > 4) {
+                png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+                return false;
             }
-            case 4: {
-                // RGBA
+            rgb->resize(3 * (*xsize) * (*ysize));
+
+            // RGB rows are decoded straight into rgb, the others are converted
+            // row by row. Interlaced passes are combined across the whole
+            // image, so only interlaced gray and alpha images keep every row.
+            const size_t row_bytes = png_get_rowbytes(png_ptr, info_ptr);
+            rows.resize(components == 3 ? 0 : (passes > 1 ? *ysize : 1) * row_bytes);
+            for (int pass = 0; pass < passes; ++pass) {
+                const bool last_pass = pass == passes - 1;
                 for (int y = 0; y < *ysize; ++y) {
-                    const uint8_t* row_in = row_pointers[y];
                     uint8_t* row_out = &(*rgb)[3 * y * (*xsize)];
-                    for (int x = 0; x < *xsize; ++x) {
-                        const uint8_t alpha = row_in[4 * x + 3];
-                        row_out[3 * x + 0] = Blend(row_in[4 * x + 0], alpha);
-                        row_out[3 * x + 1] = Blend(row_in[4 * x + 1], alpha);
-                        row_out[3 * x + 2] = Blend(row_in[4 * x + 2], alpha);
+                    uint8_t* row_in = components == 3 ? row_out
+                        : &rows[passes > 1 ? y * row_bytes : 0];
+                    png_read_row(png_ptr, row_in, nullptr);
+                    if (last_pass && components != 3) {
+                        ConvertRowToRGB(row_in, components, *xsize, row_out);
                     }
                 }
-                break;
-            }
-            default:
-                png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
-                return false;
             }
+            png_read_end(png_ptr, nullptr);
             png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
             return true;
         }
+
     public:
-        virtual ProcessResult Process(const std::string& in_data, std::string* out_data) const
+        virtual ProcessResult Decode(const InputView& in_data, DecodedImage* image) const
         {
             static const unsigned char kPNGMagicBytes[] = {
       0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
             };
-            if (in_data.size() >= 8 &&
-                memcmp(in_data.data(), kPNGMagicBytes, sizeof(kPNGMagicBytes)) == 0) {
-                int xsize, ysize;
-                std::vector<uint8_t> rgb;
-                if (!ReadPNG(in_data, &xsize, &ysize, &rgb)) {
+            if (in_data.size >= 8 &&
+                memcmp(in_data.data, kPNGMagicBytes, sizeof(kPNGMagicBytes)) == 0) {
+                guetzli::ScopedProfileZone zone("decode");
+                if (!ReadPNG(in_data, &image->xsize, &image->ysize, &image->rgb)) {
                     fprintf(stderr, "Error reading PNG data from input file\n");
                     return ProcessFailed;
                 }
-                double pixels = static_cast<double>(xsize) * ysize;
-                if (memlimit_mb != -1
-                    && (pixels * kBytesPerPixel / (1 << 20) > memlimit_mb
-                        || memlimit_mb < kLowestMemusageMB)) {
-                    fprintf(stderr, "Memory limit would be exceeded. Failing.\n");
-                    return ProcessFailed;
-                }
-
-                guetzli::Params params;
-                params.butteraugli_target = static_cast<float>(
-                    guetzli::ButteraugliScoreForQuality(quality));
-
-                guetzli::ProcessStats stats;
-
-                if (verbose) {
-                    stats.debug_output_file = stderr;
-                }
-
-                if (!guetzli::Process(params, &stats, rgb, xsize, ysize, out_data)) {
-                    fprintf(stderr, "Guetzli processing failed\n");
-                    return ProcessFailed;
-                }
                 return Sucess;
             }
             return NotSupported;
@@ -287,16 +343,18 @@ namespace {
         }
 
 
-        static int tiff_DummyMap(thandle_t, void**, toff_t*)
+        // The input is already in memory, so libtiff can read the strips
+        // of uncompressed images in place instead of copying them.
+        static int tiff_Map(thandle_t fd, void** base, toff_t* size)
         {
-            fprintf(stderr, "[TIFF] tiff_Map is not supported\n");
-            return 0;
+            tiff_io* data = (tiff_io*)fd;
+            *base = (void*)data->data;
+            *size = data->size;
+            return 1;
         };
 
-        static void tiff_DummyUnmap(thandle_t, tdata_t, toff_t)
+        static void tiff_Unmap(thandle_t, tdata_t, toff_t)
         {
-            fprintf(stderr, "[TIFF] tiff_Unmap is not supported\n");
-            return;
         };
 
         static void tiff_EmptyWarningHandler(const char*, const char*, va_list){
@@ -304,40 +362,62 @@ namespace {
 
     private:
 
-        static bool ReadTIFF(const std::string& data, int* xsize, int* ysize,
+        static bool ReadTIFF(const InputView& data, int* xsize, int* ysize,
             std::vector<uint8_t>* rgb) {
 
-            tiff_io input = { data.data(), data.size(), (char*)data.data()};
+            tiff_io input = { (const char*)data.data, data.size, (char*)data.data };
 
             if (!verbose)
                 TIFFSetWarningHandler(tiff_EmptyWarningHandler);
 
             TIFF* tif = TIFFClientOpen(
-                "Memory", "rm", (thandle_t)&input,
+                "Memory", "r", (thandle_t)&input,
                 tiff_Read, tiff_DummyWrite, tiff_Seek, tiff_DummyClose, tiff_Size,
-                tiff_DummyMap, tiff_DummyUnmap);
+                tiff_Map, tiff_Unmap);
 
             if (!tif) {
                 fprintf(stderr, "[TIFF] TIFFClientOpen failed\n");
                 return false;
             }
 
-            uint32 width(0), height(0), components(0);
-
-            TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
-            TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
-            TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &components);
-
-            uint32 npixels = width * height;
-
-            uint32* pixels = (uint32*)_TIFFmalloc(npixels * sizeof(uint32));
-
-
+            char emsg[1024];
+            TIFFRGBAImage img;
+            if (!TIFFRGBAImageOK(tif, emsg) || !TIFFRGBAImageBegin(&img, tif, 0, emsg)) {
+                fprintf(stderr, "[TIFF] %s\n", emsg);
+                TIFFClose(tif);
+                return false;
+            }
+            img.req_orientation = ORIENTATION_TOPLEFT;
+
+            const uint32 width = img.width;
+            const uint32 height = img.height;
+
+            // Decoded a strip (or a row of tiles) at a time and converted
+            // straight into rgb, instead of through a raster of the whole
+            // image. TIFFRGBAImageGet() flips each chunk to the requested
+            // orientation, the chunks of a bottom-up image are placed from
+            // the bottom of rgb.
+            bool bottom_up = false;
+            switch (img.orientation) {
+            case ORIENTATION_BOTRIGHT:
+            case ORIENTATION_BOTLEFT:
+            case ORIENTATION_RIGHTBOT:
+            case ORIENTATION_LEFTBOT:
+                bottom_up = true;
+                break;
+            }
+            uint32 chunk_rows = 0;
+            if (TIFFIsTiled(tif)) {
+                TIFFGetField(tif, TIFFTAG_TILELENGTH, &chunk_rows);
+            } else {
+                TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &chunk_rows);
+            }
+            chunk_rows = std::max<uint32>(1, std::min(chunk_rows, height));
 
-            int result = TIFFReadRGBAImageOriented(tif, width, height, pixels, ORIENTATION_TOPLEFT);
-            if (!result) {
-                fprintf(stderr, "[TIFF] TIFFReadRGBAImage failed\n");
-                _TIFFfree(pixels);
+            uint32* pixels = (uint32*)_TIFFmalloc(static_cast<tmsize_t>(width) * chunk_rows * sizeof(uint32));
+            if (!pixels) {
+                fprintf(stderr, "[TIFF] Out of memory\n");
+                TIFFRGBAImageEnd(&img);
                 TIFFClose(tif);
                 return false;
             }
@@ -346,76 +426,52 @@ namespace {
             *ysize = height;
             rgb->resize(3 * (*xsize) * (*ysize));
 
-
-            if (components != 4) {
-                for (int y = 0; y < height; ++y) {
-                    const uint32* row_in = pixels + (y * width);
-                    uint8_t* row_out = &(*rgb)[3 * y * (*xsize)];
-                    for (int x = 0; x < *xsize; ++x) {
-                        const uint8_t* pixel = (const uint8_t*)&row_in[x];
-                        row_out[3 * x + 0] = pixel[0];
-                        row_out[3 * x + 1] = pixel[1];
-                        row_out[3 * x + 2] = pixel[2];
-                    }
+            for (uint32 y0 = 0; y0 < height; y0 += chunk_rows) {
+                const uint32 rows = std::min(chunk_rows, height - y0);
+                img.row_offset = y0;
+                if (!TIFFRGBAImageGet(&img, pixels, width, rows)) {
+                    fprintf(stderr, "[TIFF] TIFFRGBAImageGet failed\n");
+                    _TIFFfree(pixels);
+                    TIFFRGBAImageEnd(&img);
+                    TIFFClose(tif);
+                    return false;
                 }
-            }
-            else {
-                for (int y = 0; y < height; ++y) {
+                const uint32 out_y0 = bottom_up ? height - y0 - rows : y0;
+                for (uint32 y = 0; y < rows; ++y) {
                     const uint32* row_in = pixels + (y * width);
-                    uint8_t* row_out = &(*rgb)[3 * y * (*xsize)];
-                    for (int x = 0; x < *xsize; ++x) {
-                        const uint8_t* pixel = (const uint8_t*)&row_in[x];
-                        const uint8_t alpha = pixel[4];
-                        row_out[3 * x + 0] = Blend(pixel[0], alpha);
-                        row_out[3 * x + 1] = Blend(pixel[1], alpha);
-                        row_out[3 * x + 2] = Blend(pixel[2], alpha);
+                    uint8_t* row_out = &(*rgb)[3 * (out_y0 + y) * (*xsize)];
+                    for (uint32 x = 0; x < width; ++x) {
+                        // The RGBA interface returns associated alpha, also
+                        // for images with unassociated alpha, and opaque
+                        // pixels for images without alpha.
+                        const uint8_t alpha = TIFFGetA(row_in[x]);
+                        row_out[3 * x + 0] = BlendPremultiplied(TIFFGetR(row_in[x]), alpha);
+                        row_out[3 * x + 1] = BlendPremultiplied(TIFFGetG(row_in[x]), alpha);
+                        row_out[3 * x + 2] = BlendPremultiplied(TIFFGetB(row_in[x]), alpha);
                     }
                 }
             }
 
             _TIFFfree(pixels);
+            TIFFRGBAImageEnd(&img);
             TIFFClose(tif);
             return true;
         }
     public:
-        virtual ProcessResult Process(const std::string& in_data, std::string* out_data) const
+        virtual ProcessResult Decode(const InputView& in_data, DecodedImage* image) const
         {
             static const ushort kTIFFMagickBE = TIFF_BIGENDIAN;
             static const ushort kTIFFMagickLE = TIFF_LITTLEENDIAN;
 
-            if(in_data.size() >= 2 &&
-                (memcmp(in_data.data(), &kTIFFMagickBE, sizeof(kTIFFMagickBE)) == 0 ||
-                    memcmp(in_data.data(), &kTIFFMagickLE, sizeof(kTIFFMagickLE)) == 0)) {
+            if(in_data.size >= 2 &&
+                (memcmp(in_data.data, &kTIFFMagickBE, sizeof(kTIFFMagickBE)) == 0 ||
+                    memcmp(in_data.data, &kTIFFMagickLE, sizeof(kTIFFMagickLE)) == 0)) {
 
-                int xsize, ysize;
-                std::vector<uint8_t> rgb;
-                if (!ReadTIFF(in_data, &xsize, &ysize, &rgb)) {
+                guetzli::ScopedProfileZone zone("decode");
+                if (!ReadTIFF(in_data, &image->xsize, &image->ysize, &image->rgb)) {
                     fprintf(stderr, "Error reading TIFF data from input file\n");
                     return ProcessFailed;
                 }
-                double pixels = static_cast<double>(xsize) * ysize;
-                if (memlimit_mb != -1
-                    && (pixels * kBytesPerPixel / (1 << 20) > memlimit_mb
-                        || memlimit_mb < kLowestMemusageMB)) {
-                    fprintf(stderr, "Memory limit would be exceeded. Failing.\n");
-                    return ProcessFailed;
-                }
-
-                guetzli::Params params;
-                params.butteraugli_target = static_cast<float>(
-                    guetzli::ButteraugliScoreForQuality(quality));
-
-                guetzli::ProcessStats stats;
-
-                if (verbose) {
-                    stats.debug_output_file = stderr;
-                }
-
-                if (!guetzli::Process(params, &stats, rgb, xsize, ysize, out_data)) {
-                    fprintf(stderr, "Guetzli processing failed\n");
-                    return ProcessFailed;
-                }
-
                 return Sucess;
 
             }
@@ -426,97 +482,455 @@ namespace {
     class JpegProcessor : public IImageProcessor
     {
     public:
-        virtual ProcessResult Process(const std::string& in_data, std::string* out_data) const
+        virtual ProcessResult Decode(const InputView& in_data, DecodedImage* image) const
         {
-            
+            // The last processor, it decides whether the input is supported.
+            guetzli::ScopedProfileZone zone("decode");
             guetzli::JPEGData jpg_header;
-            if (!guetzli::ReadJpeg(in_data, guetzli::JPEG_READ_HEADER, &jpg_header)) {
+            if (!guetzli::ReadJpeg(in_data.data, in_data.size, guetzli::JPEG_READ_HEADER, &jpg_header)) {
                 fprintf(stderr, "Error reading JPG data from input file\n");
                 return NotSupported;
             }
-            double pixels = static_cast<double>(jpg_header.width) * jpg_header.height;
-            if (memlimit_mb != -1
-                && (pixels * kBytesPerPixel / (1 << 20) > memlimit_mb
-                    || memlimit_mb < kLowestMemusageMB)) {
-                fprintf(stderr, "Memory limit would be exceeded. Failing.\n");
-                return ProcessFailed;
+            image->xsize = jpg_header.width;
+            image->ysize = jpg_header.height;
+            image->is_jpeg = true;
+            return Sucess;
+        }
+    };
+
+    // Binary Netpbm images: P5 (PGM), P6 (PPM) and P7 (PAM) with up to 4
+    // channels, 8 or 16 bits per sample.
+    class PnmProcessor : public IImageProcessor
+    {
+    private:
+        struct pnm_header
+        {
+            int width = 0;
+            int height = 0;
+            int depth = 0;
+            int maxval = 0;
+        };
+
+        static void SkipSpace(const InputView& data, size_t* pos)
+        {
+            while (*pos < data.size) {
+                const uint8_t c = data.data[*pos];
+                if (c == '#') {
+                    while (*pos < data.size && data.data[*pos] != '\n') ++*pos;
+                } else if (isspace(c)) {
+                    ++*pos;
+                } else {
+                    break;
+                }
             }
+        }
 
-            guetzli::Params params;
-            params.butteraugli_target = static_cast<float>(
-                guetzli::ButteraugliScoreForQuality(quality));
+        static bool ReadToken(const InputView& data, size_t* pos, std::string* token)
+        {
+            SkipSpace(data, pos);
+            token->clear();
+            while (*pos < data.size && !isspace(data.data[*pos])) {
+                token->push_back(static_cast<char>(data.data[(*pos)++]));
+            }
+            return !token->empty();
+        }
 
-            guetzli::ProcessStats stats;
+        static bool ReadNumber(const InputView& data, size_t* pos, int* value)
+        {
+            std::string token;
+            if (!ReadToken(data, pos, &token)) return false;
+            char* end;
+            const long v = strtol(token.c_str(), &end, 10);
+            if (*end != '\0' || v <= 0 || v > (1 << 30)) return false;
+            *value = static_cast<int>(v);
+            return true;
+        }
 
-            if (verbose) {
-                stats.debug_output_file = stderr;
+        // Parses the header up to the pixel data, which starts at *pos.
+        static bool ReadHeader(const InputView& data, pnm_header* header, size_t* pos)
+        {
+            const char type = static_cast<char>(data.data[1]);
+            *pos = 2;
+            if (type == '7') {
+                std::string token;
+                while (ReadToken(data, pos, &token) && token != "ENDHDR") {
+                    if (token == "WIDTH") {
+                        if (!ReadNumber(data, pos, &header->width)) return false;
+                    } else if (token == "HEIGHT") {
+                        if (!ReadNumber(data, pos, &header->height)) return false;
+                    } else if (token == "DEPTH") {
+                        if (!ReadNumber(data, pos, &header->depth)) return false;
+                    } else if (token == "MAXVAL") {
+                        if (!ReadNumber(data, pos, &header->maxval)) return false;
+                    } else if (token == "TUPLTYPE") {
+                        // DEPTH is enough to tell the layouts apart.
+                        while (*pos < data.size && data.data[*pos] != '\n') ++*pos;
+                    } else {
+                        return false;
+                    }
+                }
+                if (token != "ENDHDR") return false;
+            } else {
+                header->depth = type == '5' ? 1 : 3;
+                if (!ReadNumber(data, pos, &header->width) ||
+                    !ReadNumber(data, pos, &header->height) ||
+                    !ReadNumber(data, pos, &header->maxval)) {
+                    return false;
+                }
             }
+            // A single whitespace character ends the header.
+            if (*pos >= data.size || !isspace(data.data[*pos])) return false;
+            ++*pos;
+            return header->width > 0 && header->height > 0 &&
+                header->depth >= 1 && header->depth <= 4 &&
+                header->maxval > 0 && header->maxval <= 65535;
+        }
 
-            if (!guetzli::Process(params, &stats, in_data, out_data)) {
-                fprintf(stderr, "Guetzli processing failed\n");
+    public:
+        virtual ProcessResult Decode(const InputView& in_data, DecodedImage* image) const
+        {
+            if (in_data.size < 3 || in_data.data[0] != 'P' ||
+                (in_data.data[1] != '5' && in_data.data[1] != '6' && in_data.data[1] != '7') ||
+                !isspace(in_data.data[2])) {
+                return NotSupported;
+            }
+            guetzli::ScopedProfileZone zone("decode");
+            pnm_header header;
+            size_t pos;
+            if (!ReadHeader(in_data, &header, &pos)) {
+                fprintf(stderr, "Error reading PNM header from input file\n");
                 return ProcessFailed;
             }
+            const int sample_size = header.maxval > 255 ? 2 : 1;
+            const size_t row_size = static_cast<size_t>(header.width) * header.depth * sample_size;
+            if ((in_data.size - pos) / row_size < static_cast<size_t>(header.height)) {
+                fprintf(stderr, "Error reading PNM data from input file: truncated\n");
+                return ProcessFailed;
+            }
+
+            image->xsize = header.width;
+            image->ysize = header.height;
+            image->rgb.resize(3 * static_cast<size_t>(header.width) * header.height);
+            const uint8_t* pixels = in_data.data + pos;
+            if (header.depth == 3 && header.maxval == 255) {
+                // Already in the layout of the encoder.
+                memcpy(image->rgb.data(), pixels, image->rgb.size());
+                return Sucess;
+            }
+            // Other layouts are scaled to 8 bits and converted a row at a time.
+            std::vector<uint8_t> row(static_cast<size_t>(header.width) * header.depth);
+            for (int y = 0; y < header.height; ++y) {
+                const uint8_t* row_in = pixels + y * row_size;
+                if (header.maxval != 255) {
+                    for (size_t i = 0; i < row.size(); ++i) {
+                        const int v = sample_size == 2 ? (row_in[2 * i] << 8) | row_in[2 * i + 1] : row_in[i];
+                        row[i] = static_cast<uint8_t>(
+                            (std::min(v, header.maxval) * 255 + header.maxval / 2) / header.maxval);
+                    }
+                    row_in = row.data();
+                }
+                ConvertRowToRGB(row_in, header.depth, header.width,
+                    &image->rgb[3 * static_cast<size_t>(y) * header.width]);
+            }
+            return Sucess;
+        }
+    };
 
+    // Headerless 8-bit RGB pixels, with the dimensions given by --raw.
+    class RawProcessor : public IImageProcessor
+    {
+    public:
+        virtual ProcessResult Decode(const InputView& in_data, DecodedImage* image) const
+        {
+            if (raw_xsize <= 0 || raw_ysize <= 0) {
+                return NotSupported;
+            }
+            guetzli::ScopedProfileZone zone("decode");
+            const size_t size = 3 * static_cast<size_t>(raw_xsize) * raw_ysize;
+            if (in_data.size != size) {
+                fprintf(stderr, "Raw input is %zu bytes, expected %zu for %dx%d RGB\n",
+                    in_data.size, size, raw_xsize, raw_ysize);
+                return ProcessFailed;
+            }
+            image->xsize = raw_xsize;
+            image->ysize = raw_ysize;
+            image->rgb.assign(in_data.data, in_data.data + size);
             return Sucess;
         }
     };
 
+    guetzli::Params MakeParams(const EncodeOptions& options)
+    {
+        guetzli::Params params;
+        params.butteraugli_target = static_cast<float>(
+            guetzli::ButteraugliScoreForQuality(options.quality));
+        // Enforced on the tracked allocations while encoding, see
+        // guetzli/memory_account.h.
+        if (options.memlimit_mb != -1) {
+            params.memory_limit = static_cast<size_t>(options.memlimit_mb) << 20;
+        }
+        return params;
+    }
 
-std::string ReadFileOrDie(const char* filename) {
-  bool read_from_stdin = strncmp(filename, "-", 2) == 0;
+    void PrintPeakMemory(const guetzli::ProcessStats& stats)
+    {
+        for (std::map<std::string, guetzli::MemoryUsage>::const_iterator it =
+                 stats.peak_memory.begin(); it != stats.peak_memory.end(); ++it) {
+            fprintf(stderr, "Peak memory %-12s host %7.1f MB, device %7.1f MB\n",
+                    it->first.c_str(), it->second.host / 1048576.0,
+                    it->second.device / 1048576.0);
+        }
+    }
 
-  FILE* f = read_from_stdin ? stdin : fopen(filename, "rb");
-  if (!f) {
-    perror("Can't open input file");
-    exit(1);
-  }
+    // Prints stats.timings as a tree, one line per zone.
+    void PrintTimings(const guetzli::ProcessStats& stats)
+    {
+        for (std::map<std::string, guetzli::StageTiming>::const_iterator it =
+                 stats.timings.begin(); it != stats.timings.end(); ++it) {
+            const std::string& path = it->first;
+            const size_t depth = std::count(path.begin(), path.end(), '/');
+            const std::string name = std::string(2 * depth, ' ') +
+                path.substr(depth ? path.rfind('/') + 1 : 0);
+            fprintf(stderr, "Profile %-36s %8llu calls %10.3f ms wall",
+                    name.c_str(), static_cast<unsigned long long>(it->second.count),
+                    it->second.wall_ns / 1e6);
+            // Detail zones have no CPU time.
+            if (it->second.cpu_ns) {
+                fprintf(stderr, " %10.3f ms cpu", it->second.cpu_ns / 1e6);
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+
+    ProcessResult EncodeImage(const InputView& in_data, const DecodedImage& image,
+        const EncodeOptions& options, std::string* out_data,
+        guetzli::ProcessStats* stats)
+    {
+        double pixels = static_cast<double>(image.xsize) * image.ysize;
+        if (options.memlimit_mb != -1
+            && (pixels * kBytesPerPixel / (1 << 20) > options.memlimit_mb
+                || options.memlimit_mb < kLowestMemusageMB)) {
+            fprintf(stderr, "Memory limit would be exceeded. Failing.\n");
+            return ProcessFailed;
+        }
+
+        const guetzli::Params params = MakeParams(options);
 
-  std::string result;
-  off_t buffer_size = 8192;
+        if (verbose) {
+            stats->debug_output_file = stderr;
+        }
 
-  if (fseek(f, 0, SEEK_END) == 0) {
-//    buffer_size = std::max<off_t>(ftell(f), 1);
-	  long size = ftell(f);
-	  buffer_size = size > 0 ? size : 1;
-    if (fseek(f, 0, SEEK_SET) != 0) {
-      perror("fseek");
-      exit(1);
+        const guetzli::Encoder* image_encoder = EncoderFor(options, image.xsize, image.ysize);
+        bool ok;
+        {
+            guetzli::ScopedProfileZone zone("encode");
+            ok = image.is_jpeg
+                ? image_encoder->Encode(params, in_data.data, in_data.size, out_data, stats)
+                : image_encoder->Encode(params, image.rgb, image.xsize, image.ysize, out_data, stats);
+        }
+        if (verbose) {
+            PrintPeakMemory(*stats);
+        }
+        if (!ok) {
+            fprintf(stderr, "Guetzli processing failed\n");
+            return ProcessFailed;
+        }
+        return Sucess;
     }
-  } else if (ferror(f)) {
-    perror("fseek");
+
+
+void OpenInputOrDie(const char* filename, InputFile* input) {
+  std::string error;
+  if (!input->Open(filename, &error)) {
+    fprintf(stderr, "%s\n", error.c_str());
     exit(1);
   }
+}
 
-  std::unique_ptr<char[]> buf(new char[buffer_size]);
-  while (!feof(f)) {
-    size_t read_bytes = fread(buf.get(), sizeof(char), buffer_size, f);
-    if (ferror(f)) {
-      perror("fread");
-      exit(1);
-    }
-    result.append(buf.get(), read_bytes);
+void WriteFileOrDie(const char* filename, const std::string& contents) {
+  std::string error;
+  if (!WriteFile(filename, contents, &error)) {
+    fprintf(stderr, "%s\n", error.c_str());
+    exit(1);
   }
+}
 
-  fclose(f);
-  return result;
+#ifndef _WIN32
+// Identifies an encode by the input bytes and everything that affects the
+// output, i.e. the Params, the options the decoders read, the backend and the
+// encoder version.
+std::string ResultCacheKey(const InputView& in_data, const EncodeOptions& options) {
+  const guetzli::Params params = MakeParams(options);
+  // The input is not decoded yet, with --auto the backend depends on its size.
+  const std::string backend = options.backend != kBackendAny
+      ? std::to_string(options.backend)
+      : encoders->Describe();
+  char desc[512];
+  snprintf(desc, sizeof(desc),
+           "%s q=%d mem=%d backend=%s blend=%d raw=%dx%d target=%.9g "
+           "meta=%d 420=%d/%d silver=%d lookahead=%d zeroing=%d limit=%zu",
+           version, options.quality, options.memlimit_mb, backend.c_str(),
+           blendOnBlack ? 1 : 0, raw_xsize, raw_ysize,
+           params.butteraugli_target, params.clear_metadata, params.try_420,
+           params.force_420, params.use_silver_screen,
+           params.zeroing_greedy_lookahead, params.new_zeroing_model,
+           params.memory_limit);
+  return guetzli::ResultCacheKey(in_data, desc);
 }
 
-void WriteFileOrDie(const char* filename, const std::string& contents) {
-  bool write_to_stdout = strncmp(filename, "-", 2) == 0;
+constexpr int kDefaultCacheSizeMB = 1024;
 
-  FILE* f = write_to_stdout ? stdout : fopen(filename, "wb");
-  if (!f) {
-    perror("Can't open output file for writing");
-    exit(1);
+guetzli::ResultCache* result_cache = nullptr;
+#endif
+
+const char* BackendName(int mode) {
+  switch (mode) {
+    case MODE_CPU: return "cpu";
+    case MODE_CPU_OPT: return "cpu_opt";
+    case MODE_OPENCL: return "opencl";
+    case MODE_CUDA: return "cuda";
+    case MODE_CHECKCL: return "checkcl";
+    case MODE_CHECKCUDA: return "checkcuda";
   }
-  if (fwrite(contents.data(), 1, contents.size(), f) != contents.size()) {
-    perror("fwrite");
-    exit(1);
+  return "auto";
+}
+
+guetzli::StatsJsonLog* stats_json = nullptr;
+
+// Adds an image to --stats-json. |name| is the input file, nullptr for
+// daemon requests. |image| is nullptr if the input was not decoded.
+void WriteStatsJson(const char* name, const InputView& in_data,
+                    const EncodeOptions& options, ProcessResult result,
+                    bool cached, const DecodedImage* image,
+                    const guetzli::ProcessStats& stats, size_t output_size,
+                    uint64_t wall_ns) {
+  static const char* const kResults[] = {"unsupported", "failed", "ok"};
+  const bool decoded = image && image->xsize > 0;
+  guetzli::StatsJsonRecord record;
+  record.input = name;
+  record.result = kResults[result];
+  record.cached = cached;
+  record.backend = BackendName(
+      decoded ? EncoderFor(options, image->xsize, image->ysize)->mode()
+      : options.backend != kBackendAny ? options.backend
+                                       : encoders->Default()->mode());
+  record.quality = options.quality;
+  record.input_size = in_data.size;
+  if (decoded) {
+    record.width = image->xsize;
+    record.height = image->ysize;
   }
-  if (fclose(f) < 0) {
-    perror("fclose");
-    exit(1);
+  record.output_size = output_size;
+  record.wall_ns = wall_ns;
+  stats_json->Write(record, stats);
+}
+
+guetzli::TraceWriter* trace_writer = nullptr;
+
+EncodeOptions DefaultEncodeOptions() {
+  EncodeOptions options;
+  options.quality = quality;
+  options.memlimit_mb = memlimit_mb;
+  options.backend = kBackendAny;
+  return options;
+}
+
+// Decodes with the first processor that recognizes the input format and
+// encodes the result, once |scheduler| admits it if there is one. |name| is
+// the input file for --stats-json, nullptr if there is none.
+ProcessResult ProcessImage(const InputView& in_data,
+                           const EncodeOptions& options, std::string* out_data,
+                           const char* name,
+                           MemoryScheduler* scheduler = nullptr) {
+  const uint64_t start_ns = guetzli::ProfileNowNs();
+  static RawProcessor rawProcessor;
+  static PngProcessor pngProcessor;
+  static TiffProcessor tiffProcessor;
+  static PnmProcessor pnmProcessor;
+  static JpegProcessor jpegProcessor;
+
+  // Raw input has no signature, it is only tried with --raw and then first.
+  static const IImageProcessor* processors[] = {
+      &rawProcessor, &pngProcessor, &tiffProcessor, &pnmProcessor, &jpegProcessor };
+
+#ifndef _WIN32
+  std::string cache_key;
+  if (result_cache) {
+      cache_key = ResultCacheKey(in_data, options);
+      guetzli::ProcessStats stats;
+      if (result_cache->Lookup(cache_key, out_data, &stats)) {
+          if (verbose) {
+              fprintf(stderr, "Cache hit %s\n", cache_key.c_str());
+              PrintPeakMemory(stats);
+          }
+          if (stats_json) {
+              WriteStatsJson(name, in_data, options, Sucess, true, nullptr,
+                             stats, out_data->size(),
+                             guetzli::ProfileNowNs() - start_ns);
+          }
+          return Sucess;
+      }
   }
+#endif
+
+  // Covers decoding too, the encoder reports into the same profiler. A
+  // trace needs the stage events, and all of them.
+  const int profile_level =
+      std::max<int>(profile, trace_writer ? guetzli::kProfileStages : 0);
+  guetzli::Profiler profiler(
+      profile_level, trace_writer ? size_t(1) << 20
+                                  : guetzli::Profiler::kDefaultMaxEvents);
+  guetzli::ScopedProfiler scoped_profiler(profile_level ? &profiler : nullptr);
+
+  ProcessResult result = NotSupported;
+  for (size_t i = 0; i != sizeof(processors) / sizeof(processors[0]); ++i) {
+      const IImageProcessor* processor = processors[i];
+      DecodedImage image;
+      // Each processor times its decoding once it recognizes the input.
+      result = processor->Decode(in_data, &image);
+      if (result == Sucess) {
+          guetzli::ProcessStats stats;
+          if (!scheduler) {
+              result = EncodeImage(in_data, image, options, out_data, &stats);
+          } else {
+              struct Admission {
+                  MemoryScheduler* scheduler;
+                  int ticket;
+                  ~Admission() { scheduler->Release(ticket); }
+              } admission = { scheduler, scheduler->Acquire(
+                  EncoderFor(options, image.xsize, image.ysize)->mode(), image.is_jpeg,
+                  image.xsize, image.ysize, image.rgb.capacity()) };
+              result = EncodeImage(in_data, image, options, out_data, &stats);
+          }
+          if (profile) {
+              profiler.Report(&stats);
+              PrintTimings(stats);
+          }
+          if (trace_writer) {
+              trace_writer->Add(profiler);
+          }
+          if (stats_json) {
+              WriteStatsJson(name, in_data, options, result, false, &image,
+                             stats, result == Sucess ? out_data->size() : 0,
+                             guetzli::ProfileNowNs() - start_ns);
+          }
+#ifndef _WIN32
+          if (result == Sucess && result_cache) {
+              result_cache->Store(cache_key, *out_data, stats);
+          }
+#endif
+          return result;
+      }
+      if (result != ProcessResult::NotSupported) {
+          break;
+      }
+  }
+  if (stats_json) {
+      WriteStatsJson(name, in_data, options, result, false, nullptr,
+                     guetzli::ProcessStats(), 0,
+                     guetzli::ProfileNowNs() - start_ns);
+  }
+  return result;
 }
 
 void TerminateHandler() {
@@ -529,66 +943,158 @@ void Usage() {
   fprintf(stderr,
       "Guetzli JPEG compressor (%s). Usage: \n"
       "guetzli [flags] input_filename output_filename\n"
+      "  The input is a PNG, TIFF, JPEG or binary PPM/PGM/PAM image. Either file\n"
+      "  name may be \"-\" for stdin or stdout.\n"
       "\n"
       "Flags:\n"
       "  --verbose         - Print a verbose trace of all attempts to standard output.\n"
+      "  --profile         - Print the wall and CPU time of each encoding stage.\n"
+      "  --stats-json F    - Write a JSON line per image to F with the iterations of the\n"
+      "                      search, the counters, peak memory and backend.\n"
+      "  --trace F         - Write a Chrome trace (chrome://tracing, Perfetto) to F with\n"
+      "                      the encoding stages, OpenCL commands and memory events.\n"
       "  --quality Q       - Visual quality to aim for, expressed as a JPEG quality value.\n"
-      "                      Default value is %d.\n"
-      "  --memlimit M      - Memory limit in MB. Guetzli will fail if unable to stay under\n"
-      "                      the limit. Default limit is %d MB.\n"
+      "                      From 70 to 110, default value is %d.\n"
+      "  --memlimit M      - Memory limit in MB. Guetzli fails if the image is estimated to\n"
+      "                      exceed it, and stops searching and writes the best result found\n"
+      "                      so far when it reaches it. Default limit is %d MB.\n"
 #ifdef __USE_OPENCL__
 	  "  --opencl          - Use OpenCL\n"
       "  --checkcl         - Check OpenCL result\n"
+      "  --opencl-ooo      - Use an out-of-order OpenCL command queue (with --opencl)\n"
+      "  --opencl-group-zeroing - Use a work group per block for the coefficient zeroing\n"
+      "                      order (with --opencl, cross-checked by --checkcl)\n"
+      "  --opencl-hybrid N - Share the coefficient zeroing order between the OpenCL device\n"
+      "                      and N CPU threads (with --opencl)\n"
+      "  --devices LIST    - OpenCL devices to encode on: all, gpu, cpu or comma separated\n"
+      "                      indices; list prints them. Images run on the devices in turn.\n"
+      "  --queues N        - Command queues per OpenCL device (default: 1). Both need\n"
+      "                      --opencl or --auto.\n"
 #endif
 	  "  --c               - Use c opt version\n"
 #ifdef __USE_CUDA__
 	  "  --cuda            - Use CUDA\n"	 
       "  --checkcuda       - Check CUDA result\n"
 #endif
-      "  --auto            - Autodetect best mode (CUDA, OpenCL, C-Opt)\n"
+      "  --auto            - Use the backend that encodes fastest on this host for the\n"
+      "                      size of each image (C-Opt, OpenCL, CUDA), calibrated\n"
+      "                      once per host, see --recalibrate.\n"
+      "  --recalibrate     - With --auto, measure the backends again.\n"
+      "  --isa NAME        - Use the CPU kernels for at most NAME of baseline, sse4.2,\n"
+      "                      avx2 and avx512. Default is the best the CPU supports.\n"
       "  --blend-on-white  - blend pixels with transparency on white.\n"
-      "  --nomemlimit      - Do not limit memory usage.\n", version, kDefaultJPEGQuality, kDefaultMemlimitMB);
+      "  --nomemlimit      - Do not limit memory usage.\n"
+      "  --raw WxH         - The input is headerless 8-bit RGB pixels, W by H.\n"
+      "  --jobs N          - Worker threads for batch and daemon mode. Default is one\n"
+      "                      per CPU.\n"
+      "  --memory-budget M - Memory in MB the concurrent encodes of batch and daemon\n"
+      "                      mode may use together, 0 for no limit. Default is 80%%\n"
+      "                      of the physical memory.\n"
+      "  --batch-summary F - Write the batch summary to F instead of stderr.\n"
+      "  --prefetch N      - Inputs batch mode reads ahead of the encoders on up to\n"
+      "                      %d I/O threads, which also write the outputs. 0 reads\n"
+      "                      and writes on the encoders. Default is %d.\n"
+#ifndef _WIN32
+      "  --daemon-queue N  - Requests the daemon queues before refusing new ones.\n"
+      "                      Default is %d.\n"
+      "  --connect SOCKET  - Encode with the daemon listening on SOCKET, with the\n"
+      "                      backend given, if any, else the daemon's choice.\n"
+      "  --cache DIR       - Keep the results in DIR and answer repeated encodes of\n"
+      "                      the same input and settings from there.\n"
+      "  --cache-size M    - Size limit of the cache in MB, least recently used\n"
+      "                      results are removed first. Default is %d MB.\n"
+#endif
+      "\n"
+      "guetzli [flags] --batch MANIFEST\n"
+      "  Encode every image listed in MANIFEST (\"-\" for stdin), one per line as\n"
+      "  \"input<TAB>output\" or just \"input\" to write input.guetzli.jpg.\n"
+      "guetzli [flags] --batch-dir INPUT_DIR OUTPUT_DIR\n"
+      "  Encode every file in INPUT_DIR to OUTPUT_DIR/<name>.jpg.\n"
+#ifndef _WIN32
+      "guetzli [flags] --daemon SOCKET\n"
+      "  Serve encode requests on the UNIX domain socket SOCKET with --jobs workers\n"
+      "  until interrupted.\n"
+#endif
+#ifdef __USE_OPENCL__
+      "\n"
+      "guetzli [flags] --tune\n"
+      "  Time the OpenCL kernels with each candidate work-group size on synthetic\n"
+      "  images, store the fastest per device and print a report.\n"
+#endif
+      , version, kDefaultJPEGQuality, kDefaultMemlimitMB, guetzli::kMaxIoThreads,
+      guetzli::kDefaultPrefetch
+#ifndef _WIN32
+      , guetzli::kDefaultDaemonQueue, kDefaultCacheSizeMB
+#endif
+      );
   exit(1);
 }
 
-}  // namespace
-
-void autoDetectBestMode() {
-    fprintf(stdout, "Autodetect:\n");
-#ifdef __USE_CUDA__
-    __try {
-        fprintf(stdout, "  Try CUDA...\n");
-        if (supportsCuda()) {
-            fprintf(stdout, "  CUDA detected.\n");
-            g_mathMode = MODE_CUDA;
-            return;
-        }
-        else {
-            fprintf(stdout, "    CUDA is not supporded.\n");
-        }
-    }
-    __except (1 /* EXCEPTION_EXECUTE_HANDLER  */) {
-        fprintf(stdout, "    nvcuda.dll is not found\n");
-    }
-#endif
 #ifdef __USE_OPENCL__
-    __try {
-        fprintf(stdout, "  Try OpenCL...\n");
-        if (supportsOpenCl()) {
-            fprintf(stdout, "  OpenCL detected.\n");
-            g_mathMode = MODE_OPENCL;
-            return;
+// Runs the OpenCL pipeline on synthetic images until every kernel and global
+// size class has picked its work-group size.
+int TuneOpenCL() {
+  static const int kSizes[][2] = { { 128, 128 }, { 256, 256 }, { 512, 384 } };
+  static const int kMaxPasses = 8;
+
+  g_mathMode = MODE_OPENCL;
+  ocl_args_d_t &ocl = getOcl();
+
+  for (int pass = 0; pass < kMaxPasses; pass++) {
+    for (size_t i = 0; i < sizeof(kSizes) / sizeof(kSizes[0]); i++) {
+      const int xsize = kSizes[i][0];
+      const int ysize = kSizes[i][1];
+      fprintf(stderr, "Tuning pass %d, %dx%d...\n", pass + 1, xsize, ysize);
+
+      // Smooth gradients with some texture, so every stage does real work.
+      std::vector<uint8_t> rgb(3 * xsize * ysize);
+      for (int y = 0; y < ysize; y++) {
+        for (int x = 0; x < xsize; x++) {
+          uint8_t* p = &rgb[3 * (y * xsize + x)];
+          p[0] = static_cast<uint8_t>(x * 255 / xsize);
+          p[1] = static_cast<uint8_t>(y * 255 / ysize);
+          p[2] = static_cast<uint8_t>(((x / 4) ^ (y / 4)) * 37 + pass * 11);
         }
-        else {
-            fprintf(stdout, "    OpenCL is not supporded.\n");
-        }
-    }
-    __except (1 /* EXCEPTION_EXECUTE_HANDLER  */) {
-        fprintf(stdout, "    OpenCl.dll is not found\n");
+      }
+
+      guetzli::Params params;
+      params.butteraugli_target = static_cast<float>(
+          guetzli::ButteraugliScoreForQuality(kDefaultJPEGQuality));
+      guetzli::ProcessStats stats;
+      std::string out_data;
+      if (!guetzli::Process(params, &stats, rgb, xsize, ysize, &out_data)) {
+        fprintf(stderr, "Guetzli processing failed\n");
+        return 1;
+      }
     }
+    if (ocl.tuner.untuned() == 0) break;
+  }
+
+  ocl.finish();
+  if (!ocl.tuner.save()) {
+    return 1;
+  }
+  ocl.tuner.report(stdout);
+  return 0;
+}
 #endif
-    fprintf(stdout, "  Using optimized CPU implementation (--c).\n");
-    g_mathMode = MODE_CPU_OPT;
+
+}  // namespace
+
+// The check modes compare the backends while encoding, their differences are
+// reported at exit.
+int PrintCheckReport(int result) {
+  if (g_mathMode == MODE_CHECKCL || g_mathMode == MODE_CHECKCUDA) {
+    guetzli::DiffReport::Global()->Print(stderr);
+  }
+  return result;
+}
+
+// Keeps the OpenCL work-group sizes the encoders picked for the next run, the
+// tuner reports a file it can't write.
+int SaveTuning(int result) {
+  encoders->SaveTuning();
+  return result;
 }
 
 int main(int argc, char** argv) {
@@ -597,7 +1103,36 @@ int main(int argc, char** argv) {
 #endif
   std::set_terminate(TerminateHandler);
 
-  
+
+  const char* batch_manifest = nullptr;
+  std::string batch_in_dir;
+  std::string batch_out_dir;
+  const char* batch_summary = nullptr;
+  const char* stats_json_file = nullptr;
+  const char* trace_file = nullptr;
+  int batch_workers = std::max(1u, std::thread::hardware_concurrency());
+  int batch_prefetch = guetzli::kDefaultPrefetch;
+#ifndef _WIN32
+  const char* cache_dir = nullptr;
+  size_t cache_size = static_cast<size_t>(kDefaultCacheSizeMB) << 20;
+#endif
+  size_t memory_budget = guetzli::PhysicalMemoryBytes() / 10 * 8;
+#ifndef _WIN32
+  const char* daemon_socket = nullptr;
+  const char* connect_socket = nullptr;
+  int daemon_queue = guetzli::kDefaultDaemonQueue;
+#endif
+  const MATH_MODE default_mode = g_mathMode;
+  // --quality and --memlimit or --nomemlimit were given, else --connect
+  // leaves them to the daemon.
+  bool quality_given = false;
+  bool memlimit_given = false;
+  bool recalibrate = false;
+#ifdef __USE_OPENCL__
+  bool tune = false;
+  // --devices or --queues was given.
+  bool opencl_placement = false;
+#endif
 
   int opt_idx = 1;
   for(;opt_idx < argc;opt_idx++) {
@@ -605,19 +1140,99 @@ int main(int argc, char** argv) {
       break;
     if (!strcmp(argv[opt_idx], "--verbose")) {
       verbose = 1;
+    } else if (!strcmp(argv[opt_idx], "--profile")) {
+      profile = guetzli::kProfileDetail;
+    } else if (!strcmp(argv[opt_idx], "--stats-json")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      stats_json_file = argv[opt_idx];
+    } else if (!strcmp(argv[opt_idx], "--trace")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      trace_file = argv[opt_idx];
     } else if (!strcmp(argv[opt_idx], "--quality")) {
       opt_idx++;
       if (opt_idx >= argc)
         Usage();
       quality = atoi(argv[opt_idx]);
+      quality_given = true;
     } else if (!strcmp(argv[opt_idx], "--memlimit")) {
       opt_idx++;
       if (opt_idx >= argc)
         Usage();
       memlimit_mb = atoi(argv[opt_idx]);
+      memlimit_given = true;
     } else if (!strcmp(argv[opt_idx], "--nomemlimit")) {
       memlimit_mb = -1;
+      memlimit_given = true;
+    } else if (!strcmp(argv[opt_idx], "--raw")) {
+      opt_idx++;
+      if (opt_idx >= argc ||
+          sscanf(argv[opt_idx], "%dx%d", &raw_xsize, &raw_ysize) != 2 ||
+          raw_xsize <= 0 || raw_ysize <= 0)
+        Usage();
+    } else if (!strcmp(argv[opt_idx], "--batch")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      batch_manifest = argv[opt_idx];
+    } else if (!strcmp(argv[opt_idx], "--batch-dir")) {
+      opt_idx += 2;
+      if (opt_idx >= argc)
+        Usage();
+      batch_in_dir = argv[opt_idx - 1];
+      batch_out_dir = argv[opt_idx];
+    } else if (!strcmp(argv[opt_idx], "--batch-summary")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      batch_summary = argv[opt_idx];
+    } else if (!strcmp(argv[opt_idx], "--memory-budget")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      memory_budget = static_cast<size_t>(std::max(0, atoi(argv[opt_idx]))) << 20;
+    } else if (!strcmp(argv[opt_idx], "--jobs")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      batch_workers = std::max(1, atoi(argv[opt_idx]));
+    } else if (!strcmp(argv[opt_idx], "--prefetch")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      batch_prefetch = std::max(0, atoi(argv[opt_idx]));
 	}
+#ifndef _WIN32
+    else if (!strcmp(argv[opt_idx], "--daemon")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      daemon_socket = argv[opt_idx];
+    } else if (!strcmp(argv[opt_idx], "--daemon-queue")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      daemon_queue = atoi(argv[opt_idx]);
+    } else if (!strcmp(argv[opt_idx], "--connect")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      connect_socket = argv[opt_idx];
+    } else if (!strcmp(argv[opt_idx], "--cache")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      cache_dir = argv[opt_idx];
+    } else if (!strcmp(argv[opt_idx], "--cache-size")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      cache_size = static_cast<size_t>(std::max(1, atoi(argv[opt_idx]))) << 20;
+    }
+#endif
 #ifdef __USE_OPENCL__
 	else if (!strcmp(argv[opt_idx], "--opencl")) {
 		g_mathMode = MODE_OPENCL;
@@ -625,11 +1240,60 @@ int main(int argc, char** argv) {
     else if (!strcmp(argv[opt_idx], "--checkcl")) {
         g_mathMode = MODE_CHECKCL;
     }
+    else if (!strcmp(argv[opt_idx], "--tune")) {
+        tune = true;
+    }
+    else if (!strcmp(argv[opt_idx], "--opencl-ooo")) {
+        g_useOutOfOrderQueue = true;
+    }
+    else if (!strcmp(argv[opt_idx], "--opencl-group-zeroing")) {
+        g_useGroupBlockZeroing = true;
+    }
+    else if (!strcmp(argv[opt_idx], "--opencl-hybrid")) {
+        opt_idx++;
+        if (opt_idx >= argc)
+            Usage();
+        g_hybridCpuThreads = std::max(0, atoi(argv[opt_idx]));
+    }
+    else if (!strcmp(argv[opt_idx], "--devices")) {
+        opt_idx++;
+        if (opt_idx >= argc)
+            Usage();
+        if (!strcmp(argv[opt_idx], "list")) {
+            const std::vector<ocl_device_t>& devices = listOclDevices();
+            for (size_t i = 0; i < devices.size(); ++i) {
+                printf("%zu: %s (%s)\n", i, devices[i].name.c_str(),
+                       devices[i].type & CL_DEVICE_TYPE_GPU ? "gpu" :
+                       devices[i].type & CL_DEVICE_TYPE_CPU ? "cpu" : "other");
+            }
+            return 0;
+        }
+        if (!parseOclDevices(argv[opt_idx], &opencl_devices)) {
+            fprintf(stderr, "No OpenCL device matches %s, see --devices list.\n",
+                    argv[opt_idx]);
+            return 1;
+        }
+        opencl_placement = true;
+    }
+    else if (!strcmp(argv[opt_idx], "--queues")) {
+        opt_idx++;
+        if (opt_idx >= argc)
+            Usage();
+        opencl_queues = std::max(1, atoi(argv[opt_idx]));
+        opencl_placement = true;
+    }
 #endif
 	else if (!strcmp(argv[opt_idx], "--c"))
 	{
 		g_mathMode = MODE_CPU_OPT;
 	}
+    else if (!strcmp(argv[opt_idx], "--isa")) {
+      opt_idx++;
+      guetzli::CpuIsa isa;
+      if (opt_idx >= argc || !guetzli::ParseCpuIsa(argv[opt_idx], &isa))
+        Usage();
+      guetzli::SetMaxCpuIsa(isa);
+    }
     else if (!strcmp(argv[opt_idx], "--blend-on-white"))
     {
         blendOnBlack = false;
@@ -641,10 +1305,13 @@ int main(int argc, char** argv) {
     else if (!strcmp(argv[opt_idx], "--checkcuda")) {
         g_mathMode = MODE_CHECKCUDA;
     }
+#endif
     else if (!strcmp(argv[opt_idx], "--auto")) {
         g_mathMode = MODE_AUTO;
     }
-#endif
+    else if (!strcmp(argv[opt_idx], "--recalibrate")) {
+        recalibrate = true;
+    }
 	else if (!strcmp(argv[opt_idx], "--")) {
       opt_idx++;
       break;
@@ -654,37 +1321,166 @@ int main(int argc, char** argv) {
     }
   }
 
-  if (argc - opt_idx != 2) {
+#ifdef __USE_OPENCL__
+  if (tune) {
+    if (opt_idx != argc) Usage();
+    return TuneOpenCL();
+  }
+#endif
+
+  const bool batch = batch_manifest || !batch_in_dir.empty();
+  bool daemon = false;
+#ifndef _WIN32
+  daemon = daemon_socket != nullptr;
+#endif
+  if (argc - opt_idx != (batch || daemon ? 0 : 2)) {
     Usage();
   }
 
-  if (g_mathMode == MODE_AUTO) {
-      autoDetectBestMode();
+  if (!guetzli::ValidQuality(quality)) {
+    fprintf(stderr, "The quality must be between %d and %d.\n",
+            guetzli::kLowestQuality, guetzli::kHighestQuality);
+    return 1;
   }
 
+#ifdef __USE_OPENCL__
+  if (opencl_placement && g_mathMode != MODE_OPENCL &&
+      g_mathMode != MODE_AUTO) {
+    fprintf(stderr, "--devices and --queues only apply to --opencl and"
+            " --auto.\n");
+    return 1;
+  }
+#endif
 
+#ifndef _WIN32
+  if (connect_socket && (raw_xsize || !blendOnBlack)) {
+    // The request only carries the encode options, the daemon decodes
+    // with its own --raw and --blend-on-white.
+    fprintf(stderr, "--raw and --blend-on-white are not sent to the daemon,"
+            " pass them to --daemon instead.\n");
+    return 1;
+  }
+  if (connect_socket) {
+    // The daemon does the encoding, don't bring up a backend here.
+    InputFile input;
+    OpenInputOrDie(argv[opt_idx], &input);
+    std::string out_data;
+    // 0 asks for the daemon's own setting.
+    EncodeOptions options = DefaultEncodeOptions();
+    if (!quality_given) options.quality = 0;
+    if (!memlimit_given) options.memlimit_mb = 0;
+    // The backend flags ask the daemon for one of its encoders.
+    if (g_mathMode != default_mode) options.backend = g_mathMode;
+    const int result = guetzli::RunClient(connect_socket, input.view(),
+                                          options, &out_data);
+    if (result == 2) {
+      fprintf(stderr, "Unknown file format: %s\n", argv[opt_idx]);
+    } else if (result == 0) {
+      WriteFileOrDie(argv[opt_idx + 1], out_data);
+    }
+    return result;
+  }
+#endif
 
-  static PngProcessor pngProcessor;
-  static TiffProcessor tiffProcessor;
-  static JpegProcessor jpegProcessor;
+#ifdef __USE_OPENCL__
+  // The --checkcl test cases map buffers without waiting on the event chain.
+  if (g_mathMode != MODE_OPENCL && g_mathMode != MODE_AUTO) {
+      g_useOutOfOrderQueue = false;
+  }
+#endif
 
-  static const IImageProcessor* processors[] = { &pngProcessor, &tiffProcessor, &jpegProcessor };
+  guetzli::BackendSelectOptions select;
+  select.workers = batch || daemon ? batch_workers : 1;
+  select.recalibrate = recalibrate;
+  select.log = stderr;
+  select.opencl_devices = opencl_devices;
+  select.opencl_queues = opencl_queues;
+  guetzli::EncoderSet encoder_set;
+  if (!encoder_set.Init(g_mathMode, select)) {
+    fprintf(stderr, "Can't write %s, calibrating again next time.\n",
+            guetzli::BackendSelectFile().c_str());
+  }
+  encoders = &encoder_set;
+  if (g_mathMode == MODE_AUTO && verbose) {
+    for (int c = 0; c < guetzli::kSizeClassCount; ++c) {
+      const guetzli::SizeClass size_class = static_cast<guetzli::SizeClass>(c);
+      fprintf(stderr, "Auto backend for %s images: %s\n",
+              guetzli::SizeClassName(size_class),
+              BackendName(encoder_set.choice(size_class).mode));
+    }
+  }
 
-  std::string in_data = ReadFileOrDie(argv[opt_idx]);
-  std::string out_data;
+  guetzli::StatsJsonLog stats_log(version);
+  if (stats_json_file) {
+    if (!stats_log.Open(stats_json_file)) {
+      perror("Can't open stats file for writing");
+      return 1;
+    }
+    stats_json = &stats_log;
+  }
 
-  bool processed = false;
+  guetzli::TraceWriter trace_log;
+  if (trace_file) {
+    if (!trace_log.Open(trace_file)) {
+      perror("Can't open trace file for writing");
+      return 1;
+    }
+    trace_writer = &trace_log;
+  }
 
-  for (int i = 0; i != 3; ++i) {
-      const IImageProcessor* processor = processors[i];
-      const ProcessResult result = processor->Process(in_data, &out_data);
-      if (result != ProcessResult::NotSupported)
-      {
-          processed = result == ProcessResult::Sucess;
-          break;
-      }
+#ifndef _WIN32
+  std::unique_ptr<guetzli::ResultCache> cache;
+  if (cache_dir) {
+    std::string error;
+    cache.reset(new guetzli::ResultCache(cache_dir, cache_size));
+    if (!cache->Open(&error)) {
+      fprintf(stderr, "%s\n", error.c_str());
+      return 1;
+    }
+    result_cache = cache.get();
+  }
+#endif
+
+#ifndef _WIN32
+  if (daemon_socket) {
+    guetzli::DaemonOptions options;
+    options.workers = batch_workers;
+    options.queue_size = daemon_queue;
+    options.memory_budget = memory_budget;
+    options.bytes_per_pixel = kBytesPerPixel;
+    options.encode_options = DefaultEncodeOptions();
+    options.verbose = verbose != 0;
+    return SaveTuning(guetzli::RunDaemon(daemon_socket, options, encoder_set,
+                                         ProcessImage));
+  }
+#endif
+
+  if (batch) {
+    std::vector<guetzli::BatchJob> jobs;
+    if (batch_manifest
+            ? !guetzli::ReadBatchManifest(batch_manifest, &jobs)
+            : !guetzli::ReadBatchDirectory(batch_in_dir, batch_out_dir, &jobs)) {
+      return 1;
+    }
+    guetzli::BatchOptions options;
+    options.workers = batch_workers;
+    options.prefetch = batch_prefetch;
+    options.memory_budget = memory_budget;
+    options.bytes_per_pixel = kBytesPerPixel;
+    options.encode_options = DefaultEncodeOptions();
+    options.summary_file = batch_summary;
+    options.verbose = verbose != 0;
+    return PrintCheckReport(SaveTuning(
+        guetzli::RunBatch(options, encoder_set, ProcessImage, &jobs)));
   }
 
+  InputFile input;
+  OpenInputOrDie(argv[opt_idx], &input);
+  std::string out_data;
+
+  bool processed = ProcessImage(input.view(), DefaultEncodeOptions(), &out_data,
+                                argv[opt_idx]) == Sucess;
+
   if (processed)
     WriteFileOrDie(argv[opt_idx + 1], out_data);
   else {
@@ -695,5 +1491,5 @@ int main(int argc, char** argv) {
 #ifdef __USE_GPERFTOOLS__
   ProfilerStop();
 #endif
-  return 0;
+  return PrintCheckReport(SaveTuning(0));
 }
@@ -0,0 +1,47 @@
+/*
+ * What the batch and daemon modes of the command line tool run per image:
+ * decode the input, look it up in the result cache, encode it and log it.
+ * The tool implements the pipeline, the modes only see this interface.
+ */
+
+#ifndef GUETZLI_IMAGE_PIPELINE_H_
+#define GUETZLI_IMAGE_PIPELINE_H_
+
+#include <functional>
+#include <string>
+
+#include "guetzli/input_file.h"
+#include "guetzli/memory_scheduler.h"
+
+namespace guetzli {
+
+enum ProcessResult {
+  NotSupported,
+  ProcessFailed,
+  Sucess,
+};
+
+// EncodeOptions::backend of an image the EncoderSet picks the backend for.
+constexpr int kBackendAny = -1;
+
+// Per-image encoder settings. The command line sets the defaults, daemon
+// requests can override them.
+struct EncodeOptions {
+  int quality;
+  int memlimit_mb;
+  // A MATH_MODE the EncoderSet has an encoder for, or kBackendAny.
+  int backend;
+};
+
+// Encodes |in_data| with |options| into |out_data|, once |scheduler| admits
+// it if there is one. |name| is the input file for the logs, nullptr if
+// there is none. Called from any number of threads.
+typedef std::function<ProcessResult(const InputView& in_data,
+                                    const EncodeOptions& options,
+                                    std::string* out_data, const char* name,
+                                    MemoryScheduler* scheduler)>
+    ImagePipeline;
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_IMAGE_PIPELINE_H_
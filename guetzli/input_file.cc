@@ -0,0 +1,140 @@
+/*
+ * Reading and writing the image files of the command line tool.
+ */
+
+#include "guetzli/input_file.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace guetzli {
+
+bool ReadFile(const char* filename, std::string* result, std::string* error) {
+  bool read_from_stdin = strncmp(filename, "-", 2) == 0;
+
+  FILE* f = read_from_stdin ? stdin : fopen(filename, "rb");
+  if (!f) {
+    *error = std::string("Can't open input file: ") + strerror(errno);
+    return false;
+  }
+
+  result->clear();
+  const size_t kChunkSize = 8192;
+  size_t chunk_size = kChunkSize;
+
+  if (fseek(f, 0, SEEK_END) == 0) {
+    long size = ftell(f);
+    if (size > 0) {
+      // Room for the whole file and the read that finds its end.
+      chunk_size = static_cast<size_t>(size);
+      result->reserve(chunk_size + kChunkSize);
+    }
+    if (fseek(f, 0, SEEK_SET) != 0) {
+      *error = std::string("fseek: ") + strerror(errno);
+      fclose(f);
+      return false;
+    }
+  } else if (ferror(f)) {
+    *error = std::string("fseek: ") + strerror(errno);
+    fclose(f);
+    return false;
+  }
+
+  // Reads straight into |result|, the only copy of the input, which the
+  // decoders and --connect frame from.
+  while (!feof(f)) {
+    const size_t offset = result->size();
+    result->resize(offset + chunk_size);
+    size_t read_bytes = fread(&(*result)[offset], sizeof(char), chunk_size, f);
+    result->resize(offset + read_bytes);
+    if (ferror(f)) {
+      *error = std::string("fread: ") + strerror(errno);
+      fclose(f);
+      return false;
+    }
+    chunk_size = kChunkSize;
+  }
+
+  fclose(f);
+  return true;
+}
+
+bool WriteFile(const char* filename, const std::string& contents,
+               std::string* error) {
+  bool write_to_stdout = strncmp(filename, "-", 2) == 0;
+
+  FILE* f = write_to_stdout ? stdout : fopen(filename, "wb");
+  if (!f) {
+    *error = std::string("Can't open output file for writing: ") + strerror(errno);
+    return false;
+  }
+  if (fwrite(contents.data(), 1, contents.size(), f) != contents.size()) {
+    *error = std::string("fwrite: ") + strerror(errno);
+    fclose(f);
+    return false;
+  }
+  if (fclose(f) < 0) {
+    *error = std::string("fclose: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool InputFile::Open(const char* filename, std::string* error) {
+  Close();
+#ifndef _WIN32
+  if (strncmp(filename, "-", 2) != 0) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+      *error = std::string("Can't open input file: ") + strerror(errno);
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void* map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                       MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        // The decoders read the file front to back.
+        madvise(map, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+        map_ = map;
+        map_size_ = static_cast<size_t>(st.st_size);
+      }
+    }
+    close(fd);
+    if (map_) return true;
+  }
+#endif
+  return ReadFile(filename, &buffer_, error);
+}
+
+void InputFile::Populate() const {
+#ifndef _WIN32
+  if (!map_) return;
+  madvise(map_, map_size_, MADV_WILLNEED);
+  const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  volatile uint8_t sink = 0;
+  for (size_t i = 0; i < map_size_; i += page) {
+    sink ^= static_cast<const uint8_t*>(map_)[i];
+  }
+#endif
+}
+
+void InputFile::Close() {
+#ifndef _WIN32
+  if (map_) munmap(map_, map_size_);
+#endif
+  map_ = nullptr;
+  map_size_ = 0;
+  std::string().swap(buffer_);
+}
+
+}  // namespace guetzli
@@ -0,0 +1,73 @@
+/*
+ * Reading and writing the image files of the command line tool.
+ *
+ * Regular input files are mapped read-only, so the decoders read the page
+ * cache in place instead of a private copy. Pipes, stdin and Windows fall
+ * back to reading the whole file into memory.
+ */
+
+#ifndef GUETZLI_INPUT_FILE_H_
+#define GUETZLI_INPUT_FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace guetzli {
+
+// The bytes of an input image, usually mapped from the input file, see
+// InputFile. The decoders read them in place.
+struct InputView {
+  const uint8_t* data;
+  size_t size;
+};
+
+inline InputView ViewOf(const std::string& data) {
+  InputView view = { reinterpret_cast<const uint8_t*>(data.data()), data.size() };
+  return view;
+}
+
+// Reads |filename|, or stdin for "-". On failure returns false with the
+// reason in |error|.
+bool ReadFile(const char* filename, std::string* result, std::string* error);
+
+// Writes |contents| to |filename|, or stdout for "-". On failure returns
+// false with the reason in |error|.
+bool WriteFile(const char* filename, const std::string& contents,
+               std::string* error);
+
+// An input image file, mapped or read, see above.
+class InputFile {
+ public:
+  InputFile() : map_(nullptr), map_size_(0) {}
+  ~InputFile() { Close(); }
+
+  // On failure returns false with the reason in |error|.
+  bool Open(const char* filename, std::string* error);
+
+  // Faults the mapped pages in, so that reading the file happens on the
+  // calling thread rather than in the decoder.
+  void Populate() const;
+
+  InputView view() const {
+    if (map_) {
+      InputView view = { static_cast<const uint8_t*>(map_), map_size_ };
+      return view;
+    }
+    return ViewOf(buffer_);
+  }
+
+ private:
+  InputFile(const InputFile&);
+  InputFile& operator=(const InputFile&);
+
+  void Close();
+
+  void* map_;
+  size_t map_size_;
+  std::string buffer_;
+};
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_INPUT_FILE_H_
@@ -19,7 +19,7 @@
 #include <algorithm>
 #include <string.h>
 
-#include "guetzli/fdct.h"
+#include "guetzli/cpu_dispatch.h"
 
 namespace guetzli {
 
@@ -34,20 +34,6 @@ void Quantize(coeff_t* v, int iquant) {
   *v = (*v * iquant + kBias) >> kDCTBits;
 }
 
-// Single pixel rgb to 16-bit yuv conversion.
-// The returned yuv values are signed integers in the
-// range [-128, 127] inclusive.
-inline static void RGBToYUV16(const uint8_t* const rgb,
-                              coeff_t *out) {
-  enum { FRAC = 16, HALF = 1 << (FRAC - 1) };
-  const int r = rgb[0];
-  const int g = rgb[1];
-  const int b = rgb[2];
-  out[0] = (19595 * r  + 38469 * g +  7471 * b - (128 << 16) + HALF) >> FRAC;
-  out[64] = (-11059 * r - 21709 * g + 32768 * b + HALF - 1) >> FRAC;
-  out[128] = (32768 * r  - 27439 * g -  5329 * b + HALF - 1) >> FRAC;
-}
-
 }  // namespace
 
 void AddApp0Data(JPEGData* jpg) {
@@ -83,22 +69,25 @@ bool EncodeRGBToJpeg(const std::vector<uint8_t>& rgb, int w, int h,
   }
 
   // Compute YUV444 DCT coefficients.
+  const CpuKernels& kernels = GetCpuKernels();
   int block_ix = 0;
   for (int block_y = 0; block_y < jpg->MCU_rows; ++block_y) {
     for (int block_x = 0; block_x < jpg->MCU_cols; ++block_x) {
       coeff_t block[3 * kDCTBlockSize];
-      // RGB->YUV transform.
+      uint8_t block_rgb[3 * kDCTBlockSize];
       for (int iy = 0; iy < 8; ++iy) {
         for (int ix = 0; ix < 8; ++ix) {
           int y = std::min(h - 1, 8 * block_y + iy);
           int x = std::min(w - 1, 8 * block_x + ix);
           int p = y * w + x;
-          RGBToYUV16(&rgb[3 * p], &block[8 * iy + ix]);
+          memcpy(&block_rgb[3 * (8 * iy + ix)], &rgb[3 * p], 3);
         }
       }
+      // RGB->YUV transform.
+      kernels.rgb_to_ycbcr_block(block_rgb, block);
       // DCT
       for (int i = 0; i < 3; ++i) {
-        ComputeBlockDCT(&block[i * kDCTBlockSize]);
+        kernels.compute_block_dct(&block[i * kDCTBlockSize]);
       }
       // Quantization
       for (int i = 0; i < 3 * 64; ++i) {
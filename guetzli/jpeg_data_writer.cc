@@ -20,6 +20,7 @@
 #include <cstdlib>
 #include <string.h>
 
+#include "guetzli/cpu_dispatch.h"
 #include "guetzli/entropy_encode.h"
 #include "guetzli/fast_log.h"
 #include "guetzli/jpeg_bit_writer.h"
@@ -187,25 +188,7 @@ void BuildHuffmanCodeTable(const int* counts, const int* values,
 // frequent) symbol with the all 1 code.
 void UpdateACHistogramForDCTBlock(const coeff_t* coeffs,
                                   JpegHistogram* ac_histogram) {
-  int r = 0;
-  for (int k = 1; k < 64; ++k) {
-    coeff_t coeff = coeffs[kJPEGNaturalOrder[k]];
-    if (coeff == 0) {
-      r++;
-      continue;
-    }
-    while (r > 15) {
-      ac_histogram->Add(0xf0);
-      r -= 16;
-    }
-    int nbits = Log2FloorNonZero(std::abs(coeff)) + 1;
-    int symbol = (r << 4) + nbits;
-    ac_histogram->Add(symbol);
-    r = 0;
-  }
-  if (r > 0) {
-    ac_histogram->Add(0);
-  }
+  GetCpuKernels().update_ac_histogram(coeffs, ac_histogram->counts);
 }
 
 size_t HistogramHeaderCost(const JpegHistogram& histo) {
@@ -354,6 +337,53 @@ size_t EstimateJpegDataSize(const int num_components,
                             depth));
 }
 
+void EncodeDCTBlockSequential(const coeff_t* coeffs,
+                              const HuffmanCodeTable& dc_huff,
+                              const HuffmanCodeTable& ac_huff,
+                              coeff_t* last_dc_coeff,
+                              BitWriter* bw) {
+  coeff_t temp2;
+  coeff_t temp;
+  temp2 = coeffs[0];
+  temp = temp2 - *last_dc_coeff;
+  *last_dc_coeff = temp2;
+  temp2 = temp;
+  if (temp < 0) {
+    temp = -temp;
+    temp2--;
+  }
+  int nbits = Log2Floor(temp) + 1;
+  bw->WriteBits(dc_huff.depth[nbits], dc_huff.code[nbits]);
+  if (nbits > 0) {
+    bw->WriteBits(nbits, temp2 & ((1 << nbits) - 1));
+  }
+  int r = 0;
+  for (int k = 1; k < 64; ++k) {
+    if ((temp = coeffs[kJPEGNaturalOrder[k]]) == 0) {
+      r++;
+      continue;
+    }
+    if (temp < 0) {
+      temp = -temp;
+      temp2 = ~temp;
+    } else {
+      temp2 = temp;
+    }
+    while (r > 15) {
+      bw->WriteBits(ac_huff.depth[0xf0], ac_huff.code[0xf0]);
+      r -= 16;
+    }
+    int nbits = Log2FloorNonZero(temp) + 1;
+    int symbol = (r << 4) + nbits;
+    bw->WriteBits(ac_huff.depth[symbol], ac_huff.code[symbol]);
+    bw->WriteBits(nbits, temp2 & ((1 << nbits) - 1));
+    r = 0;
+  }
+  if (r > 0) {
+    bw->WriteBits(ac_huff.depth[0], ac_huff.code[0]);
+  }
+}
+
 namespace {
 
 // Writes DHT and SOS marker segments to out and fills in DC/AC Huffman tables
@@ -452,53 +482,6 @@ bool BuildAndEncodeHuffmanCodes(const JPEGData& jpg, JPEGOutput out,
   return JPEGWrite(out, &data[0], data.size());
 }
 
-void EncodeDCTBlockSequential(const coeff_t* coeffs,
-                              const HuffmanCodeTable& dc_huff,
-                              const HuffmanCodeTable& ac_huff,
-                              coeff_t* last_dc_coeff,
-                              BitWriter* bw) {
-  coeff_t temp2;
-  coeff_t temp;
-  temp2 = coeffs[0];
-  temp = temp2 - *last_dc_coeff;
-  *last_dc_coeff = temp2;
-  temp2 = temp;
-  if (temp < 0) {
-    temp = -temp;
-    temp2--;
-  }
-  int nbits = Log2Floor(temp) + 1;
-  bw->WriteBits(dc_huff.depth[nbits], dc_huff.code[nbits]);
-  if (nbits > 0) {
-    bw->WriteBits(nbits, temp2 & ((1 << nbits) - 1));
-  }
-  int r = 0;
-  for (int k = 1; k < 64; ++k) {
-    if ((temp = coeffs[kJPEGNaturalOrder[k]]) == 0) {
-      r++;
-      continue;
-    }
-    if (temp < 0) {
-      temp = -temp;
-      temp2 = ~temp;
-    } else {
-      temp2 = temp;
-    }
-    while (r > 15) {
-      bw->WriteBits(ac_huff.depth[0xf0], ac_huff.code[0xf0]);
-      r -= 16;
-    }
-    int nbits = Log2FloorNonZero(temp) + 1;
-    int symbol = (r << 4) + nbits;
-    bw->WriteBits(ac_huff.depth[symbol], ac_huff.code[symbol]);
-    bw->WriteBits(nbits, temp2 & ((1 << nbits) - 1));
-    r = 0;
-  }
-  if (r > 0) {
-    bw->WriteBits(ac_huff.depth[0], ac_huff.code[0]);
-  }
-}
-
 bool EncodeScan(const JPEGData& jpg,
                 const std::vector<HuffmanCodeTable>& dc_huff_table,
                 const std::vector<HuffmanCodeTable>& ac_huff_table,
@@ -35,7 +35,7 @@ typedef int (*JPEGOutputHook)(void* data, const uint8_t* buf, size_t len);
 struct JPEGOutput {
   JPEGOutput(JPEGOutputHook cb, void* data) : cb(cb), data(data) {}
   bool Write(const uint8_t* buf, size_t len) const {
-    return (len == 0) || (cb(data, buf, len) == len);
+    return (len == 0) || (cb(data, buf, len) == static_cast<int>(len));
   }
  private:
   JPEGOutputHook cb;
@@ -100,6 +100,15 @@ void UpdateACHistogramForDCTBlock(const coeff_t* coeffs,
 size_t ClusterHistograms(JpegHistogram* histo, size_t* num, int* histo_indexes,
                          uint8_t* depths);
 
+struct BitWriter;
+
+// Writes the Huffman coded coefficients of one block of a sequential scan.
+void EncodeDCTBlockSequential(const coeff_t* coeffs,
+                              const HuffmanCodeTable& dc_huff,
+                              const HuffmanCodeTable& ac_huff,
+                              coeff_t* last_dc_coeff,
+                              BitWriter* bw);
+
 }  // namespace guetzli
 
 #endif  // GUETZLI_JPEG_DATA_WRITER_H_
@@ -0,0 +1,161 @@
+/*
+ * Memory accounting of one encode.
+ */
+
+#include "guetzli/memory_account.h"
+
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+#include "guetzli/profiler.h"
+
+namespace guetzli {
+
+namespace {
+
+thread_local MemoryAccount* g_account = nullptr;
+
+std::atomic<size_t> g_device_bytes(0);
+
+struct BlockHeader {
+  MemoryAccount* account;
+  size_t bytes;
+};
+
+// Keeps the blocks aligned for any type.
+const size_t kHeaderSize =
+    (sizeof(BlockHeader) + alignof(std::max_align_t) - 1) /
+    alignof(std::max_align_t) * alignof(std::max_align_t);
+
+}  // namespace
+
+MemoryAccount::MemoryAccount(size_t limit) : limit_(limit) {}
+
+MemoryAccount* MemoryAccount::Current() { return g_account; }
+
+void MemoryAccount::Allocate(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (limit_ != 0 && current_ + bytes > limit_) {
+    limit_hit_ = true;
+    throw MemoryLimitExceeded(stage_);
+  }
+  current_ += bytes;
+  UpdatePeaks();
+  ProfileCounter("host memory", current_);
+}
+
+void MemoryAccount::Release(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  current_ -= std::min(bytes, current_);
+  ProfileCounter("host memory", current_);
+}
+
+void MemoryAccount::NoteDevice(size_t device_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  device_ = device_bytes;
+  UpdatePeaks();
+}
+
+void MemoryAccount::SetStage(const char* stage) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stage_ = stage;
+  UpdatePeaks();
+}
+
+void MemoryAccount::UpdatePeaks() {
+  MemoryUsage& stage = stage_peak_[stage_];
+  stage.host = std::max(stage.host, current_);
+  stage.device = std::max(stage.device, device_);
+  peak_.host = std::max(peak_.host, current_);
+  peak_.device = std::max(peak_.device, device_);
+}
+
+void MemoryAccount::Report(ProcessStats* stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (std::map<std::string, MemoryUsage>::const_iterator it =
+           stage_peak_.begin(); it != stage_peak_.end(); ++it) {
+    MemoryUsage& usage = stats->peak_memory[it->first];
+    usage.host = std::max(usage.host, it->second.host);
+    usage.device = std::max(usage.device, it->second.device);
+  }
+  MemoryUsage& total = stats->peak_memory["total"];
+  total.host = std::max(total.host, peak_.host);
+  total.device = std::max(total.device, peak_.device);
+}
+
+ScopedMemoryAccount::ScopedMemoryAccount(MemoryAccount* account)
+    : previous_(g_account) {
+  g_account = account;
+  if (account) account->NoteDevice(g_device_bytes);
+}
+
+ScopedMemoryAccount::~ScopedMemoryAccount() { g_account = previous_; }
+
+ScopedMemoryStage::ScopedMemoryStage(const char* stage)
+    : account_(g_account), previous_(nullptr) {
+  if (account_) {
+    previous_ = account_->stage();
+    account_->SetStage(stage);
+  }
+}
+
+ScopedMemoryStage::~ScopedMemoryStage() {
+  if (account_) account_->SetStage(previous_);
+}
+
+MemoryReservation::MemoryReservation(size_t bytes)
+    : account_(g_account), bytes_(0) {
+  Set(bytes);
+}
+
+MemoryReservation::~MemoryReservation() {
+  if (account_) account_->Release(bytes_);
+}
+
+void MemoryReservation::Set(size_t bytes) {
+  if (!account_) return;
+  if (bytes > bytes_) {
+    account_->Allocate(bytes - bytes_);
+  } else {
+    account_->Release(bytes_ - bytes);
+  }
+  bytes_ = bytes;
+}
+
+void* TrackedAllocate(size_t bytes) {
+  MemoryAccount* account = g_account;
+  if (account) account->Allocate(bytes);
+  char* block = static_cast<char*>(malloc(kHeaderSize + bytes));
+  if (!block) {
+    if (account) account->Release(bytes);
+    throw std::bad_alloc();
+  }
+  BlockHeader* header = reinterpret_cast<BlockHeader*>(block);
+  header->account = account;
+  header->bytes = bytes;
+  return block + kHeaderSize;
+}
+
+void TrackedDeallocate(void* p) {
+  if (!p) return;
+  char* block = static_cast<char*>(p) - kHeaderSize;
+  BlockHeader* header = reinterpret_cast<BlockHeader*>(block);
+  if (header->account) header->account->Release(header->bytes);
+  free(block);
+}
+
+void TrackDeviceAllocation(size_t bytes) {
+  size_t device = g_device_bytes += bytes;
+  if (g_account) g_account->NoteDevice(device);
+  ProfileCounter("device memory", device);
+}
+
+void TrackDeviceRelease(size_t bytes) {
+  size_t device = g_device_bytes -= bytes;
+  // Usually called back by the OpenCL runtime, without a profiler.
+  ProfileCounter("device memory", device);
+}
+
+}  // namespace guetzli
@@ -0,0 +1,151 @@
+/*
+ * Memory accounting of one encode.
+ *
+ * The big buffers of the encoder (JPEG coefficients, output image planes,
+ * Butteraugli planes, zeroing candidates) are allocated with
+ * TrackedAllocator or covered by a MemoryReservation, both of which charge
+ * the MemoryAccount installed on the calling thread. The account records the
+ * peak per processing stage and, when it has a limit, throws
+ * MemoryLimitExceeded instead of going over it. Device buffers of the OpenCL
+ * and CUDA backends are counted process wide with TrackDeviceAllocation.
+ */
+
+#ifndef GUETZLI_MEMORY_ACCOUNT_H_
+#define GUETZLI_MEMORY_ACCOUNT_H_
+
+#include <stddef.h>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "guetzli/stats.h"
+
+namespace guetzli {
+
+struct MemoryLimitExceeded : public std::bad_alloc {
+  explicit MemoryLimitExceeded(const char* s) : stage(s) {}
+  const char* what() const throw() override {
+    return "guetzli memory limit exceeded";
+  }
+
+  const char* stage;  // Where the limit was reached.
+};
+
+class MemoryAccount {
+ public:
+  // A |limit| of 0 bytes means no limit.
+  explicit MemoryAccount(size_t limit);
+
+  // The account installed on the calling thread, nullptr if none.
+  static MemoryAccount* Current();
+
+  // Throws MemoryLimitExceeded if |bytes| more would go over the limit.
+  void Allocate(size_t bytes);
+  void Release(size_t bytes);
+  void NoteDevice(size_t device_bytes);
+
+  void SetStage(const char* stage);
+  const char* stage() const { return stage_; }
+
+  size_t limit() const { return limit_; }
+  bool limit_hit() const { return limit_hit_; }
+
+  // Adds the peaks to stats->peak_memory, the whole encode as "total".
+  void Report(ProcessStats* stats) const;
+
+ private:
+  friend class ScopedMemoryAccount;
+
+  void UpdatePeaks();
+
+  const size_t limit_;
+  mutable std::mutex mutex_;
+  size_t current_ = 0;
+  size_t device_ = 0;
+  MemoryUsage peak_;
+  std::map<std::string, MemoryUsage> stage_peak_;
+  const char* stage_ = "input";
+  bool limit_hit_ = false;
+};
+
+// Installs |account| on the calling thread for the scope.
+class ScopedMemoryAccount {
+ public:
+  explicit ScopedMemoryAccount(MemoryAccount* account);
+  ~ScopedMemoryAccount();
+
+ private:
+  MemoryAccount* previous_;
+};
+
+// Names the stage of the current account for the scope.
+class ScopedMemoryStage {
+ public:
+  explicit ScopedMemoryStage(const char* stage);
+  ~ScopedMemoryStage();
+
+ private:
+  MemoryAccount* account_;
+  const char* previous_;
+};
+
+// Charges the current account for buffers that can't use TrackedAllocator,
+// because their type is fixed by the Butteraugli interfaces or by public
+// structs such as JPEGComponent.
+class MemoryReservation {
+ public:
+  explicit MemoryReservation(size_t bytes = 0);
+  ~MemoryReservation();
+
+  void Set(size_t bytes);
+
+ private:
+  MemoryReservation(const MemoryReservation&);
+  MemoryReservation& operator=(const MemoryReservation&);
+
+  MemoryAccount* account_;
+  size_t bytes_;
+};
+
+void* TrackedAllocate(size_t bytes);
+void TrackedDeallocate(void* p);
+
+// Stateless allocator charging the account that was current when the memory
+// was allocated, which is remembered in front of the block, so buffers may
+// be freed on any thread.
+template <typename T>
+struct TrackedAllocator {
+  typedef T value_type;
+
+  TrackedAllocator() {}
+  template <typename U>
+  TrackedAllocator(const TrackedAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(TrackedAllocate(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t) { TrackedDeallocate(p); }
+};
+
+template <typename T, typename U>
+bool operator==(const TrackedAllocator<T>&, const TrackedAllocator<U>&) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const TrackedAllocator<T>&, const TrackedAllocator<U>&) {
+  return false;
+}
+
+template <typename T>
+using tracked_vector = std::vector<T, TrackedAllocator<T> >;
+
+// Device memory of the GPU backends, counted process wide. Allocations also
+// update the device peak of the current account.
+void TrackDeviceAllocation(size_t bytes);
+void TrackDeviceRelease(size_t bytes);
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_MEMORY_ACCOUNT_H_
@@ -0,0 +1,178 @@
+/*
+ * Admission control for the concurrent encodes of batch and daemon mode.
+ */
+
+#include "guetzli/memory_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace guetzli {
+
+namespace {
+
+constexpr size_t kJobOverheadBytes = 16 << 20;
+constexpr double kSafetyFactor = 1.25;
+constexpr double kLearningRate = 0.25;
+constexpr int kMaxBypass = 8;
+constexpr int kSampleMs = 20;
+
+}  // namespace
+
+size_t CurrentRssBytes() {
+#ifdef __linux__
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (!f) return 0;
+  unsigned long size = 0, resident = 0;
+  int n = fscanf(f, "%lu %lu", &size, &resident);
+  fclose(f);
+  return n == 2 ? static_cast<size_t>(resident) * sysconf(_SC_PAGESIZE) : 0;
+#else
+  return 0;
+#endif
+}
+
+size_t PhysicalMemoryBytes() {
+#ifdef _WIN32
+  MEMORYSTATUSEX status;
+  status.dwLength = sizeof(status);
+  return GlobalMemoryStatusEx(&status) ? static_cast<size_t>(status.ullTotalPhys) : 0;
+#else
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+  return pages > 0 && page_size > 0 ? static_cast<size_t>(pages) * page_size : 0;
+#endif
+}
+
+MemoryScheduler::MemoryScheduler(size_t budget_bytes, double bytes_per_pixel,
+                                 FILE* log)
+    : budget_(budget_bytes), initial_bytes_per_pixel_(bytes_per_pixel),
+      log_(log) {
+  baseline_ = CurrentRssBytes();
+  if (budget_ > 0 && baseline_ > 0) {
+    sampler_ = std::thread(&MemoryScheduler::Sample, this);
+  }
+}
+
+MemoryScheduler::~MemoryScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  sampler_cv_.notify_all();
+  if (sampler_.joinable()) sampler_.join();
+}
+
+int MemoryScheduler::Acquire(int backend, bool is_jpeg, int xsize, int ysize,
+                             size_t decoded_bytes) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  const int ticket = next_ticket_++;
+  Job job;
+  job.key = Key(backend, is_jpeg);
+  job.pixels = static_cast<double>(xsize) * ysize;
+  job.estimate = Estimate(job.key, job.pixels);
+  job.decoded = decoded_bytes;
+  if (budget_ == 0) {
+    running_[ticket] = job;
+    return ticket;
+  }
+
+  in_use_ += job.decoded;
+  waiting_.push_back(Waiter(ticket));
+  admitted_cv_.wait(lock, [&] { return CanAdmit(ticket, job.estimate); });
+  for (std::list<Waiter>::iterator it = waiting_.begin(); it != waiting_.end();) {
+    if (it->ticket == ticket) {
+      it = waiting_.erase(it);
+      break;
+    }
+    ++it->bypassed;
+    ++it;
+  }
+  in_use_ += job.estimate;
+  running_[ticket] = job;
+  if (log_) {
+    fprintf(log_, "Admitted %dx%d, estimate %zu MB, %zu of %zu MB in use\n",
+            xsize, ysize, (job.estimate + job.decoded) >> 20,
+            in_use_ >> 20, budget_ >> 20);
+  }
+  return ticket;
+}
+
+void MemoryScheduler::Release(int ticket) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<int, Job>::iterator it = running_.find(ticket);
+  const Job& job = it->second;
+  double& bytes_per_pixel = BytesPerPixel(job.key);
+  // Small images are dominated by the fixed overhead, they would inflate
+  // the per pixel cost.
+  // The decoded pixels are in the peak but not in the encoder's cost.
+  const size_t peak = job.peak > job.decoded ? job.peak - job.decoded : 0;
+  if (peak > 0 && job.pixels * bytes_per_pixel >= kJobOverheadBytes) {
+    bytes_per_pixel = (1 - kLearningRate) * bytes_per_pixel +
+        kLearningRate * kSafetyFactor * peak / job.pixels;
+    if (log_) {
+      fprintf(log_, "Estimated %zu MB, observed %zu MB, now %.0f bytes/pixel\n",
+              job.estimate >> 20, job.peak >> 20, bytes_per_pixel);
+    }
+  }
+  if (budget_ > 0) in_use_ -= job.estimate + job.decoded;
+  running_.erase(it);
+  admitted_cv_.notify_all();
+}
+
+double& MemoryScheduler::BytesPerPixel(const Key& key) {
+  std::map<Key, double>::iterator it = bytes_per_pixel_.find(key);
+  if (it == bytes_per_pixel_.end()) {
+    it = bytes_per_pixel_.insert(std::make_pair(key, initial_bytes_per_pixel_)).first;
+  }
+  return it->second;
+}
+
+size_t MemoryScheduler::Estimate(const Key& key, double pixels) {
+  return kJobOverheadBytes + static_cast<size_t>(BytesPerPixel(key) * pixels);
+}
+
+bool MemoryScheduler::CanAdmit(int ticket, size_t estimate) const {
+  if (!running_.empty() && in_use_ + estimate > budget_) return false;
+  for (std::list<Waiter>::const_iterator it = waiting_.begin();
+       it != waiting_.end() && it->ticket != ticket; ++it) {
+    if (it->bypassed >= kMaxBypass) return false;
+  }
+  return true;
+}
+
+void MemoryScheduler::Sample() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopped_) {
+    sampler_cv_.wait_for(lock, std::chrono::milliseconds(kSampleMs));
+    const size_t rss = CurrentRssBytes();
+    if (running_.empty()) {
+      baseline_ = rss;
+      continue;
+    }
+    if (rss <= baseline_) continue;
+    double total = 0;
+    for (std::map<int, Job>::const_iterator it = running_.begin();
+         it != running_.end(); ++it) {
+      total += it->second.estimate + it->second.decoded;
+    }
+    for (std::map<int, Job>::iterator it = running_.begin();
+         it != running_.end(); ++it) {
+      const size_t share = static_cast<size_t>(
+          (rss - baseline_) *
+          ((it->second.estimate + it->second.decoded) / total));
+      it->second.peak = std::max(it->second.peak, share);
+    }
+  }
+}
+
+}  // namespace guetzli
@@ -0,0 +1,92 @@
+/*
+ * Admission control for the concurrent encodes of batch and daemon mode.
+ *
+ * Each decoded image gets a peak memory estimate and is only encoded while
+ * the estimates of the running encodes fit in the budget; an image larger
+ * than the whole budget runs alone. Smaller images may overtake one that
+ * doesn't fit yet, a bounded number of times. The decoded pixels are already
+ * resident while an image waits, so they count as in use from the moment it
+ * asks for admission.
+ *
+ * The process RSS is sampled while encodes run and the growth over the idle
+ * baseline is split between the running encodes by their estimates. The peak
+ * share of each encode refines the bytes per pixel estimate of its backend
+ * and input kind.
+ */
+
+#ifndef GUETZLI_MEMORY_SCHEDULER_H_
+#define GUETZLI_MEMORY_SCHEDULER_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace guetzli {
+
+// Resident set size of the process, 0 where it can't be read.
+size_t CurrentRssBytes();
+
+size_t PhysicalMemoryBytes();
+
+class MemoryScheduler {
+ public:
+  // A |budget_bytes| of 0 disables admission control. |bytes_per_pixel| is
+  // the first estimate of every backend and input kind. The admissions and
+  // refined estimates are logged to |log|, nullptr for none.
+  MemoryScheduler(size_t budget_bytes, double bytes_per_pixel, FILE* log);
+  ~MemoryScheduler();
+
+  // Blocks until an image of |xsize| by |ysize| may be encoded with the
+  // MATH_MODE |backend|. |decoded_bytes| are held by its decoded pixels.
+  // Returns the ticket for Release.
+  int Acquire(int backend, bool is_jpeg, int xsize, int ysize,
+              size_t decoded_bytes);
+
+  void Release(int ticket);
+
+ private:
+  typedef std::pair<int, bool> Key;  // Backend, JPEG input.
+
+  struct Job {
+    Key key;
+    double pixels = 0;
+    size_t estimate = 0;  // Of the encode.
+    size_t decoded = 0;   // The decoded image held since Acquire.
+    size_t peak = 0;
+  };
+
+  struct Waiter {
+    explicit Waiter(int t) : ticket(t), bypassed(0) {}
+    int ticket;
+    int bypassed;
+  };
+
+  double& BytesPerPixel(const Key& key);
+  size_t Estimate(const Key& key, double pixels);
+  bool CanAdmit(int ticket, size_t estimate) const;
+  void Sample();
+
+  const size_t budget_;
+  const double initial_bytes_per_pixel_;
+  FILE* const log_;
+  std::mutex mutex_;
+  std::condition_variable admitted_cv_;
+  std::condition_variable sampler_cv_;
+  std::list<Waiter> waiting_;
+  std::map<int, Job> running_;
+  std::map<Key, double> bytes_per_pixel_;
+  size_t in_use_ = 0;
+  size_t baseline_ = 0;
+  int next_ticket_ = 0;
+  bool stopped_ = false;
+  std::thread sampler_;
+};
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_MEMORY_SCHEDULER_H_
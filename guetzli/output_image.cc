@@ -25,7 +25,9 @@
 
 #include "guetzli/idct.h"
 #include "guetzli/color_transform.h"
+#include "guetzli/cpu_dispatch.h"
 #include "guetzli/dct_double.h"
+#include "guetzli/diff_report.h"
 #include "guetzli/gamma_correct.h"
 #include "guetzli/preprocess_downsample.h"
 #include "guetzli/quantize.h"
@@ -44,8 +46,8 @@ void OutputImageComponent::Reset(int factor_x, int factor_y) {
   width_in_blocks_ = (width_ + 8 * factor_x_ - 1) / (8 * factor_x_);
   height_in_blocks_ = (height_ + 8 * factor_y_ - 1) / (8 * factor_y_);
   num_blocks_ = width_in_blocks_ * height_in_blocks_;
-  coeffs_ = std::vector<coeff_t>(num_blocks_ * kDCTBlockSize);
-  pixels_ = std::vector<uint16_t>(width_ * height_, 128 << 4);
+  coeffs_ = tracked_vector<coeff_t>(num_blocks_ * kDCTBlockSize);
+  pixels_ = tracked_vector<uint16_t>(width_ * height_, 128 << 4);
   for (int i = 0; i < kDCTBlockSize; ++i) quant_[i] = 1;
 }
 
@@ -234,11 +236,11 @@ void OutputImageComponent::CopyFromJpegComponent(const JPEGComponent& comp,
 	assert(width_in_blocks_ <= comp.width_in_blocks);
 	assert(height_in_blocks_ <= comp.height_in_blocks);
 
-	if (MODE_CPU_OPT == g_mathMode || MODE_CPU == g_mathMode) {
+	if (MODE_CPU_OPT == CurrentMathMode() || MODE_CPU == CurrentMathMode()) {
 		_CopyFromJpegComponent(comp, factor_x, factor_y, quant);
 	}
 #ifdef __USE_OPENCL__
-	else if (MODE_OPENCL == g_mathMode)
+	else if (MODE_OPENCL == CurrentMathMode())
 	{
 		std::vector<uint8_t> output_idct_gpu(width_in_blocks_ * height_in_blocks_ * kDCTBlockSize);
 		clCopyFromJpegComponent(
@@ -261,7 +263,7 @@ void OutputImageComponent::CopyFromJpegComponent(const JPEGComponent& comp,
 	}
 #endif
 #ifdef __USE_CUDA__
-	else if (MODE_CUDA == g_mathMode)
+	else if (MODE_CUDA == CurrentMathMode())
 	{
 		std::vector<uint8_t> output_idct_gpu(width_in_blocks_ * height_in_blocks_ * kDCTBlockSize);
 		cuCopyFromJpegComponent(
@@ -284,10 +286,10 @@ void OutputImageComponent::CopyFromJpegComponent(const JPEGComponent& comp,
 	}
 #endif
 #ifdef __USE_OPENCL__
-	else if (MODE_CHECKCL == g_mathMode)
+	else if (MODE_CHECKCL == CurrentMathMode())
 	{
-		std::vector<coeff_t> output_coeff_gpu(coeffs_);
-		std::vector<uint16_t> output_pixel_gpu(pixels_);
+		tracked_vector<coeff_t> output_coeff_gpu(coeffs_);
+		tracked_vector<uint16_t> output_pixel_gpu(pixels_);
 
 		//calculate GPU data
 		std::vector<uint8_t> output_idct_gpu(width_in_blocks_ * height_in_blocks_ * kDCTBlockSize);
@@ -312,34 +314,11 @@ void OutputImageComponent::CopyFromJpegComponent(const JPEGComponent& comp,
 		//calculate CPU data
 		_CopyFromJpegComponent(comp, factor_x, factor_y, quant);
 
-		int count = 0;
-		for (int i = 0; i < output_coeff_gpu.size(); i++)
-		{
-			if (coeffs_[i] != output_coeff_gpu[i])
-			{
-				count++;
-			}
-		}
-		if (count > 0)
-		{
-			LogError("CHK %s(%d) %d:%d\r\n", "CopyFromJpegComponent coeff", __LINE__, count, output_coeff_gpu.size());
-		}
-
-		count = 0;
-		for (int i = 0; i < output_pixel_gpu.size(); i++)
-		{
-			if (pixels_[i] != output_pixel_gpu[i])
-			{
-				count++;
-			}
-		}
-		if (count > 0)
-		{
-			LogError("CHK %s(%d) %d:%d\r\n", "CopyFromJpegComponent pixel", __LINE__, count, output_pixel_gpu.size());
-		}
-		else {
-			LogError("");
-		}
+		DiffReport* report = DiffReport::Global();
+		report->CompareBlocks("CopyFromJpegComponent coeff", coeffs_.data(),
+			output_coeff_gpu.data(), coeffs_.size(), width_in_blocks_);
+		report->Compare("CopyFromJpegComponent pixel", pixels_.data(),
+			output_pixel_gpu.data(), pixels_.size(), width_, height_);
 	}
 #endif
 
@@ -361,12 +340,12 @@ void OutputImageComponent::_ApplyGlobalQuantization(const int q[kDCTBlockSize])
 
 void OutputImageComponent::ApplyGlobalQuantization(const int q[kDCTBlockSize]) {
 
-	if (MODE_CPU_OPT == g_mathMode || MODE_CPU == g_mathMode)
+	if (MODE_CPU_OPT == CurrentMathMode() || MODE_CPU == CurrentMathMode())
 	{
 		_ApplyGlobalQuantization(q);
 	}
 #ifdef __USE_OPENCL__
-	else if (MODE_OPENCL == g_mathMode)
+	else if (MODE_OPENCL == CurrentMathMode())
 	{
 		std::vector<uint8_t> output_idct_gpu(width_in_blocks_ * height_in_blocks_ * kDCTBlockSize);
 		std::vector<uint8_t> output_bool_gpu(width_in_blocks_ * height_in_blocks_);
@@ -389,7 +368,7 @@ void OutputImageComponent::ApplyGlobalQuantization(const int q[kDCTBlockSize]) {
 	}
 #endif
 #ifdef __USE_CUDA__
-	else if (MODE_CUDA == g_mathMode)
+	else if (MODE_CUDA == CurrentMathMode())
 	{
 		std::vector<uint8_t> output_idct_gpu(width_in_blocks_ * height_in_blocks_ * kDCTBlockSize);
 		std::vector<uint8_t> output_bool_gpu(width_in_blocks_ * height_in_blocks_);
@@ -412,10 +391,10 @@ void OutputImageComponent::ApplyGlobalQuantization(const int q[kDCTBlockSize]) {
 	}
 #endif
 #ifdef __USE_OPENCL__
-	else if (MODE_CHECKCL == g_mathMode)
+	else if (MODE_CHECKCL == CurrentMathMode())
 	{
-		std::vector<coeff_t> output_coeff_gpu(coeffs_);
-		std::vector<uint16_t> output_pixel_gpu(pixels_);
+		tracked_vector<coeff_t> output_coeff_gpu(coeffs_);
+		tracked_vector<uint16_t> output_pixel_gpu(pixels_);
 		//calculate GPU data
 		std::vector<uint8_t> output_idct_gpu(width_in_blocks_ * height_in_blocks_ * kDCTBlockSize);
 		std::vector<uint8_t> output_bool_gpu(width_in_blocks_ * height_in_blocks_);
@@ -439,34 +418,11 @@ void OutputImageComponent::ApplyGlobalQuantization(const int q[kDCTBlockSize]) {
 		//calculate CPU data
 		_ApplyGlobalQuantization(q);
 
-		int count = 0;
-		for (int i = 0; i < output_coeff_gpu.size(); i++)
-		{
-			if (coeffs_[i] != output_coeff_gpu[i])
-			{
-				count++;
-			}
-		}
-		if (count > 0)
-		{
-			LogError("CHK %s(%d) %d:%d\r\n", "ApplyGlobalQuantization coeff", __LINE__, count, output_coeff_gpu.size());
-		}
-
-		count = 0;
-		for (int i = 0; i < output_pixel_gpu.size(); i++)
-		{
-			if (pixels_[i] != output_pixel_gpu[i])
-			{
-				count++;
-			}
-		}
-		if (count > 0)
-		{
-			LogError("CHK %s(%d) %d:%d\r\n", "ApplyGlobalQuantization pixel", __LINE__, count, output_pixel_gpu.size());
-		}
-		else {
-			LogError("");
-		}
+		DiffReport* report = DiffReport::Global();
+		report->CompareBlocks("ApplyGlobalQuantization coeff", coeffs_.data(),
+			output_coeff_gpu.data(), coeffs_.size(), width_in_blocks_);
+		report->Compare("ApplyGlobalQuantization pixel", pixels_.data(),
+			output_pixel_gpu.data(), pixels_.size(), width_, height_);
 	}
 #endif
 
@@ -646,31 +602,29 @@ void OutputImage::_ToSRGB(std::vector<uint8_t> &rgb, int xmin, int ymin,
 	{
 		components_[c].ToPixels(xmin, ymin, xsize, ysize, &rgb[c], 3);
 	}
-	for (size_t p = 0; p < rgb.size(); p += 3) {
-		ColorTransformYCbCrToRGB(&rgb[p]);
-	}
+	GetCpuKernels().ycbcr_to_rgb(rgb.data(), rgb.size() / 3);
 }
 
 std::vector<uint8_t> OutputImage::ToSRGB(int xmin, int ymin,
                                          int xsize, int ysize) const {
   std::vector<uint8_t> rgb(xsize * ysize * 3);
 
-  if (MODE_CPU_OPT == g_mathMode || MODE_CPU == g_mathMode)
+  if (MODE_CPU_OPT == CurrentMathMode() || MODE_CPU == CurrentMathMode())
   {
 	  _ToSRGB(rgb, xmin, ymin, xsize, ysize);
   }
 #ifdef __USE_OPENCL__
-  else if (MODE_OPENCL == g_mathMode) {
+  else if (MODE_OPENCL == CurrentMathMode()) {
 	  clComponentsToPixels(rgb.data(), xmin, ymin, xsize, ysize, components_);
   }
 #endif
 #ifdef __USE_CUDA__
-  else if (MODE_CUDA == g_mathMode) {
+  else if (MODE_CUDA == CurrentMathMode()) {
 	  cuComponentsToPixels(rgb.data(), xmin, ymin, xsize, ysize, components_);
   }
 #endif
 #ifdef __USE_OPENCL__
-  else if (MODE_CHECKCL == g_mathMode)
+  else if (MODE_CHECKCL == CurrentMathMode())
   {
 	  std::vector<uint8_t> rgb_gpu(xsize * ysize * 3);
 	  //calculate GPU data
@@ -678,18 +632,8 @@ std::vector<uint8_t> OutputImage::ToSRGB(int xmin, int ymin,
 	  //calculate CPU data
 	  _ToSRGB(rgb, xmin, ymin, xsize, ysize);
 
-	  int count = 0;
-	  for (int i = 0; i < rgb_gpu.size(); i++)
-	  {
-		  if (rgb[i] != rgb_gpu[i])
-		  {
-			  count++;
-		  }
-	  }
-	  if (count > 0)
-	  {
-		  LogError("CHK %s(%d) %d:%d\r\n", "OutputImage::ToSRGB", __LINE__, count, rgb_gpu.size());
-	  }
+	  DiffReport::Global()->Compare("OutputImage::ToSRGB", rgb.data(),
+		  rgb_gpu.data(), rgb.size());
   }
 #endif
 
@@ -700,13 +644,71 @@ std::vector<uint8_t> OutputImage::ToSRGB() const {
   return ToSRGB(0, 0, width_, height_);
 }
 
+void OutputImage::_ToLinearRGB(int xmin, int ymin, int xsize, int ysize,
+                               std::vector<std::vector<float> >* rgb) const {
+  const double* lut = Srgb8ToLinearTable();
+  const uint16_t* pixels[3] = { components_[0].pixels(),
+                                components_[1].pixels(),
+                                components_[2].pixels() };
+  float* out[3] = { &(*rgb)[0][0], &(*rgb)[1][0], &(*rgb)[2][0] };
+  for (int oy = 0, p = 0; oy < ysize; ++oy) {
+    // Pixels past the image edge duplicate the edge pixels, as in ToPixels().
+    const int y = std::min(ymin + oy, height_ - 1);
+    for (int ox = 0; ox < xsize; ++ox, ++p) {
+      const int x = std::min(xmin + ox, width_ - 1);
+      const int px = y * width_ + x;
+      uint8_t pixel[3];
+      for (int c = 0; c < 3; ++c) {
+        pixel[c] = static_cast<uint8_t>((pixels[c][px] + 8 - (x & 1)) >> 4);
+      }
+      ColorTransformYCbCrToRGB(pixel);
+      for (int c = 0; c < 3; ++c) {
+        out[c][p] = static_cast<float>(lut[pixel[c]]);
+      }
+    }
+  }
+}
+
 void OutputImage::ToLinearRGB(int xmin, int ymin, int xsize, int ysize,
                               std::vector<std::vector<float> >* rgb) const {
-  const double* lut = Srgb8ToLinearTable();
-  std::vector<uint8_t> rgb_pixels = ToSRGB(xmin, ymin, xsize, ysize);
-  for (int p = 0; p < xsize * ysize; ++p) {
-    for (int i = 0; i < 3; ++i) {
-      (*rgb)[i][p] = static_cast<float>(lut[rgb_pixels[3 * p + i]]);
+  if (MODE_CPU_OPT == CurrentMathMode() || MODE_CPU == CurrentMathMode())
+  {
+    _ToLinearRGB(xmin, ymin, xsize, ysize, rgb);
+  }
+#ifdef __USE_OPENCL__
+  else if (MODE_OPENCL == CurrentMathMode())
+  {
+    clComponentsToLinearRGB((*rgb)[0].data(), (*rgb)[1].data(), (*rgb)[2].data(),
+                            xmin, ymin, xsize, ysize, *this);
+  }
+  else if (MODE_CHECKCL == CurrentMathMode())
+  {
+    std::vector<std::vector<float> > rgb_gpu(3, std::vector<float>(xsize * ysize));
+    //calculate GPU data
+    clComponentsToLinearRGB(rgb_gpu[0].data(), rgb_gpu[1].data(), rgb_gpu[2].data(),
+                            xmin, ymin, xsize, ysize, *this);
+    //calculate CPU data
+    _ToLinearRGB(xmin, ymin, xsize, ysize, rgb);
+
+    // The planes one after the other, so that a mismatch names its channel.
+    std::vector<float> cpu_planes, gpu_planes;
+    for (int c = 0; c < 3; c++)
+    {
+      cpu_planes.insert(cpu_planes.end(), (*rgb)[c].begin(), (*rgb)[c].end());
+      gpu_planes.insert(gpu_planes.end(), rgb_gpu[c].begin(), rgb_gpu[c].end());
+    }
+    DiffReport::Global()->Compare("OutputImage::ToLinearRGB", cpu_planes.data(),
+                                  gpu_planes.data(), cpu_planes.size(), xsize, ysize);
+  }
+#endif
+  else
+  {
+    const double* lut = Srgb8ToLinearTable();
+    std::vector<uint8_t> rgb_pixels = ToSRGB(xmin, ymin, xsize, ysize);
+    for (int p = 0; p < xsize * ysize; ++p) {
+      for (int i = 0; i < 3; ++i) {
+        (*rgb)[i][p] = static_cast<float>(lut[rgb_pixels[3 * p + i]]);
+      }
     }
   }
 }
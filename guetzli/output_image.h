@@ -21,6 +21,7 @@
 #include <vector>
 
 #include "guetzli/jpeg_data.h"
+#include "guetzli/memory_account.h"
 
 namespace guetzli {
 
@@ -93,8 +94,8 @@ class OutputImageComponent {
   int width_in_blocks_;
   int height_in_blocks_;
   int num_blocks_;
-  std::vector<coeff_t> coeffs_;
-  std::vector<uint16_t> pixels_;
+  tracked_vector<coeff_t> coeffs_;
+  tracked_vector<uint16_t> pixels_;
   // Same as last argument of ApplyGlobalQuantization() (default is all 1s).
   int quant_[kDCTBlockSize];
 };
@@ -158,6 +159,11 @@ private:
   void _ToSRGB(std::vector<uint8_t> &rgb, int xmin, int ymin,
 		       int xsize, int ysize) const;
 
+  // Same result as ToSRGB() followed by Srgb8ToLinearTable(), without the
+  // intermediate interleaved 8-bit buffer.
+  void _ToLinearRGB(int xmin, int ymin, int xsize, int ysize,
+                    std::vector<std::vector<float> >* rgb) const;
+
  private:
   const int width_;
   const int height_;
@@ -24,12 +24,15 @@
 #include "guetzli/butteraugli_comparator.h"
 #include "guetzli/comparator.h"
 #include "guetzli/debug_print.h"
+#include "guetzli/diff_report.h"
 #include "guetzli/fast_log.h"
 #include "guetzli/jpeg_data_decoder.h"
 #include "guetzli/jpeg_data_encoder.h"
 #include "guetzli/jpeg_data_reader.h"
 #include "guetzli/jpeg_data_writer.h"
+#include "guetzli/memory_account.h"
 #include "guetzli/output_image.h"
+#include "guetzli/profiler.h"
 #include "guetzli/quantize.h"
 #include "clguetzli/clguetzli.h"
 
@@ -65,8 +68,8 @@ class Processor {
       const double target_mul,
       bool stop_early,
       std::vector<int> &candidate_coeff_offsets,
-      std::vector<uint8_t>& candidate_coeffs,
-      std::vector<float> &candidate_coeff_errors);
+      tracked_vector<uint8_t>& candidate_coeffs,
+      tracked_vector<float> &candidate_coeff_errors);
 
   void ComputeBlockZeroingOrder(
       const coeff_t block[kBlockSize], const coeff_t orig_block[kBlockSize],
@@ -74,6 +77,13 @@ class Processor {
       const int factor_y, const uint8_t comp_mask, OutputImage* img,
       std::vector<CoeffData>* output_order);
 
+  // Computes the zeroing order of every block of |img| with the backend of
+  // the current math mode. Returns it, it lives in one of the two vectors.
+  CoeffData* ComputeBlockZeroingOrders(const JPEGData& jpg, OutputImage* img,
+      const uint8_t comp_mask,
+      tracked_vector<CoeffData>& output_order_gpu,
+      tracked_vector<CoeffData>& output_order_cpu);
+
   bool SelectQuantMatrix(const JPEGData& jpg_in, const bool downsample,
                          int best_q[3][kDCTBlockSize],
                          OutputImage* img);
@@ -81,7 +91,13 @@ class Processor {
                            const float target_mul,
                            int q[3][kDCTBlockSize],
                            OutputImage* img);
-  void MaybeOutput(const std::string& encoded_jpg);
+  // The search of ProcessJpegData, may throw MemoryLimitExceeded.
+  void ProcessJpegDataStages(const JPEGData& jpg_in, bool input_is_420,
+                             int q_in[3][kDCTBlockSize],
+                             const std::string& encoded_jpg);
+  // Keeps |encoded_jpg| if it scores best so far, and adds |record| with the
+  // outcome to stats_->iterations.
+  void MaybeOutput(const std::string& encoded_jpg, IterationRecord* record);
   void DownsampleImage(OutputImage* img);
   void OutputJpeg(const JPEGData& in, std::string* out);
 
@@ -115,6 +131,16 @@ void Processor::DownsampleImage(OutputImage* img) {
   img->Downsample(cfg);
 }
 
+// The coefficients of |jpg|, which the encode charges with a
+// MemoryReservation as JPEGComponent::coeffs is a std::vector.
+size_t CoeffMemory(const JPEGData& jpg) {
+  size_t bytes = 0;
+  for (const JPEGComponent& comp : jpg.components) {
+    bytes += comp.coeffs.capacity() * sizeof(coeff_t);
+  }
+  return bytes;
+}
+
 bool CheckJpegSanity(const JPEGData& jpg) {
   const int kMaxComponent = 1 << 12;
   for (const JPEGComponent& comp : jpg.components) {
@@ -141,6 +167,7 @@ int GuetzliStringOut(void* data, const uint8_t* buf, size_t count) {
 
 void Processor::OutputJpeg(const JPEGData& jpg,
                            std::string* out) {
+  ScopedProfileZone zone("OutputJpeg");
   out->clear();
   JPEGOutput output(GuetzliStringOut, out);
   if (!WriteJpeg(jpg, params_.clear_metadata, output)) {
@@ -148,15 +175,22 @@ void Processor::OutputJpeg(const JPEGData& jpg,
   }
 }
 
-void Processor::MaybeOutput(const std::string& encoded_jpg) {
+void Processor::MaybeOutput(const std::string& encoded_jpg,
+                            IterationRecord* record) {
   double score = comparator_->ScoreOutputSize(encoded_jpg.size());
   GUETZLI_LOG(stats_, " Score[%.4f]", score);
+  record->size = encoded_jpg.size();
+  record->distance = comparator_->distmap_aggregate();
+  record->score = score;
   if (score < final_output_->score || final_output_->score < 0) {
     final_output_->jpeg_data = encoded_jpg;
     final_output_->score = score;
+    record->best = true;
     GUETZLI_LOG(stats_, " (*)");
   }
   GUETZLI_LOG(stats_, "\n");
+  stats_->iterations.push_back(*record);
+  ProfileInstant(record->phase, "iteration", record->size);
 }
 
 bool CompareQuantData(const QuantData& a, const QuantData& b) {
@@ -311,6 +345,7 @@ QuantData Processor::TryQuantMatrix(const JPEGData& jpg_in,
                                     const float target_mul,
                                     int q[3][kDCTBlockSize],
                                     OutputImage* img) {
+  const uint64_t start_ns = ProfileNowNs();
   QuantData data;
   memcpy(data.q, q, sizeof(data.q));
   img->CopyFromJpegData(jpg_in);
@@ -318,7 +353,9 @@ QuantData Processor::TryQuantMatrix(const JPEGData& jpg_in,
   std::string encoded_jpg;
   {
     JPEGData jpg_out = jpg_in;
+    MemoryReservation jpg_out_memory(CoeffMemory(jpg_out));
     img->SaveToJpegData(&jpg_out);
+    jpg_out_memory.Set(CoeffMemory(jpg_out));
     OutputJpeg(jpg_out, &encoded_jpg);
   }
   GUETZLI_LOG(stats_, "Iter %2d: %s quantization matrix:\n",
@@ -330,16 +367,27 @@ QuantData Processor::TryQuantMatrix(const JPEGData& jpg_in,
               img->FrameTypeStr().c_str(),
               QuantMatrixHeuristicScore(q), encoded_jpg.size());
   ++stats_->counters[kNumItersCnt];
-  comparator_->Compare(*img);
+  {
+    ScopedProfileZone zone("Compare");
+    comparator_->Compare(*img);
+  }
   data.dist_ok = comparator_->DistanceOK(target_mul);
   data.jpg_size = encoded_jpg.size();
-  MaybeOutput(encoded_jpg);
+  IterationRecord record;
+  record.iteration = stats_->counters[kNumItersCnt];
+  record.phase = "quantization";
+  record.frame_type = img->FrameTypeStr();
+  record.comp_mask = (1 << jpg_in.components.size()) - 1;
+  record.quant_score = QuantMatrixHeuristicScore(q);
+  record.wall_ns = ProfileNowNs() - start_ns;
+  MaybeOutput(encoded_jpg, &record);
   return data;
 }
 
 bool Processor::SelectQuantMatrix(const JPEGData& jpg_in, const bool downsample,
                                   int best_q[3][kDCTBlockSize],
                                   OutputImage* img) {
+  ScopedProfileZone zone("SelectQuantMatrix");
   QuantMatrixGenerator qgen(downsample, stats_);
   // Don't try to go up to exactly the target distance when selecting a
   // quantization matrix, since we will need some slack to do the frequency
@@ -455,7 +503,7 @@ void Processor::ComputeBlockZeroingOrder(
 				  block_x, block_y, &processed_block[c * kDCTBlockSize]);
 		  }
 	  }
-	  if (MODE_CPU_OPT == g_mathMode)
+	  if (MODE_CPU_OPT == CurrentMathMode())
 	  {
 		  if (best_err >= comparator_->BlockErrorLimit())
 		  {   
@@ -556,29 +604,26 @@ size_t EstimateDCSize(const JPEGData& jpg) {
 
 }  // namespace
 
-void Processor::SelectFrequencyMasking(const JPEGData& jpg, OutputImage* img, const uint8_t comp_mask, 
-                                       const double target_mul, bool stop_early)
+CoeffData* Processor::ComputeBlockZeroingOrders(const JPEGData& jpg, OutputImage* img,
+                                                 const uint8_t comp_mask,
+                                                 tracked_vector<CoeffData>& output_order_gpu,
+                                                 tracked_vector<CoeffData>& output_order_cpu)
 {
+    ScopedProfileZone zone("ComputeBlockZeroingOrder");
     const int width = img->width();
     const int height = img->height();
-    const int ncomp = jpg.components.size();
     const int last_c = Log2FloorNonZero(comp_mask);
-    if (static_cast<size_t>(last_c) >= jpg.components.size()) return;
     const int factor_x = img->component(last_c).factor_x();
     const int factor_y = img->component(last_c).factor_y();
     const int block_width = (width + 8 * factor_x - 1) / (8 * factor_x);
     const int block_height = (height + 8 * factor_y - 1) / (8 * factor_y);
     const int num_blocks = block_width * block_height;
 
-
     comparator_->StartBlockComparisons();
 
-    std::vector<CoeffData> output_order_gpu;
-    std::vector<CoeffData> output_order_cpu;
-
 	CoeffData * output_order = NULL;
 #if defined(__USE_OPENCL__) || defined(__USE_CUDA__)
-    if (MODE_OPENCL == g_mathMode || MODE_CUDA == g_mathMode)
+    if (MODE_OPENCL == CurrentMathMode() || MODE_CHECKCL == CurrentMathMode() || MODE_CUDA == CurrentMathMode())
     {
 		ButteraugliComparatorEx * comp = (ButteraugliComparatorEx*)comparator_;
 
@@ -601,7 +646,7 @@ void Processor::SelectFrequencyMasking(const JPEGData& jpg, OutputImage* img, co
         output_order_gpu.resize(num_blocks * kBlockSize);
         output_order = output_order_gpu.data();
 #ifdef __USE_OPENCL__
-        if (MODE_OPENCL == g_mathMode || MODE_CHECKCL == g_mathMode)
+        if (MODE_OPENCL == CurrentMathMode() || MODE_CHECKCL == CurrentMathMode())
         {
             clComputeBlockZeroingOrder(output_order,
                 orig_channel,
@@ -616,7 +661,7 @@ void Processor::SelectFrequencyMasking(const JPEGData& jpg, OutputImage* img, co
         }
 #endif
 #ifdef __USE_CUDA__
-        if(MODE_CUDA == g_mathMode)
+        if(MODE_CUDA == CurrentMathMode())
         {
             cuComputeBlockZeroingOrder(output_order,
                 orig_channel,
@@ -633,9 +678,9 @@ void Processor::SelectFrequencyMasking(const JPEGData& jpg, OutputImage* img, co
     }
 #endif
 #ifdef __USE_OPENCL__
-    if (MODE_CPU_OPT == g_mathMode || MODE_CPU == g_mathMode || MODE_CHECKCL == g_mathMode)
+    if (MODE_CPU_OPT == CurrentMathMode() || MODE_CPU == CurrentMathMode() || MODE_CHECKCL == CurrentMathMode())
 #else
-	if (MODE_CPU_OPT == g_mathMode || MODE_CPU == g_mathMode)
+	if (MODE_CPU_OPT == CurrentMathMode() || MODE_CPU == CurrentMathMode())
 #endif
     {
         output_order_cpu.resize(num_blocks * kBlockSize);
@@ -672,28 +717,39 @@ void Processor::SelectFrequencyMasking(const JPEGData& jpg, OutputImage* img, co
     }
 
 #ifdef __USE_OPENCL__
-    if (MODE_CHECKCL == g_mathMode)
+    if (MODE_CHECKCL == CurrentMathMode())
     {
-        int count = 0;
-        int check_size = output_order_gpu.size();
-        for (int i = 0; i < check_size; i++)
-        {
-            if (output_order_cpu[i].idx != output_order_gpu[i].idx ||
-                fabs(output_order_cpu[i].block_err - output_order_gpu[i].block_err) > 0.001)
-            {
-                count++;
-            }
-        }
-        if (count > 0)
-        {
-            LogError("CHK %s(%d) %d:%d\r\n", "SelectFrequencyMasking", __LINE__, count, check_size);
-        }
+        CompareBlockZeroingOrder("SelectFrequencyMasking", output_order_cpu.data(),
+            output_order_gpu.data(), num_blocks, block_width);
     }
 #endif
 
+    return output_order;
+}
+
+void Processor::SelectFrequencyMasking(const JPEGData& jpg, OutputImage* img, const uint8_t comp_mask, 
+                                       const double target_mul, bool stop_early)
+{
+    const int width = img->width();
+    const int height = img->height();
+    const int ncomp = jpg.components.size();
+    const int last_c = Log2FloorNonZero(comp_mask);
+    if (static_cast<size_t>(last_c) >= jpg.components.size()) return;
+    const int factor_x = img->component(last_c).factor_x();
+    const int factor_y = img->component(last_c).factor_y();
+    const int block_width = (width + 8 * factor_x - 1) / (8 * factor_x);
+    const int block_height = (height + 8 * factor_y - 1) / (8 * factor_y);
+    const int num_blocks = block_width * block_height;
+
+
+    tracked_vector<CoeffData> output_order_gpu;
+    tracked_vector<CoeffData> output_order_cpu;
+    CoeffData * output_order = ComputeBlockZeroingOrders(jpg, img, comp_mask,
+        output_order_gpu, output_order_cpu);
+
     std::vector<int> candidate_coeff_offsets(num_blocks + 1);
-    std::vector<uint8_t> candidate_coeffs;
-    std::vector<float> candidate_coeff_errors;
+    tracked_vector<uint8_t> candidate_coeffs;
+    tracked_vector<float> candidate_coeff_errors;
 
     for (int block_y = 0, block_ix = 0; block_y < block_height; ++block_y) {
         for (int block_x = 0; block_x < block_width; ++block_x, ++block_ix) {
@@ -728,9 +784,10 @@ void Processor::SelectFrequencyBackEnd(const JPEGData& jpg, OutputImage* img,
                                         const double target_mul, 
                                         bool stop_early,
                                         std::vector<int> &candidate_coeff_offsets,
-                                        std::vector<uint8_t>& candidate_coeffs,
-                                        std::vector<float> &candidate_coeff_errors)
+                                        tracked_vector<uint8_t>& candidate_coeffs,
+                                        tracked_vector<float> &candidate_coeff_errors)
 {
+    ScopedProfileZone zone("SelectFrequencyBackEnd");
     const int ncomp = jpg.components.size();
     const int width = img->width();
     const int height = img->height();
@@ -746,7 +803,9 @@ void Processor::SelectFrequencyBackEnd(const JPEGData& jpg, OutputImage* img,
   int jpg_header_size, dc_size;
   {
     JPEGData jpg_out = jpg;
+    MemoryReservation jpg_out_memory(CoeffMemory(jpg_out));
     img->SaveToJpegData(&jpg_out);
+    jpg_out_memory.Set(CoeffMemory(jpg_out));
     jpg_header_size = JpegHeaderSize(jpg_out, params_.clear_metadata);
     dc_size = EstimateDCSize(jpg_out);
     BuildACHistograms(jpg_out, &ac_histograms[0]);
@@ -763,6 +822,9 @@ void Processor::SelectFrequencyBackEnd(const JPEGData& jpg, OutputImage* img,
   bool first_up_iter = true;
   for (int direction : {1, -1}) {
     for (;;) {
+      ScopedProfileZone iteration_zone(direction > 0 ? "iteration up"
+                                                     : "iteration down");
+      const uint64_t iteration_start_ns = ProfileNowNs();
       if (stop_early && direction == -1) {
         if (prev_size > 1.01 * final_output_->jpeg_data.size()) {
           // If we are down-adjusting the error, the output size will only keep
@@ -902,7 +964,9 @@ void Processor::SelectFrequencyBackEnd(const JPEGData& jpg, OutputImage* img,
       std::string encoded_jpg;
       {
         JPEGData jpg_out = jpg;
+        MemoryReservation jpg_out_memory(CoeffMemory(jpg_out));
         img->SaveToJpegData(&jpg_out);
+        jpg_out_memory.Set(CoeffMemory(jpg_out));
         OutputJpeg(jpg_out, &encoded_jpg);
       }
       GUETZLI_LOG(stats_,
@@ -914,8 +978,24 @@ void Processor::SelectFrequencyBackEnd(const JPEGData& jpg, OutputImage* img,
                   blocks_to_change, num_blocks, val_threshold,
                   encoded_jpg.size(),
                   100.0 - (100.0 * est_jpg_size) / encoded_jpg.size());
-      comparator_->Compare(*img);
-      MaybeOutput(encoded_jpg);
+      {
+        ScopedProfileZone compare_zone("Compare");
+        comparator_->Compare(*img);
+      }
+      IterationRecord record;
+      record.iteration = stats_->counters[kNumItersCnt];
+      record.phase = "zeroing";
+      record.frame_type = img->FrameTypeStr();
+      record.comp_mask = comp_mask;
+      record.direction = direction;
+      record.changed_coeffs = changed_coeffs;
+      record.candidate_coeffs = global_order_size;
+      record.changed_blocks = changed_blocks.size();
+      record.blocks_to_change = blocks_to_change;
+      record.num_blocks = num_blocks;
+      record.estimated_size = est_jpg_size;
+      record.wall_ns = ProfileNowNs() - iteration_start_ns;
+      MaybeOutput(encoded_jpg, &record);
       prev_size = est_jpg_size;
     }
   }
@@ -971,28 +1051,60 @@ bool Processor::ProcessJpegData(const Params& params, const JPEGData& jpg_in,
     // Butteraugli doesn't work with images this small.
     return true;
   }
+  try {
+    ProcessJpegDataStages(jpg_in, input_is_420, q_in, encoded_jpg);
+  } catch (const MemoryLimitExceeded& e) {
+    // Degrade to the best result found so far, which is at worst the input
+    // with its original quantization.
+    GUETZLI_LOG(stats, "\nMemory limit reached in %s, stopping the search.\n",
+                e.stage);
+    if (stats) ++stats->counters[kMemoryLimitCnt];
+    if (final_output_->score < 0) {
+      final_output_->jpeg_data = encoded_jpg;
+      final_output_->score = encoded_jpg.size();
+    }
+  }
+  return true;
+}
+
+void Processor::ProcessJpegDataStages(const JPEGData& jpg_in,
+                                      bool input_is_420,
+                                      int q_in[3][kDCTBlockSize],
+                                      const std::string& encoded_jpg) {
+  IterationRecord original;
   {
+    const uint64_t start_ns = ProfileNowNs();
+    ScopedMemoryStage stage("compare");
     JPEGData jpg = jpg_in;
+    MemoryReservation jpg_memory(CoeffMemory(jpg));
     RemoveOriginalQuantization(&jpg, q_in);
     OutputImage img(jpg.width, jpg.height);
     img.CopyFromJpegData(jpg);
+    ScopedProfileZone zone("Compare");
     comparator_->Compare(img);
+    original.phase = "original";
+    original.frame_type = img.FrameTypeStr();
+    original.comp_mask = (1 << jpg.components.size()) - 1;
+    original.wall_ns = ProfileNowNs() - start_ns;
   }
-  MaybeOutput(encoded_jpg);
+  MaybeOutput(encoded_jpg, &original);
   int try_420 = (input_is_420 || params_.force_420 ||
                  (params_.try_420 && !IsGrayscale(jpg_in))) ? 1 : 0;
   int force_420 = (input_is_420 || params_.force_420) ? 1 : 0;
   for (int downsample = force_420; downsample <= try_420; ++downsample) {
     JPEGData jpg = jpg_in;
+    MemoryReservation jpg_memory(CoeffMemory(jpg));
     RemoveOriginalQuantization(&jpg, q_in);
     OutputImage img(jpg.width, jpg.height);
     img.CopyFromJpegData(jpg);
     if (downsample) {
       DownsampleImage(&img);
       img.SaveToJpegData(&jpg);
+      jpg_memory.Set(CoeffMemory(jpg));
     }
     int best_q[3][kDCTBlockSize];
     memcpy(best_q, q_in, sizeof(best_q));
+    ScopedMemoryStage stage("quantization");
     if (!SelectQuantMatrix(jpg, downsample != 0, best_q, &img)) {
       for (int c = 0; c < 3; ++c) {
         for (int i = 0; i < kDCTBlockSize; ++i) {
@@ -1003,6 +1115,7 @@ bool Processor::ProcessJpegData(const Params& params, const JPEGData& jpg_in,
     img.CopyFromJpegData(jpg);
     img.ApplyGlobalQuantization(best_q);
 
+    ScopedMemoryStage zeroing_stage("zeroing");
     if (!downsample) {
       SelectFrequencyMasking(jpg, &img, 7, 1.0, false);
     } else {
@@ -1011,8 +1124,6 @@ bool Processor::ProcessJpegData(const Params& params, const JPEGData& jpg_in,
       SelectFrequencyMasking(jpg, &img, 6, 1.0, true);
     }
   }
-
-  return true;
 }
 
 bool ProcessJpegData(const Params& params, const JPEGData& jpg_in,
@@ -1022,14 +1133,21 @@ bool ProcessJpegData(const Params& params, const JPEGData& jpg_in,
   return processor.ProcessJpegData(params, jpg_in, comparator, out, stats);
 }
 
-bool Process(const Params& params, ProcessStats* stats,
-             const std::string& data,
-             std::string* jpg_out) {
+namespace {
+
+bool ProcessJpeg(const Params& params, ProcessStats* stats,
+                 const uint8_t* data, size_t len,
+                 std::string* jpg_out) {
+  ScopedMemoryStage stage("input");
   JPEGData jpg;
-  if (!ReadJpeg(data, JPEG_READ_ALL, &jpg)) {
-    fprintf(stderr, "Can't read jpg data from input file\n");
-    return false;
+  {
+    ScopedProfileZone zone("ReadJpeg");
+    if (!ReadJpeg(data, len, JPEG_READ_ALL, &jpg)) {
+      fprintf(stderr, "Can't read jpg data from input file\n");
+      return false;
+    }
   }
+  MemoryReservation jpg_memory(CoeffMemory(jpg));
   if (!CheckJpegSanity(jpg)) {
     fprintf(stderr, "Unsupported input JPEG (unexpectedly large coefficient "
             "values).\n");
@@ -1037,7 +1155,9 @@ bool Process(const Params& params, ProcessStats* stats,
   }
   std::vector<uint8_t> rgb = DecodeJpegToRGB(jpg);
   if (rgb.empty()) {
-    return ProcessUnsupportedJpegData(params,stats,data,jpg_out);
+    return ProcessUnsupportedJpegData(
+        params, stats, std::string(reinterpret_cast<const char*>(data), len),
+        jpg_out);
   }
   GuetzliOutput out;
   ProcessStats dummy_stats;
@@ -1061,6 +1181,8 @@ bool Process(const Params& params, ProcessStats* stats,
   return ok;
 }
 
+}  // namespace
+
 #ifdef __SUPPORT_FULL_JPEG__
 static void cmyk2rgb(unsigned char *srcbuf, unsigned char *dstbuf, unsigned long size) {
 	for (int cmykOffset = 0; cmykOffset < size; cmykOffset += 4) {
@@ -1150,14 +1272,21 @@ bool ProcessUnsupportedJpegData(const Params& params, ProcessStats* stats,
 #endif
 }
 
-bool Process(const Params& params, ProcessStats* stats,
-             const std::vector<uint8_t>& rgb, int w, int h,
-             std::string* jpg_out) {
+namespace {
+
+bool ProcessRGB(const Params& params, ProcessStats* stats,
+                const std::vector<uint8_t>& rgb, int w, int h,
+                std::string* jpg_out) {
+  ScopedMemoryStage stage("input");
   JPEGData jpg;
-  if (!EncodeRGBToJpeg(rgb, w, h, &jpg)) {
-    fprintf(stderr, "Could not create jpg data from rgb pixels\n");
-    return false;
+  {
+    ScopedProfileZone zone("EncodeRGBToJpeg");
+    if (!EncodeRGBToJpeg(rgb, w, h, &jpg)) {
+      fprintf(stderr, "Could not create jpg data from rgb pixels\n");
+      return false;
+    }
   }
+  MemoryReservation jpg_memory(CoeffMemory(jpg));
   GuetzliOutput out;
   ProcessStats dummy_stats;
   if (stats == nullptr) {
@@ -1180,4 +1309,88 @@ bool Process(const Params& params, ProcessStats* stats,
   return ok;
 }
 
+// Runs |process| with a Profiler for stats->profile unless the caller
+// already profiles, and reports the timings to |stats|.
+template <typename F>
+bool ProcessWithProfiler(ProcessStats* stats, F process) {
+  if (!stats || stats->profile == kProfileOff || Profiler::Current()) {
+    return process();
+  }
+  Profiler profiler(stats->profile);
+  bool ok;
+  {
+    ScopedProfiler scoped_profiler(&profiler);
+    ok = process();
+  }
+  profiler.Report(stats);
+  return ok;
+}
+
+// Runs |process| with a MemoryAccount for params.memory_limit unless the
+// caller already tracks memory, and reports the peaks to |stats|. Runs it
+// through ProcessWithProfiler either way.
+template <typename F>
+bool ProcessWithMemoryAccount(const Params& params, ProcessStats* stats,
+                              F process) {
+  if (MemoryAccount::Current()) {
+    return ProcessWithProfiler(stats, process);
+  }
+  MemoryAccount account(params.memory_limit);
+  ScopedMemoryAccount scoped_account(&account);
+  bool ok;
+  try {
+    ok = ProcessWithProfiler(stats, process);
+  } catch (const MemoryLimitExceeded& e) {
+    fprintf(stderr, "Memory limit exceeded in %s. Failing.\n", e.stage);
+    ok = false;
+  }
+  if (stats) account.Report(stats);
+  return ok;
+}
+
+}  // namespace
+
+void CompareBlockZeroingOrder(const char* stage, const CoeffData* a,
+                              const CoeffData* b, size_t num_blocks,
+                              size_t width_in_blocks) {
+  const size_t n = num_blocks * kBlockSize;
+  std::vector<int> idx_a(n), idx_b(n);
+  std::vector<float> err_a(n), err_b(n);
+  for (size_t i = 0; i < n; ++i) {
+    idx_a[i] = a[i].idx;
+    idx_b[i] = b[i].idx;
+    err_a[i] = a[i].block_err;
+    err_b[i] = b[i].block_err;
+  }
+  DiffReport* report = DiffReport::Global();
+  const std::string name(stage);
+  report->CompareBlocks((name + " idx").c_str(), idx_a.data(), idx_b.data(),
+                        n, width_in_blocks, kBlockSize);
+  report->CompareBlocks((name + " block_err").c_str(), err_a.data(),
+                        err_b.data(), n, width_in_blocks, kBlockSize);
+}
+
+bool Process(const Params& params, ProcessStats* stats,
+             const uint8_t* data, size_t len,
+             std::string* jpg_out) {
+  return ProcessWithMemoryAccount(params, stats, [&]() {
+    return ProcessJpeg(params, stats, data, len, jpg_out);
+  });
+}
+
+bool Process(const Params& params, ProcessStats* stats,
+             const std::string& data,
+             std::string* jpg_out) {
+  return Process(params, stats, reinterpret_cast<const uint8_t*>(data.data()),
+                 data.size(), jpg_out);
+}
+
+bool Process(const Params& params, ProcessStats* stats,
+             const std::vector<uint8_t>& rgb, int w, int h,
+             std::string* jpg_out) {
+  return ProcessWithMemoryAccount(params, stats, [&]() {
+    return ProcessRGB(params, stats, rgb, w, h, jpg_out);
+  });
+}
+
 }  // namespace guetzli
@@ -30,6 +30,13 @@ struct CoeffData {
     int idx;
     float block_err;
 };
+
+// Adds the differences of two block zeroing orders of num_blocks blocks, in
+// rows of width_in_blocks, to DiffReport::Global() as the stages
+// "<stage> idx" and "<stage> block_err".
+void CompareBlockZeroingOrder(const char* stage, const CoeffData* a,
+                              const CoeffData* b, size_t num_blocks,
+                              size_t width_in_blocks);
     
 struct Params {
   float butteraugli_target = 1.0;
@@ -39,12 +46,21 @@ struct Params {
   bool use_silver_screen = false;
   int zeroing_greedy_lookahead = 3;
   bool new_zeroing_model = true;
+  // Limit of the tracked memory in bytes, 0 for no limit. When it is reached
+  // the best result found so far is returned.
+  size_t memory_limit = 0;
 };
 
 bool Process(const Params& params, ProcessStats* stats,
              const std::string& in_data,
              std::string* out_data);
 
+// Same as above for JPEG data the caller keeps elsewhere, e.g. mapped from a
+// file.
+bool Process(const Params& params, ProcessStats* stats,
+             const uint8_t* in_data, size_t in_size,
+             std::string* out_data);
+
 struct GuetzliOutput {
   std::string jpeg_data;
   double score;
@@ -0,0 +1,254 @@
+/*
+ * Per-stage timing of one encode.
+ */
+
+#include "guetzli/profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+namespace guetzli {
+
+namespace profiler_internal {
+thread_local int t_level = kProfileOff;
+}  // namespace profiler_internal
+
+namespace {
+
+thread_local Profiler* t_profiler = nullptr;
+thread_local ProfileThread* t_thread = nullptr;
+
+}  // namespace
+
+struct ProfileNode {
+  ProfileNode(const char* n, ProfileNode* p) : name(n), parent(p) {}
+
+  const char* name;
+  ProfileNode* parent;
+  std::vector<ProfileNode*> children;
+  uint64_t count = 0;
+  uint64_t wall_ns = 0;
+  uint64_t cpu_ns = 0;
+};
+
+struct ProfileThread {
+  ProfileThread(std::thread::id i, uint64_t origin, size_t max)
+      : id(i), origin_ns(origin), max_events(max), root(nullptr, nullptr),
+        current(&root) {}
+
+  // The child of the current zone called |name|, created on first use. Names
+  // are compared by address, Report() merges equal names of different
+  // addresses.
+  ProfileNode* Child(const char* name) {
+    for (size_t i = 0; i < current->children.size(); ++i) {
+      if (current->children[i]->name == name) return current->children[i];
+    }
+    nodes.emplace_back(name, current);
+    current->children.push_back(&nodes.back());
+    return &nodes.back();
+  }
+
+  const std::thread::id id;
+  const uint64_t origin_ns;
+  const size_t max_events;
+  std::deque<ProfileNode> nodes;  // Stable addresses.
+  ProfileNode root;
+  ProfileNode* current;
+  int depth = 0;
+  // Grows up to max_events, then the oldest events are overwritten.
+  std::vector<ProfileEvent> ring;
+  uint64_t num_events = 0;
+
+  ProfileEvent* NextEvent() {
+    if (ring.size() < max_events) {
+      ++num_events;
+      ring.push_back(ProfileEvent());
+      return &ring.back();
+    }
+    return &ring[num_events++ % max_events];
+  }
+};
+
+uint64_t ProfileNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t ProfileThreadCpuNs() {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+    return 0;
+  }
+  ULARGE_INTEGER k, u;
+  k.LowPart = kernel.dwLowDateTime;
+  k.HighPart = kernel.dwHighDateTime;
+  u.LowPart = user.dwLowDateTime;
+  u.HighPart = user.dwHighDateTime;
+  return (k.QuadPart + u.QuadPart) * 100;
+#else
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+Profiler::Profiler(int level, size_t max_events)
+    : level_(level), max_events_(std::max<size_t>(max_events, 1)),
+      start_ns_(ProfileNowNs()) {}
+
+Profiler::~Profiler() {}
+
+Profiler* Profiler::Current() { return t_profiler; }
+
+ProfileThread* Profiler::ThreadState() {
+  const std::thread::id id = std::this_thread::get_id();
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    if (threads_[i]->id == id) return threads_[i].get();
+  }
+  threads_.emplace_back(new ProfileThread(id, start_ns_, max_events_));
+  return threads_.back().get();
+}
+
+namespace {
+
+void ReportNode(const ProfileNode& node, const std::string& path,
+                ProcessStats* stats) {
+  for (size_t i = 0; i < node.children.size(); ++i) {
+    const ProfileNode& child = *node.children[i];
+    const std::string child_path =
+        path.empty() ? child.name : path + "/" + child.name;
+    StageTiming& timing = stats->timings[child_path];
+    timing.count += child.count;
+    timing.wall_ns += child.wall_ns;
+    timing.cpu_ns += child.cpu_ns;
+    ReportNode(child, child_path, stats);
+  }
+}
+
+}  // namespace
+
+void Profiler::Report(ProcessStats* stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    ReportNode(threads_[i]->root, std::string(), stats);
+  }
+}
+
+std::vector<ProfileThreadEvents> Profiler::Events(size_t* dropped) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<ProfileThreadEvents> events(threads_.size());
+  *dropped = 0;
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    const ProfileThread& thread = *threads_[i];
+    const uint64_t kept = thread.ring.size();
+    *dropped += thread.num_events - kept;
+    events[i].thread = thread.id;
+    for (uint64_t e = thread.num_events - kept; e < thread.num_events; ++e) {
+      events[i].events.push_back(thread.ring[e % kept]);
+    }
+  }
+  return events;
+}
+
+ScopedProfiler::ScopedProfiler(Profiler* profiler)
+    : previous_profiler_(t_profiler), previous_thread_(t_thread) {
+  t_profiler = profiler;
+  t_thread = profiler ? profiler->ThreadState() : nullptr;
+  profiler_internal::t_level = profiler ? profiler->level() : kProfileOff;
+}
+
+ScopedProfiler::~ScopedProfiler() {
+  t_profiler = previous_profiler_;
+  t_thread = previous_thread_;
+  profiler_internal::t_level =
+      previous_profiler_ ? previous_profiler_->level() : kProfileOff;
+}
+
+void ScopedProfileZone::Begin(const char* name, int level) {
+  thread_ = t_thread;
+  node_ = thread_->Child(name);
+  thread_->current = node_;
+  ++thread_->depth;
+  level_ = level;
+  start_cpu_ns_ = level == kProfileStages ? ProfileThreadCpuNs() : 0;
+  start_ns_ = ProfileNowNs();
+}
+
+void ScopedProfileZone::End() {
+  const uint64_t end_ns = ProfileNowNs();
+  --thread_->depth;
+  thread_->current = node_->parent;
+  ++node_->count;
+  node_->wall_ns += end_ns - start_ns_;
+  if (level_ != kProfileStages) return;
+
+  const uint64_t cpu_ns = ProfileThreadCpuNs() - start_cpu_ns_;
+  node_->cpu_ns += cpu_ns;
+  ProfileEvent* event = thread_->NextEvent();
+  event->type = kProfileSpan;
+  event->name = node_->name;
+  event->category = "stage";
+  event->depth = thread_->depth;
+  event->start_ns = start_ns_ - thread_->origin_ns;
+  event->end_ns = end_ns - thread_->origin_ns;
+  event->cpu_ns = cpu_ns;
+  event->value = 0;
+  event->device = false;
+}
+
+namespace {
+
+void RecordEvent(ProfileEventType type, const char* name,
+                 const char* category, uint64_t start_ns, uint64_t end_ns,
+                 int64_t value, bool device) {
+  ProfileThread* thread = t_thread;
+  if (!thread || !ProfileEventsEnabled()) return;
+  ProfileEvent* event = thread->NextEvent();
+  event->type = type;
+  event->name = name;
+  event->category = category;
+  event->depth = thread->depth;
+  // Spans of a device may have started before the profiler.
+  start_ns = std::max(start_ns, thread->origin_ns);
+  end_ns = std::max(end_ns, start_ns);
+  event->start_ns = start_ns - thread->origin_ns;
+  event->end_ns = end_ns - thread->origin_ns;
+  event->cpu_ns = 0;
+  event->value = value;
+  event->device = device;
+}
+
+}  // namespace
+
+void ProfileInstant(const char* name, const char* category, int64_t value) {
+  const uint64_t now = ProfileNowNs();
+  RecordEvent(kProfileInstant, name, category, now, now, value, false);
+}
+
+void ProfileCounter(const char* name, int64_t value) {
+  const uint64_t now = ProfileNowNs();
+  RecordEvent(kProfileCounter, name, "counter", now, now, value, false);
+}
+
+void ProfileSpan(const char* name, const char* category, uint64_t start_ns,
+                 uint64_t end_ns, int64_t value) {
+  RecordEvent(kProfileSpan, name, category, start_ns, end_ns, value, false);
+}
+
+void ProfileDeviceSpan(const char* name, const char* category,
+                       uint64_t start_ns, uint64_t end_ns, int64_t value) {
+  RecordEvent(kProfileSpan, name, category, start_ns, end_ns, value, true);
+}
+
+}  // namespace guetzli
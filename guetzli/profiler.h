@@ -0,0 +1,172 @@
+/*
+ * Per-stage timing of one encode.
+ *
+ * ScopedProfileZone times a scope of the calling thread. Zones nest: while a
+ * Profiler is installed with ScopedProfiler, every thread keeps the call tree
+ * of the zones it entered with their count, wall and CPU time, and records
+ * each finished stage zone with nanosecond timestamps in a bounded ring
+ * buffer. Without a Profiler a zone only reads a thread local.
+ *
+ * The same ring buffers take structured events: instants and counters of
+ * the code that emits them, and spans measured elsewhere, e.g. on a GPU
+ * queue. Traces are written from Profiler::Events().
+ *
+ * The PROFILER_FUNC and PROFILER_ZONE macros of Butteraugli become detail
+ * zones when it is built with butteraugli_zones.h. Those run per block or
+ * per pixel, so they only count calls and wall time, and stay out of the
+ * ring.
+ */
+
+#ifndef GUETZLI_PROFILER_H_
+#define GUETZLI_PROFILER_H_
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "guetzli/stats.h"
+
+namespace guetzli {
+
+enum ProfileLevel {
+  kProfileOff = 0,
+  kProfileStages = 1,
+  kProfileDetail = 2,
+};
+
+// Monotonic wall clock and CPU time of the calling thread, in nanoseconds.
+uint64_t ProfileNowNs();
+uint64_t ProfileThreadCpuNs();
+
+enum ProfileEventType {
+  kProfileSpan,
+  kProfileInstant,
+  kProfileCounter,
+};
+
+// A recorded event. Times are relative to the start of the Profiler, and
+// end_ns equals start_ns except for spans. Names and categories must outlive
+// the profiler.
+struct ProfileEvent {
+  ProfileEventType type;
+  const char* name;
+  const char* category;  // "stage" for the zones.
+  int depth;             // Of the enclosing zones.
+  uint64_t start_ns;
+  uint64_t end_ns;
+  uint64_t cpu_ns;       // Zones only.
+  int64_t value;         // Counters, and bytes of transfers and allocations.
+  bool device;           // Ran on the device queue fed by the thread.
+};
+
+struct ProfileThreadEvents {
+  std::thread::id thread;
+  std::vector<ProfileEvent> events;  // In the order they were recorded.
+};
+
+struct ProfileNode;
+struct ProfileThread;
+
+class Profiler {
+ public:
+  // Keeps the last kDefaultMaxEvents events per thread, enough for the
+  // timings. Traces ask for more.
+  static const size_t kDefaultMaxEvents = 4096;
+
+  // Records the zones up to |level|, one of ProfileLevel.
+  explicit Profiler(int level, size_t max_events = kDefaultMaxEvents);
+  ~Profiler();
+
+  // The profiler installed on the calling thread, nullptr if none.
+  static Profiler* Current();
+
+  int level() const { return level_; }
+  uint64_t start_ns() const { return start_ns_; }
+
+  // Adds the zones of all threads to stats->timings. Must not run while
+  // other threads are inside zones of this profiler.
+  void Report(ProcessStats* stats) const;
+
+  // The events still in the ring buffers, per thread, and how many were
+  // overwritten. Same restriction as Report().
+  std::vector<ProfileThreadEvents> Events(size_t* dropped) const;
+
+ private:
+  friend class ScopedProfiler;
+
+  Profiler(const Profiler&);
+  Profiler& operator=(const Profiler&);
+
+  ProfileThread* ThreadState();
+
+  const int level_;
+  const size_t max_events_;
+  const uint64_t start_ns_;
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<ProfileThread> > threads_;
+};
+
+// Installs |profiler| on the calling thread for the scope. |profiler| may be
+// nullptr, which disables the zones of the scope.
+class ScopedProfiler {
+ public:
+  explicit ScopedProfiler(Profiler* profiler);
+  ~ScopedProfiler();
+
+ private:
+  Profiler* previous_profiler_;
+  ProfileThread* previous_thread_;
+};
+
+namespace profiler_internal {
+// The level of the profiler installed on this thread, kProfileOff if none.
+extern thread_local int t_level;
+}  // namespace profiler_internal
+
+// Whether events of the calling thread are recorded, which callers may check
+// before they compute the arguments of an event.
+inline bool ProfileEventsEnabled() {
+  return profiler_internal::t_level >= kProfileStages;
+}
+
+// Record an event on the calling thread if a profiler is installed.
+void ProfileInstant(const char* name, const char* category, int64_t value = 0);
+void ProfileCounter(const char* name, int64_t value);
+// |start_ns| and |end_ns| are ProfileNowNs() times.
+void ProfileSpan(const char* name, const char* category, uint64_t start_ns,
+                 uint64_t end_ns, int64_t value = 0);
+// A command of the device queue fed by the calling thread, with its device
+// timestamps converted to ProfileNowNs() time.
+void ProfileDeviceSpan(const char* name, const char* category,
+                       uint64_t start_ns, uint64_t end_ns, int64_t value = 0);
+
+// |name| must outlive the profiler, string literals and __func__ do.
+class ScopedProfileZone {
+ public:
+  explicit ScopedProfileZone(const char* name, int level = kProfileStages)
+      : thread_(nullptr) {
+    if (level <= profiler_internal::t_level) Begin(name, level);
+  }
+  ~ScopedProfileZone() {
+    if (thread_) End();
+  }
+
+ private:
+  ScopedProfileZone(const ScopedProfileZone&);
+  ScopedProfileZone& operator=(const ScopedProfileZone&);
+
+  void Begin(const char* name, int level);
+  void End();
+
+  ProfileThread* thread_;
+  ProfileNode* node_;
+  int level_;
+  uint64_t start_ns_;
+  uint64_t start_cpu_ns_;
+};
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_PROFILER_H_
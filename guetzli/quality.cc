@@ -20,9 +20,6 @@ namespace guetzli {
 
 namespace {
 
-constexpr int kLowestQuality = 70;
-constexpr int kHighestQuality = 110;
-
 // Butteraugli scores that correspond to JPEG quality levels, starting at
 // kLowestQuality. They were computed by taking median BA scores of JPEGs
 // generated using libjpeg-turbo at given quality from a set of PNGs.
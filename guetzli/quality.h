@@ -19,8 +19,19 @@
 
 namespace guetzli {
 
+// The qualities ButteraugliScoreForQuality() tells apart, it clamps the
+// others to this range.
+constexpr int kLowestQuality = 70;
+constexpr int kHighestQuality = 110;
+
 double ButteraugliScoreForQuality(double quality);
 
+// Whether --quality and the daemon requests accept |quality|: the qualities
+// that map to distinct Butteraugli targets.
+inline bool ValidQuality(int quality) {
+  return quality >= kLowestQuality && quality <= kHighestQuality;
+}
+
 }  // namespace guetzli
 
 #endif  // GUETZLI_QUALITY_H_
@@ -0,0 +1,240 @@
+/*
+ * On-disk cache of finished encodes.
+ */
+
+#include "guetzli/result_cache.h"
+
+#ifndef _WIN32
+
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+
+namespace guetzli {
+
+uint64_t XXHash64(const uint8_t* p, size_t size, uint64_t seed) {
+  static const uint64_t kPrime1 = 11400714785074694791ULL;
+  static const uint64_t kPrime2 = 14029467366897019727ULL;
+  static const uint64_t kPrime3 = 1609587929392839161ULL;
+  static const uint64_t kPrime4 = 9650029242287828579ULL;
+  static const uint64_t kPrime5 = 2870177450012600261ULL;
+  auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  auto read64 = [](const uint8_t* q) { uint64_t v; memcpy(&v, q, 8); return v; };
+  auto mix = [&](uint64_t acc, uint64_t v) {
+    return rotl(acc + v * kPrime2, 31) * kPrime1;
+  };
+  auto merge = [&](uint64_t acc, uint64_t v) {
+    return (acc ^ mix(0, v)) * kPrime1 + kPrime4;
+  };
+
+  const uint8_t* end = p + size;
+  uint64_t h;
+  if (size >= 32) {
+    uint64_t v1 = seed + kPrime1 + kPrime2, v2 = seed + kPrime2, v3 = seed,
+             v4 = seed - kPrime1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = mix(v1, read64(p));
+      v2 = mix(v2, read64(p + 8));
+      v3 = mix(v3, read64(p + 16));
+      v4 = mix(v4, read64(p + 24));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+  } else {
+    h = seed + kPrime5;
+  }
+  h += size;
+  for (; p + 8 <= end; p += 8) {
+    h = rotl(h ^ mix(0, read64(p)), 27) * kPrime1 + kPrime4;
+  }
+  if (p + 4 <= end) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    h = rotl(h ^ (v * kPrime1), 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h = rotl(h ^ (*p * kPrime5), 11) * kPrime1;
+  }
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  return h;
+}
+
+std::string ResultCacheKey(const InputView& in_data, const std::string& settings) {
+  const uint8_t* d = reinterpret_cast<const uint8_t*>(settings.data());
+  const size_t d_size = settings.size();
+  const uint64_t hi = XXHash64(d, d_size, XXHash64(in_data.data, in_data.size, 0));
+  const uint64_t lo = XXHash64(d, d_size,
+                               XXHash64(in_data.data, in_data.size, 0x9e3779b97f4a7c15ULL));
+  char key[33];
+  snprintf(key, sizeof(key), "%016llx%016llx", static_cast<unsigned long long>(hi),
+           static_cast<unsigned long long>(lo));
+  return key;
+}
+
+bool ResultCache::Open(std::string* error) {
+  if (mkdir(dir_.c_str(), 0777) != 0 && errno != EEXIST) {
+    *error = "Can't create cache directory " + dir_ + ": " + strerror(errno);
+    return false;
+  }
+  std::vector<Entry> entries;
+  if (!Scan(&entries, error)) return false;
+  std::lock_guard<std::mutex> lock(mutex_);
+  total_bytes_ = 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    total_bytes_ += entries[i].size;
+  }
+  if (total_bytes_ > max_bytes_) {
+    Evict();
+  }
+  return true;
+}
+
+bool ResultCache::Lookup(const std::string& key, std::string* jpeg,
+                         ProcessStats* stats) {
+  const std::string path = Path(key);
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) return false;
+  bool ok = ReadEntry(f, jpeg, stats);
+  fclose(f);
+  if (ok) {
+    utimes(path.c_str(), nullptr);
+  }
+  return ok;
+}
+
+void ResultCache::Store(const std::string& key, const std::string& jpeg,
+                        const ProcessStats& stats) {
+  std::string entry = "GZC1\n";
+  char line[64];
+  for (std::map<std::string, int>::const_iterator it = stats.counters.begin();
+       it != stats.counters.end(); ++it) {
+    snprintf(line, sizeof(line), "counter %d ", it->second);
+    entry += line + it->first + "\n";
+  }
+  for (std::map<std::string, MemoryUsage>::const_iterator it =
+           stats.peak_memory.begin(); it != stats.peak_memory.end(); ++it) {
+    snprintf(line, sizeof(line), "peak %zu %zu ", it->second.host,
+             it->second.device);
+    entry += line + it->first + "\n";
+  }
+  snprintf(line, sizeof(line), "jpeg %zu\n", jpeg.size());
+  entry += line;
+  entry += jpeg;
+  if (entry.size() > max_bytes_) return;
+
+  static std::atomic<unsigned> counter(0);
+  snprintf(line, sizeof(line), "/.tmp.%d.%u", static_cast<int>(getpid()),
+           counter++);
+  const std::string tmp = dir_ + line;
+  const std::string path = Path(key);
+  std::string error;
+  if (!WriteFile(tmp.c_str(), entry, &error)) {
+    unlink(tmp.c_str());
+    return;
+  }
+  // The same input may be stored twice, e.g. by two workers that missed
+  // at once; the rename replaces the older entry.
+  struct stat st;
+  const size_t replaced =
+      stat(path.c_str(), &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+  if (rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  total_bytes_ -= std::min(total_bytes_, replaced);
+  total_bytes_ += entry.size();
+  if (total_bytes_ > max_bytes_) {
+    Evict();
+  }
+}
+
+bool ResultCache::ReadEntry(FILE* f, std::string* jpeg, ProcessStats* stats) {
+  char line[512];
+  if (!fgets(line, sizeof(line), f) || strcmp(line, "GZC1\n") != 0) {
+    return false;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    size_t len = strlen(line);
+    if (len == 0 || line[len - 1] != '\n') return false;
+    line[len - 1] = '\0';
+    int value, name;
+    size_t host, device, size;
+    if (sscanf(line, "counter %d %n", &value, &name) == 1) {
+      stats->counters[line + name] = value;
+    } else if (sscanf(line, "peak %zu %zu %n", &host, &device, &name) == 2) {
+      MemoryUsage& usage = stats->peak_memory[line + name];
+      usage.host = host;
+      usage.device = device;
+    } else if (sscanf(line, "jpeg %zu", &size) == 1) {
+      jpeg->resize(size);
+      return size == 0 || fread(&(*jpeg)[0], 1, size, f) == size;
+    } else {
+      return false;
+    }
+  }
+  return false;
+}
+
+bool ResultCache::Scan(std::vector<Entry>* entries, std::string* error) const {
+  DIR* dir = opendir(dir_.c_str());
+  if (!dir) {
+    *error = "Can't read cache directory " + dir_ + ": " + strerror(errno);
+    return false;
+  }
+  const time_t now = time(nullptr);
+  while (struct dirent* ent = readdir(dir)) {
+    const std::string name = ent->d_name;
+    const std::string path = dir_ + "/" + name;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+    if (name.compare(0, 5, ".tmp.") == 0) {
+      // Left behind by a process that died while storing.
+      if (now - st.st_mtime > 3600) unlink(path.c_str());
+    } else if (name.size() > 4 &&
+               name.compare(name.size() - 4, 4, ".gzc") == 0) {
+      Entry entry = { path, static_cast<size_t>(st.st_size), st.st_mtime };
+      entries->push_back(entry);
+    }
+  }
+  closedir(dir);
+  return true;
+}
+
+// Removes the least recently used entries until 90% of the limit is left.
+// Rescans the directory, which other processes may share. Called with
+// mutex_ held.
+void ResultCache::Evict() {
+  std::vector<Entry> entries;
+  std::string error;
+  if (!Scan(&entries, &error)) return;
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+  total_bytes_ = 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    total_bytes_ += entries[i].size;
+  }
+  const size_t target = max_bytes_ / 10 * 9;
+  for (size_t i = 0; i < entries.size() && total_bytes_ > target; ++i) {
+    if (unlink(entries[i].path.c_str()) == 0) {
+      total_bytes_ -= entries[i].size;
+    }
+  }
+}
+
+}  // namespace guetzli
+
+#endif  // _WIN32
@@ -0,0 +1,80 @@
+/*
+ * On-disk cache of finished encodes, so repeated inputs are answered without
+ * decoding or encoding. Not available on Windows.
+ *
+ * Each entry is one file, KEY.gzc:
+ *   "GZC1\n"
+ *   "counter VALUE NAME\n" per ProcessStats counter
+ *   "peak HOST DEVICE NAME\n" per peak_memory entry
+ *   "jpeg SIZE\n" followed by the JPEG
+ * Entries are written to a temporary file and renamed into place, so readers
+ * never see a partial one, also across processes sharing the directory. A hit
+ * touches the entry's modification time, and once the entries exceed the size
+ * limit the least recently used ones are removed.
+ */
+
+#ifndef GUETZLI_RESULT_CACHE_H_
+#define GUETZLI_RESULT_CACHE_H_
+
+#ifndef _WIN32
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "guetzli/input_file.h"
+#include "guetzli/stats.h"
+
+namespace guetzli {
+
+// 64-bit xxHash of |size| bytes at |p|.
+uint64_t XXHash64(const uint8_t* p, size_t size, uint64_t seed);
+
+// Identifies an encode: 128 bits of hash over the input bytes and
+// |settings|, which describes everything else that affects the output.
+std::string ResultCacheKey(const InputView& in_data, const std::string& settings);
+
+class ResultCache {
+ public:
+  ResultCache(const std::string& dir, size_t max_bytes)
+      : dir_(dir), max_bytes_(max_bytes) {}
+
+  // Creates the directory if needed and sums up the existing entries,
+  // evicting some if they are over the limit already.
+  bool Open(std::string* error);
+
+  bool Lookup(const std::string& key, std::string* jpeg, ProcessStats* stats);
+
+  void Store(const std::string& key, const std::string& jpeg,
+             const ProcessStats& stats);
+
+ private:
+  struct Entry {
+    std::string path;
+    size_t size;
+    time_t mtime;
+  };
+
+  std::string Path(const std::string& key) const {
+    return dir_ + "/" + key + ".gzc";
+  }
+
+  static bool ReadEntry(FILE* f, std::string* jpeg, ProcessStats* stats);
+  bool Scan(std::vector<Entry>* entries, std::string* error) const;
+  void Evict();
+
+  const std::string dir_;
+  const size_t max_bytes_;
+  std::mutex mutex_;
+  size_t total_bytes_ = 0;
+};
+
+}  // namespace guetzli
+
+#endif  // _WIN32
+
+#endif  // GUETZLI_RESULT_CACHE_H_
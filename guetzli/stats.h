@@ -17,6 +17,8 @@
 #ifndef GUETZLI_STATS_H_
 #define GUETZLI_STATS_H_
 
+#include <stddef.h>
+#include <stdint.h>
 #include <cstdio>
 #include <map>
 #include <string>
@@ -30,13 +32,69 @@ static const char* const  kNumItersCnt = "number of iterations";
 static const char* const kNumItersUpCnt = "number of iterations up";
 static const char* const kNumItersDownCnt = "number of iterations down";
 
+static const char* const kMemoryLimitCnt = "memory limit reached";
+
+// Peak tracked memory in bytes, see memory_account.h.
+struct MemoryUsage {
+  size_t host = 0;
+  size_t device = 0;
+};
+
+// Time spent in a profiled zone, see profiler.h.
+struct StageTiming {
+  uint64_t count = 0;
+  uint64_t wall_ns = 0;
+  uint64_t cpu_ns = 0;
+};
+
+// One encode attempted by the search, in the order they were tried.
+struct IterationRecord {
+  int iteration = 0;  // Value of the kNumItersCnt counter, 0 for "original".
+  // "original", "quantization" or "zeroing".
+  const char* phase = "";
+  std::string frame_type;  // See OutputImage::FrameTypeStr().
+  int comp_mask = 0;
+  int direction = 0;  // +1 or -1 for the zeroing iterations, 0 otherwise.
+  // Zeroing iterations only.
+  int changed_coeffs = 0;
+  int candidate_coeffs = 0;
+  int changed_blocks = 0;
+  int blocks_to_change = 0;
+  int num_blocks = 0;
+  int estimated_size = 0;
+  // Quantization iterations only, the heuristic score of the matrix.
+  double quant_score = 0.0;
+  size_t size = 0;
+  double distance = 0.0;  // The comparator's distmap_aggregate().
+  double score = 0.0;     // Comparator::ScoreOutputSize(size).
+  bool best = false;      // The best output so far.
+  uint64_t wall_ns = 0;
+};
+
+// Receives the debug log of an encode, see debug_print.h.
+class LogSink {
+ public:
+  virtual ~LogSink() {}
+  virtual void Write(const char* text, size_t size) = 0;
+};
+
 struct ProcessStats {
   ProcessStats() {}
   std::map<std::string, int> counters;
+  // Per processing stage, and for the whole encode as "total".
+  std::map<std::string, MemoryUsage> peak_memory;
+  // The ProfileLevel to record timings at, see profiler.h.
+  int profile = 0;
+  // Per profiled zone, keyed by the path of the nested zones "a/b/c".
+  std::map<std::string, StageTiming> timings;
+  std::vector<IterationRecord> iterations;
   std::string* debug_output = nullptr;
   FILE* debug_output_file = nullptr;
+  LogSink* log_sink = nullptr;
 
   std::string filename;
+  // The OpenCL device that ran the encode, see guetzli::Encoder.
+  std::string device;
 };
 
 }  // namespace guetzli
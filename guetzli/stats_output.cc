@@ -0,0 +1,238 @@
+/*
+ * The per image logs of the command line tool.
+ */
+
+#include "guetzli/stats_output.h"
+
+#include <vector>
+
+namespace guetzli {
+
+namespace {
+
+constexpr int kDeviceTrack = 1000;
+
+}  // namespace
+
+void AppendJsonString(const char* s, std::string* out) {
+  out->push_back('"');
+  for (; *s; ++s) {
+    const unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      *out += escaped;
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+StatsJsonLog::~StatsJsonLog() {
+  if (file_) fclose(file_);
+}
+
+bool StatsJsonLog::Open(const char* filename) {
+  file_ = fopen(filename, "w");
+  return file_ != nullptr;
+}
+
+void StatsJsonLog::Write(const StatsJsonRecord& record,
+                         const ProcessStats& stats) {
+  std::string line = "{\"input\":";
+  if (record.input) {
+    AppendJsonString(record.input, &line);
+  } else {
+    line += "null";
+  }
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           ",\"result\":\"%s\",\"cached\":%s,\"version\":\"%s\","
+           "\"backend\":\"%s\",\"quality\":%d,\"input_size\":%zu",
+           record.result, record.cached ? "true" : "false", version_,
+           record.backend, record.quality, record.input_size);
+  line += buf;
+  if (record.width > 0) {
+    snprintf(buf, sizeof(buf), ",\"width\":%d,\"height\":%d",
+             record.width, record.height);
+    line += buf;
+  }
+  if (!stats.device.empty()) {
+    line += ",\"device\":";
+    AppendJsonString(stats.device.c_str(), &line);
+  }
+  snprintf(buf, sizeof(buf), ",\"output_size\":%zu,\"wall_ms\":%.3f",
+           record.output_size, record.wall_ns / 1e6);
+  line += buf;
+
+  line += ",\"counters\":{";
+  for (std::map<std::string, int>::const_iterator it = stats.counters.begin();
+       it != stats.counters.end(); ++it) {
+    if (it != stats.counters.begin()) line += ",";
+    AppendJsonString(it->first.c_str(), &line);
+    snprintf(buf, sizeof(buf), ":%d", it->second);
+    line += buf;
+  }
+  line += "},\"peak_memory\":{";
+  for (std::map<std::string, MemoryUsage>::const_iterator it =
+           stats.peak_memory.begin(); it != stats.peak_memory.end(); ++it) {
+    if (it != stats.peak_memory.begin()) line += ",";
+    AppendJsonString(it->first.c_str(), &line);
+    snprintf(buf, sizeof(buf), ":{\"host\":%zu,\"device\":%zu}",
+             it->second.host, it->second.device);
+    line += buf;
+  }
+  line += "}";
+  if (!stats.timings.empty()) {
+    line += ",\"timings\":{";
+    for (std::map<std::string, StageTiming>::const_iterator it =
+             stats.timings.begin(); it != stats.timings.end(); ++it) {
+      if (it != stats.timings.begin()) line += ",";
+      AppendJsonString(it->first.c_str(), &line);
+      snprintf(buf, sizeof(buf),
+               ":{\"count\":%llu,\"wall_ms\":%.3f,\"cpu_ms\":%.3f}",
+               static_cast<unsigned long long>(it->second.count),
+               it->second.wall_ns / 1e6, it->second.cpu_ns / 1e6);
+      line += buf;
+    }
+    line += "}";
+  }
+  line += ",\"iterations\":[";
+  for (size_t i = 0; i < stats.iterations.size(); ++i) {
+    const IterationRecord& it = stats.iterations[i];
+    if (i) line += ",";
+    snprintf(buf, sizeof(buf),
+             "{\"iteration\":%d,\"phase\":\"%s\",\"frame_type\":\"%s\","
+             "\"comp_mask\":%d,\"direction\":%d,\"changed_coeffs\":%d,"
+             "\"candidate_coeffs\":%d,\"changed_blocks\":%d,"
+             "\"blocks_to_change\":%d,\"num_blocks\":%d,"
+             "\"estimated_size\":%d,\"quant_score\":%.4f,\"size\":%zu,"
+             "\"distance\":%.6f,\"score\":%.4f,\"best\":%s,"
+             "\"wall_ms\":%.3f}",
+             it.iteration, it.phase, it.frame_type.c_str(), it.comp_mask,
+             it.direction, it.changed_coeffs, it.candidate_coeffs,
+             it.changed_blocks, it.blocks_to_change, it.num_blocks,
+             it.estimated_size, it.quant_score, it.size, it.distance,
+             it.score, it.best ? "true" : "false", it.wall_ns / 1e6);
+    line += buf;
+  }
+  line += "]}\n";
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  fwrite(line.data(), 1, line.size(), file_);
+  fflush(file_);
+}
+
+TraceWriter::~TraceWriter() {
+  if (file_) {
+    fputs("\n]}\n", file_);
+    fclose(file_);
+  }
+}
+
+bool TraceWriter::Open(const char* filename) {
+  file_ = fopen(filename, "w");
+  if (!file_) return false;
+  start_ns_ = ProfileNowNs();
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file_);
+  return true;
+}
+
+void TraceWriter::Add(const Profiler& profiler) {
+  size_t dropped = 0;
+  const std::vector<ProfileThreadEvents> threads = profiler.Events(&dropped);
+  // Timestamps in microseconds since Open().
+  const double origin_us =
+      (static_cast<double>(profiler.start_ns()) - start_ns_) / 1e3;
+  char buf[512];
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t t = 0; t < threads.size(); ++t) {
+    const int tid = ThreadId(threads[t].thread);
+    for (size_t i = 0; i < threads[t].events.size(); ++i) {
+      const ProfileEvent& ev = threads[t].events[i];
+      std::string line = "{\"name\":";
+      AppendJsonString(ev.name, &line);
+      line += ",\"cat\":";
+      AppendJsonString(ev.category, &line);
+      const double ts = origin_us + ev.start_ns / 1e3;
+      const int ev_tid = ev.device ? DeviceTrackId(tid) : tid;
+      switch (ev.type) {
+        case kProfileSpan:
+          snprintf(buf, sizeof(buf),
+                   ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                   "\"dur\":%.3f,\"args\":{\"cpu_ms\":%.3f,\"bytes\":%lld}}",
+                   ev_tid, ts, (ev.end_ns - ev.start_ns) / 1e3,
+                   ev.cpu_ns / 1e6, static_cast<long long>(ev.value));
+          break;
+        case kProfileInstant:
+          snprintf(buf, sizeof(buf),
+                   ",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,"
+                   "\"ts\":%.3f,\"args\":{\"value\":%lld}}",
+                   ev_tid, ts, static_cast<long long>(ev.value));
+          break;
+        case kProfileCounter:
+          line += ",\"args\":{";
+          AppendJsonString(ev.name, &line);
+          snprintf(buf, sizeof(buf),
+                   ":%lld},\"ph\":\"C\",\"pid\":1,\"tid\":%d,"
+                   "\"ts\":%.3f}",
+                   static_cast<long long>(ev.value), ev_tid, ts);
+          break;
+      }
+      line += buf;
+      Emit(line);
+    }
+  }
+  if (dropped) {
+    snprintf(buf, sizeof(buf),
+             "{\"name\":\"events dropped\",\"cat\":\"trace\","
+             "\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":0,"
+             "\"ts\":%.3f,\"args\":{\"value\":%zu}}",
+             origin_us, dropped);
+    Emit(buf);
+  }
+  fflush(file_);
+}
+
+// A small id per thread, named on first use. Called with mutex_ held.
+int TraceWriter::ThreadId(std::thread::id id) {
+  std::map<std::thread::id, int>::const_iterator it = thread_ids_.find(id);
+  if (it != thread_ids_.end()) return it->second;
+  const int tid = static_cast<int>(thread_ids_.size()) + 1;
+  thread_ids_[id] = tid;
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+           "\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+           tid, tid);
+  Emit(buf);
+  return tid;
+}
+
+// The track of the OpenCL commands of worker |tid|, named on first use so
+// that only workers with a queue get one. Called with mutex_ held.
+int TraceWriter::DeviceTrackId(int tid) {
+  const int device_tid = tid + kDeviceTrack;
+  if (device_tracks_.insert(device_tid).second) {
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+             "\"tid\":%d,\"args\":{\"name\":\"worker %d OpenCL queue\"}}",
+             device_tid, tid);
+    Emit(buf);
+  }
+  return device_tid;
+}
+
+void TraceWriter::Emit(const std::string& event) {
+  fputs(first_ ? "\n" : ",\n", file_);
+  first_ = false;
+  fwrite(event.data(), 1, event.size(), file_);
+}
+
+}  // namespace guetzli
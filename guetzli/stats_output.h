@@ -0,0 +1,91 @@
+/*
+ * The per image logs of the command line tool.
+ *
+ * StatsJsonLog writes --stats-json: one JSON object per processed image and
+ * line, with the outcome, the counters, the peak memory, the timings of
+ * --profile and every iteration of the search.
+ *
+ * TraceWriter writes --trace: the events of every encode in the Chrome trace
+ * event format, for chrome://tracing or Perfetto. Each worker thread is a
+ * track of its stage spans, counters and instants, the OpenCL commands it
+ * queued are a second track next to it.
+ *
+ * Both may be written from any number of threads.
+ */
+
+#ifndef GUETZLI_STATS_OUTPUT_H_
+#define GUETZLI_STATS_OUTPUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+#include "guetzli/profiler.h"
+#include "guetzli/stats.h"
+
+namespace guetzli {
+
+// Appends |s| to |out| as a quoted JSON string.
+void AppendJsonString(const char* s, std::string* out);
+
+// What StatsJsonLog records of an image besides its ProcessStats.
+struct StatsJsonRecord {
+  const char* input = nullptr;  // The input file, nullptr for none.
+  const char* result = "";      // "unsupported", "failed" or "ok".
+  bool cached = false;
+  const char* backend = "";
+  int quality = 0;
+  size_t input_size = 0;
+  // 0 if the input was not decoded.
+  int width = 0;
+  int height = 0;
+  size_t output_size = 0;
+  uint64_t wall_ns = 0;
+};
+
+class StatsJsonLog {
+ public:
+  // |version| of the encoder, recorded with every image.
+  explicit StatsJsonLog(const char* version) : version_(version) {}
+  ~StatsJsonLog();
+
+  bool Open(const char* filename);
+
+  void Write(const StatsJsonRecord& record, const ProcessStats& stats);
+
+ private:
+  const char* const version_;
+  FILE* file_ = nullptr;
+  std::mutex mutex_;
+};
+
+class TraceWriter {
+ public:
+  ~TraceWriter();
+
+  bool Open(const char* filename);
+
+  // Adds the events of an encode whose zones have all finished.
+  void Add(const Profiler& profiler);
+
+ private:
+  int ThreadId(std::thread::id id);
+  int DeviceTrackId(int tid);
+  void Emit(const std::string& event);
+
+  FILE* file_ = nullptr;
+  uint64_t start_ns_ = 0;
+  bool first_ = true;
+  std::map<std::thread::id, int> thread_ids_;
+  std::set<int> device_tracks_;
+  std::mutex mutex_;
+};
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_STATS_OUTPUT_H_
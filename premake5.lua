@@ -21,6 +21,22 @@ workspace "guetzli"
     symbols "On"
   filter "configurations:Release"
     optimize "Full"
+
+  -- The per instruction set CPU kernels, see guetzli/cpu_dispatch.h.
+  filter { "action:gmake", "files:guetzli/cpu_kernels_*.cc" }
+    buildoptions { "-ffp-contract=off" }
+  filter { "action:gmake", "files:guetzli/cpu_kernels_sse42.cc" }
+    buildoptions { "-msse4.2", "-mpopcnt" }
+  filter { "action:gmake", "files:guetzli/cpu_kernels_avx2.cc" }
+    buildoptions { "-mavx2", "-mfma", "-mbmi", "-mbmi2", "-mlzcnt" }
+  filter { "action:gmake", "files:guetzli/cpu_kernels_avx512.cc" }
+    buildoptions { "-mavx2", "-mfma", "-mbmi", "-mbmi2", "-mlzcnt",
+                   "-mavx512f", "-mavx512bw", "-mavx512cd", "-mavx512dq",
+                   "-mavx512vl" }
+  filter { "action:vs*", "files:guetzli/cpu_kernels_avx2.cc" }
+    vectorextensions "AVX2"
+  filter { "action:vs*", "files:guetzli/cpu_kernels_avx512.cc" }
+    buildoptions { "/arch:AVX512" }
   filter {}
 
   project "guetzli_static"
@@ -43,7 +59,7 @@ workspace "guetzli"
     kind "ConsoleApp"
     filter "action:gmake"
 	  --defines { "__USE_OPENCL__", "__USE_CUDA__", "__SUPPORT_FULL_JPEG__" }
-      linkoptions { "`pkg-config --libs libpng || libpng-config --ldflags`" }
+      linkoptions { "`pkg-config --libs libpng || libpng-config --ldflags`", "-pthread" }
       buildoptions { "`pkg-config --cflags libpng || libpng-config --cflags`" }
       --links { "OpenCL", "cuda", "profiler", "unwind", "jpeg" }
     filter "action:vs*"
@@ -58,3 +74,29 @@ workspace "guetzli"
         "clguetzli/*.cpp",
         "clguetzli/*.h"
       }
+
+  project "guetzli_bench"
+    kind "ConsoleApp"
+    links { "guetzli_static" }
+    filter "action:gmake"
+      linkoptions { "-pthread" }
+    filter {}
+    files
+      {
+        "benchmark/microbench.cc",
+        "benchmark/test_image.cc",
+        "benchmark/test_image.h"
+      }
+
+  project "guetzli_difftest"
+    kind "ConsoleApp"
+    links { "guetzli_static" }
+    filter "action:gmake"
+      linkoptions { "-pthread" }
+    filter {}
+    files
+      {
+        "benchmark/difftest.cc",
+        "benchmark/test_image.cc",
+        "benchmark/test_image.h"
+      }
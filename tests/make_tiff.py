@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+# make_tiff.py OUT ORIENTATION ALPHA writes a 16x8 uncompressed TIFF in
+# strips of 3 rows for smoke_test.sh. ALPHA=0 writes an RGB image, ALPHA=1
+# an RGBA image with associated alpha and ALPHA=2 the colors of that RGBA
+# image as RGB, which is what it looks like blended on black. Bottom-up
+# orientations (3 and 4) store the rows flipped, so they decode to the same
+# image as orientation 1.
+import struct
+import sys
+
+out, orientation, alpha = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+w, h, rps = 16, 8, 3
+spp = 4 if alpha == 1 else 3
+rows = []
+for y in range(h):
+    row = b''
+    for x in range(w):
+        r, g, b, a = 16 * x, 32 * y, 255 - 8 * (x + y), 64 + 24 * y
+        if alpha:
+            r, g, b = (r * a + 127) // 255, (g * a + 127) // 255, (b * a + 127) // 255
+        row += bytes([r, g, b, a] if alpha == 1 else [r, g, b])
+    rows.append(row)
+if orientation in (3, 4):
+    rows.reverse()
+data = b''.join(rows)
+strips = [data[i * w * spp * rps:(i + 1) * w * spp * rps] for i in range((h + rps - 1) // rps)]
+n = len(strips)
+entries = 12 if spp == 4 else 11
+ifd = 8
+extra = ifd + 2 + 12 * entries + 4
+bps_off, offs_off, counts_off = extra, extra + 2 * spp, extra + 2 * spp + 4 * n
+data_off = counts_off + 4 * n
+offsets = []
+pos = data_off
+for s in strips:
+    offsets.append(pos)
+    pos += len(s)
+tags = [(256, 3, 1, w), (257, 3, 1, h), (258, 3, spp, bps_off), (259, 3, 1, 1),
+        (262, 3, 1, 2), (273, 4, n, offs_off), (274, 3, 1, orientation),
+        (277, 3, 1, spp), (278, 3, 1, rps), (279, 4, n, counts_off),
+        (284, 3, 1, 1)]
+if spp == 4:
+    tags.append((338, 3, 1, 1))
+f = b'II' + struct.pack('<HI', 42, ifd) + struct.pack('<H', len(tags))
+for tag, typ, count, value in tags:
+    f += struct.pack('<HHI', tag, typ, count)
+    f += struct.pack('<HH', value, 0) if typ == 3 and count == 1 else struct.pack('<I', value)
+f += struct.pack('<I', 0)
+f += struct.pack('<%dH' % spp, *([8] * spp))
+f += struct.pack('<%dI' % n, *offsets) + struct.pack('<%dI' % n, *[len(s) for s in strips])
+f += b''.join(strips)
+open(out, 'wb').write(f)
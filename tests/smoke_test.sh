@@ -49,6 +49,225 @@ run_test png file stdout --nomemlimit
 run_test png file stdout --memlimit 100
 run_test png file stdout --quality 85
 
+INPUT_DIR=$(mktemp -d)
+echo "Testing mapped and read input, output in $INPUT_DIR"
+# A regular file is mapped, stdin and a pipe are read.
+$GUETZLI $BEES_JPG $INPUT_DIR/file.jpg || { echo "file input failed"; exit 1; }
+$GUETZLI - $INPUT_DIR/stdin.jpg < $BEES_JPG || { echo "stdin input failed"; exit 1; }
+$GUETZLI <(cat $BEES_JPG) $INPUT_DIR/pipe.jpg || { echo "pipe input failed"; exit 1; }
+cmp $INPUT_DIR/file.jpg $INPUT_DIR/stdin.jpg || { echo "mapped input differs from stdin"; exit 1; }
+cmp $INPUT_DIR/file.jpg $INPUT_DIR/pipe.jpg || { echo "mapped input differs from a pipe"; exit 1; }
+if $GUETZLI $INPUT_DIR/missing.png $INPUT_DIR/missing.jpg; then
+  echo "Expected a missing input to fail"
+  exit 1
+fi
+rm -r $INPUT_DIR
+echo "OK"
+
+RAW_DIR=$(mktemp -d)
+echo "Testing PNM and raw input, output in $RAW_DIR"
+pngtopnm < $BEES_PNG > $RAW_DIR/bees.ppm || exit 2
+tail -c $((444 * 258 * 3)) $RAW_DIR/bees.ppm > $RAW_DIR/bees.rgb
+$GUETZLI $BEES_PNG $RAW_DIR/png.jpg || { echo "PNG input failed"; exit 1; }
+$GUETZLI $RAW_DIR/bees.ppm $RAW_DIR/ppm.jpg || { echo "PNM input failed"; exit 1; }
+$GUETZLI --raw 444x258 $RAW_DIR/bees.rgb $RAW_DIR/rgb.jpg || { echo "raw input failed"; exit 1; }
+cmp $RAW_DIR/png.jpg $RAW_DIR/ppm.jpg || { echo "PNM input differs from PNG"; exit 1; }
+cmp $RAW_DIR/png.jpg $RAW_DIR/rgb.jpg || { echo "raw input differs from PNG"; exit 1; }
+if $GUETZLI --raw 444x257 $RAW_DIR/bees.rgb $RAW_DIR/rgb.jpg; then
+  echo "Expected raw input of the wrong size to fail"
+  exit 1
+fi
+rm -r $RAW_DIR
+echo "OK"
+
+CACHE_DIR=$(mktemp -d)
+echo "Testing --cache in $CACHE_DIR"
+# A stale entry over --cache-size is evicted when the cache is opened.
+head -c $((2 << 20)) /dev/zero > $CACHE_DIR/stale.gzc
+touch -d 2000-01-01 $CACHE_DIR/stale.gzc
+$GUETZLI --cache $CACHE_DIR --cache-size 1 $BEES_PNG $CACHE_DIR/miss.jpg || { echo "cache miss failed"; exit 1; }
+test ! -e $CACHE_DIR/stale.gzc || { echo "stale.gzc wasn't evicted"; exit 1; }
+$GUETZLI --verbose --cache $CACHE_DIR --cache-size 1 $BEES_PNG $CACHE_DIR/hit.jpg 2> $CACHE_DIR/hit.log ||
+  { echo "cache hit failed"; exit 1; }
+grep -q "^Cache hit" $CACHE_DIR/hit.log || { echo "Expected a cache hit"; exit 1; }
+cmp $CACHE_DIR/miss.jpg $CACHE_DIR/hit.jpg || { echo "cache hit differs"; exit 1; }
+$GUETZLI --verbose --cache $CACHE_DIR --cache-size 1 --quality 90 $BEES_PNG $CACHE_DIR/q90.jpg 2> $CACHE_DIR/q90.log ||
+  { echo "cache miss failed"; exit 1; }
+! grep -q "^Cache hit" $CACHE_DIR/q90.log || { echo "Expected a cache miss for another quality"; exit 1; }
+test $(ls $CACHE_DIR/*.gzc | wc -l) -eq 2 || { echo "Expected 2 cache entries"; exit 1; }
+rm -r $CACHE_DIR
+echo "OK"
+
+TIFF_DIR=$(mktemp -d)
+echo "Testing TIFF orientation and alpha, output in $TIFF_DIR"
+MAKE_TIFF="python3 $(dirname $0)/make_tiff.py"
+$MAKE_TIFF $TIFF_DIR/topleft.tif 1 0 && $MAKE_TIFF $TIFF_DIR/botleft.tif 4 0 &&
+  $MAKE_TIFF $TIFF_DIR/rgba.tif 1 1 && $MAKE_TIFF $TIFF_DIR/premultiplied.tif 1 2 || exit 2
+for tif in topleft botleft rgba premultiplied; do
+  $GUETZLI $TIFF_DIR/$tif.tif $TIFF_DIR/$tif.jpg || { echo "$tif.tif failed"; exit 1; }
+done
+cmp $TIFF_DIR/topleft.jpg $TIFF_DIR/botleft.jpg || { echo "bottom-up TIFF is flipped"; exit 1; }
+cmp $TIFF_DIR/rgba.jpg $TIFF_DIR/premultiplied.jpg || { echo "RGBA TIFF isn't blended once"; exit 1; }
+rm -r $TIFF_DIR
+echo "OK"
+
+STATS_DIR=$(mktemp -d)
+echo "Testing --stats-json, output in $STATS_DIR"
+printf "$BEES_PNG\t$STATS_DIR/png.jpg\n$BEES_JPG\t$STATS_DIR/jpeg.jpg\n" |
+  $GUETZLI --stats-json $STATS_DIR/stats.jsonl --batch - || { echo "--stats-json failed"; exit 1; }
+python3 - $STATS_DIR/stats.jsonl <<'PY' || { echo "invalid --stats-json"; exit 1; }
+import json, sys
+records = [json.loads(line) for line in open(sys.argv[1])]
+assert len(records) == 2, records
+for r in records:
+    assert r["result"] == "ok" and r["output_size"] > 0, r
+    assert r["iterations"] and any(it["best"] for it in r["iterations"]), r
+PY
+rm -r $STATS_DIR
+echo "OK"
+
+TRACE_DIR=$(mktemp -d)
+echo "Testing --trace, output in $TRACE_DIR"
+$GUETZLI --trace $TRACE_DIR/trace.json $BEES_PNG $TRACE_DIR/png.jpg || { echo "--trace failed"; exit 1; }
+python3 - $TRACE_DIR/trace.json <<'PY' || { echo "invalid --trace"; exit 1; }
+import json, sys
+events = json.load(open(sys.argv[1]))["traceEvents"]
+names = [e["name"] for e in events if e["ph"] == "X"]
+assert "encode" in names and "decode" in names, names
+for e in events:
+    if e["ph"] == "X":
+        assert e["dur"] >= 0, e
+# Without OpenCL there is no queue track.
+tracks = [e["args"]["name"] for e in events if e["name"] == "thread_name"]
+assert tracks and not any("OpenCL" in t for t in tracks), tracks
+PY
+rm -r $TRACE_DIR
+echo "OK"
+
+AUTO_DIR=$(mktemp -d)
+echo "Testing --auto, output in $AUTO_DIR"
+export GUETZLI_BACKEND_FILE=$AUTO_DIR/backend
+printf "$BEES_PNG\t$AUTO_DIR/png1.jpg\n$BEES_JPG\t$AUTO_DIR/jpeg1.jpg\n" |
+  $GUETZLI --auto --jobs 2 --batch - 2> $AUTO_DIR/log1 || { echo "--auto failed"; exit 1; }
+grep -q "Calibrating" $AUTO_DIR/log1 || { echo "--auto didn't calibrate"; exit 1; }
+test -s $GUETZLI_BACKEND_FILE || { echo "--auto didn't save its choice"; exit 1; }
+printf "$BEES_PNG\t$AUTO_DIR/png2.jpg\n$BEES_JPG\t$AUTO_DIR/jpeg2.jpg\n" |
+  $GUETZLI --auto --jobs 2 --batch - 2> $AUTO_DIR/log2 || { echo "--auto failed"; exit 1; }
+if grep -q "Calibrating" $AUTO_DIR/log2; then
+  echo "--auto didn't reuse its saved choice"
+  exit 1
+fi
+cmp -s $AUTO_DIR/png1.jpg $AUTO_DIR/png2.jpg &&
+  cmp -s $AUTO_DIR/jpeg1.jpg $AUTO_DIR/jpeg2.jpg || { echo "--auto outputs differ"; exit 1; }
+$GUETZLI --auto --recalibrate --verbose $BEES_PNG $AUTO_DIR/png3.jpg 2> $AUTO_DIR/log3 || { echo "--auto failed"; exit 1; }
+grep -q "Auto backend for small images" $AUTO_DIR/log3 || { echo "--auto --verbose didn't name the backend"; exit 1; }
+unset GUETZLI_BACKEND_FILE
+rm -r $AUTO_DIR
+echo "OK"
+
+BATCH_DIR=$(mktemp -d)
+echo "Testing --batch, output in $BATCH_DIR"
+printf "$BEES_PNG\t$BATCH_DIR/png.jpg\n$BEES_JPG\t$BATCH_DIR/jpeg with space.jpg\n" | $GUETZLI --jobs 2 --batch - || { echo "--batch failed"; exit 1; }
+for out in "$BATCH_DIR/png.jpg" "$BATCH_DIR/jpeg with space.jpg"; do
+  djpeg < "$out" > /dev/null || { echo "$out is not a valid JPEG"; exit 1; }
+done
+# A trailing tab leaves the output to the default name.
+cp $BEES_PNG $BATCH_DIR/tab.png
+printf "$BATCH_DIR/tab.png\t\n" | $GUETZLI --batch - || { echo "--batch failed on an empty output"; exit 1; }
+djpeg < $BATCH_DIR/tab.guetzli.jpg > /dev/null || { echo "$BATCH_DIR/tab.guetzli.jpg is not a valid JPEG"; exit 1; }
+# With and without the I/O threads, one missing input fails only its job.
+for prefetch in 0 2; do
+  printf "$BEES_PNG\t$BATCH_DIR/prefetch$prefetch.jpg\n$BATCH_DIR/missing.png\t$BATCH_DIR/missing.jpg\n$BEES_JPG\t$BATCH_DIR/prefetch${prefetch}_jpeg.jpg\n" |
+    $GUETZLI --jobs 2 --prefetch $prefetch --batch-summary $BATCH_DIR/summary$prefetch.txt --batch -
+  if [[ $? -ne 1 ]]; then
+    echo "Expected a failing batch with --prefetch $prefetch"
+    exit 1
+  fi
+  grep -q "^Batch: 3 images, 2 encoded, 1 failed" $BATCH_DIR/summary$prefetch.txt ||
+    { echo "Unexpected summary with --prefetch $prefetch"; exit 1; }
+done
+cmp $BATCH_DIR/prefetch0.jpg $BATCH_DIR/prefetch2.jpg || { echo "--prefetch changed the output"; exit 1; }
+cmp $BATCH_DIR/prefetch0_jpeg.jpg $BATCH_DIR/prefetch2_jpeg.jpg || { echo "--prefetch changed the output"; exit 1; }
+# A budget below one image runs the encodes one at a time.
+admitted=$(printf "$BEES_PNG\t$BATCH_DIR/1.jpg\n$BEES_PNG\t$BATCH_DIR/2.jpg\n$BEES_JPG\t$BATCH_DIR/3.jpg\n" |
+  $GUETZLI --verbose --jobs 3 --memory-budget 1 --batch - 2>&1 | grep -c "^Admitted")
+if [[ "$admitted" -ne 3 ]]; then
+  echo "Expected 3 admitted encodes, got $admitted"
+  exit 1
+fi
+for out in $BATCH_DIR/1.jpg $BATCH_DIR/2.jpg $BATCH_DIR/3.jpg; do
+  djpeg < $out > /dev/null || { echo "$out is not a valid JPEG"; exit 1; }
+done
+echo /dev/null | $GUETZLI --batch -
+if [[ $? -ne 1 ]]; then
+  echo "Expected a failing batch"
+  exit 1
+fi
+rm -r $BATCH_DIR
+echo "OK"
+
+DAEMON_SOCKET=$BATCH_DIR.sock
+echo "Testing --daemon on $DAEMON_SOCKET"
+$GUETZLI --quality 90 --jobs 2 --daemon $DAEMON_SOCKET &
+DAEMON_PID=$!
+for i in $(seq 50); do test -S $DAEMON_SOCKET && break; sleep 0.1; done
+out=$(mktemp ${TMPDIR:-/tmp}/beesXXX.guetzli.jpg)
+$GUETZLI --connect $DAEMON_SOCKET $BEES_PNG $out || { echo "--connect failed"; exit 1; }
+djpeg < $out > /dev/null || { echo "$out is not a valid JPEG"; exit 1; }
+# Without --quality the request takes the daemon's.
+$GUETZLI --quality 90 $BEES_PNG $out.local || { echo "guetzli failed"; exit 1; }
+cmp -s $out $out.local || { echo "--connect didn't use the daemon's quality"; exit 1; }
+$GUETZLI --connect $DAEMON_SOCKET - $out < $BEES_PNG || { echo "--connect from stdin failed"; exit 1; }
+cmp -s $out $out.local || { echo "--connect from stdin gave another JPEG"; exit 1; }
+rm $out.local
+$GUETZLI --connect $DAEMON_SOCKET /dev/null $out
+if [[ $? -ne 2 ]]; then
+  echo "Expected an unknown file format"
+  exit 1
+fi
+$GUETZLI --quality 200 --connect $DAEMON_SOCKET $BEES_PNG $out
+if [[ $? -ne 1 ]]; then
+  echo "Expected a quality out of range"
+  exit 1
+fi
+$GUETZLI --blend-on-white --connect $DAEMON_SOCKET $BEES_PNG $out
+if [[ $? -ne 1 ]]; then
+  echo "Expected --blend-on-white to be refused with --connect"
+  exit 1
+fi
+# The daemon only has the plain C backend it was started with.
+$GUETZLI --c --connect $DAEMON_SOCKET $BEES_PNG $out
+if [[ $? -ne 1 ]]; then
+  echo "Expected a backend the daemon doesn't have to be refused"
+  exit 1
+fi
+kill $DAEMON_PID && wait $DAEMON_PID || { echo "daemon failed"; exit 1; }
+test ! -e $DAEMON_SOCKET || { echo "$DAEMON_SOCKET wasn't removed"; exit 1; }
+rm $out
+echo "OK"
+
+if $GUETZLI --devices list > /dev/null 2>&1; then
+  echo "Testing --devices and --queues"
+  out=$(mktemp ${TMPDIR:-/tmp}/beesXXX.guetzli.jpg)
+  $GUETZLI --queues 2 $BEES_PNG $out
+  if [[ $? -ne 1 ]]; then
+    echo "Expected --queues to be refused without --opencl"
+    exit 1
+  fi
+  $GUETZLI --devices all --c $BEES_PNG $out
+  if [[ $? -ne 1 ]]; then
+    echo "Expected --devices to be refused without --opencl"
+    exit 1
+  fi
+  $GUETZLI --opencl --devices 100000 $BEES_PNG $out
+  if [[ $? -ne 1 ]]; then
+    echo "Expected an unknown OpenCL device"
+    exit 1
+  fi
+  rm -f $out
+  echo "OK"
+fi
+
 echo $GUETZLI /dev/null /dev/null
 $GUETZLI /dev/null /dev/null
 if [[ $? -ne 1 ]]; then
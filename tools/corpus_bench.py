@@ -0,0 +1,336 @@
+#!/usr/bin/env python3
+"""End-to-end benchmark of guetzli on a synthetic corpus.
+
+Generates a deterministic corpus (gradients, noise, text and photo-like
+textures at several sizes, plus tests/bees.png), encodes it in batch mode with
+every combination of backend, quality and --jobs, and records per
+configuration the wall time, CPU time and peak RSS of the process, and per
+image the output size, the Butteraugli distance and the encode time (from
+--stats-json).
+
+With --baseline FILE the results are compared against FILE and the script
+exits with 1 if a configuration got slower or bigger, or an image got bigger
+or worse, by more than the tolerances. --update-baseline writes FILE instead.
+Times and RSS depend on the machine, keep a baseline per machine.
+
+  tools/corpus_bench.py --guetzli bin/Release/guetzli --baseline base.json
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+BACKEND_FLAGS = {
+  'cpu': [],
+  'cpu_opt': ['--c'],
+  'opencl': ['--opencl'],
+  'cuda': ['--cuda'],
+}
+
+BEES_PNG = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        '..', 'tests', 'bees.png')
+
+
+def write_ppm(path, width, height, pixels):
+  with open(path, 'wb') as f:
+    f.write(b'P6\n%d %d\n255\n' % (width, height))
+    f.write(bytes(pixels))
+
+
+def clamp(v):
+  return 0 if v < 0 else 255 if v > 255 else int(v)
+
+
+def gradient(width, height, rng):
+  pixels = bytearray(3 * width * height)
+  for y in range(height):
+    for x in range(width):
+      i = 3 * (y * width + x)
+      pixels[i] = 255 * x // width
+      pixels[i + 1] = 255 * y // height
+      pixels[i + 2] = 255 * (x + y) // (width + height)
+  return pixels
+
+
+def noise(width, height, rng):
+  return bytearray(rng.getrandbits(8) for _ in range(3 * width * height))
+
+
+# 5x7 glyphs, one row per string, '#' is ink.
+FONT = {
+  'G': [' ### ', '#   #', '#    ', '# ###', '#   #', '#   #', ' ### '],
+  'U': ['#   #', '#   #', '#   #', '#   #', '#   #', '#   #', ' ### '],
+  'E': ['#####', '#    ', '#    ', '#### ', '#    ', '#    ', '#####'],
+  'T': ['#####', '  #  ', '  #  ', '  #  ', '  #  ', '  #  ', '  #  '],
+  'Z': ['#####', '    #', '   # ', '  #  ', ' #   ', '#    ', '#####'],
+  'L': ['#    ', '#    ', '#    ', '#    ', '#    ', '#    ', '#####'],
+  'I': [' ### ', '  #  ', '  #  ', '  #  ', '  #  ', '  #  ', ' ### '],
+  'J': ['  ###', '   # ', '   # ', '   # ', '#  # ', '#  # ', ' ##  '],
+  'P': ['#### ', '#   #', '#   #', '#### ', '#    ', '#    ', '#    '],
+  '0': [' ### ', '#   #', '#  ##', '# # #', '##  #', '#   #', ' ### '],
+  '1': ['  #  ', ' ##  ', '  #  ', '  #  ', '  #  ', '  #  ', ' ### '],
+  ' ': ['     '] * 7,
+}
+
+
+def text(width, height, rng):
+  """Dark text of two sizes on a light, slightly tinted page."""
+  pixels = bytearray([245, 240, 230] * (width * height))
+  chars = sorted(FONT)
+  y = 4
+  while y + 7 * 2 < height:
+    scale = 1 + (y // 16) % 2
+    x = 4
+    while x + 6 * scale < width:
+      glyph = FONT[rng.choice(chars)]
+      for gy in range(7):
+        for gx in range(5):
+          if glyph[gy][gx] != '#':
+            continue
+          for sy in range(scale):
+            for sx in range(scale):
+              i = 3 * ((y + gy * scale + sy) * width + x + gx * scale + sx)
+              pixels[i:i + 3] = b'\x14\x14\x28'
+      x += 6 * scale
+    y += 9 * scale
+  return pixels
+
+
+def photo(width, height, rng):
+  """Smooth value noise of several octaves with colored blobs, like foliage
+  or clouds."""
+  def octave(cell):
+    gw, gh = width // cell + 2, height // cell + 2
+    grid = [[rng.random() for _ in range(gw)] for _ in range(gh)]
+    def at(x, y):
+      gx, gy = x / cell, y / cell
+      x0, y0 = int(gx), int(gy)
+      fx, fy = gx - x0, gy - y0
+      fx, fy = fx * fx * (3 - 2 * fx), fy * fy * (3 - 2 * fy)
+      top = grid[y0][x0] * (1 - fx) + grid[y0][x0 + 1] * fx
+      bottom = grid[y0 + 1][x0] * (1 - fx) + grid[y0 + 1][x0 + 1] * fx
+      return top * (1 - fy) + bottom * fy
+    return at
+  octaves = [(octave(c), a) for c, a in ((64, 0.5), (16, 0.3), (4, 0.15),
+                                         (2, 0.05))]
+  blobs = [(rng.randrange(width), rng.randrange(height),
+            rng.randrange(8, 40), [rng.randrange(256) for _ in range(3)])
+           for _ in range(6)]
+  pixels = bytearray(3 * width * height)
+  for y in range(height):
+    for x in range(width):
+      v = sum(f(x, y) * a for f, a in octaves)
+      rgb = [60 + 150 * v, 90 + 130 * v, 40 + 100 * v]
+      for bx, by, r, color in blobs:
+        d2 = (x - bx) ** 2 + (y - by) ** 2
+        if d2 < r * r:
+          w = 1 - d2 / float(r * r)
+          rgb = [c * (1 - w) + b * w for c, b in zip(rgb, color)]
+      i = 3 * (y * width + x)
+      pixels[i:i + 3] = bytes(clamp(c) for c in rgb)
+  return pixels
+
+
+GENERATORS = [('gradient', gradient), ('noise', noise), ('text', text),
+              ('photo', photo)]
+
+
+def make_corpus(directory, sizes):
+  """Writes the corpus to directory, returns the paths."""
+  paths = []
+  for kind, generate in GENERATORS:
+    for width, height in sizes:
+      path = os.path.join(directory, '%s-%dx%d.ppm' % (kind, width, height))
+      if not os.path.exists(path):
+        rng = random.Random('%s %d %d' % (kind, width, height))
+        write_ppm(path, width, height, generate(width, height, rng))
+      paths.append(path)
+  if os.path.exists(BEES_PNG):
+    paths.append(os.path.abspath(BEES_PNG))
+  return paths
+
+
+def digest(path):
+  with open(path, 'rb') as f:
+    return hashlib.sha256(f.read()).hexdigest()[:16]
+
+
+def run_config(guetzli, backend, quality, jobs, corpus, work_dir):
+  """Encodes the corpus in one batch process, returns the result record."""
+  name = '%s/q%d/j%d' % (backend, quality, jobs)
+  out_dir = os.path.join(work_dir, name.replace('/', '-'))
+  os.makedirs(out_dir, exist_ok=True)
+  manifest = os.path.join(out_dir, 'manifest')
+  stats = os.path.join(out_dir, 'stats.json')
+  with open(manifest, 'w') as f:
+    for path in corpus:
+      f.write('%s\t%s\n' % (path, os.path.join(
+          out_dir, os.path.basename(path) + '.jpg')))
+  cmd = ([guetzli] + BACKEND_FLAGS[backend] +
+         ['--quality', str(quality), '--jobs', str(jobs), '--stats-json',
+          stats, '--batch', manifest])
+  print('running %s' % ' '.join(cmd), file=sys.stderr)
+  start = time.time()
+  with open(os.devnull, 'w') as devnull:
+    proc = subprocess.Popen(cmd, stdout=devnull, stderr=devnull)
+    _, status, usage = os.wait4(proc.pid, 0)
+  wall = time.time() - start
+  # ru_maxrss is in KB on Linux and in bytes on macOS.
+  rss_kb = usage.ru_maxrss // (1024 if sys.platform == 'darwin' else 1)
+
+  images = {}
+  if os.path.exists(stats):
+    with open(stats) as f:
+      for line in f:
+        record = json.loads(line)
+        best = [it for it in record['iterations'] if it['best']]
+        images[os.path.basename(record['input'])] = {
+          'result': record['result'],
+          'input': digest(record['input']),
+          'size': record['output_size'],
+          'distance': best[-1]['distance'] if best else None,
+          'wall_s': record['wall_ms'] / 1e3,
+        }
+  return name, {
+    'exit_status': os.WEXITSTATUS(status) if os.WIFEXITED(status) else -1,
+    'wall_s': wall,
+    'cpu_s': usage.ru_utime + usage.ru_stime,
+    'peak_rss_mb': rss_kb / 1024.0,
+    'total_size': sum(i['size'] for i in images.values()),
+    'images': images,
+  }
+
+
+def compare(results, baseline, args):
+  """Prints the differences to the baseline, returns the regressions."""
+  regressions = []
+  def check(what, value, base, limit):
+    change = (value - base) / base if base else 0
+    flag = ''
+    if value > limit:
+      regressions.append(what)
+      flag = '  REGRESSION'
+    print('  %-40s %12.4f %12.4f %+7.2f%%%s' %
+          (what, base, value, 100 * change, flag))
+
+  for name, config in sorted(results.items()):
+    base = baseline.get(name)
+    if base is None:
+      print('%s: not in the baseline' % name)
+      continue
+    print(name)
+    check('wall_s', config['wall_s'], base['wall_s'],
+          base['wall_s'] * (1 + args.time_tolerance))
+    check('cpu_s', config['cpu_s'], base['cpu_s'],
+          base['cpu_s'] * (1 + args.time_tolerance))
+    check('peak_rss_mb', config['peak_rss_mb'], base['peak_rss_mb'],
+          base['peak_rss_mb'] * (1 + args.rss_tolerance))
+    check('total_size', config['total_size'], base['total_size'],
+          base['total_size'] * (1 + args.size_tolerance))
+    for image, result in sorted(config['images'].items()):
+      base_image = base['images'].get(image)
+      if base_image is None:
+        continue
+      if base_image['input'] != result['input']:
+        print('  %s: input differs from the baseline, skipped' % image)
+        continue
+      if result['result'] != 'ok':
+        regressions.append('%s %s' % (name, image))
+        print('  %s: %s' % (image, result['result']))
+        continue
+      check(image + ' size', result['size'], base_image['size'],
+            base_image['size'] * (1 + args.size_tolerance))
+      if result['distance'] is not None and base_image['distance']:
+        check(image + ' distance', result['distance'],
+              base_image['distance'],
+              base_image['distance'] + args.distance_tolerance)
+    missing = set(base['images']) - set(config['images'])
+    for image in sorted(missing):
+      regressions.append('%s %s' % (name, image))
+      print('  %s: missing' % image)
+  return regressions
+
+
+def parse_sizes(s):
+  return [tuple(int(v) for v in size.split('x')) for size in s.split(',')]
+
+
+def run(args, work_dir):
+  """Benchmarks the configurations of |args|, returns the exit status."""
+  corpus_dir = args.corpus_dir or os.path.join(work_dir, 'corpus')
+  os.makedirs(corpus_dir, exist_ok=True)
+  corpus = make_corpus(corpus_dir, parse_sizes(args.sizes))
+
+  results = {}
+  for backend in args.backends.split(','):
+    for quality in [int(q) for q in args.qualities.split(',')]:
+      for jobs in [int(j) for j in args.jobs.split(',')]:
+        name, record = run_config(args.guetzli, backend, quality, jobs,
+                                  corpus, work_dir)
+        results[name] = record
+        print('%-20s exit %d  wall %8.2fs  cpu %8.2fs  rss %7.1f MB  '
+              'size %9d' % (name, record['exit_status'], record['wall_s'],
+                            record['cpu_s'], record['peak_rss_mb'],
+                            record['total_size']))
+
+  if args.results:
+    with open(args.results, 'w') as f:
+      json.dump(results, f, indent=1, sort_keys=True)
+  if args.baseline and args.update_baseline:
+    with open(args.baseline, 'w') as f:
+      json.dump(results, f, indent=1, sort_keys=True)
+    return 0
+  failed = [name for name, r in results.items() if r['exit_status'] != 0]
+  for name in failed:
+    print('%s: guetzli failed' % name)
+  if args.baseline:
+    with open(args.baseline) as f:
+      regressions = compare(results, json.load(f), args)
+    if regressions:
+      print('%d regressions: %s' % (len(regressions), ', '.join(regressions)))
+      return 1
+  return 1 if failed else 0
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+  parser.add_argument('--guetzli', default='bin/Release/guetzli')
+  parser.add_argument('--backends', default='cpu,cpu_opt',
+                      help='Of %s.' % ', '.join(sorted(BACKEND_FLAGS)))
+  parser.add_argument('--qualities', default='90',
+                      help='The --quality levels, the effort of the search.')
+  parser.add_argument('--jobs', default='1', help='The --jobs thread counts.')
+  parser.add_argument('--sizes', default='64x64,256x256',
+                      help='Sizes of the synthetic images.')
+  parser.add_argument('--corpus-dir',
+                      help='Keep the generated corpus here for later runs.')
+  parser.add_argument('--results', help='Write the results to this file.')
+  parser.add_argument('--baseline', help='Compare against this file.')
+  parser.add_argument('--update-baseline', action='store_true',
+                      help='Write the results to --baseline instead.')
+  parser.add_argument('--time-tolerance', type=float, default=0.10,
+                      help='Allowed relative increase of wall and CPU time.')
+  parser.add_argument('--rss-tolerance', type=float, default=0.10,
+                      help='Allowed relative increase of the peak RSS.')
+  parser.add_argument('--size-tolerance', type=float, default=0.002,
+                      help='Allowed relative increase of output sizes.')
+  parser.add_argument('--distance-tolerance', type=float, default=0.01,
+                      help='Allowed absolute increase of the distance.')
+  args = parser.parse_args()
+  for backend in args.backends.split(','):
+    if backend not in BACKEND_FLAGS:
+      parser.error('unknown backend %s' % backend)
+
+  with tempfile.TemporaryDirectory(prefix='guetzli-bench-') as work_dir:
+    return run(args, work_dir)
+
+
+if __name__ == '__main__':
+  sys.exit(main())